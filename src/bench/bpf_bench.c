@@ -0,0 +1,324 @@
+/* **********************************************************************
+ * Offline test and benchmark of the eBPF dataplane
+ *
+ * Loads the dataplane without attaching it, runs crafted packets
+ * through its egress program with BPF_PROG_TEST_RUN and checks each
+ * verdict and the counter it bumps. The same packets are then timed
+ * through the egress program and through the module's packet path
+ * built in userspace (libtorproxy_hook). Needs CAP_BPF, or root
+ **********************************************************************
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "torproxy_relay.h"
+#include "bench/torproxy_lib.h"
+#include "bpf_dataplane.h"
+
+#define BATCH 64
+#define MAX_PKT_LEN 128
+#define ETH_HDR_LEN 14
+#define DNS_HDR_LEN 12
+
+#define LOCAL_ADDR 0xc0a8010a /* 192.168.1.10 */
+#define TEST_RELAY 0x5e100001 /* 94.16.0.1 */
+
+struct test_case {
+  const char *name;
+  int ipv6;
+  u8 proto;
+  u32 daddr;  /* host order, ipv4 */
+  u16 dport;
+  u32 verdict;
+  enum torproxy_stat stat;
+};
+
+/* what the egress program must do with each, the module
+ * would NAT the tcp and dns it drops here */
+static const struct test_case cases[] = {
+  { "loopback", 0, IPPROTO_TCP, 0x7f000001, 9050, 1, TORPROXY_STAT_LOOPBACK },
+  { "dnsport", 0, IPPROTO_UDP, 0x7f000001, 9053, 1, TORPROXY_STAT_LOOPBACK },
+  { "relay", 0, IPPROTO_TCP, TEST_RELAY, 9001, 1, TORPROXY_STAT_RELAY },
+  { "bypass", 0, IPPROTO_TCP, 0xc0a80101, 22, 1, TORPROXY_STAT_BYPASS },
+  { "bypass-added", 0, IPPROTO_TCP, 0xcb007105, 443, 1, TORPROXY_STAT_BYPASS },
+  { "bypass-proxied", 0, IPPROTO_TCP, 0xc0a84d05, 80, 0, TORPROXY_STAT_DROP_NO_NAT },
+  { "tcp", 0, IPPROTO_TCP, 0x5db8d822, 443, 0, TORPROXY_STAT_DROP_NO_NAT },
+  { "dns", 0, IPPROTO_UDP, 0x08080808, 53, 0, TORPROXY_STAT_DROP_NON_TCP },
+  { "udp", 0, IPPROTO_UDP, 0x5db8d822, 123, 0, TORPROXY_STAT_DROP_NON_TCP },
+  { "icmp", 0, IPPROTO_ICMP, 0x5db8d822, 0, 0, TORPROXY_STAT_DROP_NON_TCP },
+  { "ipv6-loopback", 1, IPPROTO_TCP, 1, 9050, 1, TORPROXY_STAT_LOOPBACK },
+  { "ipv6", 1, IPPROTO_TCP, 0, 443, 0, TORPROXY_STAT_DROP_IPV6 },
+};
+
+#define N_CASES (sizeof(cases) / sizeof(cases[0]))
+
+/* on top of the module's defaults */
+static const struct bypass_prefix bypass_extra[] = {
+  { 0, 24, BYPASS_ACCEPT },   /* 203.0.113.0/24 */
+  { 0, 24, BYPASS_PROXY },    /* 192.168.77.0/24 */
+};
+
+static struct net_device out_dev = { &init_net, 2, "eth0" };
+static struct net_device lo_dev = { &init_net, 1, "lo", IFF_LOOPBACK };
+
+
+static double now_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static u16 ip_checksum(const void *data, unsigned int len){
+  const u16 *p = data;
+  u32 sum = 0;
+
+  while(len > 1){
+    sum += *p++;
+    len -= 2;
+  }
+
+  return csum_fold(sum);
+}
+
+/* ethernet frame of a case, the ip packet starts at ETH_HDR_LEN */
+static unsigned int build_frame(unsigned char *buf, const struct test_case *c){
+  struct iphdr *ip_header = (struct iphdr *) (buf + ETH_HDR_LEN);
+  unsigned char *l4, *ip6 = buf + ETH_HDR_LEN;
+  __be16 ethertype = htons(c->ipv6 ? 0x86dd : 0x0800);
+  unsigned int l4_len = c->proto == IPPROTO_TCP ? sizeof(struct tcphdr) : 8, len;
+
+  /* a query needs a transaction id for the module to NAT it */
+  if(c->proto == IPPROTO_UDP && c->dport == 53) l4_len += DNS_HDR_LEN;
+
+  memset(buf, 0, MAX_PKT_LEN);
+  memcpy(buf + 12, &ethertype, 2);
+
+  if(c->ipv6){
+    len = 40 + l4_len;
+    ip6[0] = 0x60;
+    *(__be16 *) (ip6 + 4) = htons(l4_len);
+    ip6[6] = c->proto;
+    ip6[7] = 64;
+    ip6[23] = 1;                                   /* ::1 */
+    if(c->daddr) ip6[39] = 1;                      /* ::1 */
+    else memcpy(ip6 + 24, "\x20\x01\x0d\xb8", 4);  /* 2001:db8:: */
+    l4 = ip6 + 40;
+  } else{
+    len = sizeof(*ip_header) + l4_len;
+    ip_header->version = 4;
+    ip_header->ihl = 5;
+    ip_header->tot_len = htons(len);
+    ip_header->ttl = 64;
+    ip_header->protocol = c->proto;
+    ip_header->saddr = (c->daddr >> 24) == 127 ? htonl(0x7f000001) : htonl(LOCAL_ADDR);
+    ip_header->daddr = htonl(c->daddr);
+    ip_header->check = ip_checksum(ip_header, sizeof(*ip_header));
+    l4 = buf + ETH_HDR_LEN + sizeof(*ip_header);
+  }
+
+  if(c->proto == IPPROTO_TCP){
+    ((struct tcphdr *) l4)->source = htons(40000);
+    ((struct tcphdr *) l4)->dest = htons(c->dport);
+    ((struct tcphdr *) l4)->doff = 5;
+    ((struct tcphdr *) l4)->syn = 1;
+  } else if(c->proto == IPPROTO_UDP){
+    ((struct udphdr *) l4)->source = htons(40000);
+    ((struct udphdr *) l4)->dest = htons(c->dport);
+    ((struct udphdr *) l4)->len = htons(l4_len);
+    l4[8] = 0x2a;
+  } else{
+    l4[0] = 8; /* icmp echo request */
+  }
+
+  return ETH_HDR_LEN + len;
+}
+
+
+/* the relays and prefixes both dataplanes are tested with */
+static int setup(struct bpf_dataplane *dp, unsigned int n_relays){
+  struct bypass_prefix prefixes[4 + sizeof(bypass_extra) / sizeof(bypass_extra[0])];
+  static const u32 private[][2] = {
+    { 0x0a000000, 8 }, { 0x7f000000, 8 }, { 0xac100000, 12 }, { 0xc0a80000, 16 }
+  };
+  struct relay_ctl_op ops[2];
+  unsigned int seed = 1, i, n = 0;
+  __be32 *relays;
+  int err;
+
+  relays = calloc(n_relays + 1, sizeof(*relays));
+  if(!relays) return -ENOMEM;
+  relays[0] = htonl(TEST_RELAY);
+  for(i=1; i<=n_relays; i++) relays[i] = htonl(0x5e000000 | ((rand_r(&seed) & 0xffff) << 8) | 2);
+
+  for(i=0; i<4; i++){
+    prefixes[n].addr = htonl(private[i][0]);
+    prefixes[n].len = private[i][1];
+    prefixes[n++].action = BYPASS_ACCEPT;
+  }
+  prefixes[n] = bypass_extra[0];
+  prefixes[n++].addr = htonl(0xcb007100);
+  prefixes[n] = bypass_extra[1];
+  prefixes[n++].addr = htonl(0xc0a84d00);
+
+  ops[0] = (struct relay_ctl_op) { TORPROXY_OP_REPLACE, TORPROXY_OP_A_RELAYS, relays, (n_relays + 1) * sizeof(*relays) };
+  ops[1] = (struct relay_ctl_op) { TORPROXY_OP_REPLACE, TORPROXY_OP_A_PREFIXES, prefixes, n * sizeof(*prefixes) };
+
+  err = bpf_dp_apply(dp, ops, 2, 0, NULL);
+  if(err == 0 && (torproxy_set_relays(relays, n_relays + 1) < 0 || torproxy_set_bypass(prefixes, n) < 0)) err = -ENOMEM;
+
+  free(relays);
+  return err;
+}
+
+/* every case once, its verdict and counter checked */
+static int check_cases(struct bpf_dataplane *dp){
+  struct relay_ctl_stats before, after;
+  unsigned char frame[MAX_PKT_LEN];
+  uint32_t retval;
+  unsigned int i, len, failed = 0;
+  int err;
+
+  printf("%-16s %8s %8s %s\n", "case", "verdict", "expected", "counter");
+  for(i=0; i<N_CASES; i++){
+    len = build_frame(frame, &cases[i]);
+
+    if((err = bpf_dp_stats(dp, &before)) < 0 ||
+       (err = bpf_dp_test_egress(dp, frame, len, 1, &retval, NULL)) < 0 ||
+       (err = bpf_dp_stats(dp, &after)) < 0){
+      printf("[*] Test run of %s failed: %s\n", cases[i].name, strerror(-err));
+      return -1;
+    }
+
+    err = retval != cases[i].verdict || after.verdicts[cases[i].stat] != before.verdicts[cases[i].stat] + 1;
+    printf("%-16s %8s %8s %s%s\n", cases[i].name, retval ? "pass" : "drop", cases[i].verdict ? "pass" : "drop",
+           after.verdicts[cases[i].stat] != before.verdicts[cases[i].stat] + 1 ? "missed" : "counted",
+           err ? "  FAIL" : "");
+    failed += err;
+  }
+
+  printf("[*] %u of %zu cases failed\n", failed, N_CASES);
+  return failed ? -1 : 0;
+}
+
+/* ns per packet of the module's hook over repeat runs of one packet,
+ * conntrack run ahead of it as in replay_bench */
+static double time_module(const unsigned char *pkt, unsigned int len, unsigned int repeat, unsigned int *verdict){
+  const struct net_device *out;
+  struct sk_buff skbs[BATCH];
+  unsigned char bufs[BATCH][MAX_PKT_LEN];
+  const struct iphdr *ip_header = (const struct iphdr *) pkt;
+  unsigned int done, i, n;
+  double ns = 0, start;
+
+  /* the host's own addresses route out the loopback */
+  out = (ntohl(ip_header->daddr) >> 24) == 127 ? &lo_dev : &out_dev;
+
+  for(done=0; done<repeat; done+=n){
+    n = repeat - done < BATCH ? repeat - done : BATCH;
+    for(i=0; i<n; i++){
+      memcpy(bufs[i], pkt, len);
+      memset(&skbs[i], 0, sizeof(skbs[i]));
+      skbs[i].head = skbs[i].data = bufs[i];
+      skbs[i].len = len;
+      skbs[i].transport_header = ip_header->ihl*4;
+      skbs[i].ip_summed = ip_header->protocol == IPPROTO_ICMP ? CHECKSUM_NONE : CHECKSUM_PARTIAL;
+      nf_conntrack_in(&init_net, PF_INET, NF_INET_LOCAL_OUT, &skbs[i]);
+    }
+
+    start = now_ns();
+    for(i=0; i<n; i++) *verdict = torproxy_local_out(&skbs[i], out);
+    ns += now_ns() - start;
+
+    for(i=0; i<n; i++) skb_dst_drop(&skbs[i]);
+    if(done % 4096 < BATCH) torproxy_run_timers();
+  }
+
+  return ns / repeat;
+}
+
+static int compare(struct bpf_dataplane *dp, unsigned int repeat){
+  unsigned char frame[MAX_PKT_LEN];
+  unsigned int i, len, verdict;
+  uint32_t retval, duration;
+  double ns;
+  int err;
+
+  printf("\n%-16s %10s %10s %10s %10s\n", "case", "bpf ns", "bpf", "module ns", "module");
+  for(i=0; i<N_CASES; i++){
+    if(cases[i].ipv6) continue;
+    len = build_frame(frame, &cases[i]);
+
+    err = bpf_dp_test_egress(dp, frame, len, repeat, &retval, &duration);
+    if(err < 0){
+      printf("[*] Test run of %s failed: %s\n", cases[i].name, strerror(-err));
+      return -1;
+    }
+
+    ns = time_module(frame + ETH_HDR_LEN, len - ETH_HDR_LEN, repeat, &verdict);
+    printf("%-16s %10u %10s %10.1f %10s\n", cases[i].name, duration, retval ? "pass" : "drop",
+           ns, verdict == NF_ACCEPT ? "accept" : "drop");
+  }
+
+  printf("[*] bpf ns include the test run's own per-packet overhead, module ns the hook alone\n");
+  return 0;
+}
+
+static void usage(const char *prog){
+  printf("usage: %s [-n relays] [-r repeat] [-c]\n", prog);
+  printf("  -n  random relays loaded on top of the tested one, default 8\n");
+  printf("  -r  runs of each packet timed, default 1000000\n");
+  printf("  -c  only check the verdicts\n");
+}
+
+
+int main(int argc, char **argv){
+  struct bpf_dataplane dp;
+  unsigned int n_relays = 8, repeat = 1000000;
+  int check_only = 0, opt, ret;
+  char *log;
+
+  while((opt = getopt(argc, argv, "n:r:ch")) != -1){
+    switch(opt){
+      case 'n': n_relays = atoi(optarg); break;
+      case 'r': repeat = atoi(optarg); break;
+      case 'c': check_only = 1; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if(n_relays >= RELAY_MAX_ADDRS) n_relays = RELAY_MAX_ADDRS - 1;
+  if(repeat < 1) repeat = 1;
+
+  log = calloc(1, 65536);
+  ret = bpf_dp_load(&dp, log, 65536);
+  if(ret < 0){
+    printf("[*] Could not load the eBPF dataplane: %s\n%s", strerror(-ret), log);
+    free(log);
+    return 1;
+  }
+  free(log);
+
+  if(torproxy_init() < 0){
+    printf("[*] Could not set up hook state\n");
+    bpf_dp_close(&dp);
+    return 1;
+  }
+
+  ret = setup(&dp, n_relays);
+  if(ret < 0){
+    printf("[*] Could not load the tables: %s\n", strerror(-ret));
+  } else{
+    printf("[*] %u relays, %zu cases\n", n_relays + 1, N_CASES);
+    ret = check_cases(&dp);
+    if(ret == 0 && !check_only) ret = compare(&dp, repeat);
+  }
+
+  torproxy_exit();
+  bpf_dp_close(&dp);
+  return ret < 0;
+}
@@ -0,0 +1,307 @@
+/* **********************************************************************
+ * Stand-in tor ControlPort replaying a recorded event stream
+ *
+ * Serves one client: answers PROTOCOLINFO, AUTHENTICATE and the
+ * commands listed in the recording, and once the client subscribes
+ * with SETEVENTS sends the recorded events in order, then closes the
+ * connection. Lets relay_pop -D be run without tor or the module:
+ *
+ *   controlport_replay -p 19051 -f guard_rotation.ctl &
+ *   relay_pop -D -n -C 19051
+ *
+ * Recording format, one directive per line:
+ *   > COMMAND      the reply to commands starting with COMMAND follows
+ *   < LINE         one raw reply line, CRLF added
+ *   ! LINE         one raw event line, sent in order after SETEVENTS
+ *   @ MS           wait MS milliseconds before the next event
+ *   # comment
+ **********************************************************************
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_LINE 4096
+
+enum entry_type { ENTRY_REPLY, ENTRY_EVENT, ENTRY_WAIT };
+
+struct entry {
+  enum entry_type type;
+  char *command;       /* ENTRY_REPLY */
+  char *text;          /* reply lines or event line, CRLF terminated */
+  unsigned int wait_ms;
+};
+
+static struct entry *entries;
+static unsigned int n_entries;
+
+
+static double now_ms(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+static struct entry *add_entry(enum entry_type type){
+  static unsigned int cap;
+  struct entry *tmp;
+
+  if(n_entries == cap){
+    cap = cap ? cap*2 : 64;
+    if((tmp = realloc(entries, cap * sizeof(*tmp))) == NULL){
+      perror("realloc");
+      exit(1);
+    }
+    entries = tmp;
+  }
+
+  memset(&entries[n_entries], 0, sizeof(*entries));
+  entries[n_entries].type = type;
+  return &entries[n_entries++];
+}
+
+static void append_line(char **text, const char *line){
+  size_t len = *text ? strlen(*text) : 0;
+
+  if((*text = realloc(*text, len + strlen(line) + 3)) == NULL){
+    perror("realloc");
+    exit(1);
+  }
+  sprintf(*text + len, "%s\r\n", line);
+}
+
+static int load_recording(const char *path){
+  FILE *file;
+  struct entry *reply = NULL, *e;
+  char line[MAX_LINE], *arg;
+  int line_no = 0;
+
+  if((file = fopen(path, "r")) == NULL){
+    perror(path);
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), file) != NULL){
+    line_no++;
+    line[strcspn(line, "\r\n")] = 0;
+    if(line[0] == 0 || line[0] == '#') continue;
+
+    arg = line + 1;
+    if(*arg == ' ') arg++;
+
+    switch(line[0]){
+      case '>':
+        reply = add_entry(ENTRY_REPLY);
+        reply->command = strdup(arg);
+        break;
+      case '<':
+        if(!reply){
+          fprintf(stderr, "%s:%d: reply line before any command\n", path, line_no);
+          goto err;
+        }
+        append_line(&reply->text, arg);
+        break;
+      case '!':
+        e = add_entry(ENTRY_EVENT);
+        append_line(&e->text, arg);
+        break;
+      case '@':
+        e = add_entry(ENTRY_WAIT);
+        e->wait_ms = strtoul(arg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "%s:%d: unknown directive '%c'\n", path, line_no, line[0]);
+        goto err;
+    }
+  }
+
+  fclose(file);
+  return 0;
+
+err:
+  fclose(file);
+  return -1;
+}
+
+
+static int send_all(int fd, const char *text){
+  size_t len = strlen(text), off = 0;
+  ssize_t r;
+
+  while(off < len){
+    if((r = send(fd, text + off, len - off, MSG_NOSIGNAL)) <= 0) return -1;
+    off += r;
+  }
+
+  return 0;
+}
+
+/* answer one command line, returns 1 once the client subscribed */
+static int answer(int fd, const char *cmd){
+  unsigned int i;
+
+  for(i=0; i<n_entries; i++){
+    if(entries[i].type == ENTRY_REPLY && !strncmp(cmd, entries[i].command, strlen(entries[i].command))){
+      send_all(fd, entries[i].text ? entries[i].text : "250 OK\r\n");
+      return !strncmp(cmd, "SETEVENTS", 9);
+    }
+  }
+
+  if(!strncmp(cmd, "PROTOCOLINFO", 12)){
+    send_all(fd, "250-PROTOCOLINFO 1\r\n250-AUTH METHODS=NULL\r\n250-VERSION Tor=\"0.4.8.12\"\r\n250 OK\r\n");
+  } else if(!strncmp(cmd, "AUTHENTICATE", 12)){
+    send_all(fd, "250 OK\r\n");
+  } else if(!strncmp(cmd, "SETEVENTS", 9)){
+    send_all(fd, "250 OK\r\n");
+    return 1;
+  } else if(!strncmp(cmd, "GETINFO", 7)){
+    send_all(fd, "552 Unrecognized key\r\n");
+  } else{
+    send_all(fd, "510 Unrecognized command\r\n");
+  }
+
+  return 0;
+}
+
+/* read and answer whatever commands the client sent, -1 once it left */
+static int serve_commands(int fd, char *buf, size_t *len, int *subscribed){
+  char *nl, *line;
+  ssize_t r;
+
+  r = recv(fd, buf + *len, MAX_LINE - *len - 1, 0);
+  if(r <= 0) return -1;
+  *len += r;
+  buf[*len] = 0;
+
+  while((nl = strchr(buf, '\n')) != NULL){
+    *nl = 0;
+    line = buf;
+    line[strcspn(line, "\r")] = 0;
+    fprintf(stderr, "[>] %s\n", line);
+    if(answer(fd, line)) *subscribed = 1;
+
+    *len -= nl+1 - buf;
+    memmove(buf, nl+1, *len + 1);
+  }
+
+  if(*len == MAX_LINE - 1) return -1;
+  return 0;
+}
+
+static void replay(int fd){
+  char buf[MAX_LINE];
+  size_t len = 0;
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  double start = 0, next = 0;
+  unsigned int i = 0;
+  int subscribed = 0, timeout;
+
+  while(1){
+    /* skip to the next event or wait once subscribed */
+    while(subscribed && i < n_entries && entries[i].type == ENTRY_REPLY) i++;
+    if(subscribed && i == n_entries) break;
+
+    timeout = -1;
+    if(subscribed){
+      if(start == 0) start = next = now_ms();
+      timeout = next > now_ms() ? (int) (next - now_ms()) + 1 : 0;
+    }
+
+    if(poll(&pfd, 1, timeout) > 0){
+      if(serve_commands(fd, buf, &len, &subscribed) < 0) return;
+      continue;
+    }
+    if(!subscribed || now_ms() < next) continue;
+
+    if(entries[i].type == ENTRY_WAIT){
+      next = now_ms() + entries[i].wait_ms;
+    } else{
+      fprintf(stderr, "[<] %8.1f ms %s", now_ms() - start, entries[i].text);
+      if(send_all(fd, entries[i].text) < 0) return;
+    }
+    i++;
+  }
+
+  /* let the client finish the commands the last events caused */
+  while(poll(&pfd, 1, 200) > 0){
+    if(serve_commands(fd, buf, &len, &subscribed) < 0) return;
+  }
+}
+
+
+static int listen_on(int port, const char *path){
+  struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  struct sockaddr_un sun = { .sun_family = AF_UNIX };
+  int fd, one = 1;
+
+  if(path){
+    if(strlen(path) >= sizeof(sun.sun_path)) return -1;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) return -1;
+  } else{
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) return -1;
+  }
+
+  return listen(fd, 1) < 0 ? -1 : fd;
+}
+
+static void usage(const char *prog){
+  printf("usage: %s [-p port | -u unix socket] -f recording\n", prog);
+}
+
+
+int main(int argc, char **argv){
+  const char *recording = NULL, *path = NULL;
+  int port = 19051, opt, lfd, fd;
+
+  while((opt = getopt(argc, argv, "p:u:f:h")) != -1){
+    switch(opt){
+      case 'p': port = atoi(optarg); break;
+      case 'u': path = optarg; break;
+      case 'f': recording = optarg; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if(!recording){
+    usage(argv[0]);
+    return 1;
+  }
+
+  if(load_recording(recording) < 0) return 1;
+
+  if((lfd = listen_on(port, path)) < 0){
+    perror("listen");
+    return 1;
+  }
+  if(path) fprintf(stderr, "[*] replaying %s on %s\n", recording, path);
+  else fprintf(stderr, "[*] replaying %s on 127.0.0.1:%d\n", recording, port);
+
+  if((fd = accept(lfd, NULL, NULL)) < 0){
+    perror("accept");
+    return 1;
+  }
+
+  replay(fd);
+
+  close(fd);
+  close(lfd);
+  if(path) unlink(path);
+  return 0;
+}
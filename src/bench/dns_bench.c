@@ -0,0 +1,412 @@
+/* **********************************************************************
+ * DNS stub benchmark
+ *
+ * A stand-in for tor's DNSPort answers A questions after an artificial
+ * latency, like a lookup over a circuit. Client threads ask names drawn
+ * from a zipf distribution, first straight at the stand-in and then
+ * through the stub with the cache, coalescing and prefetching turned
+ * on one after the other, and every run reports the stub's hit rate,
+ * the lookups that reached the stand-in and p50/p99 resolution times
+ **********************************************************************
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "dns_stub.h"
+
+#define UPSTREAM_ADDR "127.0.0.1:19053"
+#define STUB_ADDR "127.0.0.1:19054"
+
+#define MAX_NAME 64
+#define MAX_DELAYED 8192
+
+/* resolution times, 1 us buckets up to 10 ms and 100 us ones up to 10 s */
+#define HIST_FINE 10000
+#define HIST_BUCKETS (HIST_FINE + 100000)
+
+struct delayed {
+  uint64_t due;
+  struct sockaddr_in addr;
+  size_t len;
+  uint8_t msg[DNS_MSG_MAX];
+};
+
+struct upstream {
+  pthread_t thread;
+  int fd;
+  int stop_pipe[2];
+  unsigned int latency_ms;
+  unsigned int ttl;
+  unsigned long queries;
+  struct delayed *queue;  /* ring in order of arrival, all delays alike */
+  size_t head, tail;
+};
+
+struct client {
+  pthread_t thread;
+  unsigned int seed;
+  struct sockaddr_in server;
+  uint64_t end;
+  uint64_t *hist;
+  unsigned long answers, failed;
+};
+
+struct mode {
+  const char *name;
+  int stub;
+  size_t cache_entries;
+  int coalesce;
+  int prefetch;
+};
+
+static const struct mode modes[] = {
+  { "direct", 0, 0, 0, 0 },
+  { "stub", 1, 0, 0, 0 },
+  { "+cache", 1, 4096, 0, 0 },
+  { "+coalesce", 1, 4096, 1, 0 },
+  { "+prefetch", 1, 4096, 1, 1 },
+};
+
+static unsigned int n_names = 500;
+static double zipf_s = 1.0;
+static double *zipf_cdf;
+
+
+static uint64_t now_us(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void zipf_init(void){
+  double sum = 0;
+  unsigned int i;
+
+  zipf_cdf = malloc(n_names * sizeof(*zipf_cdf));
+  for(i=0; i<n_names; i++){
+    sum += 1.0 / pow(i + 1, zipf_s);
+    zipf_cdf[i] = sum;
+  }
+  for(i=0; i<n_names; i++) zipf_cdf[i] /= sum;
+}
+
+static unsigned int zipf_pick(unsigned int *seed){
+  double u = (double) rand_r(seed) / RAND_MAX;
+  unsigned int lo = 0, hi = n_names - 1, mid;
+
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(zipf_cdf[mid] < u) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/* A question for name<rank>.example */
+static size_t build_query(uint8_t *msg, uint16_t id, unsigned int rank){
+  char label[MAX_NAME];
+  size_t off = 12;
+  int n;
+
+  memset(msg, 0, 12);
+  msg[0] = id >> 8;
+  msg[1] = id;
+  msg[2] = 0x01;  /* RD */
+  msg[5] = 1;
+
+  n = snprintf(label, sizeof(label), "name%u", rank);
+  msg[off++] = n;
+  memcpy(msg + off, label, n);
+  off += n;
+  msg[off++] = 7;
+  memcpy(msg + off, "example", 7);
+  off += 7;
+  msg[off++] = 0;
+
+  msg[off++] = 0; msg[off++] = 1;  /* A */
+  msg[off++] = 0; msg[off++] = 1;  /* IN */
+  return off;
+}
+
+
+/* stand-in DNSPort */
+
+static void upstream_answer(struct upstream *u, struct delayed *d){
+  uint8_t *msg = d->msg;
+  size_t off = d->len;
+
+  msg[2] |= 0x80;  /* QR */
+  msg[3] = 0x80;   /* RA */
+  msg[7] = 1;      /* one answer */
+
+  msg[off++] = 0xc0; msg[off++] = 12;  /* the question's name */
+  msg[off++] = 0; msg[off++] = 1;
+  msg[off++] = 0; msg[off++] = 1;
+  msg[off++] = u->ttl >> 24; msg[off++] = u->ttl >> 16;
+  msg[off++] = u->ttl >> 8; msg[off++] = u->ttl;
+  msg[off++] = 0; msg[off++] = 4;
+  msg[off++] = 10; msg[off++] = msg[13]; msg[off++] = msg[14]; msg[off++] = msg[15];
+
+  sendto(u->fd, msg, off, 0, (struct sockaddr *) &d->addr, sizeof(d->addr));
+}
+
+static void *upstream_run(void *arg){
+  struct upstream *u = arg;
+  struct pollfd fds[2];
+  struct delayed *d;
+  socklen_t addr_len;
+  uint64_t now;
+  ssize_t len;
+  int timeout;
+
+  fds[0].fd = u->fd;
+  fds[1].fd = u->stop_pipe[0];
+  fds[0].events = fds[1].events = POLLIN;
+
+  while(1){
+    now = now_us();
+    while(u->head != u->tail && u->queue[u->tail % MAX_DELAYED].due <= now){
+      upstream_answer(u, &u->queue[u->tail++ % MAX_DELAYED]);
+    }
+
+    timeout = -1;
+    if(u->head != u->tail) timeout = (u->queue[u->tail % MAX_DELAYED].due - now + 999) / 1000;
+    if(poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+    if(fds[1].revents) break;
+    if(!fds[0].revents) continue;
+
+    while(u->head - u->tail < MAX_DELAYED){
+      d = &u->queue[u->head % MAX_DELAYED];
+      addr_len = sizeof(d->addr);
+      len = recvfrom(u->fd, d->msg, DNS_MSG_MAX - 16, MSG_DONTWAIT, (struct sockaddr *) &d->addr, &addr_len);
+      if(len < 0) break;
+      if(len < 17) continue;
+
+      d->len = len;
+      d->due = now_us() + u->latency_ms * 1000;
+      u->head++;
+      u->queries++;
+    }
+  }
+
+  return NULL;
+}
+
+static int upstream_start(struct upstream *u){
+  struct sockaddr_in addr;
+
+  dns_stub_parse_addr(UPSTREAM_ADDR, &addr);
+  u->queue = malloc(MAX_DELAYED * sizeof(*u->queue));
+  u->head = u->tail = 0;
+  u->queries = 0;
+
+  if(!u->queue || pipe(u->stop_pipe) < 0 || (u->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+     bind(u->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+    return -errno;
+  }
+  return pthread_create(&u->thread, NULL, upstream_run, u) ? -EAGAIN : 0;
+}
+
+static void upstream_stop(struct upstream *u){
+  char c = 0;
+
+  if(write(u->stop_pipe[1], &c, 1) < 0) return;
+  pthread_join(u->thread, NULL);
+  close(u->fd);
+  close(u->stop_pipe[0]);
+  close(u->stop_pipe[1]);
+  free(u->queue);
+}
+
+
+/* clients, one question at a time each */
+
+static void *client_run(void *arg){
+  struct client *c = arg;
+  uint8_t query[DNS_MSG_MAX], answer[DNS_MSG_MAX];
+  struct pollfd pfd;
+  uint64_t start, us;
+  uint16_t id;
+  size_t len;
+  ssize_t got;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  connect(fd, (struct sockaddr *) &c->server, sizeof(c->server));
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while((start = now_us()) < c->end){
+    id = rand_r(&c->seed);
+    len = build_query(query, id, zipf_pick(&c->seed));
+    send(fd, query, len, 0);
+
+    while(1){
+      if(poll(&pfd, 1, 5000) <= 0){
+        c->failed++;
+        break;
+      }
+      got = recv(fd, answer, sizeof(answer), 0);
+      if(got >= 12 && answer[0] == query[0] && answer[1] == query[1]){
+        if((answer[3] & 0xf) != 0){
+          c->failed++;
+          break;
+        }
+        us = now_us() - start;
+        us = us < HIST_FINE ? us : HIST_FINE + (us - HIST_FINE) / 100;
+        c->hist[us < HIST_BUCKETS ? us : HIST_BUCKETS - 1]++;
+        c->answers++;
+        break;
+      }
+    }
+  }
+
+  close(fd);
+  return NULL;
+}
+
+static void *stub_run(void *arg){
+  dns_stub_run(arg);
+  return NULL;
+}
+
+/* upper bound in ms of the bucket holding the given share of the answers */
+static double hist_percentile(const uint64_t *hist, uint64_t total, double share){
+  uint64_t seen = 0;
+  size_t i;
+
+  if(!total) return 0;
+  for(i=0; i<HIST_BUCKETS; i++){
+    seen += hist[i];
+    if(seen >= total * share) break;
+  }
+  return i < HIST_FINE ? (i + 1) / 1000.0 : (HIST_FINE + (i - HIST_FINE + 1) * 100) / 1000.0;
+}
+
+
+static void usage(const char *prog){
+  printf("usage: %s [-c clients] [-d seconds] [-l latency ms] [-T ttl] [-n names] [-s zipf exponent]\n", prog);
+  printf("  each mode runs -d seconds against a stand-in DNSPort answering after -l ms with TTL -T\n");
+}
+
+int main(int argc, char **argv){
+  struct upstream u;
+  struct dns_stub_opts opts;
+  struct dns_stub_stats st;
+  struct dns_stub *stub = NULL;
+  pthread_t stub_thread;
+  struct client *clients;
+  uint64_t *hist, answers;
+  size_t m, b;
+  unsigned long failed;
+  unsigned int n_clients = 32, seconds = 5, i;
+  int opt, err;
+
+  u.latency_ms = 200;
+  u.ttl = 3;
+
+  while((opt = getopt(argc, argv, "c:d:l:T:n:s:h")) != -1){
+    switch(opt){
+      case 'c': n_clients = strtoul(optarg, NULL, 10); break;
+      case 'd': seconds = strtoul(optarg, NULL, 10); break;
+      case 'l': u.latency_ms = strtoul(optarg, NULL, 10); break;
+      case 'T': u.ttl = strtoul(optarg, NULL, 10); break;
+      case 'n': n_names = strtoul(optarg, NULL, 10); break;
+      case 's': zipf_s = strtod(optarg, NULL); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if(n_clients < 1 || n_names < 1 || seconds < 1){
+    usage(argv[0]);
+    return 1;
+  }
+
+  zipf_init();
+  clients = calloc(n_clients, sizeof(*clients));
+  hist = malloc(HIST_BUCKETS * sizeof(*hist));
+  for(i=0; i<n_clients; i++) clients[i].hist = malloc(HIST_BUCKETS * sizeof(*hist));
+  if(!hist || !clients[n_clients-1].hist){
+    printf("[*] Out of memory\n");
+    return 1;
+  }
+
+  printf("[*] %u clients, %u names (zipf %.2f), upstream latency %u ms, TTL %u s, %u s per mode\n",
+         n_clients, n_names, zipf_s, u.latency_ms, u.ttl, seconds);
+  printf("%-10s %9s %9s %7s %9s %9s %8s %9s %9s\n",
+         "mode", "answers", "failed", "hit%", "coalesced", "upstream", "prefetch", "p50 ms", "p99 ms");
+
+  for(m=0; m<sizeof(modes)/sizeof(modes[0]); m++){
+    if((err = upstream_start(&u)) < 0){
+      printf("[*] Could not start the stand-in DNSPort: %s\n", strerror(-err));
+      return 1;
+    }
+
+    memset(&st, 0, sizeof(st));
+    if(modes[m].stub){
+      memset(&opts, 0, sizeof(opts));
+      opts.listen = STUB_ADDR;
+      opts.upstream = UPSTREAM_ADDR;
+      opts.cache_entries = modes[m].cache_entries;
+      opts.coalesce = modes[m].coalesce;
+      opts.prefetch = modes[m].prefetch;
+      dns_stub_opts_default(&opts);
+      if((stub = dns_stub_open(&opts)) == NULL){
+        printf("[*] Could not open the stub: %s\n", strerror(errno));
+        return 1;
+      }
+      pthread_create(&stub_thread, NULL, stub_run, stub);
+    }
+
+    for(i=0; i<n_clients; i++){
+      clients[i].seed = i * 7919 + 1;
+      dns_stub_parse_addr(modes[m].stub ? STUB_ADDR : UPSTREAM_ADDR, &clients[i].server);
+      clients[i].end = now_us() + (uint64_t) seconds * 1000000;
+      memset(clients[i].hist, 0, HIST_BUCKETS * sizeof(*hist));
+      clients[i].answers = 0;
+      clients[i].failed = 0;
+      pthread_create(&clients[i].thread, NULL, client_run, &clients[i]);
+    }
+
+    memset(hist, 0, HIST_BUCKETS * sizeof(*hist));
+    answers = 0;
+    failed = 0;
+    for(i=0; i<n_clients; i++){
+      pthread_join(clients[i].thread, NULL);
+      for(b=0; b<HIST_BUCKETS; b++) hist[b] += clients[i].hist[b];
+      answers += clients[i].answers;
+      failed += clients[i].failed;
+    }
+
+    if(modes[m].stub){
+      dns_stub_stop(stub);
+      pthread_join(stub_thread, NULL);
+      dns_stub_read_stats(stub, &st);
+      dns_stub_close(stub);
+    }
+    upstream_stop(&u);
+
+    printf("%-10s %9llu %9lu %6.1f%% %9llu %9lu %8llu %9.3f %9.3f\n", modes[m].name,
+           (unsigned long long) answers, failed, st.queries ? 100.0 * st.hits / st.queries : 0.0,
+           (unsigned long long) st.coalesced, u.queries, (unsigned long long) st.prefetches,
+           hist_percentile(hist, answers, 0.5), hist_percentile(hist, answers, 0.99));
+  }
+
+  for(i=0; i<n_clients; i++) free(clients[i].hist);
+  free(clients);
+  free(hist);
+  free(zipf_cdf);
+  return 0;
+}
@@ -0,0 +1,204 @@
+/* **********************************************************************
+ * Userspace implementations of the kernel interfaces declared in
+ * torproxy_compat.h and bench/kshim.h, used by the benchmarks to run
+ * the module's packet path outside the kernel
+ **********************************************************************
+*/
+
+#include <stdarg.h>
+#include <sched.h>
+
+#include "bench/kshim.h"
+
+#define CT_HASH_BITS 16
+#define CT_LOCKS 1024
+
+__thread unsigned long lock_acquired, lock_contended;
+
+struct user_namespace init_user_ns;
+struct net init_net = { .user_ns = &init_user_ns };
+
+/* grace period counter, readers snapshot it in rcu_read_lock() */
+unsigned long rcu_gp_ctr = 1;
+
+/* every thread which ever entered a read side section */
+static struct rcu_reader *rcu_readers;
+static pthread_mutex_t rcu_gp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread struct rcu_reader *rcu_self;
+
+/* per-cpu slot of the calling thread, 0 until assigned */
+__thread unsigned int tp_cpu_slot;
+static unsigned int tp_cpu_next;
+
+/* conntrack table, buckets share a striped lock array like the kernel's */
+static struct nf_conn *ct_hash[1 << CT_HASH_BITS];
+static spinlock_t ct_locks[CT_LOCKS];
+static pthread_once_t ct_once = PTHREAD_ONCE_INIT;
+
+
+/* reader state is never freed so writers can walk the
+ * list without caring about threads exiting */
+void rcu_register_thread(void){
+  struct rcu_reader *r;
+
+  r = calloc(1, sizeof(*r));
+  if(!r) abort();
+
+  pthread_mutex_lock(&rcu_gp_lock);
+  r->next = rcu_readers;
+  rcu_readers = r;
+  pthread_mutex_unlock(&rcu_gp_lock);
+
+  rcu_self = r;
+}
+
+
+/* wait until every reader which may have seen the old pointer is done */
+void synchronize_rcu(void){
+  struct rcu_reader *r;
+  unsigned long gp, ctr;
+
+  pthread_mutex_lock(&rcu_gp_lock);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  gp = __atomic_add_fetch(&rcu_gp_ctr, 1, __ATOMIC_SEQ_CST);
+
+  for(r = rcu_readers; r; r = r->next){
+    while(1){
+      ctr = __atomic_load_n(&r->ctr, __ATOMIC_ACQUIRE);
+      if(ctr == 0 || ctr >= gp) break;
+      sched_yield();
+    }
+  }
+
+  pthread_mutex_unlock(&rcu_gp_lock);
+}
+
+
+/* threads take slots in the order they first touch per-cpu data */
+void tp_cpu_register(void){
+  tp_cpu_slot = __atomic_fetch_add(&tp_cpu_next, 1, __ATOMIC_RELAXED) % NR_CPUS + 1;
+}
+
+
+/* formats like the kernel would so logging keeps its cost */
+int printk(const char *fmt, ...){
+  char buf[256];
+  va_list ap;
+  int ret;
+
+  va_start(ap, fmt);
+  ret = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  return ret;
+}
+
+
+void dst_release(struct dst_entry *dst){
+  if(dst && __atomic_sub_fetch(&dst->refcnt, 1, __ATOMIC_ACQ_REL) == 0) free(dst);
+}
+
+/* every lookup hands out a fresh route, as if the fib had no cache */
+struct rtable *ip_route_output(struct net *net, __be32 daddr, __be32 saddr, u8 tos, int oif){
+  struct rtable *rt;
+
+  rt = calloc(1, sizeof(*rt));
+  if(!rt) return ERR_PTR(-ENOMEM);
+
+  rt->dst.refcnt = 1;
+  return rt;
+}
+
+int ip_route_me_harder(struct sk_buff *skb, unsigned int addr_type){
+  struct iphdr *ip_header = (struct iphdr *) skb_network_header(skb);
+  struct rtable *rt;
+
+  rt = ip_route_output(dev_net(NULL), ip_header->daddr, ip_header->saddr, ip_header->tos, 0);
+  if(IS_ERR(rt)) return PTR_ERR(rt);
+
+  skb_dst_drop(skb);
+  skb_dst_set(skb, &rt->dst);
+  return 0;
+}
+
+unsigned long kshim_icmp_sent;
+
+
+static void ct_init(void){
+  int i;
+
+  for(i=0; i<CT_LOCKS; i++){
+    spin_lock_init(&ct_locks[i]);
+  }
+}
+
+/* attach a conntrack entry keyed on the 5-tuple, the first packet of
+ * a flow is NEW and later ones ESTABLISHED as if replies were seen */
+unsigned int nf_conntrack_in(struct net *net, u_int8_t pf, unsigned int hooknum, struct sk_buff *skb){
+  struct iphdr *ip_header = (struct iphdr *) skb_network_header(skb);
+  __be16 ports[2] = {0, 0}, *p;
+  struct nf_conn *ct;
+  unsigned int h;
+
+  pthread_once(&ct_once, ct_init);
+
+  /* previously seen, like the kernel's */
+  if(skb->nfct) return NF_ACCEPT;
+
+  if(ip_header->protocol == IPPROTO_TCP || ip_header->protocol == IPPROTO_UDP){
+    p = skb_header_pointer(skb, skb_transport_offset(skb), sizeof(ports), ports);
+    if(p) memcpy(ports, p, sizeof(ports));
+  }
+
+  h = jhash_3words(ip_header->saddr, ip_header->daddr,
+                   ((u32) ports[0] << 16 | ports[1]) ^ ip_header->protocol, 0);
+  h &= (1 << CT_HASH_BITS) - 1;
+
+  spin_lock_bh(&ct_locks[h % CT_LOCKS]);
+  for(ct = ct_hash[h]; ct; ct = ct->next){
+    if(ct->saddr == ip_header->saddr && ct->daddr == ip_header->daddr &&
+       ct->sport == ports[0] && ct->dport == ports[1] && ct->protonum == ip_header->protocol) break;
+  }
+  if(!ct){
+    ct = calloc(1, sizeof(*ct));
+    if(!ct){
+      spin_unlock_bh(&ct_locks[h % CT_LOCKS]);
+      return NF_DROP;
+    }
+    ct->saddr = ip_header->saddr;
+    ct->daddr = ip_header->daddr;
+    ct->sport = ports[0];
+    ct->dport = ports[1];
+    ct->protonum = ip_header->protocol;
+    ct->next = ct_hash[h];
+    ct_hash[h] = ct;
+  }
+  skb->nfctinfo = ct->packets++ ? IP_CT_ESTABLISHED : IP_CT_NEW;
+  spin_unlock_bh(&ct_locks[h % CT_LOCKS]);
+
+  skb->nfct = ct;
+  return NF_ACCEPT;
+}
+
+unsigned int nf_nat_setup_info(struct nf_conn *ct, const struct nf_nat_range *range,
+    enum nf_nat_manip_type maniptype)
+{
+  ct->nat_range = *range;
+  __atomic_store_n(&ct->nat_done, 1, __ATOMIC_RELEASE);
+  return NF_ACCEPT;
+}
+
+/* forget every tracked flow, callers make sure no packet is in flight */
+void nf_conntrack_flush(void){
+  struct nf_conn *ct, *next;
+  unsigned int i;
+
+  for(i=0; i<(1 << CT_HASH_BITS); i++){
+    for(ct = ct_hash[i]; ct; ct = next){
+      next = ct->next;
+      free(ct);
+    }
+    ct_hash[i] = NULL;
+  }
+}
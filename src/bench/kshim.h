@@ -0,0 +1,311 @@
+/* **********************************************************************
+ * Thin userspace stand-in for the skb, socket, checksum, routing,
+ * conntrack and workqueue interfaces used by torproxy_hook.h
+ *
+ * Only the fields and calls the hook touches exist. Conntrack and
+ * routing keep real shared state (hash buckets, refcounts) so that
+ * multi-threaded benchmarks pay for the same cache lines the kernel
+ * would, but they do none of the actual protocol tracking
+ **********************************************************************
+*/
+
+#ifndef TORPROXY_KSHIM_H
+#define TORPROXY_KSHIM_H
+
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <linux/ip.h>
+#include <linux/icmp.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_nat.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+
+#include "torproxy_compat.h"
+
+#define __force
+
+#define KERN_ALERT ""
+#define KERN_INFO ""
+int printk(const char *fmt, ...);
+
+#define ACCESS_ONCE(x) (*(volatile __typeof__(x) *) &(x))
+#define xchg(ptr, v) __atomic_exchange_n((ptr), (v), __ATOMIC_SEQ_CST)
+
+#define MAX_ERRNO 4095
+#define IS_ERR(ptr) ((unsigned long) (ptr) >= (unsigned long) -MAX_ERRNO)
+#define PTR_ERR(ptr) ((long) (ptr))
+#define ERR_PTR(err) ((void *) (long) (err))
+
+
+/* checksums */
+typedef u32 __wsum;
+typedef u16 __sum16;
+
+#define CSUM_MANGLED_0 ((__sum16) 0xffff)
+
+static inline __wsum csum_add(__wsum csum, __wsum addend){
+  u32 res = csum + addend;
+
+  return res + (res < addend);
+}
+
+static inline __wsum csum_sub(__wsum csum, __wsum addend){
+  return csum_add(csum, ~addend);
+}
+
+static inline __sum16 csum_fold(__wsum csum){
+  u32 sum = csum;
+
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (__sum16) ~sum;
+}
+
+static inline __wsum csum_unfold(__sum16 n){
+  return (__wsum) n;
+}
+
+static inline void csum_replace4(__sum16 *sum, __be32 from, __be32 to){
+  *sum = csum_fold(csum_add(csum_sub(~csum_unfold(*sum), from), to));
+}
+
+
+/* network devices and routes */
+/* one namespace, its generic slot holds whatever the user of the shim puts there */
+struct user_namespace;
+
+struct net {
+  void *generic;
+  struct user_namespace *user_ns;
+};
+extern struct net init_net;
+
+#define net_generic(net, id) ((net)->generic)
+
+#ifndef IFF_LOOPBACK
+#define IFF_LOOPBACK 0x8
+#endif
+
+struct net_device {
+  struct net *nd_net;
+  int ifindex;
+  char name[16];
+  unsigned int flags;
+};
+
+static inline struct net *dev_net(const struct net_device *dev){
+  return dev ? dev->nd_net : &init_net;
+}
+
+struct dst_entry {
+  int refcnt;
+  int obsolete;
+  struct net_device *dev;
+};
+
+struct rtable {
+  struct dst_entry dst;
+};
+
+#define RTN_UNSPEC 0
+
+static inline struct dst_entry *dst_clone(struct dst_entry *dst){
+  if(dst) __atomic_add_fetch(&dst->refcnt, 1, __ATOMIC_RELAXED);
+  return dst;
+}
+
+static inline struct dst_entry *dst_check(struct dst_entry *dst, u32 cookie){
+  return __atomic_load_n(&dst->obsolete, __ATOMIC_RELAXED) ? NULL : dst;
+}
+
+void dst_release(struct dst_entry *dst);
+struct rtable *ip_route_output(struct net *net, __be32 daddr, __be32 saddr, u8 tos, int oif);
+
+
+/* sending sockets, just what's needed to find their owner */
+typedef u32 kuid_t;
+
+struct user_namespace {
+  int unused;
+};
+extern struct user_namespace init_user_ns;
+
+#define from_kuid_munged(ns, uid) (uid)
+
+struct cred {
+  kuid_t fsuid;
+};
+
+struct file {
+  const struct cred *f_cred;
+};
+
+struct socket {
+  struct file *file;
+};
+
+struct sock {
+  struct socket *sk_socket;
+  u32 sk_classid;
+};
+
+
+/* socket buffers, always linear and private */
+#define CHECKSUM_NONE 0
+#define CHECKSUM_UNNECESSARY 1
+#define CHECKSUM_COMPLETE 2
+#define CHECKSUM_PARTIAL 3
+
+struct nf_conn;
+
+struct sk_buff {
+  struct sock *sk;
+  unsigned char *head;
+  unsigned char *data;
+  unsigned int len;
+  u16 network_header;
+  u16 transport_header;
+  u8 ip_summed;
+  u32 mark;
+  __wsum csum;
+  struct dst_entry *dst;
+  struct nf_conn *nfct;
+  enum ip_conntrack_info nfctinfo;
+};
+
+static inline unsigned char *skb_network_header(const struct sk_buff *skb){
+  return skb->head + skb->network_header;
+}
+
+static inline unsigned char *skb_transport_header(const struct sk_buff *skb){
+  return skb->head + skb->transport_header;
+}
+
+static inline int skb_transport_offset(const struct sk_buff *skb){
+  return skb_transport_header(skb) - skb->data;
+}
+
+static inline void *skb_header_pointer(const struct sk_buff *skb, int offset, int len, void *buffer){
+  if(offset < 0 || (unsigned int) (offset + len) > skb->len) return NULL;
+  return skb->data + offset;
+}
+
+static inline int skb_make_writable(struct sk_buff *skb, unsigned int writable_len){
+  return writable_len <= skb->len;
+}
+
+static inline struct dst_entry *skb_dst(const struct sk_buff *skb){
+  return skb->dst;
+}
+
+static inline void skb_dst_set(struct sk_buff *skb, struct dst_entry *dst){
+  skb->dst = dst;
+}
+
+static inline void skb_dst_drop(struct sk_buff *skb){
+  if(skb->dst) dst_release(skb->dst);
+  skb->dst = NULL;
+}
+
+int ip_route_me_harder(struct sk_buff *skb, unsigned int addr_type);
+
+/* ICMP errors the hook sends to local senders, only counted */
+extern unsigned long kshim_icmp_sent;
+
+static inline void icmp_send(struct sk_buff *skb_in, int type, int code, __be32 info){
+  __atomic_fetch_add(&kshim_icmp_sent, 1, __ATOMIC_RELAXED);
+}
+
+
+/* checksum updates as in net/core/utils.c */
+static inline void inet_proto_csum_replace4(__sum16 *sum, struct sk_buff *skb,
+    __be32 from, __be32 to, int pseudohdr)
+{
+  __wsum diff;
+
+  if(skb->ip_summed != CHECKSUM_PARTIAL){
+    *sum = csum_fold(csum_add(csum_add(~csum_unfold(*sum), ~from), to));
+    if(skb->ip_summed == CHECKSUM_COMPLETE && pseudohdr){
+      diff = csum_add(csum_add(~skb->csum, ~from), to);
+      skb->csum = ~diff;
+    }
+  } else if(pseudohdr){
+    *sum = ~csum_fold(csum_add(csum_add(csum_unfold(*sum), ~from), to));
+  }
+}
+
+static inline void inet_proto_csum_replace2(__sum16 *sum, struct sk_buff *skb,
+    __be16 from, __be16 to, int pseudohdr)
+{
+  inet_proto_csum_replace4(sum, skb, (__be32) from, (__be32) to, pseudohdr);
+}
+
+
+/* conntrack and NAT */
+enum nf_nat_manip_type {
+  NF_NAT_MANIP_SRC,
+  NF_NAT_MANIP_DST
+};
+
+struct nf_conn {
+  struct nf_conn *next;
+  u32 mark;
+  __be32 saddr, daddr;
+  __be16 sport, dport;
+  u8 protonum;
+  unsigned long packets;
+  unsigned int nat_done;
+  struct nf_nat_range nat_range;
+
+  /* references besides the table's, which frees entries regardless */
+  atomic_t use;
+};
+
+static inline struct nf_conn *nf_ct_get(const struct sk_buff *skb, enum ip_conntrack_info *ctinfo){
+  *ctinfo = skb->nfctinfo;
+  return skb->nfct;
+}
+
+static inline void nf_ct_put(struct nf_conn *ct){
+  atomic_dec(&ct->use);
+}
+
+/* entries only go away in nf_conntrack_flush() */
+static inline int nf_ct_is_dying(const struct nf_conn *ct){
+  return 0;
+}
+
+unsigned int nf_conntrack_in(struct net *net, u_int8_t pf, unsigned int hooknum, struct sk_buff *skb);
+unsigned int nf_nat_setup_info(struct nf_conn *ct, const struct nf_nat_range *range,
+    enum nf_nat_manip_type maniptype);
+void nf_conntrack_flush(void);
+
+
+/* delayed work, run by whoever calls kshim_run_delayed_work() */
+struct work_struct {
+  int unused;
+};
+
+struct delayed_work {
+  struct work_struct work;
+  void (*func)(struct work_struct *work);
+  int pending;
+};
+
+#define DECLARE_DELAYED_WORK(n, f) struct delayed_work n = { .func = (f) }
+#define INIT_DELAYED_WORK(w, f) do{ (w)->func = (f); (w)->pending = 0; }while(0)
+#define to_delayed_work(w) container_of(w, struct delayed_work, work)
+#define delayed_work_pending(w) __atomic_load_n(&(w)->pending, __ATOMIC_RELAXED)
+#define cancel_delayed_work_sync(w) __atomic_store_n(&(w)->pending, 0, __ATOMIC_RELEASE)
+
+static inline int schedule_delayed_work(struct delayed_work *w, unsigned long delay){
+  return __atomic_exchange_n(&w->pending, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+static inline void kshim_run_delayed_work(struct delayed_work *w){
+  if(__atomic_exchange_n(&w->pending, 0, __ATOMIC_ACQ_REL)) w->func(&w->work);
+}
+
+#endif /* TORPROXY_KSHIM_H */
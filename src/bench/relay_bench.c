@@ -0,0 +1,216 @@
+/* **********************************************************************
+ * Per-CPU relay lookup benchmark
+ *
+ * Runs the relay check done by local_out_hook_func on 1..N pinned
+ * threads while a writer keeps publishing new relay tables, once with
+ * the old mutex protected scan and once with the RCU relay set, and
+ * reports the per lookup cost for every thread count
+ **********************************************************************
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "torproxy_relay.h"
+
+#define N_DADDR 4096
+
+/* size of the old fixed relay table */
+#define LEGACY_RELAYS 8
+
+enum bench_mode { MODE_MUTEX, MODE_RCU };
+
+/* old scheme, table guarded by one global mutex */
+static pthread_mutex_t legacy_lock = PTHREAD_MUTEX_INITIALIZER;
+static __be32 legacy_relays[LEGACY_RELAYS];
+
+/* new scheme */
+static struct relay_set __rcu *relays;
+static DEFINE_MUTEX(relay_write_lock);
+
+static __be32 daddrs[N_DADDR];
+static volatile int running;
+
+struct reader_arg {
+  pthread_t thread;
+  enum bench_mode mode;
+  int cpu;
+  unsigned long lookups;
+  unsigned long hits;
+};
+
+
+static double now_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static void pin_cpu(int cpu){
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static int legacy_contains(__be32 addr){
+  int i;
+
+  pthread_mutex_lock(&legacy_lock);
+  for(i=0; i<LEGACY_RELAYS; i++){
+    if(addr == legacy_relays[i]){
+      pthread_mutex_unlock(&legacy_lock);
+      return 1;
+    }
+  }
+  pthread_mutex_unlock(&legacy_lock);
+
+  return 0;
+}
+
+static int rcu_contains(__be32 addr){
+  int ret;
+
+  rcu_read_lock();
+  ret = relay_set_contains(rcu_dereference(relays), addr);
+  rcu_read_unlock();
+
+  return ret;
+}
+
+/* fills the table with random relays, a few of them used as
+ * destinations so lookups see a realistic hit ratio */
+static void publish(enum bench_mode mode, unsigned int generation, unsigned int *seed){
+  __be32 slots[LEGACY_RELAYS];
+  int i;
+
+  for(i=0; i<LEGACY_RELAYS; i++){
+    slots[i] = (i < 2) ? daddrs[i*7] : (__be32) rand_r(seed);
+  }
+
+  if(mode == MODE_MUTEX){
+    pthread_mutex_lock(&legacy_lock);
+    memcpy(legacy_relays, slots, sizeof(slots));
+    pthread_mutex_unlock(&legacy_lock);
+  } else{
+    mutex_lock(&relay_write_lock);
+    relay_set_replace(&relays, relay_set_build(slots, LEGACY_RELAYS, generation));
+    mutex_unlock(&relay_write_lock);
+  }
+}
+
+static void *reader_th(void *data){
+  struct reader_arg *arg = data;
+  unsigned long n = 0, hits = 0;
+  unsigned int i = 0;
+
+  pin_cpu(arg->cpu);
+  while(!__atomic_load_n(&running, __ATOMIC_ACQUIRE));
+
+  while(__atomic_load_n(&running, __ATOMIC_RELAXED)){
+    for(i=0; i<N_DADDR; i++){
+      if(arg->mode == MODE_MUTEX){
+        hits += legacy_contains(daddrs[i]);
+      } else{
+        hits += rcu_contains(daddrs[i]);
+      }
+    }
+    n += N_DADDR;
+  }
+
+  arg->lookups = n;
+  arg->hits = hits;
+  return NULL;
+}
+
+/* runs one configuration, returns ns per lookup seen by a reader */
+static double run(enum bench_mode mode, int n_threads, int n_cpus, int duration_ms, int writer_us){
+  struct reader_arg *args;
+  unsigned int seed = 1, generation = 0;
+  unsigned long total = 0;
+  double start, end;
+  int i;
+
+  args = calloc(n_threads, sizeof(*args));
+  publish(mode, ++generation, &seed);
+
+  running = 0;
+  for(i=0; i<n_threads; i++){
+    args[i].mode = mode;
+    args[i].cpu = i % n_cpus;
+    pthread_create(&args[i].thread, NULL, reader_th, &args[i]);
+  }
+
+  start = now_ns();
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  while((end = now_ns()) - start < duration_ms*1e6){
+    if(writer_us > 0){
+      usleep(writer_us);
+      publish(mode, ++generation, &seed);
+    } else{
+      usleep(1000);
+    }
+  }
+  __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+
+  for(i=0; i<n_threads; i++){
+    pthread_join(args[i].thread, NULL);
+    total += args[i].lookups;
+  }
+  end = now_ns();
+
+  free(args);
+  if(total == 0) return 0;
+
+  /* every reader ran for the whole window */
+  return (end-start) * n_threads / total;
+}
+
+static void usage(const char *prog){
+  printf("usage: %s [-t max threads] [-d duration ms] [-w writer interval us]\n", prog);
+}
+
+
+int main(int argc, char **argv){
+  int max_threads, duration_ms = 500, writer_us = 1000, n_cpus, opt, t, i;
+  unsigned int seed = 42;
+  double ns_mutex, ns_rcu;
+
+  n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  max_threads = n_cpus;
+
+  while((opt = getopt(argc, argv, "t:d:w:h")) != -1){
+    switch(opt){
+      case 't': max_threads = atoi(optarg); break;
+      case 'd': duration_ms = atoi(optarg); break;
+      case 'w': writer_us = atoi(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if(max_threads < 1) max_threads = 1;
+
+  for(i=0; i<N_DADDR; i++){
+    daddrs[i] = (__be32) rand_r(&seed);
+  }
+
+  printf("[*] relay lookup, %d cpus, writer every %d us\n", n_cpus, writer_us);
+  printf("%8s %16s %16s\n", "threads", "mutex ns/lookup", "rcu ns/lookup");
+
+  for(t=1; ; t*=2){
+    if(t > max_threads) t = max_threads;
+    ns_mutex = run(MODE_MUTEX, t, n_cpus, duration_ms, writer_us);
+    ns_rcu = run(MODE_RCU, t, n_cpus, duration_ms, writer_us);
+    printf("%8d %16.2f %16.2f\n", t, ns_mutex, ns_rcu);
+    if(t == max_threads) break;
+  }
+
+  return 0;
+}
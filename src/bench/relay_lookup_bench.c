@@ -0,0 +1,162 @@
+/* **********************************************************************
+ * Relay set lookup benchmark
+ *
+ * Single threaded cost of the relay check done for every outgoing
+ * packet, comparing a linear scan of the relay list with the hashed
+ * relay set for sets ranging from a handful of guards to the whole
+ * consensus
+ **********************************************************************
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "torproxy_relay.h"
+
+#define N_DADDR 4096
+
+/* keeps the compiler from hoisting lookups out of the timing loop
+ * or dropping them because their result is unused */
+#define COMPILER_BARRIER(v) __asm__ __volatile__("" : "+r"(v) :: "memory")
+
+
+static double now_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static int linear_contains(const __be32 *addrs, unsigned int n, __be32 addr){
+  unsigned int i;
+
+  for(i=0; i<n; i++){
+    if(addrs[i] == addr) return 1;
+  }
+
+  return 0;
+}
+
+/* random relays that are never 0 or 255.255.255.255 */
+static __be32 random_addr(unsigned int *seed){
+  __be32 addr;
+
+  do{
+    addr = ((__be32) rand_r(seed) << 16) ^ (__be32) rand_r(seed);
+  } while(addr == RELAY_SLOT_EMPTY || addr == RELAY_SLOT_UNSET);
+
+  return addr;
+}
+
+/* ns per lookup over at least duration_ms */
+static double run_linear(const __be32 *addrs, unsigned int n, const __be32 *daddrs,
+    int duration_ms)
+{
+  unsigned long lookups = 0, h = 0;
+  double start = now_ns(), end;
+  unsigned int i;
+
+  do{
+    for(i=0; i<N_DADDR; i++){
+      h += linear_contains(addrs, n, daddrs[i]);
+    }
+    lookups += N_DADDR;
+    COMPILER_BARRIER(h);
+  } while((end = now_ns()) - start < duration_ms*1e6);
+
+  return (end-start) / lookups;
+}
+
+static double run_hashed(const struct relay_set *set, const __be32 *daddrs,
+    int duration_ms)
+{
+  unsigned long lookups = 0, h = 0;
+  double start = now_ns(), end;
+  unsigned int i;
+
+  do{
+    rcu_read_lock();
+    for(i=0; i<N_DADDR; i++){
+      h += relay_set_contains(set, daddrs[i]);
+    }
+    rcu_read_unlock();
+    lookups += N_DADDR;
+    COMPILER_BARRIER(h);
+  } while((end = now_ns()) - start < duration_ms*1e6);
+
+  return (end-start) / lookups;
+}
+
+static void usage(const char *prog){
+  printf("usage: %s [-n sizes, default 8,1000,10000] [-p hit percent] [-d duration ms]\n", prog);
+}
+
+
+int main(int argc, char **argv){
+  char sizes_default[] = "8,1000,10000", *sizes = sizes_default, *tok, *save;
+  int duration_ms = 500, hit_pct = 10, opt;
+  unsigned long mismatches;
+  __be32 *addrs, daddrs[N_DADDR];
+  double ns_linear, ns_hashed;
+  struct relay_set *set;
+  unsigned int seed = 42, n, i;
+
+  while((opt = getopt(argc, argv, "n:p:d:h")) != -1){
+    switch(opt){
+      case 'n': sizes = optarg; break;
+      case 'p': hit_pct = atoi(optarg); break;
+      case 'd': duration_ms = atoi(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if(hit_pct < 0 || hit_pct > 100){
+    usage(argv[0]);
+    return 1;
+  }
+
+  addrs = malloc(RELAY_MAX_ADDRS * sizeof(__be32));
+  if(!addrs) return 1;
+
+  printf("[*] relay lookup, %d%% of destinations are relays\n", hit_pct);
+  printf("%8s %18s %18s %10s\n", "relays", "linear ns/lookup", "hashed ns/lookup", "slots");
+
+  for(tok = strtok_r(sizes, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+    n = strtoul(tok, NULL, 10);
+    if(n == 0 || n > RELAY_MAX_ADDRS){
+      fprintf(stderr, "[-] set size %s out of range 1..%d\n", tok, RELAY_MAX_ADDRS);
+      continue;
+    }
+
+    for(i=0; i<n; i++){
+      addrs[i] = random_addr(&seed);
+    }
+    for(i=0; i<N_DADDR; i++){
+      daddrs[i] = ((unsigned int) rand_r(&seed) % 100 < (unsigned int) hit_pct) ?
+                  addrs[rand_r(&seed) % n] : random_addr(&seed);
+    }
+
+    set = relay_set_build(addrs, n, 1);
+    if(!set){
+      fprintf(stderr, "[-] can't build a set of %u relays\n", n);
+      continue;
+    }
+
+    for(i=0, mismatches=0; i<N_DADDR; i++){
+      mismatches += linear_contains(addrs, n, daddrs[i]) != relay_set_contains(set, daddrs[i]);
+    }
+    if(mismatches) fprintf(stderr, "[-] %lu lookups disagree with the linear scan\n", mismatches);
+
+    ns_linear = run_linear(addrs, n, daddrs, duration_ms);
+    ns_hashed = run_hashed(set, daddrs, duration_ms);
+    printf("%8u %18.2f %18.2f %10u\n", n, ns_linear, ns_hashed, set->mask + 1);
+
+    relay_set_free(set);
+  }
+
+  free(addrs);
+  return 0;
+}
@@ -0,0 +1,188 @@
+/* **********************************************************************
+ * relay_pop population benchmark
+ *
+ * Runs relay_pop's discovery and parsing against a tree written by
+ * relay_pop_fixture instead of the live /proc and tor data directory:
+ * finding the tor processes, indexing the consensus named by their
+ * environment, checking tor's peers against it and building the
+ * update relay_pop -c sends. Every phase is timed on its own over
+ * several runs, and the peak RSS of the whole run is reported with
+ * them. Nothing is sent to the module
+ **********************************************************************
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "consensus.h"
+#include "tor_procs.h"
+#include "relay_ctl.h"
+
+#define MAX_PATH 4096
+
+/* relay_pop's limits */
+#define MAX_RELAY 8
+#define MAX_TOR_PROCS TOR_MAX_ENDPOINTS
+
+#define MAX_RUNS 1000
+
+enum phase {
+  PHASE_FIND,
+  PHASE_INDEX,
+  PHASE_CHECK,
+  PHASE_UPDATE,
+  PHASE_TOTAL,
+  PHASE_MAX
+};
+
+static const char *phase_names[PHASE_MAX] = {
+  "find", "index", "check", "update", "total",
+};
+
+
+static double now_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static int double_cmp(const void *a, const void *b){
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* tor's peers, half of them relays of the consensus */
+static void draw_peers(const struct consensus_index *idx, uint32_t *peers, int n, unsigned int *seed){
+  int i;
+
+  for(i=0; i<n; i++){
+    if((i & 1) && idx->count) peers[i] = idx->addrs[rand_r(seed) % idx->count];
+    else peers[i] = ((uint32_t) rand_r(seed) << 16) ^ (uint32_t) rand_r(seed);
+  }
+}
+
+/* one population, times in ns per phase. returns the relays found or -1 */
+static int run(const char *proc_root, int n_peers, unsigned int *seed, double *t, size_t *n_relays){
+  struct consensus_index idx;
+  struct relay_ctl_update update;
+  pid_t pids[MAX_TOR_PROCS];
+  uint32_t *peers;
+  size_t n, n6;
+  double start, phase;
+  int n_pids, n_found = 0, err, i;
+
+  peers = malloc(n_peers * sizeof(*peers));
+  if(!peers) return -1;
+
+  start = phase = now_ns();
+
+  n_pids = tor_find_pids(proc_root, "tor", pids, MAX_TOR_PROCS);
+  t[PHASE_FIND] = now_ns() - phase;
+  if(n_pids == 0){
+    printf("[*] No tor process under %s\n", proc_root);
+    free(peers);
+    return -1;
+  }
+
+  phase = now_ns();
+  err = consensus_index_load(&idx, proc_root, pids[0]);
+  t[PHASE_INDEX] = now_ns() - phase;
+  if(err < 0){
+    printf("[*] Could not index the consensus: %s\n", strerror(-err));
+    free(peers);
+    return -1;
+  }
+
+  /* drawn outside the timing, they come from the kernel in relay_pop */
+  draw_peers(&idx, peers, n_peers, seed);
+
+  phase = now_ns();
+  for(i=0; i<n_peers && n_found<MAX_RELAY; i++){
+    if(consensus_index_contains(&idx, peers[i])) n_found++;
+  }
+  t[PHASE_CHECK] = now_ns() - phase;
+
+  /* relay_pop -c, every relay of the consensus replaces the relay
+   * tables, the ipv6 ones in an update of their own */
+  phase = now_ns();
+  n = idx.count > RELAY_MAX_ADDRS ? RELAY_MAX_ADDRS : idx.count;
+  n6 = idx.count6 > RELAY6_MAX_ADDRS ? RELAY6_MAX_ADDRS : idx.count6;
+  err = relay_ctl_update_init(&update, 0);
+  if(err == 0) err = relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_RELAYS, idx.addrs, n * sizeof(*idx.addrs));
+  relay_ctl_update_free(&update);
+  if(err == 0) err = relay_ctl_update_init(&update, 0);
+  if(err == 0) err = relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_RELAYS6, idx.addrs6, n6 * sizeof(*idx.addrs6));
+  relay_ctl_update_free(&update);
+  t[PHASE_UPDATE] = now_ns() - phase;
+
+  t[PHASE_TOTAL] = now_ns() - start;
+
+  *n_relays = idx.count;
+  consensus_index_free(&idx);
+  free(peers);
+
+  if(err < 0){
+    printf("[*] Could not build the update: %s\n", strerror(-err));
+    return -1;
+  }
+  return n_found;
+}
+
+
+static void usage(const char *prog){
+  printf("usage: %s -d dir [-r runs] [-c connections] [-s seed]\n", prog);
+  printf("  dir is a tree written by relay_pop_fixture, tor has -c connections, half of them to relays\n");
+}
+
+int main(int argc, char **argv){
+  static double times[PHASE_MAX][MAX_RUNS];
+  double t[PHASE_MAX];
+  char proc_root[MAX_PATH];
+  const char *dir = NULL;
+  struct rusage usage_self;
+  unsigned int seed = 1;
+  int runs = 10, n_peers = 64, n_found = 0, i, p;
+  size_t n_relays = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "d:r:c:s:h")) != -1){
+    switch(opt){
+      case 'd': dir = optarg; break;
+      case 'r': runs = strtol(optarg, NULL, 10); break;
+      case 'c': n_peers = strtol(optarg, NULL, 10); break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if(!dir || runs < 1 || runs > MAX_RUNS || n_peers < 1){
+    usage(argv[0]);
+    return 1;
+  }
+
+  snprintf(proc_root, sizeof(proc_root), "%s/proc", dir);
+
+  for(i=0; i<runs; i++){
+    if((n_found = run(proc_root, n_peers, &seed, t, &n_relays)) < 0) return 1;
+    for(p=0; p<PHASE_MAX; p++) times[p][i] = t[p];
+  }
+
+  printf("[*] %zu relays, %d of %d connections to relays kept, %d runs\n", n_relays, n_found, n_peers, runs);
+  printf("%-8s %10s %10s %10s\n", "phase", "min ms", "p50 ms", "max ms");
+  for(p=0; p<PHASE_MAX; p++){
+    qsort(times[p], runs, sizeof(double), double_cmp);
+    printf("%-8s %10.3f %10.3f %10.3f\n", phase_names[p],
+           times[p][0] / 1e6, times[p][runs/2] / 1e6, times[p][runs-1] / 1e6);
+  }
+
+  getrusage(RUSAGE_SELF, &usage_self);
+  printf("peak RSS %ld KiB\n", usage_self.ru_maxrss);
+
+  return 0;
+}
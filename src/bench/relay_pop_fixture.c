@@ -0,0 +1,216 @@
+/* **********************************************************************
+ * Fixture generator for the relay_pop benchmark
+ *
+ * Writes a synthetic microdesc consensus and a fake proc tree under
+ * one directory, so relay_pop's parsers can be pointed at the same
+ * input on any box:
+ *
+ *   dir/tor/cached-microdesc-consensus   -n relays, -6 of them with an
+ *                                        "a" line
+ *   dir/proc/<pid>/comm                  -t tor processes among -p others
+ *   dir/proc/<pid>/environ               TOR_BROWSER_TOR_DATA_DIR=dir/tor
+ *                                        for the tor processes
+ *
+ * Everything follows from the seed. Tor's connections are found over
+ * NETLINK_SOCK_DIAG rather than read from /proc/<pid>/net/tcp, so the
+ * tree has no sockets and the benchmark draws tor's peers itself
+ **********************************************************************
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_PATH 4096
+
+static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const char *proc_names[] = {
+  "systemd", "kworker/0:1", "sshd", "bash", "cron", "dbus-daemon", "rsyslogd", "nginx", "torsocks", "tor-gencert",
+};
+
+
+static int make_dir(const char *path){
+  if(mkdir(path, 0755) < 0 && errno != EEXIST){
+    printf("[*] Could not create %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int write_file(const char *path, const char *data, size_t len){
+  FILE *file;
+
+  if((file = fopen(path, "w")) == NULL || fwrite(data, 1, len, file) != len){
+    printf("[*] Could not write %s: %s\n", path, strerror(errno));
+    if(file) fclose(file);
+    return -1;
+  }
+
+  return fclose(file);
+}
+
+static void random_b64(unsigned int *seed, char *buf, int len){
+  int i;
+
+  for(i=0; i<len; i++) buf[i] = b64[rand_r(seed) & 63];
+  buf[len] = 0;
+}
+
+/* public looking address, never 0, 10/8, 127/8 or multicast */
+static void random_addr(unsigned int *seed, unsigned char *b){
+  do{
+    b[0] = 1 + rand_r(seed) % 223;
+  } while(b[0] == 10 || b[0] == 127);
+  b[1] = rand_r(seed);
+  b[2] = rand_r(seed);
+  b[3] = 1 + rand_r(seed) % 254;
+}
+
+static int write_consensus(const char *path, unsigned int n, double share6, unsigned int *seed){
+  char identity[28], digest[44], nick[20];
+  unsigned char b[4];
+  unsigned int i;
+  FILE *file;
+
+  if((file = fopen(path, "w")) == NULL){
+    printf("[*] Could not write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  fprintf(file, "network-status-version 3 microdesc\n"
+                "vote-status consensus\n"
+                "consensus-method 34\n"
+                "valid-after 2024-01-01 00:00:00\n"
+                "fresh-until 2024-01-01 01:00:00\n"
+                "valid-until 2024-01-01 03:00:00\n"
+                "voting-delay 300 300\n"
+                "known-flags Authority BadExit Exit Fast Guard HSDir Running Stable StaleDesc Sybil V2Dir Valid\n");
+
+  for(i=0; i<n; i++){
+    random_b64(seed, identity, 27);
+    random_b64(seed, digest, 43);
+    snprintf(nick, sizeof(nick), "relay%u", i);
+    random_addr(seed, b);
+
+    fprintf(file, "r %s %s 2023-12-31 %02u:%02u:%02u %u.%u.%u.%u %u %u\n",
+            nick, identity, rand_r(seed) % 24, rand_r(seed) % 60, rand_r(seed) % 60,
+            b[0], b[1], b[2], b[3], (i & 1) ? 443 : 9001, (i % 3) ? 0 : 9030);
+    if(rand_r(seed) < share6 * RAND_MAX){
+      fprintf(file, "a [2001:db8:%x:%x::%x]:%u\n", rand_r(seed) & 0xffff, rand_r(seed) & 0xffff,
+              rand_r(seed) & 0xffff, (i & 1) ? 443 : 9001);
+    }
+    fprintf(file, "m %s\n"
+                  "s Fast%s Running Stable V2Dir Valid\n"
+                  "v Tor 0.4.8.10\n"
+                  "pr Conflux=1 Cons=1-2 Desc=1-2 DirCache=2 FlowCtrl=1-2 HSDir=2 HSIntro=4-5 HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Padding=2 Relay=1-4\n"
+                  "w Bandwidth=%u\n",
+            digest, (i % 4) ? "" : " Guard", 1 + rand_r(seed) % 100000);
+  }
+
+  fprintf(file, "directory-footer\nbandwidth-weights Wbd=0 Wbe=0 Wbg=4131 Wbm=10000\n");
+
+  if(fclose(file) != 0){
+    printf("[*] Could not write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* n_procs processes with pids 2.., n_tor of them named tor */
+static int write_proc(const char *dir, const char *tor_dir, unsigned int n_procs, unsigned int n_tor,
+    unsigned int *seed)
+{
+  /* dir and tor_dir fit MAX_PATH, with room for what is appended */
+  char path[MAX_PATH + 32], env[MAX_PATH + 64];
+  unsigned int i, j, *tor;
+  int len, err = 0;
+
+  tor = calloc(n_procs, sizeof(*tor));
+  if(!tor) return -1;
+  for(i=0; i<n_tor; ){
+    j = rand_r(seed) % n_procs;
+    if(!tor[j]){
+      tor[j] = 1;
+      i++;
+    }
+  }
+
+  for(i=0; i<n_procs && err == 0; i++){
+    snprintf(path, sizeof(path), "%s/%u", dir, i+2);
+    if(make_dir(path) < 0){
+      err = -1;
+      break;
+    }
+
+    snprintf(path, sizeof(path), "%s/%u/comm", dir, i+2);
+    if(tor[i]){
+      err = write_file(path, "tor\n", 4);
+      if(err < 0) break;
+
+      len = snprintf(env, sizeof(env), "HOME=/var/lib/tor%cPATH=/usr/bin%cTOR_BROWSER_TOR_DATA_DIR=%s%c",
+                     0, 0, tor_dir, 0);
+      snprintf(path, sizeof(path), "%s/%u/environ", dir, i+2);
+      err = write_file(path, env, len);
+    } else{
+      len = snprintf(env, sizeof(env), "%s\n", proc_names[rand_r(seed) % (sizeof(proc_names)/sizeof(*proc_names))]);
+      err = write_file(path, env, len);
+    }
+  }
+
+  free(tor);
+  return err;
+}
+
+
+static void usage(const char *prog){
+  printf("usage: %s -d dir [-n relays] [-6 ipv6 share] [-p processes] [-t tor processes] [-s seed]\n", prog);
+  printf("  writes dir/tor/cached-microdesc-consensus and a proc tree in dir/proc\n");
+}
+
+int main(int argc, char **argv){
+  char path[MAX_PATH], tor_dir[MAX_PATH];
+  const char *dir = NULL;
+  unsigned int n_relays = 10000, n_procs = 300, n_tor = 1, seed = 1;
+  double share6 = 0.25;
+  int opt;
+
+  while((opt = getopt(argc, argv, "d:n:6:p:t:s:h")) != -1){
+    switch(opt){
+      case 'd': dir = optarg; break;
+      case 'n': n_relays = strtoul(optarg, NULL, 10); break;
+      case '6': share6 = strtod(optarg, NULL); break;
+      case 'p': n_procs = strtoul(optarg, NULL, 10); break;
+      case 't': n_tor = strtoul(optarg, NULL, 10); break;
+      case 's': seed = strtoul(optarg, NULL, 10); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if(!dir || n_procs == 0 || n_tor > n_procs || share6 < 0 || share6 > 1){
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* the data directory is found through tor's environment, which needs its full path */
+  if(make_dir(dir) < 0 || realpath(dir, path) == NULL){
+    printf("[*] Could not resolve %s\n", dir);
+    return 1;
+  }
+  if(snprintf(tor_dir, sizeof(tor_dir), "%s/tor", path) >= (int) sizeof(tor_dir) ||
+     snprintf(path, sizeof(path), "%s/cached-microdesc-consensus", tor_dir) >= (int) sizeof(path)){
+    printf("[*] %s is too long\n", dir);
+    return 1;
+  }
+  if(make_dir(tor_dir) < 0 || write_consensus(path, n_relays, share6, &seed) < 0) return 1;
+
+  snprintf(path, sizeof(path), "%s/proc", dir);
+  if(make_dir(path) < 0 || write_proc(path, tor_dir, n_procs, n_tor, &seed) < 0) return 1;
+
+  printf("[*] %u relays, %u processes (%u tor) written to %s\n", n_relays, n_procs, n_tor, dir);
+  return 0;
+}
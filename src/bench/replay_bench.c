@@ -0,0 +1,690 @@
+/* **********************************************************************
+ * Packet replay benchmark for the local out hook
+ *
+ * Replays a pcap file or a synthetic traffic mix through the module's
+ * packet path built in userspace (libtorproxy_hook) and reports
+ * packets/sec, ns/packet, lock waits and the verdict breakdown.
+ * With -t the run is repeated on 1,2,4..N pinned threads so lock
+ * contention on the hook's shared state shows up as ns/packet growth.
+ * With -c conntrack is timed along with the hook, and -o adds the flow
+ * cache ahead of it so the cost of offloaded relay flows shows up
+ **********************************************************************
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "torproxy_relay.h"
+#include "bench/torproxy_lib.h"
+
+#define BATCH 64
+#define MAX_PKT_LEN 2048
+#define N_FLOWS 1024
+#define DNS_QUERY_LEN 32
+#define SYNTHETIC_RELAYS 8
+
+/* local addresses of the simulated host, one per thread */
+#define LOCAL_ADDR 0xc0a8010a /* 192.168.1.10 */
+#define RESOLVER_ADDR 0x08080808 /* 8.8.8.8 */
+
+enum pkt_class {
+  CLASS_RELAY,
+  CLASS_BYPASS,
+  CLASS_TOR,
+  CLASS_DNS_QUERY,
+  CLASS_DNS_REPLY,
+  CLASS_UDP,
+  CLASS_OTHER,
+  N_CLASS
+};
+
+static const char *class_names[N_CLASS] = {
+  "relay", "bypass", "tor", "dns-query", "dns-reply", "udp", "other"
+};
+
+/* weights of the synthetic mix, dns counts queries (each gets a reply) */
+static unsigned int mix[N_CLASS] = { 30, 10, 40, 15, 0, 3, 2 };
+
+struct pkt {
+  unsigned int len;
+  enum pkt_class class;
+  unsigned char *data;
+};
+
+struct trace {
+  struct pkt *pkts;
+  unsigned int n;
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  int cpu;
+  int joined;
+  unsigned int passes;
+  struct trace *trace;
+  unsigned long pkts;
+  double hook_ns;
+  unsigned long locks, waits;
+  unsigned long verdicts[N_CLASS][2];
+};
+
+/* private blocks, always part of the bypass set */
+static const u32 bypass_private[][2] = {
+  { 0x0a000000, 8 }, { 0x7f000000, 8 }, { 0xac100000, 12 }, { 0xc0a80000, 16 }
+};
+
+static __be32 relay_addrs[RELAY_MAX_ADDRS];
+static unsigned int n_relays;
+static struct net_device out_dev = { &init_net, 2, "eth0" };
+static volatile int workers_running;
+
+/* time the whole LOCAL_OUT chain instead of the hook alone */
+static int chain_mode;
+
+
+static double now_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static void pin_cpu(int cpu){
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static u16 ip_checksum(const void *data, unsigned int len){
+  const u16 *p = data;
+  u32 sum = 0;
+
+  while(len > 1){
+    sum += *p++;
+    len -= 2;
+  }
+  if(len) sum += *(const u8 *) p;
+
+  return csum_fold(sum);
+}
+
+
+static enum pkt_class classify(const unsigned char *data, unsigned int len){
+  const struct iphdr *ip_header = (const struct iphdr *) data;
+  const struct udphdr *udp_header;
+
+  if(len < sizeof(*ip_header) || ip_header->ihl*4U + 8 > len) return CLASS_OTHER;
+
+  udp_header = (const struct udphdr *) (data + ip_header->ihl*4);
+
+  switch(ip_header->protocol){
+    case IPPROTO_TCP:
+      if(torproxy_is_relay(ip_header->daddr)) return CLASS_RELAY;
+      if(torproxy_is_bypassed(ip_header->daddr)) return CLASS_BYPASS;
+      return CLASS_TOR;
+    case IPPROTO_UDP:
+      if(udp_header->dest == htons(53)) return CLASS_DNS_QUERY;
+      if(ip_header->saddr == htonl(0x7f000001) && udp_header->source == htons(9053)) return CLASS_DNS_REPLY;
+      return CLASS_UDP;
+    default:
+      return CLASS_OTHER;
+  }
+}
+
+static void trace_add(struct trace *t, const unsigned char *data, unsigned int len){
+  struct pkt *p;
+
+  if(len > MAX_PKT_LEN) len = MAX_PKT_LEN;
+
+  t->pkts = realloc(t->pkts, (t->n+1) * sizeof(*t->pkts));
+  p = &t->pkts[t->n++];
+  p->len = len;
+  p->data = malloc(len);
+  memcpy(p->data, data, len);
+  p->class = classify(data, len);
+}
+
+
+/* builds an ipv4 tcp/udp/icmp packet as the stack hands it to
+ * LOCAL_OUT, l4 checksum only covering the pseudo header */
+static unsigned int build_packet(unsigned char *buf, u8 proto, __be32 saddr, __be32 daddr,
+    __be16 sport, __be16 dport, const void *payload, unsigned int payload_len)
+{
+  struct iphdr *ip_header = (struct iphdr *) buf;
+  struct tcphdr *tcp_header;
+  struct udphdr *udp_header;
+  unsigned int l4_len, len;
+  u32 pseudo;
+
+  l4_len = (proto == IPPROTO_TCP) ? sizeof(struct tcphdr) : 8;
+  len = sizeof(*ip_header) + l4_len + payload_len;
+  memset(buf, 0, len);
+
+  ip_header->version = 4;
+  ip_header->ihl = 5;
+  ip_header->tot_len = htons(len);
+  ip_header->ttl = 64;
+  ip_header->protocol = proto;
+  ip_header->saddr = saddr;
+  ip_header->daddr = daddr;
+  ip_header->check = ip_checksum(ip_header, sizeof(*ip_header));
+
+  memcpy(buf + sizeof(*ip_header) + l4_len, payload, payload_len);
+
+  pseudo = (saddr & 0xffff) + (saddr >> 16) + (daddr & 0xffff) + (daddr >> 16) +
+           htons(proto) + htons(l4_len + payload_len);
+
+  if(proto == IPPROTO_TCP){
+    tcp_header = (struct tcphdr *) (buf + sizeof(*ip_header));
+    tcp_header->source = sport;
+    tcp_header->dest = dport;
+    tcp_header->doff = 5;
+    tcp_header->ack = 1;
+    tcp_header->window = htons(65535);
+    tcp_header->check = ~csum_fold(pseudo);
+  } else if(proto == IPPROTO_UDP){
+    udp_header = (struct udphdr *) (buf + sizeof(*ip_header));
+    udp_header->source = sport;
+    udp_header->dest = dport;
+    udp_header->len = htons(l4_len + payload_len);
+    udp_header->check = ~csum_fold(pseudo);
+  } else{
+    buf[sizeof(*ip_header)] = 8; /* icmp echo request */
+  }
+
+  return len;
+}
+
+static __be32 random_public_addr(unsigned int *seed){
+  __be32 addr;
+
+  do{
+    addr = (__be32) rand_r(seed) ^ ((__be32) rand_r(seed) << 16);
+  } while(torproxy_is_bypassed(addr) || torproxy_is_relay(addr) ||
+          (addr & 0xff) == 0 || (addr & 0xff) >= 224);
+
+  return addr;
+}
+
+static unsigned int pick_class(unsigned int *seed){
+  unsigned int total = 0, r, i;
+
+  for(i=0; i<N_CLASS; i++) total += mix[i];
+  r = rand_r(seed) % total;
+  for(i=0; i<N_CLASS; i++){
+    if(r < mix[i]) return i;
+    r -= mix[i];
+  }
+
+  return CLASS_OTHER;
+}
+
+/* synthetic mix, tcp goes over a fixed pool of flows so conntrack sees
+ * repeated packets, dns replies follow their queries a few packets later */
+static void trace_synthetic(struct trace *t, unsigned int n, int id){
+  struct { __be32 daddr; __be16 sport, dport; } flows[N_FLOWS];
+  struct { __be16 port, dns_id; } pending[64];
+  unsigned char buf[MAX_PKT_LEN], dns[DNS_QUERY_LEN];
+  unsigned int seed = 7919 * (id+1), n_pending = 0, len, i, f;
+  __be32 saddr = htonl(LOCAL_ADDR + id);
+  __be16 port, dns_id;
+
+  for(i=0; i<N_FLOWS; i++){
+    flows[i].daddr = random_public_addr(&seed);
+    flows[i].sport = htons(32768 + i);
+    flows[i].dport = htons((i & 1) ? 443 : 80);
+  }
+
+  while(t->n < n){
+    switch(pick_class(&seed)){
+      case CLASS_RELAY:
+        len = build_packet(buf, IPPROTO_TCP, saddr, relay_addrs[rand_r(&seed) % n_relays],
+                           htons(40000 + rand_r(&seed) % 8), htons(9001), NULL, 0);
+        break;
+      case CLASS_BYPASS:
+        len = build_packet(buf, IPPROTO_TCP, saddr, htonl(0xc0a80000 | (rand_r(&seed) & 0xffff)),
+                           htons(50000 + rand_r(&seed) % 64), htons(22), NULL, 0);
+        break;
+      case CLASS_TOR:
+        f = rand_r(&seed) % N_FLOWS;
+        len = build_packet(buf, IPPROTO_TCP, saddr, flows[f].daddr, flows[f].sport, flows[f].dport, NULL, 0);
+        break;
+      case CLASS_DNS_QUERY:
+        port = htons(10000 + rand_r(&seed) % 50000);
+        dns_id = (__be16) rand_r(&seed);
+        memset(dns, 0, sizeof(dns));
+        memcpy(dns, &dns_id, sizeof(dns_id));
+        len = build_packet(buf, IPPROTO_UDP, saddr, htonl(RESOLVER_ADDR), port, htons(53), dns, sizeof(dns));
+        if(n_pending < 64){
+          pending[n_pending].port = port;
+          pending[n_pending].dns_id = dns_id;
+          n_pending++;
+        }
+        break;
+      case CLASS_UDP:
+        len = build_packet(buf, IPPROTO_UDP, saddr, random_public_addr(&seed),
+                           htons(20000 + rand_r(&seed) % 1000), htons(123), dns, 16);
+        break;
+      default:
+        len = build_packet(buf, IPPROTO_ICMP, saddr, random_public_addr(&seed), 0, 0, NULL, 0);
+        break;
+    }
+    trace_add(t, buf, len);
+
+    /* answer the oldest outstanding query once a few are in flight */
+    if(n_pending > 16 || (t->n >= n && n_pending)){
+      memset(dns, 0, sizeof(dns));
+      memcpy(dns, &pending[0].dns_id, sizeof(pending[0].dns_id));
+      len = build_packet(buf, IPPROTO_UDP, htonl(0x7f000001), saddr, htons(9053), pending[0].port, dns, sizeof(dns));
+      trace_add(t, buf, len);
+      memmove(pending, pending+1, --n_pending * sizeof(pending[0]));
+    }
+  }
+}
+
+
+/* pcap reader, ipv4 packets from ethernet, raw, linux cooked and
+ * loopback captures are kept */
+static int trace_pcap(struct trace *t, const char *path){
+  unsigned char hdr[24], rec[16], *buf;
+  unsigned int linktype, caplen, off, swap;
+  u32 magic;
+  u16 ethertype;
+  FILE *file;
+
+  if((file = fopen(path, "r")) == NULL) return -1;
+  if(fread(hdr, 1, sizeof(hdr), file) != sizeof(hdr)){
+    fclose(file);
+    return -1;
+  }
+
+  memcpy(&magic, hdr, 4);
+  if(magic == 0xa1b2c3d4 || magic == 0xa1b23c4d){
+    swap = 0;
+  } else if(magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1){
+    swap = 1;
+  } else{
+    fclose(file);
+    return -1;
+  }
+#define PCAP_U32(p) (swap ? __builtin_bswap32(*(u32 *) (p)) : *(u32 *) (p))
+  linktype = PCAP_U32(hdr + 20);
+
+  buf = malloc(65536);
+  while(fread(rec, 1, sizeof(rec), file) == sizeof(rec)){
+    caplen = PCAP_U32(rec + 8);
+    if(caplen > 65536 || fread(buf, 1, caplen, file) != caplen) break;
+
+    off = 0;
+    switch(linktype){
+      case 1: /* ethernet */
+        if(caplen < 14) continue;
+        off = 12;
+        memcpy(&ethertype, buf + off, 2);
+        while(ethertype == htons(0x8100) && off + 6 <= caplen){
+          off += 4;
+          memcpy(&ethertype, buf + off, 2);
+        }
+        if(ethertype != htons(0x0800)) continue;
+        off += 2;
+        break;
+      case 113: /* linux cooked */
+        if(caplen < 16) continue;
+        memcpy(&ethertype, buf + 14, 2);
+        if(ethertype != htons(0x0800)) continue;
+        off = 16;
+        break;
+      case 0: /* bsd loopback */
+        off = 4;
+        break;
+      case 101: /* raw ip */
+      case 228:
+        break;
+      default:
+        free(buf);
+        fclose(file);
+        return -1;
+    }
+
+    if(caplen <= off || (buf[off] >> 4) != 4) continue;
+    trace_add(t, buf + off, caplen - off);
+  }
+#undef PCAP_U32
+
+  free(buf);
+  fclose(file);
+  return 0;
+}
+
+static void trace_free(struct trace *t){
+  unsigned int i;
+
+  for(i=0; i<t->n; i++) free(t->pkts[i].data);
+  free(t->pkts);
+  t->pkts = NULL;
+  t->n = 0;
+}
+
+
+/* stand-in for the skb the stack would hand to LOCAL_OUT, with
+ * conntrack having already run at its higher priority unless the
+ * chain is timed */
+static void skb_prepare(struct sk_buff *skb, unsigned char *buf, const struct pkt *p){
+  const struct iphdr *ip_header = (const struct iphdr *) p->data;
+
+  memcpy(buf, p->data, p->len);
+  memset(skb, 0, sizeof(*skb));
+  skb->head = skb->data = buf;
+  skb->len = p->len;
+  skb->network_header = 0;
+  skb->transport_header = ip_header->ihl*4;
+  skb->ip_summed = (ip_header->protocol == IPPROTO_TCP || ip_header->protocol == IPPROTO_UDP) ?
+                   CHECKSUM_PARTIAL : CHECKSUM_NONE;
+
+  if(!chain_mode) nf_conntrack_in(&init_net, PF_INET, NF_INET_LOCAL_OUT, skb);
+}
+
+/* the LOCAL_OUT hooks in priority order, conntrack leaves the
+ * packets the flow cache gave an entry alone */
+static unsigned int chain_out(struct sk_buff *skb){
+  if(torproxy_flow_out(skb, &out_dev) != NF_ACCEPT) return NF_DROP;
+  if(nf_conntrack_in(&init_net, PF_INET, NF_INET_LOCAL_OUT, skb) != NF_ACCEPT) return NF_DROP;
+
+  return torproxy_local_out(skb, &out_dev);
+}
+
+static void *worker_th(void *data){
+  struct worker *w = data;
+  struct sk_buff skbs[BATCH];
+  unsigned int verdict[BATCH];
+  unsigned char *bufs;
+  unsigned long locks, waits;
+  unsigned int pass, i, j, n;
+  double start;
+
+  pin_cpu(w->cpu);
+  bufs = malloc(BATCH * MAX_PKT_LEN);
+
+  while(!__atomic_load_n(&workers_running, __ATOMIC_ACQUIRE));
+
+  for(pass=0; pass<w->passes; pass++){
+    for(i=0; i<w->trace->n; i+=BATCH){
+      n = (w->trace->n - i < BATCH) ? w->trace->n - i : BATCH;
+      for(j=0; j<n; j++){
+        skb_prepare(&skbs[j], bufs + j*MAX_PKT_LEN, &w->trace->pkts[i+j]);
+      }
+
+      locks = lock_acquired;
+      waits = lock_contended;
+      start = now_ns();
+      for(j=0; j<n; j++){
+        verdict[j] = chain_mode ? chain_out(&skbs[j]) : torproxy_local_out(&skbs[j], &out_dev);
+      }
+      w->hook_ns += now_ns() - start;
+      w->locks += lock_acquired - locks;
+      w->waits += lock_contended - waits;
+
+      for(j=0; j<n; j++){
+        w->verdicts[w->trace->pkts[i+j].class][verdict[j] == NF_ACCEPT]++;
+        skb_dst_drop(&skbs[j]);
+      }
+      w->pkts += n;
+    }
+  }
+
+  free(bufs);
+  return NULL;
+}
+
+
+static void run(struct worker *workers, int n_threads){
+  int i, done;
+
+  workers_running = 0;
+  for(i=0; i<n_threads; i++){
+    pthread_create(&workers[i].thread, NULL, worker_th, &workers[i]);
+  }
+  __atomic_store_n(&workers_running, 1, __ATOMIC_RELEASE);
+
+  /* the workqueue, advances NAT expiry while packets flow */
+  do{
+    usleep(10000);
+    torproxy_run_timers();
+    for(done=0, i=0; i<n_threads; i++){
+      if(!workers[i].joined) workers[i].joined = pthread_tryjoin_np(workers[i].thread, NULL) == 0;
+      done += workers[i].joined;
+    }
+  } while(done < n_threads);
+}
+
+static void report_verdicts(struct worker *workers, int n_threads){
+  unsigned long sum[N_CLASS][2] = {{0}}, total = 0, n;
+  int c, i;
+
+  for(i=0; i<n_threads; i++){
+    for(c=0; c<N_CLASS; c++){
+      sum[c][0] += workers[i].verdicts[c][0];
+      sum[c][1] += workers[i].verdicts[c][1];
+      total += workers[i].verdicts[c][0] + workers[i].verdicts[c][1];
+    }
+  }
+
+  printf("\n%-12s %10s %8s %10s %10s\n", "class", "packets", "share", "accept", "drop");
+  for(c=0; c<N_CLASS; c++){
+    n = sum[c][0] + sum[c][1];
+    if(!n) continue;
+    printf("%-12s %10lu %7.1f%% %10lu %10lu\n", class_names[c], n, 100.0*n/total, sum[c][1], sum[c][0]);
+  }
+}
+
+/* what the hook's own per-cpu counters saw over every run */
+static void report_hook_stats(void){
+  u64 verdicts[TORPROXY_STAT_MAX], latency[TORPROXY_HOOK_MAX][TORPROXY_LATENCY_BUCKETS];
+  u64 counted = 0, sampled = 0, seen = 0, stored, lost;
+  int i, p50 = -1;
+
+  torproxy_read_stats(verdicts, latency);
+  for(i=0; i<TORPROXY_STAT_MAX; i++) counted += verdicts[i];
+  for(i=0; i<TORPROXY_LATENCY_BUCKETS; i++) sampled += latency[TORPROXY_HOOK_LOCAL_OUT][i];
+  if(!sampled) return;
+
+  for(i=0; i<TORPROXY_LATENCY_BUCKETS-1; i++){
+    seen += latency[TORPROXY_HOOK_LOCAL_OUT][i];
+    if(p50 < 0 && seen >= sampled / 2) p50 = i;
+    if(seen >= sampled - sampled / 100) break;
+  }
+
+  printf("\n[*] hook counted %llu verdicts, %llu calls timed, p50 < %llu ns p99 < %llu ns\n",
+         (unsigned long long) counted, (unsigned long long) sampled, 1ULL << p50, 1ULL << i);
+  if(verdicts[TORPROXY_STAT_OFFLOADED]){
+    printf("[*] %llu packets offloaded past conntrack\n",
+           (unsigned long long) verdicts[TORPROXY_STAT_OFFLOADED]);
+  }
+
+  torproxy_drop_counts(&stored, &lost);
+  printf("[*] %llu drop events stored, %llu lost to full rings, %lu ICMP errors sent\n",
+         (unsigned long long) stored, (unsigned long long) lost, kshim_icmp_sent);
+}
+
+static int parse_mix(const char *spec){
+  char *copy = strdup(spec), *tok, *save = NULL, *eq;
+  int c;
+
+  memset(mix, 0, sizeof(mix));
+  for(tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+    if((eq = strchr(tok, '=')) == NULL) goto err;
+    *eq = 0;
+    if(!strcmp(tok, "dns")) tok = "dns-query";
+    for(c=0; c<N_CLASS; c++){
+      if(!strcmp(tok, class_names[c])) break;
+    }
+    if(c == N_CLASS || c == CLASS_DNS_REPLY) goto err;
+    mix[c] = atoi(eq+1);
+  }
+  free(copy);
+  return 0;
+
+err:
+  free(copy);
+  return -1;
+}
+
+/* the private blocks plus n random public prefixes of /12 to /32,
+ * every fourth one sending a range back through tor */
+static int load_bypass(unsigned int n, unsigned int *seed){
+  struct bypass_prefix *prefixes;
+  unsigned int n_private = sizeof(bypass_private) / sizeof(bypass_private[0]), i;
+  int ret;
+
+  prefixes = calloc(n_private + n, sizeof(*prefixes));
+  for(i=0; i<n_private; i++){
+    prefixes[i].addr = htonl(bypass_private[i][0]);
+    prefixes[i].len = bypass_private[i][1];
+    prefixes[i].action = BYPASS_ACCEPT;
+  }
+  for(i=n_private; i<n_private+n; i++){
+    prefixes[i].addr = (__be32) rand_r(seed) ^ ((__be32) rand_r(seed) << 16);
+    prefixes[i].len = 12 + rand_r(seed) % 21;
+    prefixes[i].action = (i % 4) ? BYPASS_ACCEPT : BYPASS_PROXY;
+  }
+
+  ret = torproxy_set_bypass(prefixes, n_private + n);
+  free(prefixes);
+  return ret;
+}
+
+static void usage(const char *prog){
+  printf("usage: %s [-r file.pcap] [-m mix] [-n packets] [-p passes] [-t max threads] [-R relay,...] [-B prefixes] [-j] [-c] [-o]\n", prog);
+  printf("  -m  synthetic mix weights, default relay=30,bypass=10,tor=40,dns=15,udp=3,other=2\n");
+  printf("  -R  relay addresses, default 8 random relays used by the synthetic mix\n");
+  printf("  -B  random bypass prefixes installed on top of the private blocks\n");
+  printf("  -j  reject dropped packets instead of dropping them silently\n");
+  printf("  -c  time conntrack along with the hook\n");
+  printf("  -o  offload established relay flows to the flow cache, implies -c\n");
+}
+
+
+int main(int argc, char **argv){
+  struct worker *workers = NULL;
+  struct trace *traces;
+  const char *pcap = NULL;
+  unsigned int n_pkts = 100000, passes = 10, n_bypass = 0, seed = 1;
+  int max_threads = 1, n_cpus, opt, t, i;
+  char *tok, *save = NULL;
+  struct in_addr addr;
+  double pps, ns;
+  unsigned long pkts, locks, waits;
+
+  n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while((opt = getopt(argc, argv, "r:m:n:p:t:R:B:jcoh")) != -1){
+    switch(opt){
+      case 'r': pcap = optarg; break;
+      case 'm':
+        if(parse_mix(optarg) < 0){
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'n': n_pkts = atoi(optarg); break;
+      case 'p': passes = atoi(optarg); break;
+      case 't': max_threads = atoi(optarg); break;
+      case 'R':
+        for(tok = strtok_r(optarg, ",", &save); tok && n_relays < RELAY_MAX_ADDRS; tok = strtok_r(NULL, ",", &save)){
+          if(inet_pton(AF_INET, tok, &addr) == 1) relay_addrs[n_relays++] = addr.s_addr;
+        }
+        break;
+      case 'B': n_bypass = atoi(optarg); break;
+      case 'j': torproxy_set_reject(1); break;
+      case 'c': chain_mode = 1; break;
+      case 'o':
+        chain_mode = 1;
+        torproxy_set_flow_offload(1);
+        break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if(max_threads < 1) max_threads = 1;
+
+  if(torproxy_init() < 0){
+    printf("[*] Could not set up hook state\n");
+    return 1;
+  }
+
+  if(!n_relays && !pcap){
+    for(n_relays=0; n_relays<SYNTHETIC_RELAYS; n_relays++){
+      relay_addrs[n_relays] = htonl(0x5e000000 | (rand_r(&seed) & 0xffffff));
+    }
+  }
+  torproxy_set_relays(relay_addrs, n_relays);
+
+  if(n_bypass && load_bypass(n_bypass, &seed) < 0){
+    printf("[*] Could not load %u bypass prefixes\n", n_bypass);
+    return 1;
+  }
+
+  traces = calloc(max_threads, sizeof(*traces));
+  for(i=0; i<max_threads; i++){
+    if(pcap){
+      if(trace_pcap(&traces[i], pcap) < 0 || traces[i].n == 0){
+        printf("[*] Could not read ipv4 packets from %s\n", pcap);
+        return 1;
+      }
+    } else{
+      trace_synthetic(&traces[i], n_pkts, i);
+    }
+  }
+
+  printf("[*] %s: %u packets x %u passes per thread, %d cpus\n",
+         pcap ? pcap : "synthetic mix", traces[0].n, passes, n_cpus);
+  printf("%8s %10s %10s %10s %10s\n", "threads", "Mpps", "ns/pkt", "locks/pkt", "waits/pkt");
+
+  for(t=1; ; t*=2){
+    if(t > max_threads) t = max_threads;
+
+    free(workers);
+    workers = calloc(t, sizeof(*workers));
+    for(i=0; i<t; i++){
+      workers[i].id = i;
+      workers[i].cpu = i % n_cpus;
+      workers[i].passes = passes;
+      workers[i].trace = &traces[i];
+    }
+
+    torproxy_flush_flows();
+    nf_conntrack_flush();
+    run(workers, t);
+
+    pps = 0;
+    pkts = locks = waits = 0;
+    for(i=0; i<t; i++){
+      pps += workers[i].pkts / workers[i].hook_ns * 1e9;
+      pkts += workers[i].pkts;
+      locks += workers[i].locks;
+      waits += workers[i].waits;
+    }
+    ns = t * 1e9 / pps;
+    printf("%8d %10.2f %10.1f %10.3f %10.4f\n", t, pps/1e6, ns, (double) locks/pkts, (double) waits/pkts);
+
+    if(t == max_threads) break;
+  }
+
+  /* breakdown of the widest run */
+  report_verdicts(workers, t);
+  report_hook_stats();
+  free(workers);
+
+  for(i=0; i<max_threads; i++) trace_free(&traces[i]);
+  free(traces);
+  torproxy_exit();
+  return 0;
+}
@@ -0,0 +1,170 @@
+/* **********************************************************************
+ * Userspace build of the module's packet path, see torproxy_lib.h
+ **********************************************************************
+*/
+
+#include "torproxy_hook.h"
+#include "bench/torproxy_lib.h"
+
+/* the only namespace, behind init_net */
+static struct torproxy_net lib_net;
+static struct kmem_cache *nat_cache;
+
+static unsigned int relay_generation;
+static DEFINE_MUTEX(relay_write_lock);
+
+static unsigned int bypass_generation;
+static DEFINE_MUTEX(bypass_write_lock);
+
+
+int torproxy_init(void){
+  int err;
+
+  err = stats_init();
+  if(err < 0) return err;
+
+  err = drop_rings_init();
+  if(err < 0){
+    stats_destroy();
+    return err;
+  }
+
+  memset(&lib_net, 0, sizeof(lib_net));
+  lib_net.net = &init_net;
+  init_net.generic = &lib_net;
+  INIT_DELAYED_WORK(&lib_net.nat_expire_work, nat_expire_work_func);
+  INIT_DELAYED_WORK(&lib_net.flow_expire_work, flow_expire_work_func);
+
+  nat_cache = nat_entry_cache_create();
+  err = nat_cache ? nat_table_init(&lib_net.dns_nat, nat_cache, NAT_HASH_BITS, NAT_MAX_ENTRIES, NAT_TIMEOUT_MS) : -ENOMEM;
+  if(err < 0){
+    if(nat_cache) kmem_cache_destroy(nat_cache);
+    drop_rings_destroy();
+    stats_destroy();
+    return err;
+  }
+
+  err = flow_table_init(&lib_net.flows, FLOW_HASH_BITS, FLOW_IDLE_MS);
+  if(err < 0){
+    nat_table_destroy(&lib_net.dns_nat);
+    kmem_cache_destroy(nat_cache);
+    drop_rings_destroy();
+    stats_destroy();
+    return err;
+  }
+
+  RCU_INIT_POINTER(lib_net.bypass, bypass_table_default(++bypass_generation));
+  RCU_INIT_POINTER(lib_net.endpoints, endpoint_set_default(1));
+  if(!lib_net.bypass || !lib_net.endpoints){
+    bypass_table_free(lib_net.bypass);
+    free(lib_net.endpoints);
+    flow_table_destroy(&lib_net.flows);
+    nat_table_destroy(&lib_net.dns_nat);
+    kmem_cache_destroy(nat_cache);
+    drop_rings_destroy();
+    stats_destroy();
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+void torproxy_exit(void){
+  cancel_delayed_work_sync(&lib_net.nat_expire_work);
+  cancel_delayed_work_sync(&lib_net.flow_expire_work);
+  flow_table_destroy(&lib_net.flows);
+  nat_table_destroy(&lib_net.dns_nat);
+  kmem_cache_destroy(nat_cache);
+  endpoint_set_free_rcu(&lib_net.endpoints->rcu);
+  lib_net.endpoints = NULL;
+  if(lib_net.relays) relay_set_free(lib_net.relays);
+  lib_net.relays = NULL;
+  bypass_table_free(rcu_dereference_protected(lib_net.bypass, 1));
+  lib_net.bypass = NULL;
+  drop_rings_destroy();
+  stats_destroy();
+}
+
+int torproxy_set_relays(const __be32 *addrs, unsigned int n){
+  struct relay_set *set;
+
+  mutex_lock(&relay_write_lock);
+  set = relay_set_build(addrs, n, ++relay_generation);
+  if(!set){
+    mutex_unlock(&relay_write_lock);
+    return -ENOMEM;
+  }
+  relay_set_replace(&lib_net.relays, set);
+  flow_table_flush(&lib_net.flows);
+  mutex_unlock(&relay_write_lock);
+
+  return 0;
+}
+
+void torproxy_set_reject(int on){
+  reject_packets = on;
+}
+
+void torproxy_set_flow_offload(int on){
+  flow_offload = on;
+}
+
+void torproxy_flush_flows(void){
+  flow_table_flush(&lib_net.flows);
+}
+
+int torproxy_set_bypass(const struct bypass_prefix *prefixes, unsigned int n){
+  struct bypass_table *t;
+  unsigned int i;
+
+  if(n > BYPASS_MAX_PREFIXES) return -EINVAL;
+  for(i=0; i<n; i++){
+    if(!bypass_prefix_valid(&prefixes[i])) return -EINVAL;
+  }
+
+  mutex_lock(&bypass_write_lock);
+  t = bypass_table_build(prefixes, n, ++bypass_generation);
+  if(!t){
+    mutex_unlock(&bypass_write_lock);
+    return -ENOMEM;
+  }
+  bypass_table_replace(&lib_net.bypass, t);
+  mutex_unlock(&bypass_write_lock);
+
+  return 0;
+}
+
+unsigned int torproxy_local_out(struct sk_buff *skb, const struct net_device *out){
+  return local_out_hook_func(NF_INET_LOCAL_OUT, skb, NULL, out, NULL);
+}
+
+unsigned int torproxy_flow_out(struct sk_buff *skb, const struct net_device *out){
+  return flow_out_hook_func(NF_INET_LOCAL_OUT, skb, NULL, out, NULL);
+}
+
+void torproxy_run_timers(void){
+  kshim_run_delayed_work(&lib_net.nat_expire_work);
+  kshim_run_delayed_work(&lib_net.flow_expire_work);
+}
+
+int torproxy_is_relay(__be32 addr){
+  return is_tor_relay(&lib_net, addr);
+}
+
+int torproxy_is_bypassed(__be32 addr){
+  return is_bypassed(&lib_net, addr);
+}
+
+void torproxy_read_stats(u64 *verdicts, u64 (*latency)[TORPROXY_LATENCY_BUCKETS]){
+  stats_read(verdicts, latency);
+}
+
+void torproxy_drop_counts(u64 *stored, u64 *lost){
+  unsigned int i;
+
+  *stored = *lost = 0;
+  for(i=0; i<drop_nrings; i++){
+    *stored += drop_rings[i].head;
+    *lost += drop_rings[i].lost;
+  }
+}
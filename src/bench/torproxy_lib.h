@@ -0,0 +1,52 @@
+/* **********************************************************************
+ * Userspace build of the module's packet path
+ *
+ * torproxy_hook.h compiled against bench/kshim.h, with the handful of
+ * entry points the module glue would otherwise provide
+ **********************************************************************
+*/
+
+#ifndef TORPROXY_LIB_H
+#define TORPROXY_LIB_H
+
+#include "bench/kshim.h"
+#include "torproxy_bypass.h"
+
+int torproxy_init(void);
+void torproxy_exit(void);
+
+/* publish a new relay generation, like a TORPROXY_OP_REPLACE of the relays */
+int torproxy_set_relays(const __be32 *addrs, unsigned int n);
+
+/* replace the bypass prefixes, like a TORPROXY_OP_REPLACE of the prefixes */
+int torproxy_set_bypass(const struct bypass_prefix *prefixes, unsigned int n);
+
+/* answer dropped packets like the module's reject parameter */
+void torproxy_set_reject(int on);
+
+/* cache tor's established relay flows like the module's flow_offload parameter */
+void torproxy_set_flow_offload(int on);
+
+/* forget every cached flow, before the conntrack entries they hold go away */
+void torproxy_flush_flows(void);
+
+/* run a packet through the local out hook, returns the verdict */
+unsigned int torproxy_local_out(struct sk_buff *skb, const struct net_device *out);
+
+/* run a packet through the flow cache hook ahead of conntrack, an
+ * offloaded packet comes back with its conntrack entry attached */
+unsigned int torproxy_flow_out(struct sk_buff *skb, const struct net_device *out);
+
+/* run pending deferred work, stands in for the kernel workqueue */
+void torproxy_run_timers(void);
+
+/* per-cpu verdict counters and hook latencies summed up, see torproxy_stats.h */
+void torproxy_read_stats(u64 *verdicts, u64 (*latency)[TORPROXY_LATENCY_BUCKETS]);
+
+/* drop events stored in the rings and lost to full ones, nothing drains them */
+void torproxy_drop_counts(u64 *stored, u64 *lost);
+
+int torproxy_is_relay(__be32 addr);
+int torproxy_is_bypassed(__be32 addr);
+
+#endif /* TORPROXY_LIB_H */
@@ -0,0 +1,1037 @@
+/* **********************************************************************
+ * eBPF dataplane, an alternative to the kernel module
+ *
+ * The programs are assembled here instruction by instruction and the
+ * maps driven through the bpf system call directly, so relay_pop keeps
+ * building with nothing but libc. Updates are checked whole before any
+ * map is touched, a table being replaced loses its stale entries
+ * before it gains the new ones so it never outgrows its map
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+
+#include "bpf_dataplane.h"
+#include "bpf_insn.h"
+
+#define MAX_INSNS 128
+
+/* stack of the programs, below the frame pointer */
+#define STK_IP -24      /* ipv4 header, or an ipv6 destination */
+#define STK_KEY -32     /* relay */
+#define STK_LPM -40     /* bypass lookup, prefix length then address */
+#define STK_STAT -44
+#define STK_ZERO -48    /* index of the config entry */
+#define STK_COOKIE -56
+#define STK_ORIG -64    /* struct dns_orig */
+
+/* 127.0.0.0/8 as the packet has it */
+#define LOOP_MASK ((int32_t) htonl(0xff000000))
+#define LOOP_NET ((int32_t) htonl(0x7f000000))
+
+/* where a redirected socket meant its DNS to go */
+struct dns_orig {
+  uint32_t addr;
+  uint32_t port;
+};
+
+/* the key of the bypass trie */
+struct lpm_key {
+  uint32_t len;
+  uint32_t addr;
+};
+
+/* one relay or prefix while a table is replaced */
+struct map_entry {
+  uint32_t key[2];
+  uint8_t value;
+};
+
+enum label {
+  L_COUNT,
+  L_PASS,
+  L_IPV6,
+  L_NOT_BYPASSED,
+  L_LOOPBACK,
+  L_RELAY,
+  L_BYPASS,
+  L_DROP_NO_NAT,
+  L_DROP_NON_TCP,
+  L_DROP_IPV6,
+  L_MAX
+};
+
+/* a program being assembled, jumps go to labels resolved at the end */
+struct prog_asm {
+  struct bpf_insn insn[MAX_INSNS];
+  int n;
+  int label[L_MAX];
+  int fix[MAX_INSNS];  /* label + 1 of the jump at that instruction */
+};
+
+static const char *map_names[BPF_DP_MAPS] = {
+  [BPF_DP_RELAYS] = "relays",
+  [BPF_DP_BYPASS] = "bypass",
+  [BPF_DP_CONFIG] = "config",
+  [BPF_DP_STATS] = "stats",
+  [BPF_DP_DNS_ORIG] = "dns_orig",
+};
+
+static const char *prog_names[BPF_DP_PROGS] = {
+  [BPF_DP_EGRESS] = "egress",
+  [BPF_DP_CONNECT4] = "connect4",
+  [BPF_DP_SENDMSG4] = "sendmsg4",
+  [BPF_DP_RECVMSG4] = "recvmsg4",
+};
+
+static const enum bpf_attach_type prog_attach[BPF_DP_PROGS] = {
+  [BPF_DP_EGRESS] = BPF_CGROUP_INET_EGRESS,
+  [BPF_DP_CONNECT4] = BPF_CGROUP_INET4_CONNECT,
+  [BPF_DP_SENDMSG4] = BPF_CGROUP_UDP4_SENDMSG,
+  [BPF_DP_RECVMSG4] = BPF_CGROUP_UDP4_RECVMSG,
+};
+
+/* the module's defaults */
+static const struct { uint32_t addr, len; } bypass_default[] = {
+  { 0x0a000000, 8 }, { 0x7f000000, 8 }, { 0xac100000, 12 }, { 0xc0a80000, 16 }
+};
+
+
+static int sys_bpf(int cmd, union bpf_attr *attr){
+  long ret = syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+
+  return ret < 0 ? -errno : (int) ret;
+}
+
+static int map_create(enum bpf_map_type type, uint32_t key_size, uint32_t value_size,
+    uint32_t max_entries, uint32_t flags, const char *name)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  attr.map_flags = flags;
+  strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+
+  return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int map_lookup(int fd, const void *key, void *value){
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = (uintptr_t) key;
+  attr.value = (uintptr_t) value;
+
+  return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static int map_update(int fd, const void *key, const void *value){
+  union bpf_attr attr;
+  int err;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = (uintptr_t) key;
+  attr.value = (uintptr_t) value;
+  attr.flags = BPF_ANY;
+
+  err = sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+  return err == -E2BIG ? -ENOSPC : err;
+}
+
+static int map_delete(int fd, const void *key){
+  union bpf_attr attr;
+  int err;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = (uintptr_t) key;
+
+  err = sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+  return err == -ENOENT ? 0 : err;
+}
+
+/* key after key, the first one when key is NULL. -ENOENT past the last */
+static int map_next_key(int fd, const void *key, void *next){
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = (uintptr_t) key;
+  attr.next_key = (uintptr_t) next;
+
+  return sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr);
+}
+
+static int obj_pin(int fd, const char *path){
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.bpf_fd = fd;
+  attr.pathname = (uintptr_t) path;
+
+  return sys_bpf(BPF_OBJ_PIN, &attr);
+}
+
+static int obj_get(const char *path){
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.pathname = (uintptr_t) path;
+
+  return sys_bpf(BPF_OBJ_GET, &attr);
+}
+
+static int prog_attach_cgroup(int cgroup_fd, int prog_fd, enum bpf_attach_type type, int attach){
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.target_fd = cgroup_fd;
+  attr.attach_bpf_fd = prog_fd;
+  attr.attach_type = type;
+  attr.attach_flags = attach ? BPF_F_ALLOW_MULTI : 0;
+
+  return sys_bpf(attach ? BPF_PROG_ATTACH : BPF_PROG_DETACH, &attr);
+}
+
+
+static void emit(struct prog_asm *a, struct bpf_insn insn){
+  if(a->n < MAX_INSNS) a->insn[a->n] = insn;
+  a->n++;
+}
+
+static void emit_jump(struct prog_asm *a, struct bpf_insn insn, enum label label){
+  if(a->n < MAX_INSNS) a->fix[a->n] = label + 1;
+  emit(a, insn);
+}
+
+static void emit_map(struct prog_asm *a, int reg, int fd){
+  emit(a, INSN_LD_MAP_FD(reg, fd));
+  emit(a, INSN_LD_IMM64_HI(0));
+}
+
+static void place(struct prog_asm *a, enum label label){
+  a->label[label] = a->n;
+}
+
+static int resolve(struct prog_asm *a){
+  int i;
+
+  if(a->n > MAX_INSNS) return -E2BIG;
+
+  for(i=0; i<a->n; i++){
+    if(a->fix[i]) a->insn[i].off = a->label[a->fix[i] - 1] - i - 1;
+  }
+
+  return 0;
+}
+
+/* count the stat in r9 and return r7, or return 1 uncounted at L_PASS */
+static void emit_tail(struct prog_asm *a, int stats_fd){
+  place(a, L_COUNT);
+  emit(a, INSN_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_9, STK_STAT));
+  emit_map(a, BPF_REG_1, stats_fd);
+  emit(a, INSN_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  emit(a, INSN_ALU64_IMM(BPF_ADD, BPF_REG_2, STK_STAT));
+  emit(a, INSN_CALL(BPF_FUNC_map_lookup_elem));
+  emit(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 3));
+  emit(a, INSN_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_0, 0));
+  emit(a, INSN_ALU64_IMM(BPF_ADD, BPF_REG_1, 1));
+  emit(a, INSN_STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_1, 0));
+  emit(a, INSN_MOV64_REG(BPF_REG_0, BPF_REG_7));
+  emit(a, INSN_EXIT());
+
+  place(a, L_PASS);
+  emit(a, INSN_MOV64_IMM(BPF_REG_0, 1));
+  emit(a, INSN_EXIT());
+}
+
+static void emit_verdict(struct prog_asm *a, enum label label, enum torproxy_stat stat, int verdict){
+  place(a, label);
+  emit(a, INSN_MOV64_IMM(BPF_REG_9, stat));
+  emit(a, INSN_MOV64_IMM(BPF_REG_7, verdict));
+  emit_jump(a, INSN_JA(0), L_COUNT);
+}
+
+/* r8 into the lpm key of a /32, or into the relay key */
+static void emit_lookup_addr(struct prog_asm *a, int map_fd, int lpm){
+  if(lpm){
+    emit(a, INSN_ST_MEM(BPF_W, BPF_REG_10, STK_LPM, 32));
+    emit(a, INSN_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_8, STK_LPM + 4));
+  } else{
+    emit(a, INSN_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_8, STK_KEY));
+  }
+  emit_map(a, BPF_REG_1, map_fd);
+  emit(a, INSN_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  emit(a, INSN_ALU64_IMM(BPF_ADD, BPF_REG_2, lpm ? STK_LPM : STK_KEY));
+  emit(a, INSN_CALL(BPF_FUNC_map_lookup_elem));
+}
+
+/* bpf_skb_load_bytes(ctx, off, fp + STK_IP, len) */
+static void emit_load_bytes(struct prog_asm *a, int off, int len){
+  emit(a, INSN_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  emit(a, INSN_MOV64_IMM(BPF_REG_2, off));
+  emit(a, INSN_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  emit(a, INSN_ALU64_IMM(BPF_ADD, BPF_REG_3, STK_IP));
+  emit(a, INSN_MOV64_IMM(BPF_REG_4, len));
+  emit(a, INSN_CALL(BPF_FUNC_skb_load_bytes));
+}
+
+/* cgroup egress, the local out hook without NAT. returns 1 to pass */
+static void build_egress(struct prog_asm *a, const struct bpf_dataplane *dp){
+  int i;
+
+  emit(a, INSN_MOV64_REG(BPF_REG_6, BPF_REG_1));
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_6, offsetof(struct __sk_buff, protocol)));
+  emit_jump(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_7, htons(ETH_P_IPV6), 0), L_IPV6);
+  emit_jump(a, INSN_JMP_IMM(BPF_JNE, BPF_REG_7, htons(ETH_P_IP), 0), L_PASS);
+
+  emit_load_bytes(a, 0, 20);
+  emit_jump(a, INSN_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), L_DROP_NON_TCP);
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_8, BPF_REG_10, STK_IP + 16));
+
+  /* never leaves the host */
+  emit(a, INSN_MOV64_REG(BPF_REG_1, BPF_REG_8));
+  emit(a, INSN_ALU64_IMM(BPF_AND, BPF_REG_1, LOOP_MASK));
+  emit_jump(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_1, LOOP_NET, 0), L_LOOPBACK);
+
+  emit_lookup_addr(a, dp->maps[BPF_DP_RELAYS], 0);
+  emit_jump(a, INSN_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), L_RELAY);
+
+  /* the longest prefix decides, a proxied range is for tor */
+  emit_lookup_addr(a, dp->maps[BPF_DP_BYPASS], 1);
+  emit_jump(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), L_NOT_BYPASSED);
+  emit(a, INSN_LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_0, 0));
+  emit_jump(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_1, BYPASS_ACCEPT, 0), L_BYPASS);
+
+  /* DNS was sent to the DNSPort by the sock programs, on the loopback */
+  place(a, L_NOT_BYPASSED);
+  emit(a, INSN_LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_10, STK_IP + 9));
+  emit_jump(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_1, IPPROTO_TCP, 0), L_DROP_NO_NAT);
+  emit_jump(a, INSN_JA(0), L_DROP_NON_TCP);
+
+  /* ipv6 only to ::1 */
+  place(a, L_IPV6);
+  emit_load_bytes(a, 24, 16);
+  emit_jump(a, INSN_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), L_DROP_IPV6);
+  for(i=0; i<4; i++){
+    emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_10, STK_IP + 4*i));
+    emit_jump(a, INSN_JMP_IMM(BPF_JNE, BPF_REG_1, i < 3 ? 0 : (int32_t) htonl(1), 0), L_DROP_IPV6);
+  }
+  emit_jump(a, INSN_JA(0), L_LOOPBACK);
+
+  emit_verdict(a, L_LOOPBACK, TORPROXY_STAT_LOOPBACK, 1);
+  emit_verdict(a, L_RELAY, TORPROXY_STAT_RELAY, 1);
+  emit_verdict(a, L_BYPASS, TORPROXY_STAT_BYPASS, 1);
+  emit_verdict(a, L_DROP_NO_NAT, TORPROXY_STAT_DROP_NO_NAT, 0);
+  emit_verdict(a, L_DROP_NON_TCP, TORPROXY_STAT_DROP_NON_TCP, 0);
+  emit_verdict(a, L_DROP_IPV6, TORPROXY_STAT_DROP_IPV6, 0);
+  emit_tail(a, dp->maps[BPF_DP_STATS]);
+}
+
+/* r0 = the config entry, L_PASS without one */
+static void emit_config(struct prog_asm *a, const struct bpf_dataplane *dp){
+  emit(a, INSN_ST_MEM(BPF_W, BPF_REG_10, STK_ZERO, 0));
+  emit_map(a, BPF_REG_1, dp->maps[BPF_DP_CONFIG]);
+  emit(a, INSN_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  emit(a, INSN_ALU64_IMM(BPF_ADD, BPF_REG_2, STK_ZERO));
+  emit(a, INSN_CALL(BPF_FUNC_map_lookup_elem));
+  emit_jump(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), L_PASS);
+}
+
+/* cookie of the socket at fp + STK_COOKIE */
+static void emit_cookie(struct prog_asm *a){
+  emit(a, INSN_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  emit(a, INSN_CALL(BPF_FUNC_get_socket_cookie));
+  emit(a, INSN_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_0, STK_COOKIE));
+}
+
+/* connect and sendmsg of UDP sockets, a query to port 53 is sent
+ * to the DNSPort and its resolver kept for the reply */
+static void build_dns_query(struct prog_asm *a, const struct bpf_dataplane *dp){
+  emit(a, INSN_MOV64_REG(BPF_REG_6, BPF_REG_1));
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct bpf_sock_addr, type)));
+  emit_jump(a, INSN_JMP_IMM(BPF_JNE, BPF_REG_1, SOCK_DGRAM, 0), L_PASS);
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct bpf_sock_addr, user_port)));
+  emit_jump(a, INSN_JMP_IMM(BPF_JNE, BPF_REG_1, htons(53), 0), L_PASS);
+
+  /* a local resolver is asked like the module lets it be */
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_8, BPF_REG_6, offsetof(struct bpf_sock_addr, user_ip4)));
+  emit(a, INSN_MOV64_REG(BPF_REG_1, BPF_REG_8));
+  emit(a, INSN_ALU64_IMM(BPF_AND, BPF_REG_1, LOOP_MASK));
+  emit_jump(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_1, LOOP_NET, 0), L_PASS);
+
+  emit_config(a, dp);
+  emit(a, INSN_MOV64_REG(BPF_REG_9, BPF_REG_0));
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_9, offsetof(struct bpf_config, dns.addr)));
+  emit_jump(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 0), L_PASS);
+
+  emit_cookie(a);
+  emit(a, INSN_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_8, STK_ORIG));
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct bpf_sock_addr, user_port)));
+  emit(a, INSN_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1, STK_ORIG + 4));
+  emit_map(a, BPF_REG_1, dp->maps[BPF_DP_DNS_ORIG]);
+  emit(a, INSN_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  emit(a, INSN_ALU64_IMM(BPF_ADD, BPF_REG_2, STK_COOKIE));
+  emit(a, INSN_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  emit(a, INSN_ALU64_IMM(BPF_ADD, BPF_REG_3, STK_ORIG));
+  emit(a, INSN_MOV64_IMM(BPF_REG_4, BPF_ANY));
+  emit(a, INSN_CALL(BPF_FUNC_map_update_elem));
+
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_9, offsetof(struct bpf_config, dns.addr)));
+  emit(a, INSN_STX_MEM(BPF_W, BPF_REG_6, BPF_REG_1, offsetof(struct bpf_sock_addr, user_ip4)));
+  emit(a, INSN_LDX_MEM(BPF_H, BPF_REG_1, BPF_REG_9, offsetof(struct bpf_config, dns.dns_port)));
+  emit(a, INSN_STX_MEM(BPF_W, BPF_REG_6, BPF_REG_1, offsetof(struct bpf_sock_addr, user_port)));
+
+  emit(a, INSN_MOV64_IMM(BPF_REG_9, TORPROXY_STAT_DNS_QUERY));
+  emit(a, INSN_MOV64_IMM(BPF_REG_7, 1));
+  emit_tail(a, dp->maps[BPF_DP_STATS]);
+}
+
+/* recvmsg of UDP sockets, the DNSPort's answer to a redirected
+ * query comes from the resolver that was asked */
+static void build_dns_reply(struct prog_asm *a, const struct bpf_dataplane *dp){
+  emit(a, INSN_MOV64_REG(BPF_REG_6, BPF_REG_1));
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct bpf_sock_addr, type)));
+  emit_jump(a, INSN_JMP_IMM(BPF_JNE, BPF_REG_1, SOCK_DGRAM, 0), L_PASS);
+
+  emit_cookie(a);
+  emit_map(a, BPF_REG_1, dp->maps[BPF_DP_DNS_ORIG]);
+  emit(a, INSN_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  emit(a, INSN_ALU64_IMM(BPF_ADD, BPF_REG_2, STK_COOKIE));
+  emit(a, INSN_CALL(BPF_FUNC_map_lookup_elem));
+  emit_jump(a, INSN_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), L_PASS);
+  emit(a, INSN_MOV64_REG(BPF_REG_8, BPF_REG_0));
+
+  emit_config(a, dp);
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_0, offsetof(struct bpf_config, dns.addr)));
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct bpf_sock_addr, user_ip4)));
+  emit_jump(a, INSN_JMP_REG(BPF_JNE, BPF_REG_1, BPF_REG_2, 0), L_PASS);
+  emit(a, INSN_LDX_MEM(BPF_H, BPF_REG_1, BPF_REG_0, offsetof(struct bpf_config, dns.dns_port)));
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct bpf_sock_addr, user_port)));
+  emit_jump(a, INSN_JMP_REG(BPF_JNE, BPF_REG_1, BPF_REG_2, 0), L_PASS);
+
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_8, offsetof(struct dns_orig, addr)));
+  emit(a, INSN_STX_MEM(BPF_W, BPF_REG_6, BPF_REG_1, offsetof(struct bpf_sock_addr, user_ip4)));
+  emit(a, INSN_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_8, offsetof(struct dns_orig, port)));
+  emit(a, INSN_STX_MEM(BPF_W, BPF_REG_6, BPF_REG_1, offsetof(struct bpf_sock_addr, user_port)));
+
+  emit(a, INSN_MOV64_IMM(BPF_REG_9, TORPROXY_STAT_DNS_REPLY));
+  emit(a, INSN_MOV64_IMM(BPF_REG_7, 1));
+  emit_tail(a, dp->maps[BPF_DP_STATS]);
+}
+
+/* returns the program fd or -errno, the verifier log only on failure */
+static int prog_load(enum bpf_prog_type type, enum bpf_attach_type attach, const char *name,
+    struct prog_asm *a, char *log, size_t log_size)
+{
+  union bpf_attr attr;
+  int err;
+
+  err = resolve(a);
+  if(err < 0) return err;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = type;
+  attr.expected_attach_type = attach;
+  attr.insn_cnt = a->n;
+  attr.insns = (uintptr_t) a->insn;
+  attr.license = (uintptr_t) "GPL";
+  strncpy(attr.prog_name, name, sizeof(attr.prog_name) - 1);
+
+  err = sys_bpf(BPF_PROG_LOAD, &attr);
+  if(err >= 0 || !log || !log_size) return err;
+
+  log[0] = 0;
+  attr.log_level = 1;
+  attr.log_buf = (uintptr_t) log;
+  attr.log_size = log_size;
+  sys_bpf(BPF_PROG_LOAD, &attr);
+
+  return err;
+}
+
+
+static int lpm_key_cmp(const void *a, const void *b){
+  return memcmp(a, b, sizeof(((struct map_entry *) 0)->key));
+}
+
+static struct lpm_key prefix_key(const struct bypass_prefix *p){
+  struct lpm_key key = { p->len, p->addr & htonl(p->len ? ~0U << (32 - p->len) : 0) };
+
+  return key;
+}
+
+static int relay_valid(const void *entry){
+  uint32_t addr = *(const uint32_t *) entry;
+
+  return addr != 0 && addr != 0xffffffff;
+}
+
+static int prefix_valid(const void *entry){
+  const struct bypass_prefix *p = entry;
+
+  return p->len <= 32 && (p->action == BYPASS_ACCEPT || p->action == BYPASS_PROXY);
+}
+
+static int endpoint_valid(const void *entry){
+  const struct torproxy_endpoint *ep = entry;
+
+  return ep->addr && ep->trans_port && ep->dns_port && ep->weight <= TOR_MAX_WEIGHT;
+}
+
+static int endpoint_same(const struct torproxy_endpoint *a, const struct torproxy_endpoint *b){
+  return a->addr == b->addr && a->trans_port == b->trans_port && a->dns_port == b->dns_port;
+}
+
+/* entry size of a table, 0 for those only the module keeps */
+static size_t table_entry_size(int table){
+  switch(table){
+    case TORPROXY_OP_A_RELAYS: return sizeof(uint32_t);
+    case TORPROXY_OP_A_PREFIXES: return sizeof(struct bypass_prefix);
+    case TORPROXY_OP_A_ENDPOINTS: return sizeof(struct torproxy_endpoint);
+    case TORPROXY_OP_A_RELAYS6: return sizeof(struct in6_addr);
+    case TORPROXY_OP_A_PREFIXES6: return sizeof(struct bypass_prefix6);
+    default: return 0;
+  }
+}
+
+static int op_check(const struct relay_ctl_op *op){
+  size_t size = table_entry_size(op->table), n, i, max;
+  int (*valid)(const void *);
+
+  if(size == 0) return -EOPNOTSUPP;
+  if(op->code != TORPROXY_OP_ADD && op->code != TORPROXY_OP_REMOVE && op->code != TORPROXY_OP_REPLACE) return -EINVAL;
+  if(op->size % size) return -EINVAL;
+
+  switch(op->table){
+    case TORPROXY_OP_A_RELAYS: valid = relay_valid; max = RELAY_MAX_ADDRS; break;
+    case TORPROXY_OP_A_PREFIXES: valid = prefix_valid; max = BYPASS_MAX_PREFIXES; break;
+    case TORPROXY_OP_A_ENDPOINTS: valid = endpoint_valid; max = TOR_MAX_ENDPOINTS; break;
+    default: return 0;  /* ipv6 is dropped whatever its tables say */
+  }
+
+  n = op->size / size;
+  for(i=0; i<n; i++){
+    if(!valid((const char *) op->items + i*size)) return -EINVAL;
+  }
+
+  return op->code == TORPROXY_OP_REPLACE && n > max ? -ENOSPC : 0;
+}
+
+/* the endpoints after an operation, like the module's config_apply() */
+static int endpoints_apply(struct bpf_config *cfg, const struct relay_ctl_op *op){
+  const struct torproxy_endpoint *items = op->items;
+  size_t n = op->size / sizeof(*items), i, j;
+
+  if(op->code == TORPROXY_OP_REPLACE){
+    memcpy(cfg->endpoints, items, op->size);
+    cfg->n_endpoints = n;
+    return 0;
+  }
+
+  for(i=0; i<n; i++){
+    for(j=0; j<cfg->n_endpoints && !endpoint_same(&cfg->endpoints[j], &items[i]); j++);
+
+    if(op->code == TORPROXY_OP_ADD){
+      if(j == cfg->n_endpoints){
+        if(j == TOR_MAX_ENDPOINTS) return -ENOSPC;
+        cfg->n_endpoints++;
+      }
+      cfg->endpoints[j] = items[i];
+    } else if(j < cfg->n_endpoints){
+      cfg->n_endpoints--;
+      memmove(&cfg->endpoints[j], &cfg->endpoints[j+1], (cfg->n_endpoints - j) * sizeof(*items));
+    }
+  }
+
+  return 0;
+}
+
+/* make a relay hash or bypass trie hold exactly n entries, sorted by key */
+static int map_replace(int fd, size_t key_size, const struct map_entry *entries, size_t n){
+  uint32_t key[2], next[2];
+  struct map_entry probe;
+  int err, first = 1;
+  size_t i;
+
+  /* stale keys go first, the map never holds more than either set */
+  memset(&probe, 0, sizeof(probe));
+  while((err = map_next_key(fd, first ? NULL : key, next)) == 0){
+    memcpy(probe.key, next, key_size);
+    if(!bsearch(&probe, entries, n, sizeof(*entries), lpm_key_cmp)){
+      err = map_delete(fd, next);
+      if(err < 0) return err;
+      /* the walk starts over, a deleted key can't be continued from */
+      first = 1;
+      continue;
+    }
+    memcpy(key, next, key_size);
+    first = 0;
+  }
+  if(err != -ENOENT) return err;
+
+  for(i=0; i<n; i++){
+    err = map_update(fd, entries[i].key, &entries[i].value);
+    if(err < 0) return err;
+  }
+
+  return 0;
+}
+
+static int relays_apply(struct bpf_dataplane *dp, const struct relay_ctl_op *op){
+  const uint32_t *items = op->items;
+  size_t n = op->size / sizeof(*items), i;
+  struct map_entry *entries;
+  uint8_t one = 1;
+  int err = 0;
+
+  if(op->code != TORPROXY_OP_REPLACE){
+    for(i=0; i<n && err == 0; i++){
+      if(op->code == TORPROXY_OP_ADD) err = map_update(dp->maps[BPF_DP_RELAYS], &items[i], &one);
+      else err = map_delete(dp->maps[BPF_DP_RELAYS], &items[i]);
+    }
+    return err;
+  }
+
+  entries = calloc(n ? n : 1, sizeof(*entries));
+  if(!entries) return -ENOMEM;
+  for(i=0; i<n; i++){
+    entries[i].key[0] = items[i];
+    entries[i].value = 1;
+  }
+  qsort(entries, n, sizeof(*entries), lpm_key_cmp);
+
+  err = map_replace(dp->maps[BPF_DP_RELAYS], sizeof(uint32_t), entries, n);
+  free(entries);
+  return err;
+}
+
+static int prefixes_apply(struct bpf_dataplane *dp, const struct relay_ctl_op *op){
+  const struct bypass_prefix *items = op->items;
+  size_t n = op->size / sizeof(*items), i, j;
+  struct map_entry *entries;
+  struct lpm_key key;
+  int err = 0;
+
+  if(op->code != TORPROXY_OP_REPLACE){
+    for(i=0; i<n && err == 0; i++){
+      key = prefix_key(&items[i]);
+      if(op->code == TORPROXY_OP_ADD) err = map_update(dp->maps[BPF_DP_BYPASS], &key, &items[i].action);
+      else err = map_delete(dp->maps[BPF_DP_BYPASS], &key);
+    }
+    return err;
+  }
+
+  entries = calloc(n ? n : 1, sizeof(*entries));
+  if(!entries) return -ENOMEM;
+  for(i=0; i<n; i++){
+    key = prefix_key(&items[i]);
+    memcpy(entries[i].key, &key, sizeof(key));
+    entries[i].value = items[i].action;
+  }
+  qsort(entries, n, sizeof(*entries), lpm_key_cmp);
+
+  /* on a duplicate prefix sending it through tor wins */
+  for(i=0, j=0; i<n; i++){
+    if(j && !lpm_key_cmp(&entries[j-1], &entries[i])){
+      if(entries[i].value == BYPASS_PROXY) entries[j-1].value = BYPASS_PROXY;
+      continue;
+    }
+    entries[j++] = entries[i];
+  }
+
+  err = map_replace(dp->maps[BPF_DP_BYPASS], sizeof(key), entries, j);
+  free(entries);
+  return err;
+}
+
+/* the endpoint DNS is sent to, none without a weighted one */
+static void config_pick_dns(struct bpf_config *cfg){
+  uint32_t i;
+
+  memset(&cfg->dns, 0, sizeof(cfg->dns));
+  for(i=0; i<cfg->n_endpoints; i++){
+    if(cfg->endpoints[i].weight){
+      cfg->dns = cfg->endpoints[i];
+      break;
+    }
+  }
+}
+
+
+int bpf_dp_load(struct bpf_dataplane *dp, char *log, size_t log_size){
+  static const struct { enum bpf_prog_type type; void (*build)(struct prog_asm *, const struct bpf_dataplane *); } progs[BPF_DP_PROGS] = {
+    [BPF_DP_EGRESS] = { BPF_PROG_TYPE_CGROUP_SKB, build_egress },
+    [BPF_DP_CONNECT4] = { BPF_PROG_TYPE_CGROUP_SOCK_ADDR, build_dns_query },
+    [BPF_DP_SENDMSG4] = { BPF_PROG_TYPE_CGROUP_SOCK_ADDR, build_dns_query },
+    [BPF_DP_RECVMSG4] = { BPF_PROG_TYPE_CGROUP_SOCK_ADDR, build_dns_reply },
+  };
+  struct bypass_prefix prefixes[sizeof(bypass_default) / sizeof(*bypass_default)];
+  struct bpf_config cfg;
+  struct prog_asm *a;
+  struct relay_ctl_op op;
+  uint32_t zero = 0;
+  int i, err;
+
+  memset(dp, -1, sizeof(*dp));
+
+  dp->maps[BPF_DP_RELAYS] = map_create(BPF_MAP_TYPE_HASH, sizeof(uint32_t), 1, RELAY_MAX_ADDRS, 0, "torproxy_relays");
+  dp->maps[BPF_DP_BYPASS] = map_create(BPF_MAP_TYPE_LPM_TRIE, sizeof(struct lpm_key), 1, BYPASS_MAX_PREFIXES,
+                                       BPF_F_NO_PREALLOC, "torproxy_bypass");
+  dp->maps[BPF_DP_CONFIG] = map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), sizeof(cfg), 1, 0, "torproxy_config");
+  dp->maps[BPF_DP_STATS] = map_create(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t), sizeof(uint64_t),
+                                      TORPROXY_STAT_MAX, 0, "torproxy_stats");
+  dp->maps[BPF_DP_DNS_ORIG] = map_create(BPF_MAP_TYPE_LRU_HASH, sizeof(uint64_t), sizeof(struct dns_orig),
+                                         BPF_DNS_SOCKETS, 0, "torproxy_dns");
+  for(i=0; i<BPF_DP_MAPS; i++){
+    if(dp->maps[i] < 0){
+      err = dp->maps[i];
+      bpf_dp_close(dp);
+      return err;
+    }
+  }
+
+  /* what a freshly inserted module starts with */
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.generation = 1;
+  cfg.n_endpoints = 1;
+  cfg.endpoints[0].addr = htonl(0x7f000001);
+  cfg.endpoints[0].trans_port = htons(9040);
+  cfg.endpoints[0].dns_port = htons(9053);
+  cfg.endpoints[0].weight = 1;
+  config_pick_dns(&cfg);
+
+  memset(prefixes, 0, sizeof(prefixes));
+  for(i=0; i<(int) (sizeof(prefixes) / sizeof(*prefixes)); i++){
+    prefixes[i].addr = htonl(bypass_default[i].addr);
+    prefixes[i].len = bypass_default[i].len;
+    prefixes[i].action = BYPASS_ACCEPT;
+  }
+  op = (struct relay_ctl_op) { TORPROXY_OP_REPLACE, TORPROXY_OP_A_PREFIXES, prefixes, sizeof(prefixes) };
+
+  err = map_update(dp->maps[BPF_DP_CONFIG], &zero, &cfg);
+  if(err == 0) err = prefixes_apply(dp, &op);
+  if(err < 0){
+    bpf_dp_close(dp);
+    return err;
+  }
+
+  a = malloc(sizeof(*a));
+  if(!a){
+    bpf_dp_close(dp);
+    return -ENOMEM;
+  }
+
+  for(i=0; i<BPF_DP_PROGS; i++){
+    memset(a, 0, sizeof(*a));
+    progs[i].build(a, dp);
+
+    dp->progs[i] = prog_load(progs[i].type, prog_attach[i], prog_names[i], a, log, log_size);
+    if(dp->progs[i] < 0){
+      err = dp->progs[i];
+      free(a);
+      bpf_dp_close(dp);
+      return err;
+    }
+  }
+
+  free(a);
+  return 0;
+}
+
+int bpf_dp_attach(struct bpf_dataplane *dp, const char *cgroup){
+  char path[256];
+  int cgroup_fd, err = 0, i, attached;
+
+  if(mkdir(TORPROXY_BPF_PIN_DIR, 0700) < 0) return -errno;
+
+  for(i=0; i<BPF_DP_MAPS && err == 0; i++){
+    snprintf(path, sizeof(path), "%s/%s", TORPROXY_BPF_PIN_DIR, map_names[i]);
+    err = obj_pin(dp->maps[i], path);
+  }
+  for(i=0; i<BPF_DP_PROGS && err == 0; i++){
+    snprintf(path, sizeof(path), "%s/%s", TORPROXY_BPF_PIN_DIR, prog_names[i]);
+    err = obj_pin(dp->progs[i], path);
+  }
+
+  cgroup_fd = -1;
+  if(err == 0 && (cgroup_fd = open(cgroup, O_RDONLY | O_DIRECTORY)) < 0) err = -errno;
+
+  for(attached=0; attached<BPF_DP_PROGS && err == 0; attached++){
+    err = prog_attach_cgroup(cgroup_fd, dp->progs[attached], prog_attach[attached], 1);
+    if(err < 0) break;
+  }
+
+  if(err < 0){
+    for(i=0; i<attached; i++) prog_attach_cgroup(cgroup_fd, dp->progs[i], prog_attach[i], 0);
+    for(i=0; i<BPF_DP_MAPS; i++){
+      snprintf(path, sizeof(path), "%s/%s", TORPROXY_BPF_PIN_DIR, map_names[i]);
+      unlink(path);
+    }
+    for(i=0; i<BPF_DP_PROGS; i++){
+      snprintf(path, sizeof(path), "%s/%s", TORPROXY_BPF_PIN_DIR, prog_names[i]);
+      unlink(path);
+    }
+    rmdir(TORPROXY_BPF_PIN_DIR);
+  }
+
+  if(cgroup_fd >= 0) close(cgroup_fd);
+  return err;
+}
+
+int bpf_dp_remove(const char *cgroup){
+  char path[256];
+  int cgroup_fd, fd, err = 0, i;
+
+  if((cgroup_fd = open(cgroup, O_RDONLY | O_DIRECTORY)) < 0) return -errno;
+
+  for(i=0; i<BPF_DP_PROGS; i++){
+    snprintf(path, sizeof(path), "%s/%s", TORPROXY_BPF_PIN_DIR, prog_names[i]);
+    if((fd = obj_get(path)) < 0){
+      if(err == 0) err = fd;
+      continue;
+    }
+    if(prog_attach_cgroup(cgroup_fd, fd, prog_attach[i], 0) < 0 && err == 0) err = -errno;
+    close(fd);
+  }
+  close(cgroup_fd);
+
+  /* the pins go whatever happened, a dataplane can't be half removed twice */
+  for(i=0; i<BPF_DP_MAPS; i++){
+    snprintf(path, sizeof(path), "%s/%s", TORPROXY_BPF_PIN_DIR, map_names[i]);
+    unlink(path);
+  }
+  for(i=0; i<BPF_DP_PROGS; i++){
+    snprintf(path, sizeof(path), "%s/%s", TORPROXY_BPF_PIN_DIR, prog_names[i]);
+    unlink(path);
+  }
+  rmdir(TORPROXY_BPF_PIN_DIR);
+
+  return err;
+}
+
+int bpf_dp_open(struct bpf_dataplane *dp){
+  char path[256];
+  int i, err;
+
+  memset(dp, -1, sizeof(*dp));
+
+  for(i=0; i<BPF_DP_MAPS; i++){
+    snprintf(path, sizeof(path), "%s/%s", TORPROXY_BPF_PIN_DIR, map_names[i]);
+    if((dp->maps[i] = obj_get(path)) < 0){
+      err = dp->maps[i];
+      bpf_dp_close(dp);
+      return err;
+    }
+  }
+
+  return 0;
+}
+
+void bpf_dp_close(struct bpf_dataplane *dp){
+  int i;
+
+  for(i=0; i<BPF_DP_MAPS; i++){
+    if(dp->maps[i] >= 0) close(dp->maps[i]);
+    dp->maps[i] = -1;
+  }
+  for(i=0; i<BPF_DP_PROGS; i++){
+    if(dp->progs[i] >= 0) close(dp->progs[i]);
+    dp->progs[i] = -1;
+  }
+}
+
+
+int bpf_dp_apply(struct bpf_dataplane *dp, const struct relay_ctl_op *ops, int n,
+    uint32_t expected_generation, uint32_t *generation)
+{
+  struct bpf_config cfg;
+  uint32_t zero = 0;
+  int i, err;
+
+  err = map_lookup(dp->maps[BPF_DP_CONFIG], &zero, &cfg);
+  if(err < 0) return err;
+  if(expected_generation && expected_generation != cfg.generation) return -ESTALE;
+
+  /* nothing is touched until every operation checks out */
+  for(i=0; i<n; i++){
+    err = op_check(&ops[i]);
+    if(err < 0) return err;
+    if(ops[i].table == TORPROXY_OP_A_ENDPOINTS){
+      err = endpoints_apply(&cfg, &ops[i]);
+      if(err < 0) return err;
+    }
+  }
+  if(cfg.n_endpoints == 0) return -EINVAL;
+  config_pick_dns(&cfg);
+  if(!cfg.dns.addr) return -EINVAL;
+
+  for(i=0; i<n; i++){
+    if(ops[i].table == TORPROXY_OP_A_RELAYS) err = relays_apply(dp, &ops[i]);
+    else if(ops[i].table == TORPROXY_OP_A_PREFIXES) err = prefixes_apply(dp, &ops[i]);
+    if(err < 0) return err;
+  }
+
+  cfg.generation++;
+  err = map_update(dp->maps[BPF_DP_CONFIG], &zero, &cfg);
+  if(err == 0 && generation) *generation = cfg.generation;
+
+  return err;
+}
+
+int bpf_dp_send(struct relay_ctl_update *u, uint32_t *generation){
+  struct bpf_dataplane dp;
+  struct relay_ctl_op *ops;
+  uint32_t expected;
+  int n, err;
+
+  err = bpf_dp_open(&dp);
+  if(err < 0) return err;
+
+  n = relay_ctl_update_ops(u, &ops, &expected);
+  err = n < 0 ? n : bpf_dp_apply(&dp, ops, n, expected, generation);
+
+  free(ops);
+  bpf_dp_close(&dp);
+  return err;
+}
+
+int bpf_dp_get(struct bpf_dataplane *dp, struct relay_ctl_state *state){
+  struct bpf_config cfg;
+  struct lpm_key key, next;
+  uint32_t relay, next_relay, zero = 0;
+  size_t cap;
+  uint8_t action;
+  void *tmp;
+  int err;
+
+  memset(state, 0, sizeof(*state));
+
+  err = map_lookup(dp->maps[BPF_DP_CONFIG], &zero, &cfg);
+  if(err < 0) return err;
+
+  state->generation = cfg.generation;
+  state->n_endpoints = cfg.n_endpoints;
+  state->endpoints = malloc((cfg.n_endpoints ? cfg.n_endpoints : 1) * sizeof(*state->endpoints));
+  if(!state->endpoints) return -ENOMEM;
+  memcpy(state->endpoints, cfg.endpoints, cfg.n_endpoints * sizeof(*state->endpoints));
+
+  cap = 0;
+  while((err = map_next_key(dp->maps[BPF_DP_RELAYS], state->n_relays ? &relay : NULL, &next_relay)) == 0){
+    if(state->n_relays == cap){
+      cap = cap ? cap*2 : 1024;
+      if((tmp = realloc(state->relays, cap * sizeof(*state->relays))) == NULL) goto nomem;
+      state->relays = tmp;
+    }
+    state->relays[state->n_relays++] = relay = next_relay;
+  }
+  if(err != -ENOENT) goto err;
+
+  cap = 0;
+  while((err = map_next_key(dp->maps[BPF_DP_BYPASS], state->n_prefixes ? &key : NULL, &next)) == 0){
+    key = next;
+    if(map_lookup(dp->maps[BPF_DP_BYPASS], &key, &action) < 0) continue;
+
+    if(state->n_prefixes == cap){
+      cap = cap ? cap*2 : 64;
+      if((tmp = realloc(state->prefixes, cap * sizeof(*state->prefixes))) == NULL) goto nomem;
+      state->prefixes = tmp;
+    }
+    memset(&state->prefixes[state->n_prefixes], 0, sizeof(*state->prefixes));
+    state->prefixes[state->n_prefixes].addr = key.addr;
+    state->prefixes[state->n_prefixes].len = key.len;
+    state->prefixes[state->n_prefixes].action = action;
+    state->n_prefixes++;
+  }
+  if(err != -ENOENT) goto err;
+
+  return 0;
+
+nomem:
+  err = -ENOMEM;
+err:
+  relay_ctl_state_free(state);
+  memset(state, 0, sizeof(*state));
+  return err;
+}
+
+/* cpus a per-cpu map has a value for */
+static int possible_cpus(void){
+  char buf[128], *p;
+  int n = 0, lo, hi;
+  FILE *file;
+
+  if((file = fopen("/sys/devices/system/cpu/possible", "r")) == NULL) return -errno;
+  p = fgets(buf, sizeof(buf), file);
+  fclose(file);
+  if(!p) return -EINVAL;
+
+  /* "0-3,5,7-8" */
+  while(*p && *p != '\n'){
+    lo = hi = strtol(p, &p, 10);
+    if(*p == '-') hi = strtol(p+1, &p, 10);
+    n += hi - lo + 1;
+    if(*p == ',') p++;
+    else if(*p && *p != '\n') return -EINVAL;
+  }
+
+  return n;
+}
+
+int bpf_dp_stats(struct bpf_dataplane *dp, struct relay_ctl_stats *stats){
+  uint64_t *values;
+  uint32_t i;
+  int n_cpus, cpu, err = 0;
+
+  memset(stats, 0, sizeof(*stats));
+
+  n_cpus = possible_cpus();
+  if(n_cpus <= 0) return n_cpus < 0 ? n_cpus : -EINVAL;
+
+  values = calloc(n_cpus, sizeof(*values));
+  if(!values) return -ENOMEM;
+
+  for(i=0; i<TORPROXY_STAT_MAX && err == 0; i++){
+    err = map_lookup(dp->maps[BPF_DP_STATS], &i, values);
+    for(cpu=0; cpu<n_cpus && err == 0; cpu++) stats->verdicts[i] += values[cpu];
+  }
+
+  free(values);
+  return err;
+}
+
+int bpf_dp_test_egress(struct bpf_dataplane *dp, const void *frame, size_t len, unsigned int repeat,
+    uint32_t *retval, uint32_t *duration)
+{
+  union bpf_attr attr;
+  int err;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.test.prog_fd = dp->progs[BPF_DP_EGRESS];
+  attr.test.data_in = (uintptr_t) frame;
+  attr.test.data_size_in = len;
+  attr.test.repeat = repeat;
+
+  err = sys_bpf(BPF_PROG_TEST_RUN, &attr);
+  if(err < 0) return err;
+
+  *retval = attr.test.retval;
+  if(duration) *duration = attr.test.duration;
+  return 0;
+}
@@ -0,0 +1,94 @@
+/* **********************************************************************
+ * eBPF dataplane, an alternative to the kernel module
+ *
+ * A cgroup egress program applies the local out policy to every
+ * packet sent from a cgroup: loopback, relays and bypass prefixes
+ * pass, everything else is dropped. UDP senders get EPERM at once,
+ * a TCP connect retries until it times out.
+ * Connect and sendmsg programs send UDP DNS to the endpoint's DNSPort
+ * and a recvmsg program gives the reply back the resolver's address.
+ *
+ * TCP can't be sent to a TransPort, which finds a connection's real
+ * destination in conntrack's NAT, so applications use tor's SocksPort.
+ * IPv6 only passes on the loopback, and the gateway interfaces and the
+ * steering policy are the module's only.
+ *
+ * relay_pop talks to it through relay_ctl when the module isn't
+ * loaded, its maps and programs are pinned in TORPROXY_BPF_PIN_DIR
+ **********************************************************************
+*/
+
+#ifndef BPF_DATAPLANE_H
+#define BPF_DATAPLANE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "relay_ctl.h"
+
+#define TORPROXY_BPF_PIN_DIR "/sys/fs/bpf/torproxy"
+
+/* sockets whose DNS was redirected at once, older ones are evicted */
+#define BPF_DNS_SOCKETS 65536
+
+/* the one entry of the config map */
+struct bpf_config {
+  uint32_t generation;
+  uint32_t n_endpoints;
+  struct torproxy_endpoint dns;  /* the first endpoint with a weight */
+  struct torproxy_endpoint endpoints[TOR_MAX_ENDPOINTS];
+};
+
+enum bpf_map {
+  BPF_DP_RELAYS,    /* hash of __be32 */
+  BPF_DP_BYPASS,    /* lpm trie of the prefixes, the value is their action */
+  BPF_DP_CONFIG,    /* array of one struct bpf_config */
+  BPF_DP_STATS,     /* per-cpu array of u64 indexed by enum torproxy_stat */
+  BPF_DP_DNS_ORIG,  /* lru hash from socket cookie to the resolver it asked */
+  BPF_DP_MAPS
+};
+
+enum bpf_prog {
+  BPF_DP_EGRESS,
+  BPF_DP_CONNECT4,
+  BPF_DP_SENDMSG4,
+  BPF_DP_RECVMSG4,
+  BPF_DP_PROGS
+};
+
+struct bpf_dataplane {
+  int maps[BPF_DP_MAPS];
+  int progs[BPF_DP_PROGS];
+};
+
+/* create the maps with the module's defaults and load the programs.
+ * the verifier's complaints go to log. returns 0 or -errno */
+int bpf_dp_load(struct bpf_dataplane *dp, char *log, size_t log_size);
+
+/* pin a loaded dataplane and attach it to a cgroup v2 directory */
+int bpf_dp_attach(struct bpf_dataplane *dp, const char *cgroup);
+
+/* detach the pinned dataplane from cgroup and unpin it */
+int bpf_dp_remove(const char *cgroup);
+
+/* the maps of the pinned dataplane, -ENOENT when there is none */
+int bpf_dp_open(struct bpf_dataplane *dp);
+void bpf_dp_close(struct bpf_dataplane *dp);
+
+/* apply every operation or, when one is invalid, none. returns 0 or -errno */
+int bpf_dp_apply(struct bpf_dataplane *dp, const struct relay_ctl_op *ops, int n,
+    uint32_t expected_generation, uint32_t *generation);
+
+/* apply an update built for the module to the pinned dataplane,
+ * -ENOENT when there is none */
+int bpf_dp_send(struct relay_ctl_update *u, uint32_t *generation);
+
+int bpf_dp_get(struct bpf_dataplane *dp, struct relay_ctl_state *state);
+int bpf_dp_stats(struct bpf_dataplane *dp, struct relay_ctl_stats *stats);
+
+/* run the egress program once over an ethernet frame, returns 0 or
+ * -errno with its verdict in retval and the mean ns of repeat runs */
+int bpf_dp_test_egress(struct bpf_dataplane *dp, const void *frame, size_t len, unsigned int repeat,
+    uint32_t *retval, uint32_t *duration);
+
+#endif /* BPF_DATAPLANE_H */
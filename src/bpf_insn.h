@@ -0,0 +1,42 @@
+/* **********************************************************************
+ * eBPF instruction builders
+ *
+ * The eBPF dataplane is assembled from these at load time, so it needs
+ * neither clang nor libbpf to build. Named apart from the opcodes in
+ * linux/bpf.h, which they are made of
+ **********************************************************************
+*/
+
+#ifndef BPF_INSN_H
+#define BPF_INSN_H
+
+#include <linux/bpf.h>
+
+#define INSN(CODE, DST, SRC, OFF, IMM) \
+  ((struct bpf_insn) { .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM) })
+
+/* dst op= src, dst op= imm */
+#define INSN_ALU64_REG(OP, DST, SRC) INSN(BPF_ALU64 | BPF_OP(OP) | BPF_X, DST, SRC, 0, 0)
+#define INSN_ALU64_IMM(OP, DST, IMM) INSN(BPF_ALU64 | BPF_OP(OP) | BPF_K, DST, 0, 0, IMM)
+#define INSN_MOV64_REG(DST, SRC) INSN_ALU64_REG(BPF_MOV, DST, SRC)
+#define INSN_MOV64_IMM(DST, IMM) INSN_ALU64_IMM(BPF_MOV, DST, IMM)
+
+/* dst = *(size *) (src + off), *(size *) (dst + off) = src or imm */
+#define INSN_LDX_MEM(SIZE, DST, SRC, OFF) INSN(BPF_LDX | BPF_SIZE(SIZE) | BPF_MEM, DST, SRC, OFF, 0)
+#define INSN_STX_MEM(SIZE, DST, SRC, OFF) INSN(BPF_STX | BPF_SIZE(SIZE) | BPF_MEM, DST, SRC, OFF, 0)
+#define INSN_ST_MEM(SIZE, DST, OFF, IMM) INSN(BPF_ST | BPF_SIZE(SIZE) | BPF_MEM, DST, 0, OFF, IMM)
+
+/* map fd as the first half of a 64 bit immediate load, the
+ * second half is INSN_LD_IMM64_HI */
+#define INSN_LD_MAP_FD(DST, FD) INSN(BPF_LD | BPF_DW | BPF_IMM, DST, BPF_PSEUDO_MAP_FD, 0, FD)
+#define INSN_LD_IMM64_HI(IMM) INSN(0, 0, 0, 0, IMM)
+
+/* pc += off + 1 when dst op src/imm holds */
+#define INSN_JMP_REG(OP, DST, SRC, OFF) INSN(BPF_JMP | BPF_OP(OP) | BPF_X, DST, SRC, OFF, 0)
+#define INSN_JMP_IMM(OP, DST, IMM, OFF) INSN(BPF_JMP | BPF_OP(OP) | BPF_K, DST, 0, OFF, IMM)
+#define INSN_JA(OFF) INSN(BPF_JMP | BPF_JA, 0, 0, OFF, 0)
+
+#define INSN_CALL(FUNC) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, FUNC)
+#define INSN_EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+#endif /* BPF_INSN_H */
@@ -0,0 +1,261 @@
+/* **********************************************************************
+ * In-memory index of the relays in tor's cached consensus
+ *
+ * The file is mapped rather than read line by line. Lines are found
+ * with memchr, which libc vectorizes, and only "r " lines are looked
+ * at further: their address is the third field from the end in both
+ * consensus flavours so it is found scanning back from the newline.
+ * Relays with an ipv6 ORPort list it on an "a [addr]:port" line
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "consensus.h"
+#include "tor_procs.h"
+
+/* smallest hash table */
+#define MIN_SLOTS 64
+
+
+/* the index is masked with the low bits, fold the well mixed high ones
+ * into them so tables past 65536 slots are used whole */
+static uint32_t addr_hash(uint32_t addr){
+  uint32_t h = addr * 0x9e3779b1;
+
+  return h ^ (h >> 16);
+}
+
+/* dotted quad between p and end to a network order address */
+static int parse_ipv4(const char *p, const char *end, uint32_t *addr){
+  unsigned char *b = (unsigned char *) addr;
+  unsigned int octet, digits, i;
+
+  for(i=0; i<4; i++){
+    if(i && (p == end || *p++ != '.')) return -1;
+
+    for(octet = 0, digits = 0; p < end && *p >= '0' && *p <= '9'; p++, digits++){
+      octet = octet*10 + (*p - '0');
+    }
+    if(digits == 0 || digits > 3 || octet > 255) return -1;
+    b[i] = octet;
+  }
+
+  return p == end ? 0 : -1;
+}
+
+/* address of the "r " line between line and end, which points at its newline */
+static int relay_line_addr(const char *line, const char *end, uint32_t *addr){
+  const char *field_end = end, *p = end;
+  int fields = 0;
+
+  if(end > line && end[-1] == '\r') field_end = p = end-1;
+
+  /* back over dirport and orport to the address */
+  while(p > line){
+    if(*--p != ' ') continue;
+    if(++fields == 3) return parse_ipv4(p+1, field_end, addr);
+    field_end = p;
+  }
+
+  return -1;
+}
+
+/* ipv6 address of the "a " line between line and end */
+static int addr_line_addr6(const char *line, const char *end, struct in6_addr *addr){
+  const char *close;
+  char buf[INET6_ADDRSTRLEN];
+
+  if(end-line < 4 || line[2] != '[') return -1;
+  if((close = memchr(line+3, ']', end-line-3)) == NULL || close-line-3 >= (long) sizeof(buf)) return -1;
+
+  memcpy(buf, line+3, close-line-3);
+  buf[close-line-3] = 0;
+  return inet_pton(AF_INET6, buf, addr) == 1 ? 0 : -1;
+}
+
+static int addr6_cmp(const void *a, const void *b){
+  return memcmp(a, b, sizeof(struct in6_addr));
+}
+
+/* sort the n ipv6 addresses collected from the file and drop duplicates */
+static void index_build6(struct consensus_index *idx, struct in6_addr *addrs6, size_t n){
+  size_t i;
+
+  qsort(addrs6, n, sizeof(*addrs6), addr6_cmp);
+
+  idx->addrs6 = addrs6;
+  idx->count6 = 0;
+  for(i=0; i<n; i++){
+    if(idx->count6 && !addr6_cmp(&addrs6[idx->count6-1], &addrs6[i])) continue;
+    addrs6[idx->count6++] = addrs6[i];
+  }
+}
+
+static void index_add(struct consensus_index *idx, uint32_t addr){
+  uint32_t h;
+
+  for(h = addr_hash(addr) & idx->mask; idx->slots[h]; h = (h+1) & idx->mask){
+    if(idx->slots[h] == addr) return;
+  }
+
+  idx->slots[h] = addr;
+  idx->addrs[idx->count++] = addr;
+}
+
+/* hash the n addresses collected from the file into idx */
+static int index_build(struct consensus_index *idx, const uint32_t *addrs, size_t n){
+  uint32_t n_slots = MIN_SLOTS;
+  size_t i;
+
+  while(n_slots < n*2) n_slots *= 2;
+
+  idx->slots = calloc(n_slots, sizeof(uint32_t));
+  idx->addrs = malloc((n ? n : 1) * sizeof(uint32_t));
+  if(!idx->slots || !idx->addrs){
+    consensus_index_free(idx);
+    return -ENOMEM;
+  }
+  idx->mask = n_slots - 1;
+  idx->count = 0;
+
+  for(i=0; i<n; i++){
+    if(addrs[i] != 0) index_add(idx, addrs[i]);
+  }
+
+  return 0;
+}
+
+
+int consensus_index_load_buf(struct consensus_index *idx, const char *buf, size_t len){
+  const char *p, *end = buf + len, *nl;
+  uint32_t *addrs = NULL, *tmp, addr;
+  struct in6_addr *addrs6 = NULL, *tmp6, addr6;
+  size_t n = 0, cap = 0, n6 = 0, cap6 = 0;
+  int err;
+
+  memset(idx, 0, sizeof(*idx));
+
+  for(p = buf; p < end; p = nl+1){
+    if((nl = memchr(p, '\n', end-p)) == NULL) nl = end;
+
+    if(nl-p >= 2 && p[0] == 'a' && p[1] == ' '){
+      if(addr_line_addr6(p, nl, &addr6) < 0) continue;
+
+      if(n6 == cap6){
+        cap6 = cap6 ? cap6*2 : 1024;
+        if((tmp6 = realloc(addrs6, cap6 * sizeof(*addrs6))) == NULL){
+          free(addrs);
+          free(addrs6);
+          return -ENOMEM;
+        }
+        addrs6 = tmp6;
+      }
+      addrs6[n6++] = addr6;
+      continue;
+    }
+
+    if(nl-p < 2 || p[0] != 'r' || p[1] != ' ') continue;
+    if(relay_line_addr(p, nl, &addr) < 0) continue;
+
+    if(n == cap){
+      cap = cap ? cap*2 : 8192;
+      if((tmp = realloc(addrs, cap * sizeof(uint32_t))) == NULL){
+        free(addrs);
+        free(addrs6);
+        return -ENOMEM;
+      }
+      addrs = tmp;
+    }
+    addrs[n++] = addr;
+  }
+
+  err = index_build(idx, addrs, n);
+  free(addrs);
+  if(err < 0){
+    free(addrs6);
+    return err;
+  }
+
+  index_build6(idx, addrs6, n6);
+  return 0;
+}
+
+int consensus_index_load_file(struct consensus_index *idx, const char *path){
+  struct stat st;
+  char *map;
+  int fd, err;
+
+  memset(idx, 0, sizeof(*idx));
+
+  if((fd = open(path, O_RDONLY)) < 0) return -errno;
+  if(fstat(fd, &st) < 0){
+    err = -errno;
+    close(fd);
+    return err;
+  }
+  if(st.st_size == 0){
+    close(fd);
+    return -ENODATA;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return -errno;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  err = consensus_index_load_buf(idx, map, st.st_size);
+
+  munmap(map, st.st_size);
+  return err;
+}
+
+int consensus_relay_line_addr(const char *line, size_t len, uint32_t *addr){
+  if(len < 2 || line[0] != 'r' || line[1] != ' ') return -1;
+  return relay_line_addr(line, line + len, addr);
+}
+
+
+int consensus_index_load(struct consensus_index *idx, const char *proc_root, pid_t tor_pid){
+  char data_dir[512], path[600];
+  int err;
+
+  tor_data_dir(proc_root, tor_pid, data_dir, sizeof(data_dir));
+
+  snprintf(path, sizeof(path), "%s/cached-microdesc-consensus", data_dir);
+  err = consensus_index_load_file(idx, path);
+  if(err == -ENOENT || err == -ENODATA){
+    snprintf(path, sizeof(path), "%s/cached-consensus", data_dir);
+    err = consensus_index_load_file(idx, path);
+  }
+
+  return err;
+}
+
+
+int consensus_index_contains(const struct consensus_index *idx, uint32_t addr){
+  uint32_t h;
+
+  if(!idx->slots || addr == 0) return 0;
+
+  for(h = addr_hash(addr) & idx->mask; idx->slots[h]; h = (h+1) & idx->mask){
+    if(idx->slots[h] == addr) return 1;
+  }
+
+  return 0;
+}
+
+void consensus_index_free(struct consensus_index *idx){
+  free(idx->slots);
+  free(idx->addrs);
+  free(idx->addrs6);
+  memset(idx, 0, sizeof(*idx));
+}
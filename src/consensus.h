@@ -0,0 +1,45 @@
+/* **********************************************************************
+ * In-memory index of the relays in tor's cached consensus
+ *
+ * The consensus is mapped and parsed once, afterwards every relay
+ * check of the run is a hash probe instead of a pass over the file
+ **********************************************************************
+*/
+
+#ifndef CONSENSUS_H
+#define CONSENSUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+struct consensus_index {
+  uint32_t *slots;  /* hash table of network order addresses, 0 is free */
+  uint32_t mask;
+  uint32_t *addrs;  /* the relays in consensus order, without duplicates */
+  size_t count;
+  struct in6_addr *addrs6;  /* ipv6 addresses of the "a " lines, sorted, without duplicates */
+  size_t count6;
+};
+
+/* index the consensus of the tor process tor_pid under proc_root,
+ * found in its TOR_BROWSER_TOR_DATA_DIR or /var/lib/tor. returns 0
+ * or -errno */
+int consensus_index_load(struct consensus_index *idx, const char *proc_root, pid_t tor_pid);
+
+/* index one consensus file, microdesc or full flavour */
+int consensus_index_load_file(struct consensus_index *idx, const char *path);
+
+/* index the "r " and "a " lines of a consensus held in memory */
+int consensus_index_load_buf(struct consensus_index *idx, const char *buf, size_t len);
+
+/* address of one "r " line, without its newline. returns 0 or -1 */
+int consensus_relay_line_addr(const char *line, size_t len, uint32_t *addr);
+
+/* addr in network order */
+int consensus_index_contains(const struct consensus_index *idx, uint32_t addr);
+
+void consensus_index_free(struct consensus_index *idx);
+
+#endif /* CONSENSUS_H */
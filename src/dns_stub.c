@@ -0,0 +1,685 @@
+/* **********************************************************************
+ * Caching DNS stub in front of tor's DNSPort
+ *
+ * A single threaded poll loop over the listening socket and one socket
+ * connected to the DNSPort. Questions are keyed by their lowercased
+ * name, type and class. A miss becomes a lookup tracked by the id it
+ * was sent upstream with, identical questions arriving meanwhile are
+ * added to its waiters and all of them get the one answer. Answers
+ * are cached until their smallest TTL runs out, a hit rewrites every
+ * TTL to what is left. A name hit often enough in the last tenth of
+ * its TTL is looked up again in the background so popular names don't
+ * expire under their clients
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+
+#include "dns_stub.h"
+
+#define DNS_HEADER_LEN 12
+#define DNS_QUESTION_MAX (255 + 4)
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_FLAG_RA 0x0080
+#define DNS_OPCODE(flags) (((flags) >> 11) & 0xf)
+#define DNS_RCODE(flags) ((flags) & 0xf)
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_TYPE_OPT 41
+
+/* records whose TTL a cached answer can carry */
+#define DNS_TTL_MAX 32
+
+/* TTL of an answer without records, and the longest one kept */
+#define DNS_NEGATIVE_TTL 30
+#define DNS_TTL_CAP 86400
+
+/* hits before an expiring answer is refreshed */
+#define DNS_PREFETCH_HITS 2
+
+/* clients waiting on one lookup, and lookups in flight */
+#define DNS_WAITERS_MAX 32
+#define DNS_PENDING_MAX 4096
+#define DNS_PENDING_BUCKETS 1024
+
+/* random ids drawn for a lookup, with at most a sixteenth of them
+ * taken all of them being in use is out of the question */
+#define DNS_ID_DRAWS 16
+
+struct dns_key {
+  uint32_t hash;
+  uint16_t len;
+  uint8_t q[DNS_QUESTION_MAX];  /* lowercased name, type, class */
+};
+
+struct cache_entry {
+  struct cache_entry *hnext;
+  struct cache_entry *prev, *next;  /* lru, most recent first */
+  struct dns_key key;
+
+  uint64_t stored, expires;  /* ms */
+  uint32_t ttl;
+  uint32_t hits;
+  int refreshing;
+
+  uint16_t n_ttl;
+  uint16_t ttl_off[DNS_TTL_MAX];
+  uint32_t ttl_val[DNS_TTL_MAX];
+
+  uint16_t len;
+  uint8_t msg[];
+};
+
+struct waiter {
+  struct sockaddr_in addr;
+  uint16_t id;
+  uint16_t rd;
+  uint8_t q[DNS_QUESTION_MAX];  /* as the client spelled it */
+};
+
+struct pending {
+  struct pending *hnext;
+  struct pending *prev, *next;  /* in order of deadline */
+  struct dns_key key;
+  uint16_t id;
+  uint64_t deadline;
+
+  size_t n_waiters;
+  struct waiter waiters[];
+};
+
+struct dns_stub {
+  struct dns_stub_opts opts;
+  int listen_fd, upstream_fd;
+  int stop_pipe[2];
+
+  struct cache_entry **cache;
+  size_t cache_mask, n_cache;
+  struct cache_entry *lru_head, *lru_tail;
+
+  struct pending *pending[DNS_PENDING_BUCKETS];
+  struct pending *by_id[65536];
+  struct pending *oldest, *newest;
+  size_t n_pending;
+
+  struct dns_stub_stats stats;
+
+  uint8_t buf[DNS_MSG_MAX];  /* received message */
+  uint8_t out[DNS_MSG_MAX];  /* cached answer being sent */
+};
+
+
+static uint64_t now_ms(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint16_t get16(const uint8_t *p){
+  return (uint16_t) p[0] << 8 | p[1];
+}
+
+static uint32_t get32(const uint8_t *p){
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put16(uint8_t *p, uint16_t v){
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v){
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+
+/* question of a query, uncompressed. returns its length or -1 */
+static int question_len(const uint8_t *msg, size_t len){
+  size_t off = DNS_HEADER_LEN;
+
+  while(off < len && msg[off] != 0){
+    if(msg[off] & 0xc0) return -1;
+    off += msg[off] + 1;
+  }
+  off += 1 + 4;
+
+  if(off > len || off - DNS_HEADER_LEN > DNS_QUESTION_MAX) return -1;
+  return off - DNS_HEADER_LEN;
+}
+
+static void key_init(struct dns_key *key, const uint8_t *q, int qlen){
+  uint32_t h = 2166136261u;
+  int i;
+
+  key->len = qlen;
+  for(i=0; i<qlen; i++){
+    key->q[i] = (i < qlen - 4 && q[i] >= 'A' && q[i] <= 'Z') ? q[i] | 0x20 : q[i];
+    h = (h ^ key->q[i]) * 16777619u;
+  }
+  key->hash = h;
+}
+
+static int key_equal(const struct dns_key *a, const struct dns_key *b){
+  return a->hash == b->hash && a->len == b->len && memcmp(a->q, b->q, a->len) == 0;
+}
+
+/* past a possibly compressed name, returns the offset after it or -1 */
+static int skip_name(const uint8_t *msg, size_t len, size_t off){
+  while(off < len){
+    if((msg[off] & 0xc0) == 0xc0) return off + 2 <= len ? (int) off + 2 : -1;
+    if(msg[off] & 0xc0) return -1;
+    if(msg[off] == 0) return off + 1;
+    off += msg[off] + 1;
+  }
+  return -1;
+}
+
+
+/* cache */
+
+static void lru_unlink(struct dns_stub *stub, struct cache_entry *e){
+  if(e->prev) e->prev->next = e->next;
+  else stub->lru_head = e->next;
+  if(e->next) e->next->prev = e->prev;
+  else stub->lru_tail = e->prev;
+}
+
+static void lru_push(struct dns_stub *stub, struct cache_entry *e){
+  e->prev = NULL;
+  e->next = stub->lru_head;
+  if(stub->lru_head) stub->lru_head->prev = e;
+  else stub->lru_tail = e;
+  stub->lru_head = e;
+}
+
+static void cache_remove(struct dns_stub *stub, struct cache_entry *e){
+  struct cache_entry **p = &stub->cache[e->key.hash & stub->cache_mask];
+
+  while(*p != e) p = &(*p)->hnext;
+  *p = e->hnext;
+  lru_unlink(stub, e);
+  stub->n_cache--;
+  free(e);
+}
+
+static struct cache_entry * cache_find(struct dns_stub *stub, const struct dns_key *key){
+  struct cache_entry *e;
+
+  if(!stub->cache) return NULL;
+
+  for(e = stub->cache[key->hash & stub->cache_mask]; e; e = e->hnext){
+    if(key_equal(&e->key, key)) return e;
+  }
+  return NULL;
+}
+
+/* keeps a copy of an upstream answer if it can be cached */
+static void cache_store(struct dns_stub *stub, const struct dns_key *key, const uint8_t *msg, size_t len, uint64_t now){
+  struct cache_entry *e, *old;
+  uint16_t flags = get16(msg + 2), counts[3];
+  uint32_t ttl = DNS_TTL_CAP, rr_ttl;
+  int off, n, i, records = 0, type;
+
+  if(!stub->cache || len > DNS_MSG_MAX || (flags & DNS_FLAG_TC) ||
+     (DNS_RCODE(flags) != DNS_RCODE_NOERROR && DNS_RCODE(flags) != DNS_RCODE_NXDOMAIN) ||
+     get16(msg + 4) != 1){
+    return;
+  }
+
+  if((e = malloc(sizeof(*e) + len)) == NULL) return;
+  e->n_ttl = 0;
+
+  /* find every TTL, the smallest answer or authority one decides */
+  off = DNS_HEADER_LEN + key->len;
+  for(i=0; i<3; i++) counts[i] = get16(msg + 6 + 2*i);
+  for(i=0; i<3; i++){
+    for(n=0; n<counts[i]; n++){
+      if((off = skip_name(msg, len, off)) < 0 || (size_t) off + 10 > len ||
+         (size_t) off + 10 + get16(msg + off + 8) > len){
+        free(e);
+        return;
+      }
+      type = get16(msg + off);
+      rr_ttl = get32(msg + off + 4);
+
+      if(type != DNS_TYPE_OPT){
+        if(e->n_ttl == DNS_TTL_MAX){
+          free(e);
+          return;
+        }
+        e->ttl_off[e->n_ttl] = off + 4;
+        e->ttl_val[e->n_ttl++] = rr_ttl;
+        if(i < 2){
+          if(rr_ttl < ttl) ttl = rr_ttl;
+          records++;
+        }
+      }
+      off += 10 + get16(msg + off + 8);
+    }
+  }
+  if(records == 0) ttl = DNS_NEGATIVE_TTL;
+  if(ttl == 0){
+    free(e);
+    return;
+  }
+
+  if((old = cache_find(stub, key)) != NULL) cache_remove(stub, old);
+  if(stub->n_cache == stub->opts.cache_entries){
+    cache_remove(stub, stub->lru_tail);
+    stub->stats.evictions++;
+  }
+
+  e->key = *key;
+  e->stored = now;
+  e->expires = now + (uint64_t) ttl * 1000;
+  e->ttl = ttl;
+  e->hits = 0;
+  e->refreshing = 0;
+  e->len = len;
+  memcpy(e->msg, msg, len);
+
+  e->hnext = stub->cache[key->hash & stub->cache_mask];
+  stub->cache[key->hash & stub->cache_mask] = e;
+  lru_push(stub, e);
+  stub->n_cache++;
+}
+
+
+/* lookups in flight */
+
+static struct pending * pending_find(struct dns_stub *stub, const struct dns_key *key){
+  struct pending *p;
+
+  for(p = stub->pending[key->hash % DNS_PENDING_BUCKETS]; p; p = p->hnext){
+    if(key_equal(&p->key, key)) return p;
+  }
+  return NULL;
+}
+
+static void pending_free(struct dns_stub *stub, struct pending *p){
+  struct pending **pp = &stub->pending[p->key.hash % DNS_PENDING_BUCKETS];
+
+  while(*pp != p) pp = &(*pp)->hnext;
+  *pp = p->hnext;
+
+  if(p->prev) p->prev->next = p->next;
+  else stub->oldest = p->next;
+  if(p->next) p->next->prev = p->prev;
+  else stub->newest = p->prev;
+
+  stub->by_id[p->id] = NULL;
+  stub->n_pending--;
+  free(p);
+}
+
+static int pending_add_waiter(struct pending *p, const struct sockaddr_in *addr, const uint8_t *query){
+  struct waiter *w;
+  size_t i;
+
+  /* a retransmission is already waiting */
+  for(i=0; i<p->n_waiters; i++){
+    w = &p->waiters[i];
+    if(w->id == get16(query) && w->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+       w->addr.sin_port == addr->sin_port){
+      return 0;
+    }
+  }
+  if(p->n_waiters == DNS_WAITERS_MAX) return -1;
+
+  w = &p->waiters[p->n_waiters++];
+  w->addr = *addr;
+  w->id = get16(query);
+  w->rd = get16(query + 2) & DNS_FLAG_RD;
+  memcpy(w->q, query + DNS_HEADER_LEN, p->key.len);
+  return 0;
+}
+
+/* an unused id, random so that a forged answer has to guess it
+ * rather than follow a counter. returns 0 or -1 */
+static int pending_id(struct dns_stub *stub, uint16_t *id){
+  uint16_t ids[DNS_ID_DRAWS];
+  unsigned int i;
+
+  if(getrandom(ids, sizeof(ids), 0) != sizeof(ids)) return -1;
+
+  for(i=0; i<DNS_ID_DRAWS; i++){
+    if(!stub->by_id[ids[i]]){
+      *id = ids[i];
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/* sends query upstream under a fresh id and tracks it */
+static struct pending * pending_start(struct dns_stub *stub, const struct dns_key *key,
+    const uint8_t *query, size_t len, uint64_t now)
+{
+  struct pending *p;
+  uint8_t msg[DNS_MSG_MAX];
+  uint16_t id;
+
+  if(stub->n_pending == DNS_PENDING_MAX) return NULL;
+  if(pending_id(stub, &id) < 0) return NULL;
+
+  if((p = malloc(sizeof(*p) + DNS_WAITERS_MAX * sizeof(struct waiter))) == NULL) return NULL;
+
+  memcpy(msg, query, len);
+  put16(msg, id);
+  if(send(stub->upstream_fd, msg, len, 0) < 0){
+    free(p);
+    return NULL;
+  }
+  stub->stats.upstream++;
+
+  p->key = *key;
+  p->id = id;
+  p->deadline = now + stub->opts.timeout_ms;
+  p->n_waiters = 0;
+
+  p->hnext = stub->pending[key->hash % DNS_PENDING_BUCKETS];
+  stub->pending[key->hash % DNS_PENDING_BUCKETS] = p;
+  p->next = NULL;
+  p->prev = stub->newest;
+  if(stub->newest) stub->newest->next = p;
+  else stub->oldest = p;
+  stub->newest = p;
+  stub->by_id[p->id] = p;
+  stub->n_pending++;
+
+  return p;
+}
+
+
+/* answers */
+
+static void reply(struct dns_stub *stub, const struct sockaddr_in *addr, uint8_t *msg, size_t len,
+    uint16_t id, uint16_t rd, const uint8_t *q, size_t qlen)
+{
+  put16(msg, id);
+  put16(msg + 2, (get16(msg + 2) & ~DNS_FLAG_RD) | rd);
+  memcpy(msg + DNS_HEADER_LEN, q, qlen);
+  sendto(stub->listen_fd, msg, len, 0, (const struct sockaddr *) addr, sizeof(*addr));
+}
+
+static void reply_servfail(struct dns_stub *stub, const struct waiter *w, size_t qlen){
+  uint8_t msg[DNS_HEADER_LEN + DNS_QUESTION_MAX];
+
+  memset(msg, 0, DNS_HEADER_LEN);
+  put16(msg + 2, DNS_FLAG_QR | DNS_FLAG_RA | DNS_RCODE_SERVFAIL);
+  put16(msg + 4, 1);
+  reply(stub, &w->addr, msg, DNS_HEADER_LEN + qlen, w->id, w->rd, w->q, qlen);
+}
+
+static void answer_from_cache(struct dns_stub *stub, struct cache_entry *e, const struct sockaddr_in *addr,
+    const uint8_t *query, uint64_t now)
+{
+  uint8_t *msg = stub->out;
+  uint32_t elapsed = (now - e->stored) / 1000;
+  int i;
+
+  memcpy(msg, e->msg, e->len);
+  for(i=0; i<e->n_ttl; i++){
+    put32(msg + e->ttl_off[i], e->ttl_val[i] > elapsed ? e->ttl_val[i] - elapsed : 0);
+  }
+
+  reply(stub, addr, msg, e->len, get16(query), get16(query + 2) & DNS_FLAG_RD,
+        query + DNS_HEADER_LEN, e->key.len);
+}
+
+static void handle_query(struct dns_stub *stub, const struct sockaddr_in *addr, const uint8_t *query, size_t len){
+  struct dns_key key;
+  struct cache_entry *e;
+  struct pending *p;
+  uint64_t now;
+  int qlen;
+
+  if(len < DNS_HEADER_LEN || (get16(query + 2) & DNS_FLAG_QR) || DNS_OPCODE(get16(query + 2)) != 0 ||
+     get16(query + 4) != 1 || (qlen = question_len(query, len)) < 0){
+    stub->stats.invalid++;
+    return;
+  }
+  stub->stats.queries++;
+
+  key_init(&key, query + DNS_HEADER_LEN, qlen);
+  now = now_ms();
+
+  if((e = cache_find(stub, &key)) != NULL){
+    if(now < e->expires){
+      stub->stats.hits++;
+      e->hits++;
+      lru_unlink(stub, e);
+      lru_push(stub, e);
+      answer_from_cache(stub, e, addr, query, now);
+
+      /* popular and in the last tenth of its TTL */
+      if(stub->opts.prefetch && !e->refreshing && e->hits >= DNS_PREFETCH_HITS &&
+         (e->expires - now) * 10 < (uint64_t) e->ttl * 1000 && !pending_find(stub, &key)){
+        if(pending_start(stub, &key, query, len, now)){
+          e->refreshing = 1;
+          stub->stats.prefetches++;
+        }
+      }
+      return;
+    }
+    cache_remove(stub, e);
+  }
+
+  if(stub->opts.coalesce && (p = pending_find(stub, &key)) != NULL){
+    if(pending_add_waiter(p, addr, query) == 0){
+      stub->stats.coalesced++;
+      return;
+    }
+  }
+
+  if((p = pending_start(stub, &key, query, len, now)) == NULL ||
+     pending_add_waiter(p, addr, query) < 0){
+    stub->stats.invalid++;
+  }
+}
+
+static void handle_answer(struct dns_stub *stub, uint8_t *msg, size_t len){
+  struct pending *p;
+  struct dns_key key;
+  size_t i;
+  int qlen;
+
+  if(len < DNS_HEADER_LEN || !(get16(msg + 2) & DNS_FLAG_QR)) return;
+  if((p = stub->by_id[get16(msg)]) == NULL) return;
+
+  /* the answer must be to the question asked */
+  if(get16(msg + 4) != 1 || (qlen = question_len(msg, len)) < 0) return;
+  key_init(&key, msg + DNS_HEADER_LEN, qlen);
+  if(!key_equal(&key, &p->key)) return;
+
+  cache_store(stub, &p->key, msg, len, now_ms());
+
+  for(i=0; i<p->n_waiters; i++){
+    reply(stub, &p->waiters[i].addr, msg, len, p->waiters[i].id, p->waiters[i].rd,
+          p->waiters[i].q, qlen);
+  }
+  pending_free(stub, p);
+}
+
+static void expire_pending(struct dns_stub *stub, uint64_t now){
+  struct cache_entry *e;
+  struct pending *p;
+  size_t i;
+
+  while((p = stub->oldest) != NULL && p->deadline <= now){
+    stub->stats.timeouts++;
+    for(i=0; i<p->n_waiters; i++) reply_servfail(stub, &p->waiters[i], p->key.len);
+
+    /* a failed refresh may be tried again */
+    if((e = cache_find(stub, &p->key)) != NULL) e->refreshing = 0;
+    pending_free(stub, p);
+  }
+}
+
+
+/* sockets and the loop */
+
+int dns_stub_parse_addr(const char *arg, struct sockaddr_in *addr){
+  char host[INET_ADDRSTRLEN];
+  const char *port = strrchr(arg, ':');
+  long p;
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if(port){
+    if((size_t) (port - arg) >= sizeof(host)) return -1;
+    memcpy(host, arg, port - arg);
+    host[port - arg] = 0;
+    if(inet_pton(AF_INET, host, &addr->sin_addr) != 1) return -1;
+    port++;
+  } else{
+    port = arg;
+  }
+
+  p = strtol(port, NULL, 10);
+  if(p <= 0 || p > 65535) return -1;
+  addr->sin_port = htons(p);
+  return 0;
+}
+
+void dns_stub_opts_default(struct dns_stub_opts *opts){
+  if(!opts->listen) opts->listen = DNS_STUB_LISTEN_DEFAULT;
+  if(!opts->upstream) opts->upstream = DNS_STUB_UPSTREAM_DEFAULT;
+  if(!opts->timeout_ms) opts->timeout_ms = 10000;
+}
+
+struct dns_stub * dns_stub_open(const struct dns_stub_opts *opts){
+  struct dns_stub *stub;
+  struct sockaddr_in listen_addr, upstream_addr;
+  size_t buckets;
+  int err;
+
+  if(dns_stub_parse_addr(opts->listen, &listen_addr) < 0 ||
+     dns_stub_parse_addr(opts->upstream, &upstream_addr) < 0){
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if((stub = calloc(1, sizeof(*stub))) == NULL) return NULL;
+  stub->opts = *opts;
+  stub->listen_fd = stub->upstream_fd = stub->stop_pipe[0] = stub->stop_pipe[1] = -1;
+
+  if(opts->cache_entries){
+    for(buckets = 1; buckets < opts->cache_entries * 2; buckets <<= 1);
+    if((stub->cache = calloc(buckets, sizeof(*stub->cache))) == NULL) goto fail;
+    stub->cache_mask = buckets - 1;
+  }
+
+  if(pipe(stub->stop_pipe) < 0) goto fail;
+
+  if((stub->listen_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0 ||
+     bind(stub->listen_fd, (struct sockaddr *) &listen_addr, sizeof(listen_addr)) < 0){
+    goto fail;
+  }
+  if((stub->upstream_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0 ||
+     connect(stub->upstream_fd, (struct sockaddr *) &upstream_addr, sizeof(upstream_addr)) < 0){
+    goto fail;
+  }
+
+  return stub;
+
+fail:
+  err = errno;
+  dns_stub_close(stub);
+  errno = err;
+  return NULL;
+}
+
+void dns_stub_close(struct dns_stub *stub){
+  struct cache_entry *e;
+
+  if(!stub) return;
+
+  while(stub->oldest) pending_free(stub, stub->oldest);
+  while((e = stub->lru_head) != NULL){
+    stub->lru_head = e->next;
+    free(e);
+  }
+  free(stub->cache);
+
+  if(stub->listen_fd >= 0) close(stub->listen_fd);
+  if(stub->upstream_fd >= 0) close(stub->upstream_fd);
+  if(stub->stop_pipe[0] >= 0) close(stub->stop_pipe[0]);
+  if(stub->stop_pipe[1] >= 0) close(stub->stop_pipe[1]);
+  free(stub);
+}
+
+void dns_stub_stop(struct dns_stub *stub){
+  char c = 0;
+
+  if(write(stub->stop_pipe[1], &c, 1) < 0) return;
+}
+
+void dns_stub_read_stats(const struct dns_stub *stub, struct dns_stub_stats *stats){
+  *stats = stub->stats;
+}
+
+int dns_stub_run(struct dns_stub *stub){
+  struct pollfd fds[3];
+  struct sockaddr_in addr;
+  socklen_t addr_len;
+  ssize_t len;
+  uint64_t now;
+  int timeout;
+
+  fds[0].fd = stub->listen_fd;
+  fds[1].fd = stub->upstream_fd;
+  fds[2].fd = stub->stop_pipe[0];
+  fds[0].events = fds[1].events = fds[2].events = POLLIN;
+
+  while(1){
+    timeout = -1;
+    if(stub->oldest){
+      now = now_ms();
+      timeout = stub->oldest->deadline > now ? (int) (stub->oldest->deadline - now) : 0;
+    }
+
+    if(poll(fds, 3, timeout) < 0){
+      if(errno == EINTR) continue;
+      return -errno;
+    }
+    if(fds[2].revents) return 0;
+
+    /* answers first, they may free the waiters of queued questions */
+    while((len = recv(stub->upstream_fd, stub->buf, sizeof(stub->buf), 0)) > 0){
+      handle_answer(stub, stub->buf, len);
+    }
+
+    while(1){
+      addr_len = sizeof(addr);
+      len = recvfrom(stub->listen_fd, stub->buf, sizeof(stub->buf), 0, (struct sockaddr *) &addr, &addr_len);
+      if(len < 0) break;
+      handle_query(stub, &addr, stub->buf, len);
+    }
+
+    expire_pending(stub, now_ms());
+  }
+}
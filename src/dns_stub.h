@@ -0,0 +1,66 @@
+/* **********************************************************************
+ * Caching DNS stub in front of tor's DNSPort
+ *
+ * Listens on a loopback UDP port the module's DNS redirect can point
+ * at (relay_pop -e addr:transport:stubport) and answers from a cache
+ * keyed by question, with the TTLs counting down. Identical questions
+ * asked while one is on its way to tor wait for that one answer, and
+ * names asked again close to their expiry are fetched again before
+ * they run out
+ **********************************************************************
+*/
+
+#ifndef DNS_STUB_H
+#define DNS_STUB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define DNS_STUB_LISTEN_DEFAULT "127.0.0.1:9054"
+#define DNS_STUB_UPSTREAM_DEFAULT "127.0.0.1:9053"
+
+/* largest message passed through, tor's answers are far smaller */
+#define DNS_MSG_MAX 1232
+
+struct dns_stub_opts {
+  const char *listen;     /* addr:port */
+  const char *upstream;   /* tor's DNSPort, addr:port */
+  size_t cache_entries;   /* 0 disables the cache */
+  int coalesce;           /* identical in-flight questions share one lookup */
+  int prefetch;           /* refresh popular answers before they expire */
+  int timeout_ms;         /* upstream lookups answered SERVFAIL after this */
+};
+
+struct dns_stub_stats {
+  uint64_t queries;       /* well formed questions received */
+  uint64_t hits;          /* answered from the cache */
+  uint64_t coalesced;     /* joined a lookup already in flight */
+  uint64_t upstream;      /* lookups sent to tor, prefetches included */
+  uint64_t prefetches;
+  uint64_t timeouts;
+  uint64_t evictions;
+  uint64_t invalid;       /* dropped without an answer */
+};
+
+struct dns_stub;
+
+/* fills in the defaults for every field left 0 */
+void dns_stub_opts_default(struct dns_stub_opts *opts);
+
+/* binds the sockets, returns NULL with errno set */
+struct dns_stub * dns_stub_open(const struct dns_stub_opts *opts);
+void dns_stub_close(struct dns_stub *stub);
+
+/* serves until dns_stub_stop(), returns 0 then or -errno */
+int dns_stub_run(struct dns_stub *stub);
+
+/* safe from a signal handler or another thread */
+void dns_stub_stop(struct dns_stub *stub);
+
+void dns_stub_read_stats(const struct dns_stub *stub, struct dns_stub_stats *stats);
+
+/* "addr:port" or "port" on 127.0.0.1 */
+int dns_stub_parse_addr(const char *arg, struct sockaddr_in *addr);
+
+#endif /* DNS_STUB_H */
@@ -0,0 +1,81 @@
+/* **********************************************************************
+ * Reader for the module's per-cpu drop event rings
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "drop_reader.h"
+
+
+int drop_reader_open(struct drop_reader *r){
+  struct drop_ring *first;
+  uint32_t events;
+  int err;
+
+  memset(r, 0, sizeof(*r));
+  if((r->fd = open(DROP_RING_DEVICE, O_RDWR)) < 0) return -errno;
+
+  /* ring 0 tells how many rings there are */
+  first = mmap(NULL, sizeof(*first), PROT_READ, MAP_SHARED, r->fd, 0);
+  if(first == MAP_FAILED){
+    err = -errno;
+    close(r->fd);
+    return err;
+  }
+  r->n_rings = first->rings;
+  events = first->events;
+  munmap(first, sizeof(*first));
+
+  if(r->n_rings == 0 || events != DROP_RING_EVENTS){
+    close(r->fd);
+    return -EPROTO;
+  }
+
+  r->len = r->n_rings * sizeof(struct drop_ring);
+  r->rings = mmap(NULL, r->len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+  if(r->rings == MAP_FAILED){
+    err = -errno;
+    close(r->fd);
+    return err;
+  }
+
+  return 0;
+}
+
+void drop_reader_close(struct drop_reader *r){
+  munmap(r->rings, r->len);
+  close(r->fd);
+}
+
+
+int drop_reader_poll(struct drop_reader *r, struct drop_event *ev, int max){
+  struct drop_ring *ring;
+  uint32_t head, tail;
+  unsigned int i;
+  int n = 0;
+
+  r->lost = 0;
+  for(i=0; i<r->n_rings; i++){
+    ring = &r->rings[i];
+    r->lost += __atomic_load_n(&ring->lost, __ATOMIC_RELAXED);
+
+    /* events up to head are complete once head is seen */
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+    while(tail != head && n < max){
+      ev[n++] = ring->ev[tail & (DROP_RING_EVENTS - 1)];
+      tail++;
+    }
+
+    /* the module may reuse the slots once tail moves past them */
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  return n;
+}
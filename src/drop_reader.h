@@ -0,0 +1,33 @@
+/* **********************************************************************
+ * Reader for the module's per-cpu drop event rings
+ *
+ * The rings are mapped from DROP_RING_DEVICE and drained without any
+ * system call, see struct drop_ring in torproxy_genl.h
+ **********************************************************************
+*/
+
+#ifndef DROP_READER_H
+#define DROP_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "torproxy_genl.h"
+
+struct drop_reader {
+  int fd;
+  struct drop_ring *rings;
+  unsigned int n_rings;
+  size_t len;
+  uint64_t lost;  /* events the module could not store so far */
+};
+
+/* returns 0 or -errno */
+int drop_reader_open(struct drop_reader *r);
+void drop_reader_close(struct drop_reader *r);
+
+/* copies up to max events out of the rings, returns how many. events
+ * are in order per cpu but not across cpus */
+int drop_reader_poll(struct drop_reader *r, struct drop_event *ev, int max);
+
+#endif /* DROP_READER_H */
@@ -3,6 +3,9 @@ set -e
 
 torproxy="torproxy_module"
 torprocess="tor"
+bypass_file="/etc/torproxy/bypass.conf"
+daemon_log="/var/log/torproxy.log"
+dns_stub_log="/var/log/torproxy_dns.log"
 
 # check if tor is running
 tor_running(){
@@ -52,15 +55,33 @@ insert_module(){
 
   # ensure necessary netfilter modules are loaded 
   modprobe -a nf_conntrack nf_conntrack_ipv4 nf_nat nf_nat_ipv4 x_tables ip_tables iptable_nat xt_REDIRECT
+  modprobe -a nf_conntrack_ipv6 nf_nat_ipv6 ip6_tables ip6table_nat
 
   local mod_loaded=$(module_loaded)
   if [ $mod_loaded = 0 ] ; then
     modprobe ${torproxy}
     echo "[+] torproxy module inserted"
+    load_bypass
+    set_tor_owner
     echo "[+] Remember to remove module using '-r' option to allow regular internet access"
   fi
 }
 
+# lets whatever tor's own user sends pass without looking at its destination, never root
+set_tor_owner(){
+  local user=$(ps -o user= -C "$torprocess" | head -n1)
+  if [ -n "$user" ] && [ "$user" != "root" ]; then
+    /usr/local/lib/torproxy/relay_pop -T "$user"
+  fi
+}
+
+# loads bypass prefixes into the module
+load_bypass(){
+  if [ -f "$bypass_file" ]; then
+    /usr/local/lib/torproxy/relay_pop -b "$bypass_file"
+  fi
+}
+
 # starts the proxy
 start_torproxy(){
   /usr/local/lib/torproxy/relay_pop
@@ -68,6 +89,39 @@ start_torproxy(){
   exit
 }
 
+# keeps the relays table current from tor's ControlPort events
+start_daemon(){
+  nohup /usr/local/lib/torproxy/relay_pop -D >> "$daemon_log" 2>&1 &
+  echo "[+] relay_pop following tor's ControlPort, logging to $daemon_log"
+}
+
+# caches tor's DNS answers and sends the module's DNS redirect through it
+start_dns_stub(){
+  nohup /usr/local/lib/torproxy/relay_pop -R -L 127.0.0.1:9054 -U 127.0.0.1:9053 >> "$dns_stub_log" 2>&1 &
+  sleep 0.5
+  /usr/local/lib/torproxy/relay_pop -e 127.0.0.1:9040:9054
+  echo "[+] DNS cached by the stub on 127.0.0.1:9054, logging to $dns_stub_log"
+}
+
+# sends ipv6 through tor, needs TransPort [::1]:9040 and DNSPort [::1]:9053 in torrc
+start_ipv6(){
+  /usr/local/lib/torproxy/relay_pop -e [::1]:9040:9053
+  echo "[+] IPv6 now being routed through Tor on [::1]"
+}
+
+# proxies the LAN clients on an interface too, tor has to listen on the interface's address
+start_gateway(){
+  local addr=$(ip -4 -o addr show dev "$1" | awk '{print $4}' | cut -d/ -f1 | head -n1)
+  if [ -z "$addr" ]; then
+    echo "[*] $1 has no ipv4 address"
+    exit
+  fi
+
+  # the host's own endpoints, and the DNS stub of -n, are left alone
+  /usr/local/lib/torproxy/relay_pop -i "$1" -G "$addr":9040:9053
+  echo "[+] LAN clients on $1 now being routed through Tor on $addr"
+}
+
 # Displays usage
 usage(){
   echo "  _______         _____                     "
@@ -85,6 +139,12 @@ usage(){
   echo "  -i insert torproxy kernel module"
   echo "  -r remove torproxy kernel module"
   echo "  -t refresh tor relays table"
+  echo "  -c allow every relay in tor's consensus"
+  echo "  -d follow tor's guards through its ControlPort, needs ControlPort 9051 in torrc"
+  echo "  -b reload bypass prefixes from $bypass_file"
+  echo "  -n cache DNS answers in a stub in front of tor's DNSPort"
+  echo "  -6 send ipv6 through tor, needs TransPort [::1]:9040 and DNSPort [::1]:9053 in torrc"
+  echo "  -g iface  route the LAN on iface through tor too, needs TransPort and DNSPort on its address"
   echo ""
 }
 
@@ -96,7 +156,7 @@ if (( $EUID != 0 )); then
 fi
 
 
-while getopts "hsirt" opt; do
+while getopts "hsirtcdbn6g:" opt; do
   case $opt in
     h)
       usage
@@ -114,6 +174,24 @@ while getopts "hsirt" opt; do
     t)
       ./relay_pop
       ;;
+    c)
+      /usr/local/lib/torproxy/relay_pop -c
+      ;;
+    d)
+      start_daemon
+      ;;
+    b)
+      load_bypass
+      ;;
+    n)
+      start_dns_stub
+      ;;
+    6)
+      start_ipv6
+      ;;
+    g)
+      start_gateway "$OPTARG"
+      ;;
     \?)
       echo "Invalid option: -$OPTARG"
       ;;
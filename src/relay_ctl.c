@@ -0,0 +1,421 @@
+/* **********************************************************************
+ * Generic netlink client for the torproxy kernel module
+ *
+ * Plain netlink sockets so relay_pop keeps building without libnl
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "relay_ctl.h"
+
+/* large enough for a reply carrying a full relay set and bypass table */
+#define CTL_BUF_SIZE (256 * 1024)
+
+#define MSG_HDR_LEN (NLMSG_HDRLEN + GENL_HDRLEN)
+
+/* nla_len is 16 bits, a longer attribute or nest can't be expressed */
+#define ATTR_MAX_LEN 0xffff
+
+/* a request being built, same layout as an update */
+struct ctl_msg {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+
+static int msg_init(struct ctl_msg *m){
+  m->cap = 4096;
+  m->len = MSG_HDR_LEN;
+  m->buf = calloc(1, m->cap);
+  return m->buf ? 0 : -ENOMEM;
+}
+
+/* append an attribute, returns its offset, -EMSGSIZE or -ENOMEM */
+static long msg_put(struct ctl_msg *m, int type, const void *data, size_t len){
+  struct nlattr *attr;
+  size_t off = m->len, total = NLA_ALIGN(NLA_HDRLEN + len);
+  char *buf;
+
+  if(NLA_HDRLEN + len > ATTR_MAX_LEN) return -EMSGSIZE;
+
+  while(m->len + total > m->cap){
+    buf = realloc(m->buf, m->cap * 2);
+    if(!buf) return -ENOMEM;
+    memset(buf + m->cap, 0, m->cap);
+    m->buf = buf;
+    m->cap *= 2;
+  }
+
+  attr = (struct nlattr *) (m->buf + off);
+  attr->nla_type = type;
+  attr->nla_len = NLA_HDRLEN + len;
+  if(len) memcpy(m->buf + off + NLA_HDRLEN, data, len);
+  m->len += total;
+
+  return off;
+}
+
+/* close a nest opened with msg_put(m, type, NULL, 0), -EMSGSIZE
+ * when its content outgrew what nla_len can hold */
+static int msg_nest_end(struct ctl_msg *m, size_t off){
+  struct nlattr *attr = (struct nlattr *) (m->buf + off);
+
+  if(m->len - off > ATTR_MAX_LEN) return -EMSGSIZE;
+
+  attr->nla_len = m->len - off;
+  return 0;
+}
+
+static void parse_attrs(struct nlattr **tb, int max, void *data, int len){
+  struct nlattr *attr = data;
+
+  memset(tb, 0, (max+1) * sizeof(*tb));
+  while(len >= NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN && attr->nla_len <= len){
+    if((attr->nla_type & NLA_TYPE_MASK) <= max) tb[attr->nla_type & NLA_TYPE_MASK] = attr;
+    len -= NLA_ALIGN(attr->nla_len);
+    attr = (struct nlattr *) ((char *) attr + NLA_ALIGN(attr->nla_len));
+  }
+}
+
+#define ATTR_DATA(attr) ((void *) ((char *) (attr) + NLA_HDRLEN))
+#define ATTR_LEN(attr) ((attr)->nla_len - NLA_HDRLEN)
+
+
+/* send a request and wait for its ack, a reply of the same
+ * command is copied to reply. returns 0 or -errno */
+static int ctl_request(struct relay_ctl *ctl, uint16_t family, uint8_t cmd,
+    struct ctl_msg *m, char *reply)
+{
+  struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+  struct nlmsghdr *nlh = (struct nlmsghdr *) m->buf, *r;
+  struct genlmsghdr *genl = (struct genlmsghdr *) (m->buf + NLMSG_HDRLEN);
+  struct nlmsgerr *nle;
+  char *buf;
+  ssize_t len;
+  int err = 1;
+
+  nlh->nlmsg_len = m->len;
+  nlh->nlmsg_type = family;
+  nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  nlh->nlmsg_seq = ++ctl->seq;
+  nlh->nlmsg_pid = 0;
+  genl->cmd = cmd;
+  genl->version = (family == GENL_ID_CTRL) ? 1 : TORPROXY_GENL_VERSION;
+
+  if(sendto(ctl->fd, m->buf, m->len, 0, (struct sockaddr *) &kernel, sizeof(kernel)) < 0) return -errno;
+
+  buf = malloc(CTL_BUF_SIZE);
+  if(!buf) return -ENOMEM;
+
+  while(err > 0){
+    len = recv(ctl->fd, buf, CTL_BUF_SIZE, 0);
+    if(len < 0){
+      err = -errno;
+      break;
+    }
+
+    for(r = (struct nlmsghdr *) buf; NLMSG_OK(r, len); r = NLMSG_NEXT(r, len)){
+      if(r->nlmsg_seq != ctl->seq) continue;
+
+      if(r->nlmsg_type == NLMSG_ERROR){
+        nle = NLMSG_DATA(r);
+        err = nle->error;
+        break;
+      }
+      if(reply && r->nlmsg_type == family && r->nlmsg_len <= CTL_BUF_SIZE){
+        memcpy(reply, r, r->nlmsg_len);
+      }
+    }
+  }
+
+  free(buf);
+  return err;
+}
+
+static int resolve_family(struct relay_ctl *ctl){
+  struct nlattr *tb[CTRL_ATTR_MAX+1];
+  struct nlmsghdr *nlh;
+  struct ctl_msg m;
+  char *reply;
+  int err;
+
+  if(msg_init(&m) < 0) return -ENOMEM;
+  reply = calloc(1, CTL_BUF_SIZE);
+  if(!reply || msg_put(&m, CTRL_ATTR_FAMILY_NAME, TORPROXY_GENL_NAME, sizeof(TORPROXY_GENL_NAME)) < 0){
+    free(reply);
+    free(m.buf);
+    return -ENOMEM;
+  }
+
+  err = ctl_request(ctl, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, &m, reply);
+  free(m.buf);
+  if(err < 0){
+    free(reply);
+    return err;
+  }
+
+  nlh = (struct nlmsghdr *) reply;
+  parse_attrs(tb, CTRL_ATTR_MAX, (char *) NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - MSG_HDR_LEN);
+  if(!tb[CTRL_ATTR_FAMILY_ID]){
+    free(reply);
+    return -ENOENT;
+  }
+  ctl->family = *(uint16_t *) ATTR_DATA(tb[CTRL_ATTR_FAMILY_ID]);
+
+  free(reply);
+  return 0;
+}
+
+
+int relay_ctl_open(struct relay_ctl *ctl){
+  struct sockaddr_nl local = { .nl_family = AF_NETLINK };
+  int err;
+
+  ctl->seq = 0;
+  ctl->fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+  if(ctl->fd < 0) return -1;
+
+  if(bind(ctl->fd, (struct sockaddr *) &local, sizeof(local)) < 0){
+    close(ctl->fd);
+    return -1;
+  }
+
+  err = resolve_family(ctl);
+  if(err < 0){
+    close(ctl->fd);
+    errno = -err;
+    return -1;
+  }
+
+  return 0;
+}
+
+void relay_ctl_close(struct relay_ctl *ctl){
+  close(ctl->fd);
+}
+
+
+int relay_ctl_update_init(struct relay_ctl_update *u, uint32_t expected_generation){
+  struct ctl_msg m;
+  long off;
+
+  if(msg_init(&m) < 0) return -ENOMEM;
+  if(expected_generation && msg_put(&m, TORPROXY_A_GENERATION, &expected_generation, sizeof(uint32_t)) < 0){
+    free(m.buf);
+    return -ENOMEM;
+  }
+  if((off = msg_put(&m, TORPROXY_A_OPS | NLA_F_NESTED, NULL, 0)) < 0){
+    free(m.buf);
+    return -ENOMEM;
+  }
+
+  u->buf = m.buf;
+  u->len = m.len;
+  u->cap = m.cap;
+  u->ops = off;
+  return 0;
+}
+
+/* table is one of TORPROXY_OP_A_RELAYS, _PREFIXES or _ENDPOINTS, or their ipv6 ones.
+ * an operation that would take the ops nest past nla_len is not added */
+int relay_ctl_update_op(struct relay_ctl_update *u, int code, int table, const void *items, size_t size){
+  struct ctl_msg m = { u->buf, u->len, u->cap };
+  uint8_t op_code = code;
+  long err;
+  size_t op = m.len;
+
+  err = msg_put(&m, TORPROXY_A_OP | NLA_F_NESTED, NULL, 0);
+  if(err >= 0) err = msg_put(&m, TORPROXY_OP_A_CODE, &op_code, sizeof(op_code));
+  if(err >= 0) err = msg_put(&m, table, items, size);
+  if(err >= 0) err = msg_nest_end(&m, op);
+  if(err >= 0 && m.len - u->ops > ATTR_MAX_LEN) err = -EMSGSIZE;
+
+  /* u->len is left alone so a failed operation is dropped whole */
+  if(err < 0){
+    u->buf = m.buf;
+    u->cap = m.cap;
+    return err;
+  }
+
+  u->buf = m.buf;
+  u->len = m.len;
+  u->cap = m.cap;
+  return 0;
+}
+
+int relay_ctl_update_ops(const struct relay_ctl_update *u, struct relay_ctl_op **ops, uint32_t *expected_generation){
+  struct nlattr *tb[TORPROXY_OP_A_MAX+1], *attr, *gen;
+  struct relay_ctl_op *list = NULL, *tmp;
+  char *end = u->buf + u->len;
+  int n = 0, table;
+
+  *ops = NULL;
+  *expected_generation = 0;
+
+  /* the generation, when there is one, comes before the nest */
+  gen = (struct nlattr *) (u->buf + MSG_HDR_LEN);
+  if((char *) gen < u->buf + u->ops && (gen->nla_type & NLA_TYPE_MASK) == TORPROXY_A_GENERATION){
+    *expected_generation = *(uint32_t *) ATTR_DATA(gen);
+  }
+
+  /* the nest is still open, its ops run to the end of the message */
+  attr = (struct nlattr *) (u->buf + u->ops + NLA_HDRLEN);
+  while((char *) attr + NLA_HDRLEN <= end && attr->nla_len >= NLA_HDRLEN && (char *) attr + attr->nla_len <= end){
+    parse_attrs(tb, TORPROXY_OP_A_MAX, ATTR_DATA(attr), ATTR_LEN(attr));
+    for(table = TORPROXY_OP_A_CODE + 1; table <= TORPROXY_OP_A_MAX && !tb[table]; table++);
+    if(!tb[TORPROXY_OP_A_CODE] || table > TORPROXY_OP_A_MAX){
+      free(list);
+      return -EINVAL;
+    }
+
+    if((tmp = realloc(list, (n+1) * sizeof(*list))) == NULL){
+      free(list);
+      return -ENOMEM;
+    }
+    list = tmp;
+    list[n].code = *(uint8_t *) ATTR_DATA(tb[TORPROXY_OP_A_CODE]);
+    list[n].table = table;
+    list[n].items = ATTR_DATA(tb[table]);
+    list[n].size = ATTR_LEN(tb[table]);
+    n++;
+
+    attr = (struct nlattr *) ((char *) attr + NLA_ALIGN(attr->nla_len));
+  }
+
+  *ops = list;
+  return n;
+}
+
+void relay_ctl_update_free(struct relay_ctl_update *u){
+  free(u->buf);
+  u->buf = NULL;
+}
+
+int relay_ctl_send(struct relay_ctl *ctl, struct relay_ctl_update *u, uint32_t *generation){
+  struct ctl_msg m = { u->buf, u->len, u->cap };
+  struct nlattr *tb[TORPROXY_A_MAX+1];
+  struct nlmsghdr *nlh;
+  char *reply;
+  int err;
+
+  reply = calloc(1, CTL_BUF_SIZE);
+  if(!reply) return -ENOMEM;
+
+  err = msg_nest_end(&m, u->ops);
+  if(err == 0) err = ctl_request(ctl, ctl->family, TORPROXY_CMD_UPDATE, &m, reply);
+
+  nlh = (struct nlmsghdr *) reply;
+  if(err == 0 && generation && nlh->nlmsg_len > MSG_HDR_LEN){
+    parse_attrs(tb, TORPROXY_A_MAX, (char *) NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - MSG_HDR_LEN);
+    if(tb[TORPROXY_A_GENERATION]) *generation = *(uint32_t *) ATTR_DATA(tb[TORPROXY_A_GENERATION]);
+  }
+
+  free(reply);
+  return err;
+}
+
+
+static void *attr_copy(struct nlattr *attr, size_t size, size_t *n){
+  void *p;
+
+  *n = 0;
+  if(!attr || ATTR_LEN(attr) == 0) return NULL;
+  if((p = malloc(ATTR_LEN(attr))) == NULL) return NULL;
+
+  memcpy(p, ATTR_DATA(attr), ATTR_LEN(attr));
+  *n = ATTR_LEN(attr) / size;
+  return p;
+}
+
+int relay_ctl_get(struct relay_ctl *ctl, struct relay_ctl_state *state){
+  struct nlattr *tb[TORPROXY_A_MAX+1];
+  struct nlmsghdr *nlh;
+  struct ctl_msg m;
+  char *reply;
+  int err;
+
+  memset(state, 0, sizeof(*state));
+  if(msg_init(&m) < 0) return -ENOMEM;
+  reply = calloc(1, CTL_BUF_SIZE);
+  if(!reply){
+    free(m.buf);
+    return -ENOMEM;
+  }
+
+  err = ctl_request(ctl, ctl->family, TORPROXY_CMD_GET, &m, reply);
+  free(m.buf);
+
+  nlh = (struct nlmsghdr *) reply;
+  if(err == 0 && nlh->nlmsg_len > MSG_HDR_LEN){
+    parse_attrs(tb, TORPROXY_A_MAX, (char *) NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - MSG_HDR_LEN);
+    if(tb[TORPROXY_A_GENERATION]) state->generation = *(uint32_t *) ATTR_DATA(tb[TORPROXY_A_GENERATION]);
+    state->relays = attr_copy(tb[TORPROXY_A_RELAYS], sizeof(__be32), &state->n_relays);
+    state->prefixes = attr_copy(tb[TORPROXY_A_PREFIXES], sizeof(struct bypass_prefix), &state->n_prefixes);
+    state->endpoints = attr_copy(tb[TORPROXY_A_ENDPOINTS], sizeof(struct torproxy_endpoint), &state->n_endpoints);
+    state->relays6 = attr_copy(tb[TORPROXY_A_RELAYS6], sizeof(struct in6_addr), &state->n_relays6);
+    state->prefixes6 = attr_copy(tb[TORPROXY_A_PREFIXES6], sizeof(struct bypass_prefix6), &state->n_prefixes6);
+    state->endpoints6 = attr_copy(tb[TORPROXY_A_ENDPOINTS6], sizeof(struct torproxy_endpoint6), &state->n_endpoints6);
+    state->gateways = attr_copy(tb[TORPROXY_A_GATEWAYS], sizeof(uint32_t), &state->n_gateways);
+    state->policy = attr_copy(tb[TORPROXY_A_POLICY], sizeof(struct torproxy_policy), &state->n_policy);
+    state->gateway_endpoints = attr_copy(tb[TORPROXY_A_GATEWAY_ENDPOINTS], sizeof(struct torproxy_endpoint),
+                                         &state->n_gateway_endpoints);
+  }
+
+  free(reply);
+  return err;
+}
+
+void relay_ctl_state_free(struct relay_ctl_state *state){
+  free(state->relays);
+  free(state->prefixes);
+  free(state->endpoints);
+  free(state->relays6);
+  free(state->prefixes6);
+  free(state->endpoints6);
+  free(state->gateways);
+  free(state->policy);
+  free(state->gateway_endpoints);
+}
+
+
+static void attr_read(struct nlattr *attr, void *dst, size_t size){
+  if(attr) memcpy(dst, ATTR_DATA(attr), ATTR_LEN(attr) < size ? ATTR_LEN(attr) : size);
+}
+
+int relay_ctl_stats(struct relay_ctl *ctl, struct relay_ctl_stats *stats){
+  struct nlattr *tb[TORPROXY_A_MAX+1];
+  struct nlmsghdr *nlh;
+  struct ctl_msg m;
+  char *reply;
+  int err;
+
+  memset(stats, 0, sizeof(*stats));
+  if(msg_init(&m) < 0) return -ENOMEM;
+  reply = calloc(1, CTL_BUF_SIZE);
+  if(!reply){
+    free(m.buf);
+    return -ENOMEM;
+  }
+
+  err = ctl_request(ctl, ctl->family, TORPROXY_CMD_STATS, &m, reply);
+  free(m.buf);
+
+  nlh = (struct nlmsghdr *) reply;
+  if(err == 0 && nlh->nlmsg_len > MSG_HDR_LEN){
+    parse_attrs(tb, TORPROXY_A_MAX, (char *) NLMSG_DATA(nlh) + GENL_HDRLEN, nlh->nlmsg_len - MSG_HDR_LEN);
+    attr_read(tb[TORPROXY_A_STATS], stats->verdicts, sizeof(stats->verdicts));
+    attr_read(tb[TORPROXY_A_LATENCY], stats->latency, sizeof(stats->latency));
+  }
+
+  free(reply);
+  return err;
+}
@@ -0,0 +1,94 @@
+/* **********************************************************************
+ * Generic netlink client for the torproxy kernel module
+ *
+ * Updates are built up as a list of operations and sent as one
+ * TORPROXY_CMD_UPDATE message, see torproxy_genl.h
+ **********************************************************************
+*/
+
+#ifndef RELAY_CTL_H
+#define RELAY_CTL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "torproxy_genl.h"
+
+struct relay_ctl {
+  int fd;
+  uint16_t family;
+  uint32_t seq;
+};
+
+/* an update message being built */
+struct relay_ctl_update {
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t ops;  /* offset of the TORPROXY_A_OPS nest */
+};
+
+/* one operation of an update, as given to relay_ctl_update_op() */
+struct relay_ctl_op {
+  int code;
+  int table;
+  const void *items;
+  size_t size;
+};
+
+/* tables as returned by TORPROXY_CMD_GET */
+struct relay_ctl_state {
+  uint32_t generation;
+  __be32 *relays;
+  size_t n_relays;
+  struct bypass_prefix *prefixes;
+  size_t n_prefixes;
+  struct torproxy_endpoint *endpoints;
+  size_t n_endpoints;
+  struct in6_addr *relays6;
+  size_t n_relays6;
+  struct bypass_prefix6 *prefixes6;
+  size_t n_prefixes6;
+  struct torproxy_endpoint6 *endpoints6;
+  size_t n_endpoints6;
+  uint32_t *gateways;
+  size_t n_gateways;
+  struct torproxy_policy *policy;
+  size_t n_policy;
+  struct torproxy_endpoint *gateway_endpoints;
+  size_t n_gateway_endpoints;
+};
+
+/* counters as returned by TORPROXY_CMD_STATS, those the module
+ * doesn't know of are left 0 */
+struct relay_ctl_stats {
+  uint64_t verdicts[TORPROXY_STAT_MAX];
+  uint64_t latency[TORPROXY_HOOK_MAX][TORPROXY_LATENCY_BUCKETS];
+};
+
+/* returns -1 with errno set when the module is not loaded */
+int relay_ctl_open(struct relay_ctl *ctl);
+void relay_ctl_close(struct relay_ctl *ctl);
+
+/* expected_generation of 0 applies the update whatever the generation */
+int relay_ctl_update_init(struct relay_ctl_update *u, uint32_t expected_generation);
+
+/* returns 0, -ENOMEM or -EMSGSIZE once the operations outgrow the 16 bit
+ * length of their nest, the operation is then left out of the update */
+int relay_ctl_update_op(struct relay_ctl_update *u, int code, int table, const void *items, size_t size);
+void relay_ctl_update_free(struct relay_ctl_update *u);
+
+/* the operations of an update for a dataplane other than the module,
+ * items point into u. returns how many there are or -errno */
+int relay_ctl_update_ops(const struct relay_ctl_update *u, struct relay_ctl_op **ops, uint32_t *expected_generation);
+
+/* send an update and wait for the ack, returns 0 or -errno */
+int relay_ctl_send(struct relay_ctl *ctl, struct relay_ctl_update *u, uint32_t *generation);
+
+int relay_ctl_get(struct relay_ctl *ctl, struct relay_ctl_state *state);
+void relay_ctl_state_free(struct relay_ctl_state *state);
+
+int relay_ctl_stats(struct relay_ctl *ctl, struct relay_ctl_stats *stats);
+
+#endif /* RELAY_CTL_H */
@@ -0,0 +1,478 @@
+/* **********************************************************************
+ * relay_pop daemon mode
+ *
+ * The relay set is the relays tor has an OR connection to or is
+ * about to open one to, plus its entry guards, plus with -c every
+ * relay of the consensus. ORCONN, GUARD and NEWCONSENSUS events keep
+ * it current and every change is published as one update adding the
+ * relays that entered the set and removing those that left it, so
+ * relays added by hand with relay_pop -a stay. A relay tor neither
+ * connects to nor lists as a guard is forgotten. Between events the
+ * daemon sleeps in recv
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "relay_daemon.h"
+#include "relay_ctl.h"
+#include "tor_control.h"
+#include "consensus.h"
+#include "snapshot.h"
+#include "bpf_dataplane.h"
+
+#define FINGERPRINT_LEN 40
+
+/* smallest hash table of tracked relays, doubled as it fills */
+#define TRACKED_BUCKETS_MIN 64
+
+/* a relay tor uses or may use next */
+struct tracked_relay {
+  struct tracked_relay *next;  /* in its bucket */
+  char id[FINGERPRINT_LEN+1];  /* upper case hex fingerprint, empty when tor only gave an address */
+  uint32_t addr;               /* network order, 0 until resolved */
+  int orconn;                  /* an OR connection is launched or open */
+  int guard;                   /* listed as an entry guard */
+};
+
+struct relay_daemon {
+  const struct relay_daemon_opts *opts;
+  struct tor_control tc;
+  struct relay_ctl ctl;
+  int ctl_open;
+
+  /* hashed by fingerprint, or by address without one */
+  struct tracked_relay **buckets;
+  size_t n_buckets, n_relays;
+
+  struct consensus_index consensus;
+
+  /* last published set, sorted */
+  uint32_t *published;
+  size_t n_published;
+  int has_published;
+};
+
+
+static int addr_cmp(const void *a, const void *b){
+  uint32_t x = ntohl(*(const uint32_t *) a), y = ntohl(*(const uint32_t *) b);
+
+  return (x > y) - (x < y);
+}
+
+/* "$FINGERPRINT~nick", "$FINGERPRINT=nick", "$FINGERPRINT" or "a.b.c.d:port" */
+static int parse_target(const char *target, char *id, uint32_t *addr){
+  char host[INET_ADDRSTRLEN];
+  size_t len;
+
+  id[0] = 0;
+  *addr = 0;
+
+  if(target[0] == '$'){
+    len = strspn(target+1, "0123456789ABCDEFabcdef");
+    if(len != FINGERPRINT_LEN) return -1;
+    for(len=0; len<FINGERPRINT_LEN; len++) id[len] = toupper((unsigned char) target[1+len]);
+    id[FINGERPRINT_LEN] = 0;
+    return 0;
+  }
+
+  len = strcspn(target, ":");
+  if(len >= sizeof(host)) return -1;
+  memcpy(host, target, len);
+  host[len] = 0;
+
+  return inet_pton(AF_INET, host, addr) == 1 ? 0 : -1;
+}
+
+/* address of a relay from tor's view of the consensus */
+static uint32_t resolve(struct relay_daemon *d, const char *id){
+  struct tor_control_msg *reply;
+  char cmd[64], *line, *nl;
+  uint32_t addr = 0;
+
+  snprintf(cmd, sizeof(cmd), "GETINFO ns/id/%s", id);
+  if(tor_control_command(&d->tc, cmd, &reply) != 250){
+    free(reply);
+    return 0;
+  }
+
+  for(line = reply->text; (nl = strchr(line, '\n')) != NULL; line = nl+1){
+    if(consensus_relay_line_addr(line, nl - line, &addr) == 0) break;
+  }
+
+  free(reply);
+  return addr;
+}
+
+/* FNV-1a of the fingerprint, or of the address without one */
+static size_t tracked_hash(const struct relay_daemon *d, const char *id, uint32_t addr){
+  const unsigned char *p = id[0] ? (const unsigned char *) id : (const unsigned char *) &addr;
+  size_t i, len = id[0] ? FINGERPRINT_LEN : sizeof(addr);
+  uint32_t h = 2166136261u;
+
+  for(i=0; i<len; i++) h = (h ^ p[i]) * 16777619u;
+
+  return h & (d->n_buckets - 1);
+}
+
+static struct tracked_relay **tracked_slot(struct relay_daemon *d, const char *id, uint32_t addr){
+  struct tracked_relay **r;
+
+  for(r = &d->buckets[tracked_hash(d, id, addr)]; *r; r = &(*r)->next){
+    if(id[0] ? !strcmp((*r)->id, id) : (!(*r)->id[0] && (*r)->addr == addr)) break;
+  }
+
+  return r;
+}
+
+/* double the buckets once there is a relay per bucket */
+static int tracked_grow(struct relay_daemon *d){
+  struct tracked_relay **old = d->buckets, *r, *next;
+  size_t n_old = d->n_buckets, i, h;
+
+  d->n_buckets = n_old ? n_old*2 : TRACKED_BUCKETS_MIN;
+  if((d->buckets = calloc(d->n_buckets, sizeof(*d->buckets))) == NULL){
+    d->buckets = old;
+    d->n_buckets = n_old;
+    return -1;
+  }
+
+  for(i=0; i<n_old; i++){
+    for(r = old[i]; r; r = next){
+      next = r->next;
+      h = tracked_hash(d, r->id, r->addr);
+      r->next = d->buckets[h];
+      d->buckets[h] = r;
+    }
+  }
+
+  free(old);
+  return 0;
+}
+
+static struct tracked_relay *track(struct relay_daemon *d, const char *target){
+  struct tracked_relay **slot, *r;
+  char id[FINGERPRINT_LEN+1];
+  uint32_t addr;
+
+  if(parse_target(target, id, &addr) < 0) return NULL;
+
+  if(d->n_relays >= d->n_buckets && tracked_grow(d) < 0 && !d->n_buckets) return NULL;
+
+  slot = tracked_slot(d, id, addr);
+  if(*slot) return *slot;
+
+  if((r = calloc(1, sizeof(*r))) == NULL) return NULL;
+  strcpy(r->id, id);
+  r->addr = id[0] ? resolve(d, id) : addr;
+
+  /* keyed by what tor named it by, the address of a fingerprint may change */
+  *slot = r;
+  d->n_relays++;
+
+  return r;
+}
+
+/* forget a relay tor neither connects to nor may pick as a guard */
+static void untrack_unused(struct relay_daemon *d, struct tracked_relay *r){
+  struct tracked_relay **slot;
+
+  if(r->orconn || r->guard) return;
+
+  slot = tracked_slot(d, r->id, r->addr);
+  if(*slot != r) return;
+
+  *slot = r->next;
+  d->n_relays--;
+  free(r);
+}
+
+static void tracked_free(struct relay_daemon *d){
+  struct tracked_relay *r, *next;
+  size_t i;
+
+  for(i=0; i<d->n_buckets; i++){
+    for(r = d->buckets[i]; r; r = next){
+      next = r->next;
+      free(r);
+    }
+  }
+  free(d->buckets);
+}
+
+
+/* one update removing del and adding add, as two when both don't fit one message */
+static int send_delta(struct relay_daemon *d, const uint32_t *del, size_t n_del,
+    const uint32_t *add, size_t n_add, uint32_t *generation)
+{
+  struct relay_ctl_update update;
+  int err;
+
+  /* without the module the eBPF dataplane gets it, if there is one */
+  err = relay_ctl_update_init(&update, 0);
+  if(err == 0 && n_del) err = relay_ctl_update_op(&update, TORPROXY_OP_REMOVE, TORPROXY_OP_A_RELAYS, del, n_del * sizeof(*del));
+  if(err == 0 && n_add) err = relay_ctl_update_op(&update, TORPROXY_OP_ADD, TORPROXY_OP_A_RELAYS, add, n_add * sizeof(*add));
+  if(err == 0) err = d->ctl_open ? relay_ctl_send(&d->ctl, &update, generation) : bpf_dp_send(&update, generation);
+  relay_ctl_update_free(&update);
+
+  if(err == -EMSGSIZE && n_del && n_add){
+    err = send_delta(d, del, n_del, NULL, 0, generation);
+    if(err == 0) err = send_delta(d, NULL, 0, add, n_add, generation);
+  }
+
+  return err;
+}
+
+/* add and remove the relays that entered and left the set since the last publish */
+static void publish(struct relay_daemon *d){
+  struct tracked_relay *r;
+  char ip_str[INET_ADDRSTRLEN];
+  uint32_t *set, *add, *del, generation = 0;
+  size_t n = 0, n_add = 0, n_del = 0, i, j;
+  int err;
+
+  set = malloc((d->consensus.count + d->n_relays + 1) * sizeof(*set));
+  if(!set) return;
+
+  if(d->consensus.count){
+    memcpy(set, d->consensus.addrs, d->consensus.count * sizeof(*set));
+    n = d->consensus.count;
+  }
+  for(i=0; i<d->n_buckets; i++){
+    for(r = d->buckets[i]; r; r = r->next){
+      if(r->addr && (r->orconn || r->guard)) set[n++] = r->addr;
+    }
+  }
+
+  qsort(set, n, sizeof(*set), addr_cmp);
+  for(i=0, j=0; i<n; i++){
+    if(j == 0 || set[i] != set[j-1]) set[j++] = set[i];
+  }
+  n = (j > RELAY_MAX_ADDRS) ? RELAY_MAX_ADDRS : j;
+
+  /* both sorted, one merge finds what entered and what left */
+  add = malloc((n + 1) * sizeof(*add));
+  del = malloc((d->n_published + 1) * sizeof(*del));
+  if(!add || !del){
+    free(set);
+    free(add);
+    free(del);
+    return;
+  }
+  for(i=0, j=0; i<n || j<d->n_published; ){
+    if(j == d->n_published || (i < n && addr_cmp(&set[i], &d->published[j]) < 0)) add[n_add++] = set[i++];
+    else if(i == n || addr_cmp(&set[i], &d->published[j]) > 0) del[n_del++] = d->published[j++];
+    else{
+      i++;
+      j++;
+    }
+  }
+
+  if(d->has_published && n_add == 0 && n_del == 0){
+    free(set);
+    free(add);
+    free(del);
+    return;
+  }
+
+  if(d->opts->dry_run){
+    printf("[*] Relay set (%zu):", n);
+    for(i=0; i<n && i<32; i++){
+      inet_ntop(AF_INET, &set[i], ip_str, sizeof(ip_str));
+      printf(" %s", ip_str);
+    }
+    printf("%s\n", n > 32 ? " ..." : "");
+  } else{
+    if(!d->ctl_open && relay_ctl_open(&d->ctl) == 0) d->ctl_open = 1;
+
+    err = send_delta(d, del, n_del, add, n_add, &generation);
+
+    if(err == -ENOENT && !d->ctl_open){
+      printf("[*] Kernel modules not loaded, relay set not published\n");
+      goto out;
+    }
+
+    if(err < 0){
+      printf("[*] Kernel module rejected relay set: %s\n", strerror(-err));
+      /* the module may have been reloaded, look the family up again next time */
+      if(d->ctl_open) relay_ctl_close(&d->ctl);
+      d->ctl_open = 0;
+      goto out;
+    }
+    printf("[*] Relay set of %zu published, %zu added and %zu removed, generation %u\n", n, n_add, n_del, generation);
+
+    err = d->ctl_open ? snapshot_save(&d->ctl, TORPROXY_SNAPSHOT_PATH) : 0;
+    if(err < 0 && err != -ENOENT){
+      printf("[*] Could not save snapshot %s: %s\n", TORPROXY_SNAPSHOT_PATH, strerror(-err));
+    }
+  }
+
+  free(d->published);
+  d->published = set;
+  d->n_published = n;
+  d->has_published = 1;
+  set = NULL;
+
+out:
+  free(set);
+  free(add);
+  free(del);
+}
+
+
+/* a consensus from GETINFO ns/all or a NEWCONSENSUS event */
+static void load_consensus(struct relay_daemon *d, const char *text, size_t len){
+  struct consensus_index idx;
+
+  if(consensus_index_load_buf(&idx, text, len) < 0) return;
+
+  consensus_index_free(&d->consensus);
+  d->consensus = idx;
+}
+
+/* tor's addresses can change with a consensus, look them up again.
+ * a relay that left it can't be a guard, only an open connection
+ * keeps it */
+static void refresh_addrs(struct relay_daemon *d){
+  struct tracked_relay *r, *next;
+  uint32_t addr;
+  size_t i;
+
+  for(i=0; i<d->n_buckets; i++){
+    for(r = d->buckets[i]; r; r = next){
+      next = r->next;
+      if(!r->id[0]) continue;
+      if((addr = resolve(d, r->id)) != 0) r->addr = addr;
+      else r->guard = 0;
+      untrack_unused(d, r);
+    }
+  }
+}
+
+static void handle_event(struct relay_daemon *d, struct tor_control_msg *ev){
+  struct tracked_relay *r;
+  char type[32], arg1[128], arg2[128], arg3[32];
+  int n;
+
+  n = sscanf(ev->text, "%31s %127s %127s %31s", type, arg1, arg2, arg3);
+  if(n < 1) return;
+
+  if(!strcmp(type, "ORCONN") && n >= 3){
+    /* ORCONN target status */
+    if((r = track(d, arg1)) == NULL) return;
+    if(!strcmp(arg2, "LAUNCHED") || !strcmp(arg2, "CONNECTED")) r->orconn = 1;
+    else if(!strcmp(arg2, "FAILED") || !strcmp(arg2, "CLOSED")) r->orconn = 0;
+    untrack_unused(d, r);
+  } else if(!strcmp(type, "GUARD") && n >= 4){
+    /* GUARD ENTRY target status */
+    if((r = track(d, arg2)) == NULL) return;
+    if(!strcmp(arg3, "NEW") || !strcmp(arg3, "UP") || !strcmp(arg3, "GOOD")) r->guard = 1;
+    else if(!strcmp(arg3, "DROPPED") || !strcmp(arg3, "BAD")) r->guard = 0;
+    untrack_unused(d, r);
+  } else if(!strcmp(type, "NEWCONSENSUS")){
+    if(d->opts->consensus) load_consensus(d, ev->text, ev->len);
+    refresh_addrs(d);
+  } else{
+    return;
+  }
+
+  publish(d);
+}
+
+
+/* GETINFO key whose value is one "target status" pair per line */
+static void load_status(struct relay_daemon *d, const char *key, int guard){
+  struct tor_control_msg *reply;
+  struct tracked_relay *r;
+  char cmd[64], target[128], status[32], *line, *nl;
+
+  snprintf(cmd, sizeof(cmd), "GETINFO %s", key);
+  if(tor_control_command(&d->tc, cmd, &reply) != 250){
+    free(reply);
+    return;
+  }
+
+  for(line = reply->text; (nl = strchr(line, '\n')) != NULL; line = nl+1){
+    *nl = 0;
+    if(!strncmp(line, key, strlen(key)) && line[strlen(key)] == '=') line += strlen(key)+1;
+    if(sscanf(line, "%127s %31s", target, status) != 2) continue;
+    if((r = track(d, target)) == NULL) continue;
+
+    if(guard) r->guard = strcmp(status, "unusable") != 0;
+    else r->orconn = !strcmp(status, "LAUNCHED") || !strcmp(status, "CONNECTED");
+    untrack_unused(d, r);
+  }
+
+  free(reply);
+}
+
+static int daemon_init(struct relay_daemon *d){
+  struct tor_control_msg *reply = NULL;
+  int err;
+
+  if((err = tor_control_open(&d->tc, d->opts->control)) < 0){
+    printf("[*] Could not connect to tor ControlPort %s: %s\n", d->opts->control, strerror(-err));
+    return err;
+  }
+  if((err = tor_control_authenticate(&d->tc)) < 0){
+    printf("[*] Could not authenticate to tor ControlPort: %s\n", strerror(-err));
+    tor_control_close(&d->tc);
+    return err;
+  }
+
+  /* subscribe first so no change between the snapshot and the events is lost */
+  if((err = tor_control_command(&d->tc, "SETEVENTS ORCONN GUARD NEWCONSENSUS", NULL)) != 250){
+    printf("[*] tor refused the event subscription\n");
+    tor_control_close(&d->tc);
+    return err < 0 ? err : -EPROTO;
+  }
+
+  load_status(d, "orconn-status", 0);
+  load_status(d, "entry-guards", 1);
+
+  if(d->opts->consensus){
+    if(tor_control_command(&d->tc, "GETINFO ns/all", &reply) == 250) load_consensus(d, reply->text, reply->len);
+    free(reply);
+  }
+
+  return 0;
+}
+
+
+int relay_daemon_run(const struct relay_daemon_opts *opts){
+  struct relay_daemon d;
+  struct tor_control_msg *ev;
+  int err;
+
+  memset(&d, 0, sizeof(d));
+  d.opts = opts;
+
+  if((err = daemon_init(&d)) < 0) return err;
+  printf("[*] Following tor on %s\n", opts->control);
+  publish(&d);
+
+  while((err = tor_control_next_event(&d.tc, &ev)) == 0){
+    handle_event(&d, ev);
+    free(ev);
+  }
+
+  if(err == -EPIPE){
+    printf("[*] Tor closed the control connection\n");
+    err = 0;
+  } else{
+    printf("[*] Control connection failed: %s\n", strerror(-err));
+  }
+
+  tor_control_close(&d.tc);
+  if(d.ctl_open) relay_ctl_close(&d.ctl);
+  consensus_index_free(&d.consensus);
+  tracked_free(&d);
+  free(d.published);
+
+  return err;
+}
@@ -0,0 +1,24 @@
+/* **********************************************************************
+ * relay_pop daemon mode
+ *
+ * Follows tor's OR connections and entry guards over its ControlPort
+ * and pushes the relay set to the kernel module as soon as they change
+ **********************************************************************
+*/
+
+#ifndef RELAY_DAEMON_H
+#define RELAY_DAEMON_H
+
+#include "tor_control.h"
+
+struct relay_daemon_opts {
+  const char *control;  /* ControlPort, see tor_control_open() */
+  int consensus;        /* also allow every relay in the consensus */
+  int dry_run;          /* print the relay sets instead of sending them */
+};
+
+/* runs until tor closes the control connection, returns 0 then
+ * or -errno when tor can't be reached at all */
+int relay_daemon_run(const struct relay_daemon_opts *opts);
+
+#endif /* RELAY_DAEMON_H */
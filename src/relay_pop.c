@@ -6,75 +6,415 @@
  **********************************************************************
 */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
-#include <glob.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <pwd.h>
+
+#include "relay_ctl.h"
+#include "consensus.h"
+#include "tor_procs.h"
+#include "relay_daemon.h"
+#include "sock_diag.h"
+#include "drop_reader.h"
+#include "dns_stub.h"
+#include "snapshot.h"
+#include "bpf_dataplane.h"
 
 /* maximum number of tor entry relays allowed to be used at once */
 #define MAX_RELAY 8
 
+/* most of tor's connections looked at to find them */
+#define MAX_TOR_CONNS 1024
+
+/* most tor processes whose relays are merged */
+#define MAX_TOR_PROCS TOR_MAX_ENDPOINTS
+
 #define TOR_PROC_NAME "tor"
 
-pid_t determine_pid(char *process_name);
+int merge_relays(int *relays, int n, const int *add);
 int * determine_tor_relay(pid_t tor_pid);
-int check_ip_is_relay(int ip);
+struct consensus_index * get_consensus(pid_t tor_pid);
+int read_consensus(__be32 *relays, struct in6_addr *relays6, int *n_relays6);
+int check_ip_is_relay(pid_t tor_pid, int ip);
+int read_bypass(char *path, struct bypass_prefix *prefixes, struct bypass_prefix6 *prefixes6, int *n_prefixes6);
+int parse_endpoint(char *arg, struct torproxy_endpoint *ep, struct torproxy_endpoint6 *ep6);
+int parse_owner(char *arg, struct torproxy_policy *rule);
+int send_update(struct relay_ctl_update *update, uint32_t *applied);
+int drop_privileges(void);
+void save_snapshot(struct relay_ctl *ctl);
+int show_state(void);
+int show_stats(void);
+int watch_drops(void);
+int run_dns_stub(struct dns_stub_opts *opts);
+int load_bpf(const char *cgroup);
+int remove_bpf(const char *cgroup);
+
+
+/* give up the setuid ids for the caller's own, for good */
+int drop_privileges(void){
+  if(setresgid(getgid(), getgid(), getgid()) < 0 || setresuid(getuid(), getuid(), getuid()) < 0){
+    printf("[*] Could not drop privileges: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
 
 
-int main(){
-  FILE *relays;
-  pid_t pid;
-  int *relay_ip, tor_running, i;
+void usage(char *prog){
+  printf("usage: %s [-c] [-b file] [-e addr:transport:dnsport[:weight]] [-W addr:transport:dnsport[:weight]] [-a relay] [-d relay] [-i iface] [-I iface] [-G addr:transport:dnsport[:weight]] [-T user] [-x owner] [-S owner=addr:transport:dnsport] [-X owner] [-g generation] [-l] [-s] [-w]\n", prog);
+  printf("       %s -D [-C controlport] [-c] [-n]\n", prog);
+  printf("       %s -R [-L listen] [-U dnsport]\n", prog);
+  printf("       %s -B cgroup | -K cgroup\n", prog);
+  printf("  without options the relays every tor process is connected to replace the relay table\n");
+  printf("  -c  replace the relay tables with every relay in tor's consensus\n");
+  printf("  -b  replace the bypass prefixes with those in file\n");
+  printf("  -e  replace the tor endpoints, may be repeated, new flows are spread by weight (default 1)\n");
+  printf("      an ipv6 addr is given as [addr] and replaces the ipv6 endpoints only\n");
+  printf("  -W  add an endpoint or change its weight, 0 drains it, may be repeated\n");
+  printf("  -a  add a relay, ipv4 or ipv6, may be repeated\n");
+  printf("  -d  remove a relay, may be repeated\n");
+  printf("  -i  proxy the LAN clients on an interface too, may be repeated, needs -G\n");
+  printf("  -I  stop proxying the clients on an interface, may be repeated\n");
+  printf("  -G  replace the tor endpoints of the LAN clients, may be repeated, not on loopback\n");
+  printf("  -T  tor's own user, its TCP passes\n");
+  printf("  -x  send an owner's traffic directly, may be repeated. owners are a user, a net_cls\n");
+  printf("      classid:major:minor or dev:iface for traffic leaving through that interface\n");
+  printf("  -S  send an owner's TCP and DNS to a tor endpoint of its own, may be repeated\n");
+  printf("  -X  remove the policy of an owner, may be repeated\n");
+  printf("  -g  only apply the update if the module is at this generation\n");
+  printf("  -l  list the module's tables\n");
+  printf("  -s  show the module's packet counters and hook latencies\n");
+  printf("  -w  print packets as the module drops them\n");
+  printf("  -D  keep the relay table current following tor's ControlPort events\n");
+  printf("  -C  tor ControlPort, host:port, port or unix socket path (default %s)\n", TOR_CONTROL_DEFAULT);
+  printf("  -n  with -D print the relay sets instead of sending them\n");
+  printf("  -R  run a caching DNS stub for tor's DNSPort, point an endpoint's dnsport at it\n");
+  printf("  -L  address the stub listens on, addr:port or port (default %s)\n", DNS_STUB_LISTEN_DEFAULT);
+  printf("  -U  tor DNSPort the stub asks, addr:port or port (default %s)\n", DNS_STUB_UPSTREAM_DEFAULT);
+  printf("  -B  load the eBPF dataplane instead of the module and attach it to a cgroup v2\n");
+  printf("      directory, the options above then update it while the module isn't loaded\n");
+  printf("  -K  detach the eBPF dataplane from a cgroup and unload it\n");
+  printf("all changes given together are applied as one update, with -c the ipv6 relays follow in a second\n");
+}
 
-  /* ensure running as root */
-  if(getuid() != 0){
+
+int main(int argc, char **argv){
+  struct relay_ctl_update update;
+  struct relay_daemon_opts daemon = { TOR_CONTROL_DEFAULT, 0, 0 };
+  struct dns_stub_opts stub = { NULL, NULL, 4096, 1, 1, 0 };
+  struct bypass_prefix *prefixes;
+  struct bypass_prefix6 prefixes6[BYPASS6_MAX_PREFIXES];
+  __be32 *consensus;
+  struct in6_addr *consensus6;
+  struct torproxy_endpoint endpoints[TOR_MAX_ENDPOINTS], weights[TOR_MAX_ENDPOINTS], gw_endpoints[TOR_MAX_ENDPOINTS], ep;
+  struct torproxy_endpoint6 endpoints6[TOR_MAX_ENDPOINTS], weights6[TOR_MAX_ENDPOINTS], ep6;
+  __be32 add[MAX_RELAY], del[MAX_RELAY];
+  struct in6_addr add6[MAX_RELAY], del6[MAX_RELAY];
+  uint32_t gw_add[GATEWAY_MAX_IFACES], gw_del[GATEWAY_MAX_IFACES], ifindex;
+  struct torproxy_policy policy_add[POLICY_MAX_RULES], policy_del[POLICY_MAX_RULES], rule;
+  char *steer, *bpf_load = NULL, *bpf_remove = NULL;
+  struct in_addr addr;
+  struct in6_addr addr6;
+  unsigned int generation = 0;
+  uint32_t applied = 0;
+  int n_prefixes = -1, n_consensus = -1, n_endpoints = 0, n_weights = 0, n_add = 0, n_del = 0, list = 0, stats = 0, watch = 0, run_daemon = 0, run_stub = 0;
+  int n_prefixes6 = 0, n_consensus6 = 0, n_endpoints6 = 0, n_weights6 = 0, n_add6 = 0, n_del6 = 0, family;
+  int n_gw_add = 0, n_gw_del = 0, n_gw_endpoints = 0, n_policy_add = 0, n_policy_del = 0;
+  pid_t pids[MAX_TOR_PROCS];
+  int relays[MAX_RELAY * MAX_TOR_PROCS];
+  int *relay_ip, n_pids, i, n, opt, ret;
+
+  prefixes = calloc(BYPASS_MAX_PREFIXES, sizeof(*prefixes));
+  consensus = calloc(RELAY_MAX_ADDRS, sizeof(*consensus));
+  consensus6 = calloc(RELAY6_MAX_ADDRS, sizeof(*consensus6));
+
+  while((opt = getopt(argc, argv, "cb:e:W:a:d:i:I:G:T:x:S:X:g:lswDC:nRL:U:B:K:h")) != -1){
+    switch(opt){
+      case 'c':
+        n_consensus = 0;
+        break;
+      case 'b':
+        if((n_prefixes = read_bypass(optarg, prefixes, prefixes6, &n_prefixes6)) < 0) exit(1);
+        break;
+      case 'e':
+      case 'W':
+        family = parse_endpoint(optarg, &ep, &ep6);
+        if(family == AF_INET && (opt == 'e' ? n_endpoints : n_weights) < TOR_MAX_ENDPOINTS){
+          if(opt == 'e') endpoints[n_endpoints++] = ep;
+          else weights[n_weights++] = ep;
+        } else if(family == AF_INET6 && (opt == 'e' ? n_endpoints6 : n_weights6) < TOR_MAX_ENDPOINTS){
+          if(opt == 'e') endpoints6[n_endpoints6++] = ep6;
+          else weights6[n_weights6++] = ep6;
+        } else{
+          printf("[*] Invalid tor endpoint %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'a':
+      case 'd':
+        if(inet_pton(AF_INET6, optarg, &addr6) == 1 && (opt == 'a' ? n_add6 : n_del6) < MAX_RELAY){
+          if(opt == 'a') add6[n_add6++] = addr6;
+          else del6[n_del6++] = addr6;
+          break;
+        }
+        if(inet_pton(AF_INET, optarg, &addr) != 1 || (opt == 'a' ? n_add : n_del) == MAX_RELAY){
+          printf("[*] Invalid relay %s\n", optarg);
+          exit(1);
+        }
+        if(opt == 'a') add[n_add++] = addr.s_addr;
+        else del[n_del++] = addr.s_addr;
+        break;
+      case 'i':
+      case 'I':
+        ifindex = if_nametoindex(optarg);
+        if(ifindex == 0 || (opt == 'i' ? n_gw_add : n_gw_del) == GATEWAY_MAX_IFACES){
+          printf("[*] Invalid interface %s\n", optarg);
+          exit(1);
+        }
+        if(opt == 'i') gw_add[n_gw_add++] = ifindex;
+        else gw_del[n_gw_del++] = ifindex;
+        break;
+      case 'G':
+        if(parse_endpoint(optarg, &ep, &ep6) != AF_INET || ntohl(ep.addr) >> IN_CLASSA_NSHIFT == IN_LOOPBACKNET ||
+           n_gw_endpoints == TOR_MAX_ENDPOINTS){
+          printf("[*] Invalid gateway endpoint %s\n", optarg);
+          exit(1);
+        }
+        gw_endpoints[n_gw_endpoints++] = ep;
+        break;
+      case 'T':
+      case 'x':
+      case 'S':
+      case 'X':
+        steer = opt == 'S' ? strchr(optarg, '=') : NULL;
+        if(steer) *steer++ = 0;
+        if(parse_owner(optarg, &rule) < 0 || (opt == 'T' && rule.match != POLICY_MATCH_UID) ||
+           (opt == 'S' && (!steer || rule.match == POLICY_MATCH_IFACE || parse_endpoint(steer, &rule.endpoint, &ep6) != AF_INET)) ||
+           (opt == 'X' ? n_policy_del : n_policy_add) == POLICY_MAX_RULES){
+          printf("[*] Invalid policy %s\n", optarg);
+          exit(1);
+        }
+        rule.action = opt == 'T' ? POLICY_TOR : opt == 'S' ? POLICY_ENDPOINT : POLICY_EXEMPT;
+        if(opt == 'X') policy_del[n_policy_del++] = rule;
+        else policy_add[n_policy_add++] = rule;
+        break;
+      case 'g':
+        generation = strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        list = 1;
+        break;
+      case 's':
+        stats = 1;
+        break;
+      case 'w':
+        watch = 1;
+        break;
+      case 'D':
+        run_daemon = 1;
+        break;
+      case 'C':
+        daemon.control = optarg;
+        break;
+      case 'n':
+        daemon.dry_run = 1;
+        break;
+      case 'R':
+        run_stub = 1;
+        break;
+      case 'L':
+        stub.listen = optarg;
+        break;
+      case 'U':
+        stub.upstream = optarg;
+        break;
+      case 'B':
+        bpf_load = optarg;
+        break;
+      case 'K':
+        bpf_remove = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  /* ensure running as root, a daemon dry run and the DNS stub touch nothing */
+  if(getuid() != 0 && !(run_daemon && daemon.dry_run) && !run_stub){
     printf("Must run as root!\n");
     exit(0);
   }
 
-  /* find tor process */
-  pid = determine_pid(TOR_PROC_NAME);
-  if(pid == -1){
+  /* installed setuid root, a user's dry run connects and reads and a
+   * user's DNS stub binds and asks upstream as that user */
+  if(getuid() != 0 && drop_privileges() < 0) exit(1);
+
+  if(list) exit(show_state() < 0);
+  if(stats) exit(show_stats() < 0);
+  if(watch) exit(watch_drops() < 0);
+  if(run_stub) exit(run_dns_stub(&stub) < 0);
+  if(bpf_load) exit(load_bpf(bpf_load) < 0);
+  if(bpf_remove) exit(remove_bpf(bpf_remove) < 0);
+
+  if(run_daemon){
+    free(prefixes);
+    free(consensus);
+    free(consensus6);
+    daemon.consensus = n_consensus >= 0;
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    exit(relay_daemon_run(&daemon) < 0);
+  }
+
+  if(n_consensus >= 0){
+    if((n_consensus = read_consensus(consensus, consensus6, &n_consensus6)) < 0) exit(1);
+    printf("[*] Read %d relays and %d ipv6 relays from the consensus\n", n_consensus, n_consensus6);
+  }
+
+  /* explicit changes, all sent in one message */
+  if(n_prefixes >= 0 || n_consensus >= 0 || n_endpoints || n_weights || n_add || n_del ||
+     n_endpoints6 || n_weights6 || n_add6 || n_del6 || n_gw_add || n_gw_del || n_gw_endpoints ||
+     n_policy_add || n_policy_del){
+    ret = relay_ctl_update_init(&update, generation);
+    if(ret == 0 && n_prefixes >= 0){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_PREFIXES,
+                                prefixes, n_prefixes * sizeof(*prefixes));
+      if(ret == 0){
+        ret = relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_PREFIXES6,
+                                  prefixes6, n_prefixes6 * sizeof(*prefixes6));
+      }
+    }
+    if(ret == 0 && n_endpoints){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_ENDPOINTS,
+                                endpoints, n_endpoints * sizeof(*endpoints));
+    }
+    if(ret == 0 && n_weights){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_ADD, TORPROXY_OP_A_ENDPOINTS,
+                                weights, n_weights * sizeof(*weights));
+    }
+    if(ret == 0 && n_endpoints6){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_ENDPOINTS6,
+                                endpoints6, n_endpoints6 * sizeof(*endpoints6));
+    }
+    if(ret == 0 && n_weights6){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_ADD, TORPROXY_OP_A_ENDPOINTS6,
+                                weights6, n_weights6 * sizeof(*weights6));
+    }
+    /* the ipv6 relays follow in an update of their own, a whole
+     * consensus of both doesn't fit one nest's 16 bit length */
+    if(ret == 0 && n_consensus >= 0){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_RELAYS,
+                                consensus, n_consensus * sizeof(*consensus));
+    }
+    if(ret == 0 && n_del){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_REMOVE, TORPROXY_OP_A_RELAYS, del, n_del * sizeof(*del));
+    }
+    if(ret == 0 && n_add){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_ADD, TORPROXY_OP_A_RELAYS, add, n_add * sizeof(*add));
+    }
+    if(ret == 0 && n_del6){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_REMOVE, TORPROXY_OP_A_RELAYS6, del6, n_del6 * sizeof(*del6));
+    }
+    if(ret == 0 && n_add6){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_ADD, TORPROXY_OP_A_RELAYS6, add6, n_add6 * sizeof(*add6));
+    }
+    if(ret == 0 && n_gw_endpoints){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_GATEWAY_ENDPOINTS,
+                                gw_endpoints, n_gw_endpoints * sizeof(*gw_endpoints));
+    }
+    if(ret == 0 && n_gw_del){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_REMOVE, TORPROXY_OP_A_GATEWAYS, gw_del, n_gw_del * sizeof(*gw_del));
+    }
+    if(ret == 0 && n_gw_add){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_ADD, TORPROXY_OP_A_GATEWAYS, gw_add, n_gw_add * sizeof(*gw_add));
+    }
+    if(ret == 0 && n_policy_del){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_REMOVE, TORPROXY_OP_A_POLICY,
+                                policy_del, n_policy_del * sizeof(*policy_del));
+    }
+    if(ret == 0 && n_policy_add){
+      ret = relay_ctl_update_op(&update, TORPROXY_OP_ADD, TORPROXY_OP_A_POLICY,
+                                policy_add, n_policy_add * sizeof(*policy_add));
+    }
+    if(ret == -EMSGSIZE){
+      printf("[*] Update too large for one message, give fewer changes at once\n");
+      exit(1);
+    }
+    if(ret < 0){
+      printf("[*] Out of memory\n");
+      exit(1);
+    }
+
+    free(prefixes);
+    free(consensus);
+    if(send_update(&update, &applied) < 0){
+      free(consensus6);
+      exit(1);
+    }
+
+    /* only on top of the update just applied */
+    if(n_consensus >= 0){
+      if(relay_ctl_update_init(&update, applied) < 0 ||
+         relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_RELAYS6,
+                             consensus6, n_consensus6 * sizeof(*consensus6)) < 0){
+        printf("[*] Out of memory\n");
+        exit(1);
+      }
+      ret = send_update(&update, NULL);
+    }
+    free(consensus6);
+    exit(ret < 0);
+  }
+  free(prefixes);
+  free(consensus);
+  free(consensus6);
+
+  /* find tor processes, every one of them may be an endpoint */
+  n_pids = tor_find_pids(PROC_ROOT, TOR_PROC_NAME, pids, MAX_TOR_PROCS);
+  if(n_pids == 0){
     printf("[*] Could not find running tor process...\n");
     exit(0);
   }
-  printf("[*] Found running Tor process (%d)\n", pid);
+  for(i=0; i<n_pids; i++) printf("[*] Found running Tor process (%d)\n", pids[i]);
 
 
-  /* save currently used tor relays and ensure tor service is still running */
-  tor_running = 1;
+  /* save the relays all of them use and ensure tor service is still running */
   while(1){
-    if(~tor_running){
-      pid = determine_pid(TOR_PROC_NAME);
-      if(pid == -1){
-        printf("[*] Tor is no longer running...\n");
-        fclose(relays);
-        exit(0);
-      }
+    n = 0;
+    for(i=0; i<n_pids; i++){
+      relay_ip = determine_tor_relay(pids[i]);
+      n = merge_relays(relays, n, relay_ip);
+      free(relay_ip);
     }
 
-    relay_ip = determine_tor_relay(pid);
-    if(relay_ip[0] == 0){
-      tor_running = 0;
-    } else{
-      relays = fopen("/proc/tor_relays", "w");
-      if(relays == NULL){
-        printf("[*] Kernel modules not loaded\n");
-        exit(0);
-      }
-      for(i=0; i<MAX_RELAY; i++){
-          fwrite(&relay_ip[i], 1, sizeof(int), relays);
+    if(n > 0){
+      if(relay_ctl_update_init(&update, generation) < 0 ||
+         relay_ctl_update_op(&update, TORPROXY_OP_REPLACE, TORPROXY_OP_A_RELAYS, relays, n * sizeof(int)) < 0){
+        printf("[*] Out of memory\n");
+        exit(1);
       }
+
+      if(send_update(&update, NULL) < 0) exit(1);
       printf("[*] Entry relay table populated\n");
-      fclose(relays);
-      free(relay_ip);
       exit(0);
     }
 
     sleep(5);
+    n_pids = tor_find_pids(PROC_ROOT, TOR_PROC_NAME, pids, MAX_TOR_PROCS);
+    if(n_pids == 0){
+      printf("[*] Tor is no longer running...\n");
+      exit(0);
+    }
   }
 
   return 0;
@@ -82,263 +422,634 @@ int main(){
 
 
 
-/* find tor relays currently being used
- * return integer array of ip addresses */
-int * determine_tor_relay(pid_t tor_pid){
-  FILE *tcp;
-  char *tcp_path, *buf;
-  char ip[9], ip_b[3], ignore_ip_1[9], ignore_ip_2[9];
-  int *relay_ip, ip_count, res;
-  size_t path_length;
+/* save the module's relay and bypass tables, quietly skipped
+ * where torproxy isn't installed */
+void save_snapshot(struct relay_ctl *ctl){
+  int err = snapshot_save(ctl, TORPROXY_SNAPSHOT_PATH);
 
+  if(err < 0 && err != -ENOENT){
+    printf("[*] Could not save snapshot %s: %s\n", TORPROXY_SNAPSHOT_PATH, strerror(-err));
+  }
+}
 
-  /* Allocate buffers */
-  path_length = strlen("/proc/") + ((sizeof(pid_t)/4)*10+1) + strlen("/net/tcp") + 1;
-  tcp_path = malloc(path_length);
-  buf = malloc(500);
-  relay_ip = malloc(sizeof(int)*MAX_RELAY);
+/* send one update to the kernel module, or the eBPF dataplane
+ * without one, and report the outcome */
+/* applied, when given, is set to the generation the update produced */
+int send_update(struct relay_ctl_update *update, uint32_t *applied){
+  struct relay_ctl ctl;
+  uint32_t generation = 0;
+  int err;
+
+  if(relay_ctl_open(&ctl) < 0){
+    err = bpf_dp_send(update, &generation);
+    relay_ctl_update_free(update);
+    if(err == -ENOENT){
+      printf("[*] Kernel modules not loaded\n");
+      return -1;
+    }
+  } else{
+    err = relay_ctl_send(&ctl, update, &generation);
+    relay_ctl_update_free(update);
 
-  /* initialize ips */
-  int i;
-  for(i=0; i<MAX_RELAY; i++){
-    relay_ip[i] = 0;
+    /* the tables the module starts with next time it is inserted */
+    if(err == 0) save_snapshot(&ctl);
+    relay_ctl_close(&ctl);
   }
 
-  /* get path to tcp file for tor process */
-  sprintf(tcp_path, "/proc/%d/net/tcp", tor_pid);
+  if(err == -ESTALE){
+    printf("[*] Module configuration changed since the given generation\n");
+    return -1;
+  }
+  if(err < 0){
+    printf("[*] Kernel module rejected update: %s\n", strerror(-err));
+    return -1;
+  }
 
-  /* parse file to get tor relay currently being used */
-  if((tcp = fopen(tcp_path,"r")) == NULL) return relay_ip;
+  printf("[*] Update applied, generation %u\n", generation);
+  if(applied) *applied = generation;
+  return 0;
+}
 
 
-  /* ignore NULL and loopback address */
-  strcpy(ignore_ip_1, "00000000");
-  strcpy(ignore_ip_2, "0100007F");
+/* print one policy rule as relay_pop takes it */
+static void show_policy(const struct torproxy_policy *rule){
+  char ip_str[INET_ADDRSTRLEN], if_name[IF_NAMESIZE];
+  struct passwd *pw;
+
+  if(rule->match == POLICY_MATCH_UID){
+    pw = getpwuid(rule->value);
+    if(pw) printf("policy %s", pw->pw_name);
+    else printf("policy %u", rule->value);
+  } else if(rule->match == POLICY_MATCH_CLASSID){
+    printf("policy classid:%x:%x", rule->value >> 16, rule->value & 0xffff);
+  } else{
+    if(!if_indextoname(rule->value, if_name)) snprintf(if_name, sizeof(if_name), "#%u", rule->value);
+    printf("policy dev:%s", if_name);
+  }
+
+  if(rule->action == POLICY_TOR){
+    printf(" tor\n");
+  } else if(rule->action == POLICY_EXEMPT){
+    printf(" exempt\n");
+  } else{
+    inet_ntop(AF_INET, &rule->endpoint.addr, ip_str, sizeof(ip_str));
+    printf(" endpoint %s transport %d dnsport %d\n", ip_str,
+           ntohs(rule->endpoint.trans_port), ntohs(rule->endpoint.dns_port));
+  }
+}
+
+/* print every table of the kernel module or the eBPF dataplane */
+int show_state(void){
+  struct relay_ctl ctl;
+  struct relay_ctl_state state;
+  struct bpf_dataplane dp;
+  char ip_str[INET6_ADDRSTRLEN], if_name[IF_NAMESIZE];
+  size_t i;
+  int err;
+
+  if(relay_ctl_open(&ctl) == 0){
+    err = relay_ctl_get(&ctl, &state);
+    relay_ctl_close(&ctl);
+  } else if(bpf_dp_open(&dp) == 0){
+    err = bpf_dp_get(&dp, &state);
+    bpf_dp_close(&dp);
+  } else{
+    printf("[*] Kernel modules not loaded\n");
+    return -1;
+  }
+  if(err < 0){
+    printf("[*] Could not read module tables: %s\n", strerror(-err));
+    return -1;
+  }
+
+  printf("generation %u\n", state.generation);
+  for(i=0; i<state.n_endpoints; i++){
+    inet_ntop(AF_INET, &state.endpoints[i].addr, ip_str, sizeof(ip_str));
+    printf("endpoint %s transport %d dnsport %d weight %d%s\n", ip_str,
+           ntohs(state.endpoints[i].trans_port), ntohs(state.endpoints[i].dns_port),
+           state.endpoints[i].weight, state.endpoints[i].weight ? "" : " (draining)");
+  }
+  for(i=0; i<state.n_relays; i++){
+    inet_ntop(AF_INET, &state.relays[i], ip_str, sizeof(ip_str));
+    printf("relay %s\n", ip_str);
+  }
+  for(i=0; i<state.n_prefixes; i++){
+    inet_ntop(AF_INET, &state.prefixes[i].addr, ip_str, sizeof(ip_str));
+    printf("bypass %s%s/%d\n", state.prefixes[i].action == BYPASS_PROXY ? "!" : "", ip_str, state.prefixes[i].len);
+  }
+  for(i=0; i<state.n_endpoints6; i++){
+    inet_ntop(AF_INET6, state.endpoints6[i].addr, ip_str, sizeof(ip_str));
+    printf("endpoint [%s] transport %d dnsport %d weight %d%s\n", ip_str,
+           ntohs(state.endpoints6[i].trans_port), ntohs(state.endpoints6[i].dns_port),
+           state.endpoints6[i].weight, state.endpoints6[i].weight ? "" : " (draining)");
+  }
+  for(i=0; i<state.n_relays6; i++){
+    inet_ntop(AF_INET6, &state.relays6[i], ip_str, sizeof(ip_str));
+    printf("relay %s\n", ip_str);
+  }
+  for(i=0; i<state.n_prefixes6; i++){
+    inet_ntop(AF_INET6, state.prefixes6[i].addr, ip_str, sizeof(ip_str));
+    printf("bypass %s%s/%d\n", state.prefixes6[i].action == BYPASS_PROXY ? "!" : "", ip_str, state.prefixes6[i].len);
+  }
+  for(i=0; i<state.n_gateways; i++){
+    if(!if_indextoname(state.gateways[i], if_name)) snprintf(if_name, sizeof(if_name), "#%u", state.gateways[i]);
+    printf("gateway %s\n", if_name);
+  }
+  for(i=0; i<state.n_gateway_endpoints; i++){
+    inet_ntop(AF_INET, &state.gateway_endpoints[i].addr, ip_str, sizeof(ip_str));
+    printf("gateway endpoint %s transport %d dnsport %d weight %d%s\n", ip_str,
+           ntohs(state.gateway_endpoints[i].trans_port), ntohs(state.gateway_endpoints[i].dns_port),
+           state.gateway_endpoints[i].weight, state.gateway_endpoints[i].weight ? "" : " (draining)");
+  }
+  for(i=0; i<state.n_policy; i++){
+    show_policy(&state.policy[i]);
+  }
+
+  relay_ctl_state_free(&state);
+  return 0;
+}
 
-  /* loop through file extracting ips */
-  ip_count = 0;
-  ip_b[2] = '\x00';
-  if(fgets(buf, 500, tcp) == NULL) return relay_ip; // skip first line
-  while((fgets(buf, 500, tcp) != NULL)){
-    if(ip_count > MAX_RELAY) break;
-
-    /* retrieve ip and filter out ignored ips */
-    strncpy(ip, buf+20, 9);
-    ip[8] = '\x00';
-    if(strcmp(ignore_ip_1, ip) == 0) continue;
-    if(strcmp(ignore_ip_2, ip) == 0) continue;
-
-    /* add relay ip to array */
-    relay_ip[ip_count] = 0;
-    strncpy(ip_b, ip, 2);
-    relay_ip[ip_count] = (relay_ip[ip_count] | strtol(ip_b,NULL,16) <<24);
-    strncpy(ip_b, ip+2, 2);
-    relay_ip[ip_count] = (relay_ip[ip_count] | (strtol(ip_b,NULL,16) << 16));
-    strncpy(ip_b, ip+4, 2);
-    relay_ip[ip_count] = (relay_ip[ip_count] | (strtol(ip_b,NULL,16) << 8));
-    strncpy(ip_b, ip+6, 2);
-    relay_ip[ip_count] = (relay_ip[ip_count] | (strtol(ip_b,NULL,16)));
-
-    /* ensure ip is tor relay */
-    res = check_ip_is_relay(relay_ip[ip_count]);
-    if(!res){
-      relay_ip[ip_count] = 0;
-      continue;
-    }
 
-    ip_count++;
+static const char *stat_names[TORPROXY_STAT_MAX] = {
+  [TORPROXY_STAT_RELAY] = "relay",
+  [TORPROXY_STAT_BYPASS] = "bypass",
+  [TORPROXY_STAT_TRANS_NAT] = "transport_new",
+  [TORPROXY_STAT_TRANS] = "transport",
+  [TORPROXY_STAT_DNS_QUERY] = "dns_query",
+  [TORPROXY_STAT_DNS_REPLY] = "dns_reply",
+  [TORPROXY_STAT_DNS_UNMATCHED] = "dns_unmatched",
+  [TORPROXY_STAT_LOOPBACK] = "loopback",
+  [TORPROXY_STAT_DROP_NON_TCP] = "drop_non_tcp",
+  [TORPROXY_STAT_DROP_DNS_INVALID] = "drop_dns_invalid",
+  [TORPROXY_STAT_DROP_NAT_FULL] = "drop_nat_full",
+  [TORPROXY_STAT_DROP_REWRITE] = "drop_rewrite",
+  [TORPROXY_STAT_DROP_ROUTE] = "drop_route",
+  [TORPROXY_STAT_DROP_CONNTRACK] = "drop_conntrack",
+  [TORPROXY_STAT_DROP_FORWARD] = "drop_forward",
+  [TORPROXY_STAT_DROP_IPV6] = "drop_ipv6",
+  [TORPROXY_STAT_DROP_GATEWAY] = "drop_gateway",
+  [TORPROXY_STAT_TOR_OWNED] = "tor_owned",
+  [TORPROXY_STAT_EXEMPT] = "exempt",
+  [TORPROXY_STAT_STEERED] = "steered",
+  [TORPROXY_STAT_DROP_NO_NAT] = "drop_no_nat",
+  [TORPROXY_STAT_OFFLOADED] = "offloaded",
+};
+
+static const char *hook_names[TORPROXY_HOOK_MAX] = {
+  [TORPROXY_HOOK_LOCAL_OUT] = "local_out",
+  [TORPROXY_HOOK_FORWARD] = "forward",
+  [TORPROXY_HOOK_IPV6] = "ipv6",
+  [TORPROXY_HOOK_GATEWAY] = "gateway",
+  [TORPROXY_HOOK_FLOW_OUT] = "flow_out",
+};
+
+/* upper bound in ns of the bucket holding the given share of the samples */
+static unsigned long long latency_percentile(const uint64_t *buckets, uint64_t total, double share){
+  uint64_t seen = 0;
+  int i;
 
+  for(i=0; i<TORPROXY_LATENCY_BUCKETS-1; i++){
+    seen += buckets[i];
+    if(seen >= total * share) break;
   }
+  return 1ULL << i;
+}
 
+int show_stats(void){
+  struct relay_ctl ctl;
+  struct relay_ctl_stats stats;
+  struct bpf_dataplane dp;
+  uint64_t total;
+  int i, j, err;
+
+  if(relay_ctl_open(&ctl) == 0){
+    err = relay_ctl_stats(&ctl, &stats);
+    relay_ctl_close(&ctl);
+  } else if(bpf_dp_open(&dp) == 0){
+    err = bpf_dp_stats(&dp, &stats);
+    bpf_dp_close(&dp);
+  } else{
+    printf("[*] Kernel modules not loaded\n");
+    return -1;
+  }
+  if(err < 0){
+    printf("[*] Could not read module statistics: %s\n", strerror(-err));
+    return -1;
+  }
 
-  fclose(tcp);
-  free(tcp_path);
-  free(buf);
-  return relay_ip;
+  for(i=0; i<TORPROXY_STAT_MAX; i++){
+    printf("%-18s %llu\n", stat_names[i], (unsigned long long) stats.verdicts[i]);
+  }
 
+  for(i=0; i<TORPROXY_HOOK_MAX; i++){
+    total = 0;
+    for(j=0; j<TORPROXY_LATENCY_BUCKETS; j++) total += stats.latency[i][j];
+    if(total == 0) continue;
+
+    printf("\n%s latency, %llu calls sampled, p50 < %llu ns p99 < %llu ns\n", hook_names[i],
+           (unsigned long long) total, latency_percentile(stats.latency[i], total, 0.5),
+           latency_percentile(stats.latency[i], total, 0.99));
+    for(j=0; j<TORPROXY_LATENCY_BUCKETS; j++){
+      if(stats.latency[i][j] == 0) continue;
+      if(j == TORPROXY_LATENCY_BUCKETS-1) printf("  >= %10llu ns", 1ULL << (j-1));
+      else printf("  <  %10llu ns", 1ULL << j);
+      printf(" %12llu\n", (unsigned long long) stats.latency[i][j]);
+    }
+  }
+
+  return 0;
 }
 
 
+/* follow the drop rings until killed */
+int watch_drops(void){
+  struct drop_reader reader;
+  struct drop_event ev[256];
+  char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+  const char *open, *close;
+  uint64_t lost = 0;
+  int i, n, err;
 
+  if((err = drop_reader_open(&reader)) < 0){
+    printf("[*] Could not map %s: %s\n", DROP_RING_DEVICE, strerror(-err));
+    return -1;
+  }
+  setvbuf(stdout, NULL, _IOLBF, 0);
 
-/* find pid for a given process name */
-pid_t determine_pid(char *process_name){
-  pid_t pid = -1;
-  glob_t pglob;
-  size_t name_length = strlen(process_name);
-  char *name_buf, *proc_name;
-  unsigned int i;
+  while(1){
+    n = drop_reader_poll(&reader, ev, 256);
+
+    for(i=0; i<n; i++){
+      inet_ntop(ev[i].family, ev[i].saddr, src, sizeof(src));
+      inet_ntop(ev[i].family, ev[i].daddr, dst, sizeof(dst));
+      open = ev[i].family == AF_INET6 ? "[" : "";
+      close = ev[i].family == AF_INET6 ? "]" : "";
+      printf("%llu.%06llu %-18s proto %-3d %s%s%s:%d -> %s%s%s:%d uid %d\n",
+             (unsigned long long) ev[i].timestamp / 1000000000, (unsigned long long) ev[i].timestamp % 1000000000 / 1000,
+             ev[i].reason < TORPROXY_STAT_MAX ? stat_names[ev[i].reason] : "?", ev[i].protocol,
+             open, src, close, ntohs(ev[i].sport), open, dst, close, ntohs(ev[i].dport), (int) ev[i].uid);
+    }
+    if(reader.lost != lost){
+      printf("[*] %llu events lost to full rings\n", (unsigned long long) (reader.lost - lost));
+      lost = reader.lost;
+    }
 
-  if(glob("/proc/*/comm", 0, NULL, &pglob) != 0) return pid;
+    /* a full batch means more are waiting */
+    if(n < 256) usleep(100000);
+  }
 
-  name_buf = malloc(name_length+2);
+  drop_reader_close(&reader);
+  return 0;
+}
 
-  proc_name = malloc(name_length+2);
-  strcpy(proc_name, process_name);
-  proc_name[name_length] = '\n';
-  proc_name[name_length+1] = '\x00';
 
+/* parse addr:transport:dnsport[:weight], an ipv6 addr in brackets,
+ * returns the family of the endpoint filled in or -1 */
+int parse_endpoint(char *arg, struct torproxy_endpoint *ep, struct torproxy_endpoint6 *ep6){
+  char *host = arg, *trans, *dns, *weight;
+  struct in_addr addr;
+  struct in6_addr addr6;
+  long trans_port, dns_port, w = 1;
+  int family = AF_INET;
+
+  if(*arg == '['){
+    host = arg+1;
+    if((trans = strchr(host, ']')) == NULL || trans[1] != ':') return -1;
+    *trans = 0;
+    trans += 2;
+    family = AF_INET6;
+  } else{
+    if((trans = strchr(arg, ':')) == NULL) return -1;
+    *trans++ = 0;
+  }
+  if((dns = strchr(trans, ':')) == NULL) return -1;
+  *dns++ = 0;
+  if((weight = strchr(dns, ':')) != NULL){
+    *weight++ = 0;
+    w = strtol(weight, NULL, 10);
+  }
 
-  for(i=0; i<pglob.gl_pathc; i++){
-    FILE *pid_comm;
+  trans_port = strtol(trans, NULL, 10);
+  dns_port = strtol(dns, NULL, 10);
+  if(trans_port <= 0 || trans_port > 65535 || dns_port <= 0 || dns_port > 65535 ||
+     w < 0 || w > TOR_MAX_WEIGHT){
+    return -1;
+  }
 
-    if((pid_comm = fopen(pglob.gl_pathv[i], "r")) == NULL) continue;
+  if(family == AF_INET6){
+    if(inet_pton(AF_INET6, host, &addr6) != 1) return -1;
 
-    if((fgets(name_buf, name_length+2, pid_comm)) == NULL) continue;
+    memset(ep6, 0, sizeof(*ep6));
+    memcpy(ep6->addr, &addr6, sizeof(ep6->addr));
+    ep6->trans_port = htons(trans_port);
+    ep6->dns_port = htons(dns_port);
+    ep6->weight = w;
+    return AF_INET6;
+  }
 
-    if(strcmp(proc_name, name_buf) == 0) pid = (pid_t)atoi(pglob.gl_pathv[i] + strlen("/proc/"));
+  if(inet_pton(AF_INET, host, &addr) != 1) return -1;
 
-    fclose(pid_comm);
+  memset(ep, 0, sizeof(*ep));
+  ep->addr = addr.s_addr;
+  ep->trans_port = htons(trans_port);
+  ep->dns_port = htons(dns_port);
+  ep->weight = w;
+  return AF_INET;
+}
 
+/* user name or uid, classid:major:minor or dev:iface */
+int parse_owner(char *arg, struct torproxy_policy *rule){
+  struct passwd *pw;
+  unsigned int major, minor;
+  char *end;
+
+  memset(rule, 0, sizeof(*rule));
+
+  if(strncmp(arg, "classid:", 8) == 0){
+    if(sscanf(arg + 8, "%x:%x", &major, &minor) != 2 || major > 0xffff || minor > 0xffff) return -1;
+    rule->match = POLICY_MATCH_CLASSID;
+    rule->value = major << 16 | minor;
+  } else if(strncmp(arg, "dev:", 4) == 0){
+    rule->match = POLICY_MATCH_IFACE;
+    rule->value = if_nametoindex(arg + 4);
+  } else{
+    rule->match = POLICY_MATCH_UID;
+    rule->value = strtoul(arg, &end, 10);
+    if(*arg == 0 || *end != 0){
+      if((pw = getpwnam(arg)) == NULL) return -1;
+      rule->value = pw->pw_uid;
+    }
   }
 
-  free(name_buf);
-  free(proc_name);
-  globfree(&pglob);
-  return pid;
+  /* root is uid 0, no interface or classid is */
+  return rule->match == POLICY_MATCH_UID || rule->value ? 0 : -1;
+}
 
 
 
+/* find tor relays currently being used
+ * return integer array of ip addresses */
+int * determine_tor_relay(pid_t tor_pid){
+  uint32_t conns[MAX_TOR_CONNS];
+  int *relay_ip, n, i, ip_count;
+
+  relay_ip = calloc(MAX_RELAY, sizeof(int));
+
+  /* tor's outbound connections, loopback peers already left out */
+  n = tor_or_connections(tor_pid, conns, MAX_TOR_CONNS);
+  if(n < 0){
+    printf("[*] Could not list tor's connections: %s\n", strerror(-n));
+    return relay_ip;
+  }
+
+  /* ensure ip is tor relay */
+  ip_count = 0;
+  for(i=0; i<n && ip_count<MAX_RELAY; i++){
+    if(check_ip_is_relay(tor_pid, conns[i])) relay_ip[ip_count++] = conns[i];
+  }
+
+  return relay_ip;
 }
 
 
 
-int check_ip_is_relay(int ip){
-  FILE *file;
-  pid_t pid = -1;
-  char c, *environ_path, *tor_data_path, *buf;
-  char env_tor_data[]="TOR_BROWSER_TOR_DATA_DIR";
-  char ip_str[INET_ADDRSTRLEN], match_ip[INET_ADDRSTRLEN];
-  int i, k, len, path_length;
-
-  /* Convert ip address to string */
-  if(inet_ntop(AF_INET, &ip, ip_str, INET_ADDRSTRLEN) == NULL){
-    printf("couldn't convert ip address\n");
-    exit(0);
+
+/* add the relays of a zero terminated array not already among the n in relays
+ * return the new count */
+int merge_relays(int *relays, int n, const int *add){
+  int i, j;
+
+  for(i=0; i<MAX_RELAY && add[i] != 0; i++){
+    for(j=0; j<n && relays[j] != add[i]; j++);
+    if(j == n) relays[n++] = add[i];
   }
-  
 
-  pid = determine_pid(TOR_PROC_NAME);
-  if(pid == -1){
-    printf("could not find running tor process...\n");
-    exit(0);
+  return n;
+}
+
+
+
+
+struct consensus_index * get_consensus(pid_t tor_pid){
+  static struct consensus_index consensus;
+  int err;
+
+  if(consensus.slots) return &consensus;
+
+  err = consensus_index_load(&consensus, PROC_ROOT, tor_pid);
+  if(err < 0){
+    printf("Error retrieving tor relays consensus file: %s\n", strerror(-err));
+    return NULL;
   }
 
-  /* Allocate buffers */
-  path_length = strlen("/proc/") + ((sizeof(pid_t)/4)*10+1) + strlen("/environ") + 1;
-  environ_path = malloc(path_length);
-  tor_data_path = malloc(500);
-  buf = malloc(500);
+  return &consensus;
+}
 
-  /* get path to environment variables for tor process */
-  sprintf(environ_path, "/proc/%d/environ", pid);
 
-  /* parse file to get tor relay currently being used */
-  if((file = fopen(environ_path,"r")) == NULL){
-    free(environ_path);
-    free(tor_data_path);
-    free(buf);
-    printf("error opening environment for tor\n");
-    exit(0);
+/* every relay in the consensus, at most RELAY_MAX_ADDRS. returns the count or -1 */
+int read_consensus(__be32 *relays, struct in6_addr *relays6, int *n_relays6){
+  struct consensus_index *consensus;
+  pid_t pid;
+  size_t n;
+
+  /* every tor process follows the same consensus, any one will do */
+  if(tor_find_pids(PROC_ROOT, TOR_PROC_NAME, &pid, 1) == 0){
+    printf("[*] Could not find running tor process...\n");
+    return -1;
   }
+  if((consensus = get_consensus(pid)) == NULL) return -1;
 
-  i = 0;
-  len = strlen(env_tor_data)-1;
-  while(c != EOF){
-    c = getc(file);
-    if(c == (int) env_tor_data[i]){
-      if(i == len) break;
-      i++;
-    } else{
-      i=0;
-    }
-  }
-
-  /* Relay file not found in environment so check default install location */
-  if(c == EOF){
-    sprintf(tor_data_path, "/var/lib/tor");
-  } else {
-    /* read equal sign */
-    getc(file);
-    i = 0;
-    while((c != EOF) & (c != 0x00)){
-      c = getc(file);
-      tor_data_path[i] = c;
-      i++;
-      if(i>=500){
-        printf("overflow protection, in retrieving tor data directory path\n");
-        exit(0);
-      }
-    }
-    tor_data_path[i] = 0x00;
-    fclose(file);
+  n = consensus->count;
+  if(n > RELAY_MAX_ADDRS){
+    printf("[*] More than %d relays in the consensus, ignoring the rest\n", RELAY_MAX_ADDRS);
+    n = RELAY_MAX_ADDRS;
   }
+  memcpy(relays, consensus->addrs, n * sizeof(*relays));
 
+  *n_relays6 = consensus->count6;
+  if(*n_relays6 > RELAY6_MAX_ADDRS){
+    printf("[*] More than %d ipv6 relays in the consensus, ignoring the rest\n", RELAY6_MAX_ADDRS);
+    *n_relays6 = RELAY6_MAX_ADDRS;
+  }
+  memcpy(relays6, consensus->addrs6, *n_relays6 * sizeof(*relays6));
 
-  /* open tor consensus file */
-  sprintf(tor_data_path, "%s%s", tor_data_path, "/cached-microdesc-consensus");
-  if((file = fopen(tor_data_path,"r")) == NULL){
-    tor_data_path[i] = 0x00;
-    sprintf(tor_data_path, "%s%s", tor_data_path, "/cached-consensus");
-    if((file = fopen(tor_data_path,"r")) == NULL){
-      free(environ_path);
-      free(tor_data_path);
-      free(buf);
-      printf("Error retrieving tor relays consensus file\n");
-      exit(0);
-    }
+  return n;
+}
+
+
+int check_ip_is_relay(pid_t tor_pid, int ip){
+  struct consensus_index *consensus;
+
+  if((consensus = get_consensus(tor_pid)) == NULL) exit(0);
+
+  return consensus_index_contains(consensus, ip);
+}
+
+
+
+/* read bypass prefixes from a file, one "a.b.c.d/len" or ipv6
+ * "addr/len" per line, a leading '!' sends the range through tor
+ * even when a shorter prefix bypasses it and '#' starts a comment.
+ * returns the ipv4 count, the ipv6 one goes in n_prefixes6 */
+int read_bypass(char *path, struct bypass_prefix *prefixes, struct bypass_prefix6 *prefixes6, int *n_prefixes6){
+  FILE *file;
+  struct in_addr addr;
+  struct in6_addr addr6;
+  char buf[128], *line, *slash, *end;
+  int n, line_no, len, action;
+
+  if((file = fopen(path, "r")) == NULL){
+    printf("[*] Could not open bypass file %s\n", path);
+    return -1;
   }
 
+  n = 0;
+  *n_prefixes6 = 0;
+  line_no = 0;
+  while(fgets(buf, sizeof(buf), file) != NULL){
+    line_no++;
+    buf[strcspn(buf, "#\r\n")] = 0;
+    line = buf + strspn(buf, " \t");
+    line[strcspn(line, " \t")] = 0;
+    if(*line == 0) continue;
+
+    action = BYPASS_ACCEPT;
+    if(*line == '!'){
+      action = BYPASS_PROXY;
+      line++;
+    }
 
-  /* parse relay entries looking for matching ip */
-  while((fgets(buf, 500, file) != NULL)){
-    if(!strncmp(buf, "r ", 2)){ //is relay entry
-      i=0;
-      k=0;
-      c=buf[i]; 
-      while(i < strlen(buf)){
-        if(c == 0x20) k++; //space character (0x20)
-        if(k == 5) break; // five spaces till ip address
-        i++;
-        c=buf[i];
-      }
-      i++;
-      k=0;
-      c=buf[i];
-      while(c != 0x20){ // get relay ip to compare
-        match_ip[k]=c;
-        k++;
-        i++;
-        c=buf[i];
-      }
-      match_ip[k]=0x00;
-      if(!strcmp(ip_str, match_ip)){ // see if it matches input and return 1 if found
-        free(environ_path);
-        free(tor_data_path);
-        free(buf);
-        fclose(file);
-        return 1;
+    len = -2;
+    if((slash = strchr(line, '/')) != NULL){
+      *slash = 0;
+      len = strtol(slash+1, &end, 10);
+      if(*end != 0 || end == slash+1) len = -1;
+    }
+
+    if(inet_pton(AF_INET6, line, &addr6) == 1){
+      if(len == -2) len = 128;
+      if(len < 0 || len > 128) goto invalid;
+      if(*n_prefixes6 == BYPASS6_MAX_PREFIXES){
+        printf("[*] More than %d ipv6 bypass prefixes in %s\n", BYPASS6_MAX_PREFIXES, path);
+        goto err;
       }
+
+      memset(&prefixes6[*n_prefixes6], 0, sizeof(prefixes6[*n_prefixes6]));
+      memcpy(prefixes6[*n_prefixes6].addr, &addr6, sizeof(addr6));
+      prefixes6[*n_prefixes6].len = len;
+      prefixes6[*n_prefixes6].action = action;
+      (*n_prefixes6)++;
+      continue;
+    }
+
+    if(len == -2) len = 32;
+    if(inet_pton(AF_INET, line, &addr) != 1 || len < 0 || len > 32) goto invalid;
+    if(n == BYPASS_MAX_PREFIXES){
+      printf("[*] More than %d bypass prefixes in %s\n", BYPASS_MAX_PREFIXES, path);
+      goto err;
     }
+
+    memset(&prefixes[n], 0, sizeof(prefixes[n]));
+    prefixes[n].addr = addr.s_addr;
+    prefixes[n].len = len;
+    prefixes[n].action = action;
+    n++;
   }
 
+  fclose(file);
+  return n;
 
-  free(environ_path);
-  free(tor_data_path);
-  free(buf);
+invalid:
+  printf("[*] Invalid bypass prefix on line %d of %s\n", line_no, path);
+err:
   fclose(file);
+  return -1;
+}
 
-  /* input ip is not a tor relay */
-  return 0;
+
+static struct dns_stub *running_stub;
+
+static void stop_dns_stub(int sig){
+  (void) sig;
+  dns_stub_stop(running_stub);
 }
 
+/* serve DNS until SIGINT or SIGTERM, then print what the cache saved */
+int run_dns_stub(struct dns_stub_opts *opts){
+  struct dns_stub_stats st;
+  int err;
 
+  dns_stub_opts_default(opts);
+  if((running_stub = dns_stub_open(opts)) == NULL){
+    printf("[*] Could not open the DNS stub on %s for %s: %s\n", opts->listen, opts->upstream, strerror(errno));
+    return -1;
+  }
+  signal(SIGINT, stop_dns_stub);
+  signal(SIGTERM, stop_dns_stub);
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("[*] DNS stub on %s asking %s\n", opts->listen, opts->upstream);
+  err = dns_stub_run(running_stub);
+
+  dns_stub_read_stats(running_stub, &st);
+  printf("[*] %llu queries, %llu cache hits, %llu coalesced, %llu sent to tor (%llu prefetches), %llu timed out\n",
+         (unsigned long long) st.queries, (unsigned long long) st.hits, (unsigned long long) st.coalesced,
+         (unsigned long long) st.upstream, (unsigned long long) st.prefetches, (unsigned long long) st.timeouts);
+  dns_stub_close(running_stub);
+
+  if(err < 0){
+    printf("[*] DNS stub failed: %s\n", strerror(-err));
+    return -1;
+  }
+  return 0;
+}
 
 
+/* load the eBPF dataplane and attach it, it then stays pinned
+ * until removed with remove_bpf() */
+int load_bpf(const char *cgroup){
+  struct bpf_dataplane dp;
+  char *log;
+  int err;
 
+  log = calloc(1, 65536);
+  if(!log){
+    printf("[*] Out of memory\n");
+    return -1;
+  }
 
+  err = bpf_dp_load(&dp, log, 65536);
+  if(err < 0){
+    printf("[*] Could not load the eBPF dataplane: %s\n", strerror(-err));
+    if(log[0]) printf("%s", log);
+    free(log);
+    return -1;
+  }
+  free(log);
 
+  err = bpf_dp_attach(&dp, cgroup);
+  bpf_dp_close(&dp);
+  if(err == -EEXIST){
+    printf("[*] eBPF dataplane already loaded\n");
+    return -1;
+  }
+  if(err < 0){
+    printf("[*] Could not attach the eBPF dataplane to %s: %s\n", cgroup, strerror(-err));
+    return -1;
+  }
 
+  printf("[*] eBPF dataplane attached to %s\n", cgroup);
+  return 0;
+}
 
+int remove_bpf(const char *cgroup){
+  int err = bpf_dp_remove(cgroup);
 
+  if(err < 0){
+    printf("[*] Could not remove the eBPF dataplane from %s: %s\n", cgroup, strerror(-err));
+    return -1;
+  }
 
+  printf("[*] eBPF dataplane removed from %s\n", cgroup);
+  return 0;
+}
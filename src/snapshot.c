@@ -0,0 +1,96 @@
+/* **********************************************************************
+ * Writer for the relay and bypass snapshot the module loads at insert
+ *
+ * The tables are written next to the snapshot and renamed over it, so
+ * a module inserted at any time reads either snapshot whole
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "snapshot.h"
+
+
+static int write_all(int fd, const void *buf, size_t len){
+  const char *p = buf;
+  ssize_t n;
+
+  while(len){
+    n = write(fd, p, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) return -errno;
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+int snapshot_write(const char *path, const struct relay_ctl_state *state){
+  struct torproxy_snapshot_header hdr;
+  char *buf, *p, tmp[4096];
+  size_t size;
+  int fd, err;
+
+  if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) return -ENAMETOOLONG;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = TORPROXY_SNAPSHOT_MAGIC;
+  hdr.version = TORPROXY_SNAPSHOT_VERSION;
+  hdr.header_size = sizeof(hdr);
+  hdr.n_relays = state->n_relays;
+  hdr.n_prefixes = state->n_prefixes;
+  hdr.n_relays6 = state->n_relays6;
+  hdr.n_prefixes6 = state->n_prefixes6;
+
+  size = snapshot_tables_size(&hdr);
+  buf = malloc(size ? size : 1);
+  if(!buf) return -ENOMEM;
+
+  p = buf;
+  if(state->n_relays) memcpy(p, state->relays, state->n_relays * sizeof(*state->relays));
+  p += state->n_relays * sizeof(*state->relays);
+  if(state->n_prefixes) memcpy(p, state->prefixes, state->n_prefixes * sizeof(*state->prefixes));
+  p += state->n_prefixes * sizeof(*state->prefixes);
+  if(state->n_relays6) memcpy(p, state->relays6, state->n_relays6 * sizeof(*state->relays6));
+  p += state->n_relays6 * sizeof(*state->relays6);
+  if(state->n_prefixes6) memcpy(p, state->prefixes6, state->n_prefixes6 * sizeof(*state->prefixes6));
+
+  hdr.crc = snapshot_crc(buf, size);
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if(fd < 0){
+    err = -errno;
+    free(buf);
+    return err;
+  }
+
+  err = write_all(fd, &hdr, sizeof(hdr));
+  if(err == 0) err = write_all(fd, buf, size);
+  if(err == 0 && fsync(fd) < 0) err = -errno;
+  if(close(fd) < 0 && err == 0) err = -errno;
+  free(buf);
+
+  if(err == 0 && rename(tmp, path) < 0) err = -errno;
+  if(err < 0) unlink(tmp);
+
+  return err;
+}
+
+int snapshot_save(struct relay_ctl *ctl, const char *path){
+  struct relay_ctl_state state;
+  int err;
+
+  err = relay_ctl_get(ctl, &state);
+  if(err < 0) return err;
+
+  err = snapshot_write(path, &state);
+  relay_ctl_state_free(&state);
+
+  return err;
+}
@@ -0,0 +1,22 @@
+/* **********************************************************************
+ * Writer for the relay and bypass snapshot the module loads at insert
+ *
+ * The snapshot is replaced atomically, see torproxy_snapshot.h for
+ * its format
+ **********************************************************************
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "relay_ctl.h"
+#include "torproxy_snapshot.h"
+
+/* write the relay and bypass tables of state to path, returns 0 or -errno */
+int snapshot_write(const char *path, const struct relay_ctl_state *state);
+
+/* write the module's current tables to path, returns 0 or -errno.
+ * -ENOENT when the directory doesn't exist, torproxy isn't installed */
+int snapshot_save(struct relay_ctl *ctl, const char *path);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,238 @@
+/* **********************************************************************
+ * Discovery of tor's OR connections over NETLINK_SOCK_DIAG
+ *
+ * Tor's sockets are known by the inodes behind /proc/<pid>/fd, which
+ * costs one readlink per descriptor tor has open. The established
+ * socket dump is filtered in the kernel by state and by an inet_diag
+ * bytecode dropping loopback peers, the rest is matched by inode
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#include "sock_diag.h"
+
+#define DIAG_BUF_SIZE (32 * 1024)
+
+/* most listening ports tor can have */
+#define MAX_LISTEN 32
+
+struct tor_sockets {
+  ino_t *inodes;  /* sorted */
+  size_t n_inodes;
+  uid_t uid;
+  int by_uid;     /* tor's descriptors can't be read, match its uid instead */
+
+  uint16_t listen[MAX_LISTEN];  /* network order */
+  size_t n_listen;
+
+  uint32_t *addrs;
+  int n_addrs, max_addrs;
+};
+
+/* inet_diag bytecode: a peer in 127.0.0.0/8 falls through to a jump
+ * past the end of the program, which rejects the socket, any other
+ * peer jumps straight to the end and is accepted */
+struct loopback_filter {
+  struct inet_diag_bc_op op;
+  struct inet_diag_hostcond cond;
+  uint32_t addr;
+  struct inet_diag_bc_op reject;
+};
+
+
+static int ino_cmp(const void *a, const void *b){
+  ino_t x = *(const ino_t *) a, y = *(const ino_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static int read_socket_inodes(pid_t tor_pid, struct tor_sockets *ts){
+  char path[300], link[64];
+  struct dirent *ent;
+  struct stat st;
+  unsigned long ino;
+  size_t cap = 0;
+  ssize_t len;
+  ino_t *tmp;
+  DIR *dir;
+
+  snprintf(path, sizeof(path), "/proc/%d", tor_pid);
+  if(stat(path, &st) < 0) return -errno;
+  ts->uid = st.st_uid;
+
+  snprintf(path, sizeof(path), "/proc/%d/fd", tor_pid);
+  if((dir = opendir(path)) == NULL){
+    ts->by_uid = 1;
+    return 0;
+  }
+
+  while((ent = readdir(dir)) != NULL){
+    if(ent->d_name[0] == '.') continue;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd/%s", tor_pid, ent->d_name);
+    if((len = readlink(path, link, sizeof(link)-1)) < 0) continue;
+    link[len] = 0;
+    if(sscanf(link, "socket:[%lu]", &ino) != 1) continue;
+
+    if(ts->n_inodes == cap){
+      cap = cap ? cap*2 : 256;
+      if((tmp = realloc(ts->inodes, cap * sizeof(*tmp))) == NULL){
+        closedir(dir);
+        return -ENOMEM;
+      }
+      ts->inodes = tmp;
+    }
+    ts->inodes[ts->n_inodes++] = ino;
+  }
+  closedir(dir);
+
+  qsort(ts->inodes, ts->n_inodes, sizeof(*ts->inodes), ino_cmp);
+  return 0;
+}
+
+static int owned_by_tor(const struct tor_sockets *ts, const struct inet_diag_msg *msg){
+  ino_t ino = msg->idiag_inode;
+
+  if(ts->by_uid) return msg->idiag_uid == ts->uid;
+  return bsearch(&ino, ts->inodes, ts->n_inodes, sizeof(ino), ino_cmp) != NULL;
+}
+
+
+/* dump the TCP sockets of family in states, calling fn for each */
+static int diag_dump(int fd, int family, uint32_t states, const void *bc, size_t bc_len,
+    void (*fn)(struct tor_sockets *, const struct inet_diag_msg *), struct tor_sockets *ts)
+{
+  struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+  struct {
+    struct nlmsghdr nlh;
+    struct inet_diag_req_v2 req;
+    struct rtattr rta;
+    char bc[64];
+  } msg;
+  struct nlmsghdr *nlh;
+  struct nlmsgerr *err;
+  char *buf;
+  ssize_t len;
+  int ret = 1;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(msg.req));
+  msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+  msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  msg.req.sdiag_family = family;
+  msg.req.sdiag_protocol = IPPROTO_TCP;
+  msg.req.idiag_states = states;
+
+  if(bc){
+    if(bc_len > sizeof(msg.bc)) return -EINVAL;
+    msg.rta.rta_type = INET_DIAG_REQ_BYTECODE;
+    msg.rta.rta_len = RTA_LENGTH(bc_len);
+    memcpy(msg.bc, bc, bc_len);
+    msg.nlh.nlmsg_len += RTA_SPACE(bc_len);
+  }
+
+  if(sendto(fd, &msg, msg.nlh.nlmsg_len, 0, (struct sockaddr *) &kernel, sizeof(kernel)) < 0) return -errno;
+
+  if((buf = malloc(DIAG_BUF_SIZE)) == NULL) return -ENOMEM;
+
+  while(ret > 0){
+    if((len = recv(fd, buf, DIAG_BUF_SIZE, 0)) < 0){
+      ret = -errno;
+      break;
+    }
+
+    for(nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)){
+      if(nlh->nlmsg_type == NLMSG_DONE){
+        ret = 0;
+        break;
+      }
+      if(nlh->nlmsg_type == NLMSG_ERROR){
+        err = NLMSG_DATA(nlh);
+        ret = err->error ? err->error : -EPROTO;
+        break;
+      }
+      if(nlh->nlmsg_type == SOCK_DIAG_BY_FAMILY) fn(ts, NLMSG_DATA(nlh));
+    }
+  }
+
+  free(buf);
+  return ret;
+}
+
+static void add_listener(struct tor_sockets *ts, const struct inet_diag_msg *msg){
+  if(!owned_by_tor(ts, msg) || ts->n_listen == MAX_LISTEN) return;
+  ts->listen[ts->n_listen++] = msg->id.idiag_sport;
+}
+
+static void add_connection(struct tor_sockets *ts, const struct inet_diag_msg *msg){
+  uint32_t addr = msg->id.idiag_dst[0];
+  size_t i;
+  int j;
+
+  if(addr == 0 || !owned_by_tor(ts, msg)) return;
+
+  /* accepted on one of tor's listeners, not one tor opened */
+  for(i=0; i<ts->n_listen; i++){
+    if(ts->listen[i] == msg->id.idiag_sport) return;
+  }
+
+  for(j=0; j<ts->n_addrs; j++){
+    if(ts->addrs[j] == addr) return;
+  }
+  if(ts->n_addrs < ts->max_addrs) ts->addrs[ts->n_addrs++] = addr;
+}
+
+
+int tor_or_connections(pid_t tor_pid, uint32_t *addrs, int max){
+  struct tor_sockets ts;
+  struct loopback_filter bc;
+  int fd, err;
+
+  memset(&ts, 0, sizeof(ts));
+  ts.addrs = addrs;
+  ts.max_addrs = max;
+
+  if((err = read_socket_inodes(tor_pid, &ts)) < 0) goto out;
+
+  if((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_SOCK_DIAG)) < 0){
+    err = -errno;
+    goto out;
+  }
+
+  memset(&bc, 0, sizeof(bc));
+  bc.op.code = INET_DIAG_BC_D_COND;
+  bc.op.yes = offsetof(struct loopback_filter, reject);
+  bc.op.no = sizeof(bc);
+  bc.cond.family = AF_INET;
+  bc.cond.prefix_len = 8;
+  bc.cond.port = -1;
+  bc.addr = htonl(INADDR_LOOPBACK & 0xff000000);
+  bc.reject.code = INET_DIAG_BC_JMP;
+  bc.reject.yes = sizeof(bc.reject);
+  bc.reject.no = sizeof(bc.reject) + 4;
+
+  /* without ipv6 there are no v6 listeners to find */
+  err = diag_dump(fd, AF_INET, 1 << TCP_LISTEN, NULL, 0, add_listener, &ts);
+  if(err == 0) diag_dump(fd, AF_INET6, 1 << TCP_LISTEN, NULL, 0, add_listener, &ts);
+  if(err == 0) err = diag_dump(fd, AF_INET, 1 << TCP_ESTABLISHED, &bc, sizeof(bc), add_connection, &ts);
+  close(fd);
+
+out:
+  free(ts.inodes);
+  return err < 0 ? err : ts.n_addrs;
+}
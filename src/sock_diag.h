@@ -0,0 +1,21 @@
+/* **********************************************************************
+ * Discovery of tor's OR connections over NETLINK_SOCK_DIAG
+ *
+ * The kernel only dumps established IPv4 TCP sockets to non-loopback
+ * peers, and of those only the sockets tor owns and did not accept on
+ * one of its listeners are kept, so only tor's outbound connections
+ * are returned and no text is parsed
+ **********************************************************************
+*/
+
+#ifndef SOCK_DIAG_H
+#define SOCK_DIAG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* peer addresses of tor's outbound connections in network order,
+ * without duplicates. returns the count, at most max, or -errno */
+int tor_or_connections(pid_t tor_pid, uint32_t *addrs, int max);
+
+#endif /* SOCK_DIAG_H */
@@ -0,0 +1,360 @@
+/* **********************************************************************
+ * Client for tor's ControlPort
+ *
+ * Replies are read with blocking reads into one buffer, nothing here
+ * polls: a daemon waiting in tor_control_next_event() sleeps in recv
+ * until tor has something to say
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "tor_control.h"
+#include "tor_procs.h"
+
+#define TOR_COOKIE_LEN 32
+
+/* tor processes whose data directory a cookie may be in */
+#define TOR_COOKIE_PROCS 16
+
+
+static int connect_unix(const char *path){
+  struct sockaddr_un sun = { .sun_family = AF_UNIX };
+  int fd;
+
+  if(strlen(path) >= sizeof(sun.sun_path)) return -ENAMETOOLONG;
+  strcpy(sun.sun_path, path);
+
+  if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -errno;
+  if(connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0){
+    close(fd);
+    return -errno;
+  }
+
+  return fd;
+}
+
+static int connect_tcp(const char *target){
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res, *ai;
+  char host[256];
+  const char *port;
+  int fd = -ECONNREFUSED;
+
+  if((port = strrchr(target, ':')) == NULL){
+    strcpy(host, "127.0.0.1");
+    port = target;
+  } else{
+    if((size_t) (port - target) >= sizeof(host)) return -EINVAL;
+    memcpy(host, target, port - target);
+    host[port - target] = 0;
+    port++;
+  }
+
+  if(getaddrinfo(host, port, &hints, &res) != 0) return -EINVAL;
+
+  for(ai = res; ai; ai = ai->ai_next){
+    if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0){
+      fd = -errno;
+      continue;
+    }
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -errno;
+  }
+
+  freeaddrinfo(res);
+  return fd;
+}
+
+int tor_control_open(struct tor_control *tc, const char *target){
+  int fd;
+
+  memset(tc, 0, sizeof(*tc));
+  tc->events_tail = &tc->events;
+
+  fd = (target[0] == '/') ? connect_unix(target) : connect_tcp(target);
+  if(fd < 0) return fd;
+
+  tc->fd = fd;
+  return 0;
+}
+
+void tor_control_close(struct tor_control *tc){
+  struct tor_control_msg *m;
+
+  while((m = tc->events) != NULL){
+    tc->events = m->next;
+    free(m);
+  }
+  close(tc->fd);
+}
+
+
+/* next line without its CRLF, valid until the next call. NULL on error */
+static char *read_line(struct tor_control *tc, int *err){
+  char *nl;
+  ssize_t r;
+
+  while(1){
+    nl = memchr(tc->buf + tc->start, '\n', tc->end - tc->start);
+    if(nl){
+      char *line = tc->buf + tc->start;
+
+      tc->start = nl+1 - tc->buf;
+      if(nl > line && nl[-1] == '\r') nl--;
+      *nl = 0;
+      return line;
+    }
+
+    /* make room, a line longer than the buffer is a protocol error */
+    if(tc->start > 0){
+      memmove(tc->buf, tc->buf + tc->start, tc->end - tc->start);
+      tc->end -= tc->start;
+      tc->start = 0;
+    }
+    if(tc->end == sizeof(tc->buf)){
+      *err = -EPROTO;
+      return NULL;
+    }
+
+    r = recv(tc->fd, tc->buf + tc->end, sizeof(tc->buf) - tc->end, 0);
+    if(r <= 0){
+      *err = (r == 0) ? -EPIPE : -errno;
+      return NULL;
+    }
+    tc->end += r;
+  }
+}
+
+static int msg_append(struct tor_control_msg **m, size_t *cap, const char *text, size_t len){
+  struct tor_control_msg *tmp;
+
+  while(sizeof(**m) + (*m ? (*m)->len : 0) + len + 2 > *cap){
+    *cap = *cap ? *cap*2 : 256;
+    if((tmp = realloc(*m, *cap)) == NULL) return -ENOMEM;
+    if(*m == NULL){
+      tmp->next = NULL;
+      tmp->code = 0;
+      tmp->len = 0;
+    }
+    *m = tmp;
+  }
+
+  memcpy((*m)->text + (*m)->len, text, len);
+  (*m)->len += len;
+  (*m)->text[(*m)->len++] = '\n';
+  (*m)->text[(*m)->len] = 0;
+  return 0;
+}
+
+/* one complete reply or event: "xyz-" and "xyz+" lines continue it,
+ * the latter followed by dot terminated data, "xyz " ends it */
+static int read_msg(struct tor_control *tc, struct tor_control_msg **msg){
+  struct tor_control_msg *m = NULL;
+  size_t cap = 0;
+  char *line, sep;
+  int err = 0;
+
+  while(1){
+    if((line = read_line(tc, &err)) == NULL) goto err;
+    if(strlen(line) < 4 || (line[3] != ' ' && line[3] != '-' && line[3] != '+')){
+      err = -EPROTO;
+      goto err;
+    }
+
+    sep = line[3];
+    if(msg_append(&m, &cap, line+4, strlen(line+4)) < 0) goto nomem;
+    m->code = atoi(line);
+
+    if(sep == '+'){
+      while(1){
+        if((line = read_line(tc, &err)) == NULL) goto err;
+        if(!strcmp(line, ".")) break;
+        if(line[0] == '.') line++;
+        if(msg_append(&m, &cap, line, strlen(line)) < 0) goto nomem;
+      }
+    } else if(sep == ' '){
+      *msg = m;
+      return 0;
+    }
+  }
+
+nomem:
+  err = -ENOMEM;
+err:
+  free(m);
+  return err;
+}
+
+
+int tor_control_command(struct tor_control *tc, const char *cmd, struct tor_control_msg **reply){
+  struct tor_control_msg *m;
+  size_t len = strlen(cmd);
+  char *line;
+  int err, code;
+
+  if(reply) *reply = NULL;
+  if((line = malloc(len + 2)) == NULL) return -ENOMEM;
+  memcpy(line, cmd, len);
+  memcpy(line + len, "\r\n", 2);
+  err = (send(tc->fd, line, len+2, MSG_NOSIGNAL) == (ssize_t) (len+2)) ? 0 : -errno;
+  free(line);
+  if(err < 0) return err;
+
+  /* replies come in order, events may arrive before ours */
+  while(1){
+    if((err = read_msg(tc, &m)) < 0) return err;
+    if(m->code != 650) break;
+
+    *tc->events_tail = m;
+    tc->events_tail = &m->next;
+  }
+
+  code = m->code;
+  if(reply) *reply = m;
+  else free(m);
+
+  return code;
+}
+
+int tor_control_next_event(struct tor_control *tc, struct tor_control_msg **event){
+  struct tor_control_msg *m;
+  int err;
+
+  if((m = tc->events) != NULL){
+    tc->events = m->next;
+    if(!tc->events) tc->events_tail = &tc->events;
+    m->next = NULL;
+    *event = m;
+    return 0;
+  }
+
+  while(1){
+    if((err = read_msg(tc, &m)) < 0) return err;
+    if(m->code == 650) break;
+
+    /* a reply nobody waits for */
+    free(m);
+  }
+
+  *event = m;
+  return 0;
+}
+
+
+/* value of KEY= in a PROTOCOLINFO reply, quoted or not */
+static int protocolinfo_value(const char *text, const char *key, char *out, size_t size){
+  const char *p, *end;
+  size_t n = 0;
+
+  if((p = strstr(text, key)) == NULL) return -1;
+  p += strlen(key);
+
+  if(*p == '"'){
+    for(p++; *p && *p != '"' && n+1 < size; p++){
+      if(*p == '\\' && p[1]) p++;
+      out[n++] = *p;
+    }
+  } else{
+    end = p + strcspn(p, " \n");
+    while(p < end && n+1 < size) out[n++] = *p++;
+  }
+
+  out[n] = 0;
+  return 0;
+}
+
+/* the path comes from whoever answers on the ControlPort, which need
+ * not be tor. only a regular file of a running tor's user inside that
+ * tor's data directory is opened, returns its fd or -errno */
+static int cookie_open(const char *path){
+  char real[PATH_MAX], dir[PATH_MAX], data_dir[512];
+  pid_t pids[TOR_COOKIE_PROCS];
+  struct stat st;
+  uid_t uid;
+  size_t len;
+  int fd, n, i;
+
+  if(realpath(path, real) == NULL) return -errno;
+  if((fd = open(real, O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) < 0) return -errno;
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+    close(fd);
+    return -EACCES;
+  }
+
+  n = tor_find_pids(PROC_ROOT, "tor", pids, TOR_COOKIE_PROCS);
+  for(i=0; i<n; i++){
+    if(tor_proc_uid(PROC_ROOT, pids[i], &uid) < 0 || uid != st.st_uid) continue;
+
+    tor_data_dir(PROC_ROOT, pids[i], data_dir, sizeof(data_dir));
+    if(realpath(data_dir, dir) == NULL) continue;
+
+    len = strlen(dir);
+    if(!strncmp(real, dir, len) && real[len] == '/') return fd;
+  }
+
+  close(fd);
+  return -EACCES;
+}
+
+static int authenticate_cookie(struct tor_control *tc, const char *path){
+  unsigned char cookie[TOR_COOKIE_LEN];
+  char cmd[sizeof("AUTHENTICATE ") + 2*TOR_COOKIE_LEN];
+  ssize_t r;
+  int fd, i;
+
+  if((fd = cookie_open(path)) < 0) return fd;
+  r = read(fd, cookie, sizeof(cookie));
+  close(fd);
+  if(r != sizeof(cookie)) return -EINVAL;
+
+  strcpy(cmd, "AUTHENTICATE ");
+  for(i=0; i<TOR_COOKIE_LEN; i++){
+    sprintf(cmd + strlen("AUTHENTICATE ") + 2*i, "%02x", cookie[i]);
+  }
+
+  return tor_control_command(tc, cmd, NULL);
+}
+
+int tor_control_authenticate(struct tor_control *tc){
+  struct tor_control_msg *reply;
+  char methods[128], cookie_file[512], cmd[512];
+  const char *passwd = getenv("TOR_CONTROL_PASSWD");
+  int code;
+
+  code = tor_control_command(tc, "PROTOCOLINFO 1", &reply);
+  if(code < 0) return code;
+  if(code != 250){
+    free(reply);
+    return -EPROTO;
+  }
+
+  if(protocolinfo_value(reply->text, "METHODS=", methods, sizeof(methods)) < 0) methods[0] = 0;
+  if(protocolinfo_value(reply->text, "COOKIEFILE=", cookie_file, sizeof(cookie_file)) < 0) cookie_file[0] = 0;
+  free(reply);
+
+  if(strstr(methods, "NULL")){
+    code = tor_control_command(tc, "AUTHENTICATE", NULL);
+  } else if(strstr(methods, "COOKIE") && cookie_file[0]){
+    code = authenticate_cookie(tc, cookie_file);
+  } else if(strstr(methods, "HASHEDPASSWORD") && passwd && strlen(passwd) < sizeof(cmd) - 20 &&
+            !strpbrk(passwd, "\"\\\r\n")){
+    snprintf(cmd, sizeof(cmd), "AUTHENTICATE \"%s\"", passwd);
+    code = tor_control_command(tc, cmd, NULL);
+  } else{
+    return -EACCES;
+  }
+
+  if(code < 0) return code;
+  return code == 250 ? 0 : -EACCES;
+}
@@ -0,0 +1,52 @@
+/* **********************************************************************
+ * Client for tor's ControlPort
+ *
+ * Just enough of the control protocol for relay_pop's daemon mode:
+ * authenticate, issue commands and wait for asynchronous events.
+ * Events that arrive while a command waits for its reply are queued
+ * and handed out by tor_control_next_event() afterwards
+ **********************************************************************
+*/
+
+#ifndef TOR_CONTROL_H
+#define TOR_CONTROL_H
+
+#include <stddef.h>
+
+#define TOR_CONTROL_DEFAULT "127.0.0.1:9051"
+
+/* one event or reply, the "650"/"250" prefixes stripped, one line per
+ * line of the message and the data of multi-line entries included */
+struct tor_control_msg {
+  struct tor_control_msg *next;
+  int code;
+  size_t len;
+  char text[];
+};
+
+struct tor_control {
+  int fd;
+  char buf[16384];
+  size_t start, end;
+  struct tor_control_msg *events, **events_tail;
+};
+
+/* target is host:port, a port on 127.0.0.1 or the path of a unix
+ * socket. returns 0 or -errno */
+int tor_control_open(struct tor_control *tc, const char *target);
+void tor_control_close(struct tor_control *tc);
+
+/* NULL, COOKIE or, with TOR_CONTROL_PASSWD set, HASHEDPASSWORD. the
+ * cookie is only read from a running tor's own data directory */
+int tor_control_authenticate(struct tor_control *tc);
+
+/* send a command line without its CRLF and wait for the reply,
+ * returns the reply's status code or -errno. unless reply is NULL
+ * it is set to the reply, or NULL on error, which must be freed */
+int tor_control_command(struct tor_control *tc, const char *cmd, struct tor_control_msg **reply);
+
+/* blocks until the next event, returns 0 or -errno (-EPIPE once tor
+ * closed the connection). the event must be freed */
+int tor_control_next_event(struct tor_control *tc, struct tor_control_msg **event);
+
+#endif /* TOR_CONTROL_H */
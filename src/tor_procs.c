@@ -0,0 +1,102 @@
+/* **********************************************************************
+ * Discovery of tor processes
+ *
+ * Every <pid>/comm under the proc root is read, the name the kernel
+ * keeps for the process followed by a newline. A process's data
+ * directory is read from its environ and its user is the owner of
+ * its <pid> directory
+ **********************************************************************
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+#include "tor_procs.h"
+
+
+int tor_find_pids(const char *proc_root, const char *name, pid_t *pids, int max){
+  glob_t pglob;
+  size_t name_length = strlen(name), root_length = strlen(proc_root);
+  char pattern[512], *name_buf;
+  unsigned int i;
+  int n = 0;
+
+  snprintf(pattern, sizeof(pattern), "%s/*/comm", proc_root);
+  if(glob(pattern, 0, NULL, &pglob) != 0) return 0;
+
+  if((name_buf = malloc(name_length+2)) == NULL){
+    globfree(&pglob);
+    return 0;
+  }
+
+  for(i=0; i<pglob.gl_pathc && n<max; i++){
+    FILE *pid_comm;
+
+    if((pid_comm = fopen(pglob.gl_pathv[i], "r")) == NULL) continue;
+
+    if(fgets(name_buf, name_length+2, pid_comm) != NULL &&
+       strncmp(name_buf, name, name_length) == 0 && strcmp(name_buf + name_length, "\n") == 0){
+      pids[n++] = (pid_t) atoi(pglob.gl_pathv[i] + root_length + 1);
+    }
+
+    fclose(pid_comm);
+  }
+
+  free(name_buf);
+  globfree(&pglob);
+  return n;
+}
+
+
+void tor_data_dir(const char *proc_root, pid_t tor_pid, char *path, size_t size){
+  char environ_path[600], *env = NULL, *tmp, *var;
+  size_t len = 0, cap = 0;
+  ssize_t r;
+  int fd;
+
+  snprintf(path, size, "%s", TOR_DATA_DEFAULT);
+
+  snprintf(environ_path, sizeof(environ_path), "%s/%d/environ", proc_root, tor_pid);
+  if((fd = open(environ_path, O_RDONLY)) < 0) return;
+
+  /* the whole environment, NUL separated and NUL terminated */
+  do{
+    if(len + 1 >= cap){
+      cap = cap ? cap*2 : 4096;
+      if((tmp = realloc(env, cap)) == NULL) break;
+      env = tmp;
+    }
+    r = read(fd, env + len, cap - len - 1);
+    if(r > 0) len += r;
+  } while(r > 0);
+  close(fd);
+
+  if(!env) return;
+  env[len] = 0;
+
+  for(var = env; var < env + len; var += strlen(var) + 1){
+    if(!strncmp(var, TOR_DATA_ENV, strlen(TOR_DATA_ENV))){
+      snprintf(path, size, "%s", var + strlen(TOR_DATA_ENV));
+      break;
+    }
+  }
+
+  free(env);
+}
+
+int tor_proc_uid(const char *proc_root, pid_t pid, uid_t *uid){
+  char path[512];
+  struct stat st;
+
+  snprintf(path, sizeof(path), "%s/%d", proc_root, pid);
+  if(stat(path, &st) < 0) return -errno;
+
+  *uid = st.st_uid;
+  return 0;
+}
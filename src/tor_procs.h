@@ -0,0 +1,31 @@
+/* **********************************************************************
+ * Discovery of tor processes
+ *
+ * Processes are found by the name in their comm file under a proc
+ * root, /proc for relay_pop and a generated tree for the benchmarks
+ **********************************************************************
+*/
+
+#ifndef TOR_PROCS_H
+#define TOR_PROCS_H
+
+#include <sys/types.h>
+
+#define PROC_ROOT "/proc"
+
+/* where tor keeps its state unless its environment says otherwise */
+#define TOR_DATA_ENV "TOR_BROWSER_TOR_DATA_DIR="
+#define TOR_DATA_DEFAULT "/var/lib/tor"
+
+/* pids of the processes named name under proc_root, at most max.
+ * returns the number found */
+int tor_find_pids(const char *proc_root, const char *name, pid_t *pids, int max);
+
+/* data directory of the tor process tor_pid, its TOR_BROWSER_TOR_DATA_DIR
+ * or TOR_DATA_DEFAULT. path holds size bytes */
+void tor_data_dir(const char *proc_root, pid_t tor_pid, char *path, size_t size);
+
+/* user the process runs as. returns 0 or -errno */
+int tor_proc_uid(const char *proc_root, pid_t pid, uid_t *uid);
+
+#endif /* TOR_PROCS_H */
@@ -0,0 +1,205 @@
+/*
+ ***************************************************
+ *
+ * bypass prefix table
+ *
+ * destinations matching a bypass prefix are sent
+ * directly instead of through tor. the prefixes are
+ * compiled into a direct-index table on the top 16
+ * address bits, with 256 entry chunks below it for
+ * longer prefixes, so a lookup reads at most three
+ * entries however many prefixes are configured.
+ *
+ * like the relay set, every update builds a complete
+ * new table and swaps it in with one pointer store
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_BYPASS_H
+#define TORPROXY_BYPASS_H
+
+#include "torproxy_compat.h"
+#include "torproxy_genl.h"
+
+/* lookup result when no prefix matches, BYPASS_ACCEPT
+ * and BYPASS_PROXY are in torproxy_genl.h */
+#define BYPASS_NONE 0
+
+#define BYPASS_ROOT_BITS 16
+#define BYPASS_CHUNK_BITS 8
+#define BYPASS_CHUNK_SIZE (1U << BYPASS_CHUNK_BITS)
+
+/* a table entry either holds an action or, with this bit set,
+ * the offset of the chunk resolving the next 8 address bits */
+#define BYPASS_CHUNK 0x80000000U
+
+struct bypass_table {
+  unsigned int generation;
+
+  /* prefixes the table was built from, sorted by length */
+  unsigned int n_prefixes;
+  struct bypass_prefix *prefixes;
+
+  unsigned int n_chunks;
+  unsigned int max_chunks;
+  u32 *chunks;
+  u32 root[1 << BYPASS_ROOT_BITS];
+};
+
+
+/* action of the longest prefix holding addr, caller holds rcu_read_lock() */
+static inline u32 bypass_lookup(const struct bypass_table *t, __be32 addr){
+  u32 a = ntohl(addr), e;
+
+  if(!t) return BYPASS_NONE;
+
+  e = t->root[a >> 16];
+  if(e & BYPASS_CHUNK){
+    e = t->chunks[(e & ~BYPASS_CHUNK) + ((a >> 8) & 0xff)];
+    if(e & BYPASS_CHUNK){
+      e = t->chunks[(e & ~BYPASS_CHUNK) + (a & 0xff)];
+    }
+  }
+
+  return e;
+}
+
+static inline int bypass_prefix_valid(const struct bypass_prefix *p){
+  return p->len <= 32 && (p->action == BYPASS_ACCEPT || p->action == BYPASS_PROXY);
+}
+
+static inline u32 bypass_mask(unsigned int len){
+  return len ? ~0U << (32 - len) : 0;
+}
+
+/* prefixes are keyed on their masked address and length */
+static inline int bypass_prefix_same(const struct bypass_prefix *a, const struct bypass_prefix *b){
+  return a->len == b->len && !((a->addr ^ b->addr) & htonl(bypass_mask(a->len)));
+}
+
+/* shorter prefixes first so longer ones overwrite them, on
+ * a duplicate prefix sending it through tor wins */
+static inline int bypass_prefix_cmp(const void *a, const void *b){
+  const struct bypass_prefix *pa = a, *pb = b;
+
+  if(pa->len != pb->len) return pa->len - pb->len;
+  return pa->action - pb->action;
+}
+
+
+/* make room for n more chunks */
+static inline int bypass_reserve(struct bypass_table *t, unsigned int n){
+  unsigned int max = t->max_chunks ? t->max_chunks : 16;
+  u32 *chunks;
+
+  if(t->n_chunks + n <= t->max_chunks) return 0;
+
+  while(max < t->n_chunks + n) max *= 2;
+  chunks = vmalloc(max * BYPASS_CHUNK_SIZE * sizeof(u32));
+  if(!chunks) return -ENOMEM;
+
+  if(t->chunks){
+    memcpy(chunks, t->chunks, t->n_chunks * BYPASS_CHUNK_SIZE * sizeof(u32));
+    vfree(t->chunks);
+  }
+  t->chunks = chunks;
+  t->max_chunks = max;
+
+  return 0;
+}
+
+/* turn entry *e into a chunk inheriting its action, returns the chunk offset */
+static inline u32 bypass_expand(struct bypass_table *t, u32 *e){
+  u32 off, i;
+
+  if(*e & BYPASS_CHUNK) return *e & ~BYPASS_CHUNK;
+
+  off = t->n_chunks++ * BYPASS_CHUNK_SIZE;
+  for(i=0; i<BYPASS_CHUNK_SIZE; i++){
+    t->chunks[off + i] = *e;
+  }
+  *e = BYPASS_CHUNK | off;
+
+  return off;
+}
+
+static inline void bypass_fill(u32 *e, unsigned int n, u32 action){
+  while(n--) *e++ = action;
+}
+
+/* paint one prefix, every shorter prefix has already been added */
+static inline int bypass_table_add(struct bypass_table *t, const struct bypass_prefix *p){
+  u32 a = ntohl(p->addr) & bypass_mask(p->len), off;
+
+  if(p->len <= 16){
+    bypass_fill(&t->root[a >> 16], 1U << (16 - p->len), p->action);
+    return 0;
+  }
+
+  /* both levels are reserved up front so entry pointers stay valid */
+  if(bypass_reserve(t, 2) < 0) return -ENOMEM;
+
+  off = bypass_expand(t, &t->root[a >> 16]);
+  if(p->len <= 24){
+    bypass_fill(&t->chunks[off + ((a >> 8) & 0xff)], 1U << (24 - p->len), p->action);
+    return 0;
+  }
+
+  off = bypass_expand(t, &t->chunks[off + ((a >> 8) & 0xff)]);
+  bypass_fill(&t->chunks[off + (a & 0xff)], 1U << (32 - p->len), p->action);
+
+  return 0;
+}
+
+static inline void bypass_table_free(struct bypass_table *t){
+  if(!t) return;
+
+  vfree(t->chunks);
+  vfree(t->prefixes);
+  vfree(t);
+}
+
+/* compile a new generation, prefixes must have passed bypass_prefix_valid() */
+static inline struct bypass_table *bypass_table_build(const struct bypass_prefix *prefixes,
+    unsigned int n, unsigned int generation)
+{
+  struct bypass_table *t;
+  unsigned int i;
+
+  t = vzalloc(sizeof(*t));
+  if(!t) return NULL;
+
+  t->generation = generation;
+  t->n_prefixes = n;
+  t->prefixes = vmalloc((n ? n : 1) * sizeof(*prefixes));
+  if(!t->prefixes) goto err;
+
+  memcpy(t->prefixes, prefixes, n * sizeof(*prefixes));
+  sort(t->prefixes, n, sizeof(*prefixes), bypass_prefix_cmp, NULL);
+
+  for(i=0; i<n; i++){
+    if(bypass_table_add(t, &t->prefixes[i]) < 0) goto err;
+  }
+
+  return t;
+
+err:
+  bypass_table_free(t);
+  return NULL;
+}
+
+/* publish a new generation and free the old one once no reader
+ * can see it. caller serializes writers and may sleep */
+static inline void bypass_table_replace(struct bypass_table __rcu **head, struct bypass_table *t){
+  struct bypass_table *old;
+
+  old = rcu_dereference_protected(*head, 1);
+  rcu_assign_pointer(*head, t);
+  if(old){
+    synchronize_rcu();
+    bypass_table_free(old);
+  }
+}
+
+#endif /* TORPROXY_BYPASS_H */
@@ -0,0 +1,280 @@
+/*
+ ***************************************************
+ *
+ * kernel/userspace compatibility layer
+ *
+ * the packet path data structures are shared with the
+ * userspace benchmarks, this maps the few kernel
+ * primitives they need onto userspace equivalents
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_COMPAT_H
+#define TORPROXY_COMPAT_H
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/bitops.h>
+#include <asm/byteorder.h>
+
+#else
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <linux/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef unsigned int gfp_t;
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+#define kmalloc(size, flags) malloc(size)
+#define kzalloc(size, flags) calloc(1, size)
+#define kfree(ptr) free(ptr)
+#define vmalloc(size) malloc(size)
+#define vzalloc(size) calloc(1, size)
+#define vmalloc_user(size) calloc(1, size)
+#define vfree(ptr) free(ptr)
+#define is_vmalloc_addr(ptr) 0
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+/* slab caches */
+struct kmem_cache {
+  size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+    size_t align, unsigned long flags, void (*ctor)(void *))
+{
+  struct kmem_cache *c = malloc(sizeof(*c));
+
+  if(c) c->size = size;
+  return c;
+}
+
+#define kmem_cache_alloc(c, flags) malloc((c)->size)
+#define kmem_cache_free(c, ptr) free(ptr)
+#define kmem_cache_destroy(c) free(c)
+
+/* lock acquisitions of the calling thread, and how many of them
+ * had to wait for another thread, so benchmarks can show contention */
+extern __thread unsigned long lock_acquired, lock_contended;
+
+/* spinlocks, userspace has no bottom halves to disable */
+typedef pthread_spinlock_t spinlock_t;
+#define spin_lock_init(l) pthread_spin_init(l, PTHREAD_PROCESS_PRIVATE)
+
+static inline void spin_lock_bh(spinlock_t *l){
+  lock_acquired++;
+  if(pthread_spin_trylock(l)){
+    lock_contended++;
+    pthread_spin_lock(l);
+  }
+}
+
+static inline void spin_unlock_bh(spinlock_t *l){
+  pthread_spin_unlock(l);
+}
+
+/* atomics */
+typedef struct {
+  int counter;
+} atomic_t;
+
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_inc_return(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_inc(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec(v) __atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+
+/* time, jiffies tick in milliseconds */
+#define HZ 1000
+
+static inline unsigned long tp_jiffies(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec*HZ + ts.tv_nsec/(1000000000/HZ);
+}
+
+#define jiffies tp_jiffies()
+#define msecs_to_jiffies(ms) ((unsigned long) (ms))
+#define time_after(a, b) ((long) ((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+#define time_after_eq(a, b) ((long) ((a) - (b)) >= 0)
+
+static inline void get_random_bytes(void *buf, int n){
+  unsigned char *p = buf;
+
+  while(n--) *p++ = (unsigned char) random();
+}
+
+#define sort(base, num, size, cmp, swap) qsort(base, num, size, cmp)
+
+/* nanosecond clock for latency measurements */
+static inline u64 local_clock(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static inline int fls64(u64 x){
+  return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+/* per-cpu data, every thread takes the next of NR_CPUS slots on first
+ * use. slots lie PERCPU_STRIDE bytes apart so this_cpu_*() only needs
+ * the address of a field in slot 0, like the kernel's per-cpu offsets.
+ * threads beyond NR_CPUS share slots and may lose updates */
+#define NR_CPUS 64
+#define PERCPU_STRIDE 16384
+#define __percpu
+
+extern __thread unsigned int tp_cpu_slot;
+void tp_cpu_register(void);
+
+static inline size_t tp_percpu_offset(void){
+  if(unlikely(!tp_cpu_slot)) tp_cpu_register();
+  return (size_t) (tp_cpu_slot - 1) * PERCPU_STRIDE;
+}
+
+#define alloc_percpu(type) ((type *) (sizeof(type) <= PERCPU_STRIDE ? calloc(NR_CPUS, PERCPU_STRIDE) : NULL))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) ((__typeof__(ptr)) ((char *) (ptr) + (size_t) (cpu) * PERCPU_STRIDE))
+#define this_cpu_ptr(ptr) ((__typeof__(ptr)) ((char *) (ptr) + tp_percpu_offset()))
+#define this_cpu_add_return(pcp, v) (*(__typeof__(&(pcp))) ((char *) &(pcp) + tp_percpu_offset()) += (v))
+#define this_cpu_add(pcp, v) ((void) this_cpu_add_return(pcp, v))
+#define this_cpu_inc(pcp) this_cpu_add(pcp, 1)
+#define this_cpu_inc_return(pcp) this_cpu_add_return(pcp, 1)
+#define for_each_possible_cpu(cpu) for((cpu) = 0; (cpu) < NR_CPUS; (cpu)++)
+#define nr_cpu_ids NR_CPUS
+#define smp_processor_id() ((int) (tp_percpu_offset() / PERCPU_STRIDE))
+
+/* nothing interrupts a thread, slot sharing aside */
+#define local_irq_save(flags) ((void) (flags = 0))
+#define local_irq_restore(flags) ((void) (flags))
+
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* bob jenkins' hash, same as the kernel's jhash_3words */
+#define JHASH_INITVAL 0xdeadbeef
+
+static inline u32 rol32(u32 word, unsigned int shift){
+  return (word << shift) | (word >> ((-shift) & 31));
+}
+
+static inline u32 jhash_3words(u32 a, u32 b, u32 c, u32 initval){
+  a += JHASH_INITVAL;
+  b += JHASH_INITVAL;
+  c += initval;
+
+  c ^= b; c -= rol32(b, 14);
+  a ^= c; a -= rol32(c, 11);
+  b ^= a; b -= rol32(a, 25);
+  c ^= b; c -= rol32(b, 16);
+  a ^= c; a -= rol32(c, 4);
+  b ^= a; b -= rol32(a, 14);
+  c ^= b; c -= rol32(b, 24);
+
+  return c;
+}
+
+/* mutexes */
+struct mutex {
+  pthread_mutex_t lock;
+};
+#define DEFINE_MUTEX(name) struct mutex name = { PTHREAD_MUTEX_INITIALIZER }
+
+static inline void mutex_init(struct mutex *m){
+  pthread_mutex_init(&m->lock, NULL);
+}
+
+static inline void mutex_lock(struct mutex *m){
+  lock_acquired++;
+  if(pthread_mutex_trylock(&m->lock)){
+    lock_contended++;
+    pthread_mutex_lock(&m->lock);
+  }
+}
+
+static inline void mutex_unlock(struct mutex *m){
+  pthread_mutex_unlock(&m->lock);
+}
+
+/* rcu, memory barrier flavour: every reader thread publishes the
+ * grace period it started in, synchronize_rcu() waits for readers
+ * still inside an older one (implemented in bench/kshim.c) */
+struct rcu_head {
+  void *next;
+};
+
+struct rcu_reader {
+  unsigned long ctr;
+  struct rcu_reader *next;
+};
+
+#define __rcu
+
+extern unsigned long rcu_gp_ctr;
+extern __thread struct rcu_reader *rcu_self;
+void rcu_register_thread(void);
+void synchronize_rcu(void);
+
+static inline void rcu_read_lock(void){
+  if(unlikely(!rcu_self)) rcu_register_thread();
+  __atomic_store_n(&rcu_self->ctr, __atomic_load_n(&rcu_gp_ctr, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_unlock(void){
+  __atomic_store_n(&rcu_self->ctr, 0, __ATOMIC_RELEASE);
+}
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_access_pointer(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+#define kfree_rcu(ptr, field) do{ synchronize_rcu(); free(ptr); }while(0)
+#define call_rcu(head, func) do{ synchronize_rcu(); (func)(head); }while(0)
+#define rcu_barrier() do{ }while(0)
+
+#endif /* __KERNEL__ */
+
+#endif /* TORPROXY_COMPAT_H */
@@ -0,0 +1,754 @@
+/*
+ ***************************************************
+ *
+ * generic netlink control plane
+ *
+ * an update is applied to private copies of the
+ * relay, bypass and endpoint tables, their ipv6
+ * counterparts, the gateway interfaces and their
+ * endpoints and the steering policy, which are then
+ * rebuilt and published together under one new
+ * generation. a malformed operation, a generation
+ * mismatch or a failed allocation leaves every
+ * table as it was. see torproxy_genl.h for the
+ * messages.
+ *
+ * every request reads and updates the tables of the
+ * sender's network namespace, and needs CAP_NET_ADMIN
+ * in the user namespace owning it. the relay and
+ * bypass tables of the initial namespace can also
+ * be loaded from a snapshot at insert
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_CONTROL_H
+#define TORPROXY_CONTROL_H
+
+#include <net/genetlink.h>
+
+#include "torproxy_hook.h"
+#include "torproxy_hook6.h"
+#include "torproxy_gateway.h"
+#include "torproxy_genl.h"
+#include "torproxy_snapshot.h"
+
+/* working copy of the tables while an update is applied */
+struct config_edit {
+  __be32 *relays;
+  unsigned int n_relays;
+  int relays_changed;
+
+  struct bypass_prefix *prefixes;
+  unsigned int n_prefixes;
+  int bypass_changed;
+
+  struct torproxy_endpoint endpoints[TOR_MAX_ENDPOINTS];
+  unsigned int n_endpoints;
+  int endpoints_changed;
+
+  struct in6_addr *relays6;
+  unsigned int n_relays6;
+  int relays6_changed;
+
+  struct bypass_prefix6 *prefixes6;
+  unsigned int n_prefixes6;
+  int bypass6_changed;
+
+  struct torproxy_endpoint6 endpoints6[TOR_MAX_ENDPOINTS];
+  unsigned int n_endpoints6;
+  int endpoints6_changed;
+
+  u32 gateways[GATEWAY_MAX_IFACES];
+  unsigned int n_gateways;
+  int gateways_changed;
+
+  struct torproxy_endpoint gateway_endpoints[TOR_MAX_ENDPOINTS];
+  unsigned int n_gateway_endpoints;
+  int gateway_endpoints_changed;
+
+  struct torproxy_policy *policy;
+  unsigned int n_policy;
+  int policy_changed;
+};
+
+/* one table as seen by config_apply() */
+struct config_table {
+  void *entries;
+  unsigned int *n;
+  unsigned int max;
+  size_t size;
+  int (*same)(const void *a, const void *b);
+  int (*valid)(const void *entry);
+};
+
+
+static int relay_same(const void *a, const void *b){
+  return *(const __be32 *) a == *(const __be32 *) b;
+}
+
+static int relay_valid(const void *entry){
+  __be32 addr = *(const __be32 *) entry;
+
+  return addr != RELAY_SLOT_EMPTY && addr != RELAY_SLOT_UNSET;
+}
+
+static int prefix_same(const void *a, const void *b){
+  return bypass_prefix_same(a, b);
+}
+
+static int prefix_valid(const void *entry){
+  return bypass_prefix_valid(entry);
+}
+
+static int endpoint_same(const void *a, const void *b){
+  const struct torproxy_endpoint *ea = a, *eb = b;
+
+  return ea->addr == eb->addr && ea->trans_port == eb->trans_port && ea->dns_port == eb->dns_port;
+}
+
+static int endpoint_valid(const void *entry){
+  const struct torproxy_endpoint *ep = entry;
+
+  return ep->addr && ep->trans_port && ep->dns_port && ep->weight <= TOR_MAX_WEIGHT;
+}
+
+static int relay6_same(const void *a, const void *b){
+  return ipv6_addr_equal(a, b);
+}
+
+static int relay6_valid(const void *entry){
+  return !ipv6_addr_any(entry);
+}
+
+static int prefix6_same(const void *a, const void *b){
+  return bypass_prefix6_same(a, b);
+}
+
+static int prefix6_valid(const void *entry){
+  return bypass_prefix6_valid(entry);
+}
+
+static int endpoint6_same(const void *a, const void *b){
+  const struct torproxy_endpoint6 *ea = a, *eb = b;
+
+  return ipv6_addr_equal(in6(ea->addr), in6(eb->addr)) &&
+         ea->trans_port == eb->trans_port && ea->dns_port == eb->dns_port;
+}
+
+static int endpoint6_valid(const void *entry){
+  const struct torproxy_endpoint6 *ep = entry;
+
+  return !ipv6_addr_any(in6(ep->addr)) && ep->trans_port && ep->dns_port && ep->weight <= TOR_MAX_WEIGHT;
+}
+
+static int gateway_same(const void *a, const void *b){
+  return *(const u32 *) a == *(const u32 *) b;
+}
+
+/* the interface need not exist yet, indexes are never 0 */
+static int gateway_valid(const void *entry){
+  return *(const u32 *) entry != 0;
+}
+
+/* the clients' packets are NAT'd before routing, where loopback is martian */
+static int gateway_endpoint_valid(const void *entry){
+  const struct torproxy_endpoint *ep = entry;
+
+  return endpoint_valid(entry) && !ipv4_is_loopback(ep->addr);
+}
+
+static int policy_rule_same(const void *a, const void *b){
+  return policy_same(a, b);
+}
+
+static int policy_rule_valid(const void *entry){
+  return policy_valid(entry);
+}
+
+
+/* apply one add/remove/replace operation to a table copy */
+static int config_apply(struct config_table *t, u8 code, const void *items, unsigned int n_items){
+  const char *item;
+  char *entry;
+  unsigned int i, j;
+
+  for(i=0; i<n_items; i++){
+    if(!t->valid((const char *) items + i*t->size)) return -EINVAL;
+  }
+
+  if(code == TORPROXY_OP_REPLACE){
+    if(n_items > t->max) return -ENOSPC;
+    memcpy(t->entries, items, n_items * t->size);
+    *t->n = n_items;
+    return 0;
+  }
+
+  for(i=0; i<n_items; i++){
+    item = (const char *) items + i*t->size;
+
+    for(j=0; j<*t->n; j++){
+      entry = (char *) t->entries + j*t->size;
+      if(t->same(entry, item)) break;
+    }
+
+    if(code == TORPROXY_OP_ADD){
+      if(j == *t->n){
+        if(*t->n == t->max) return -ENOSPC;
+        (*t->n)++;
+      }
+      memcpy((char *) t->entries + j*t->size, item, t->size);
+    } else if(code == TORPROXY_OP_REMOVE){
+      if(j == *t->n) continue;
+      (*t->n)--;
+      memmove((char *) t->entries + j*t->size, (char *) t->entries + (j+1)*t->size,
+              (*t->n - j) * t->size);
+    } else{
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+static const struct nla_policy torproxy_op_policy[TORPROXY_OP_A_MAX+1] = {
+  [TORPROXY_OP_A_CODE] = { .type = NLA_U8 },
+  [TORPROXY_OP_A_RELAYS] = { .type = NLA_BINARY },
+  [TORPROXY_OP_A_PREFIXES] = { .type = NLA_BINARY },
+  [TORPROXY_OP_A_ENDPOINTS] = { .type = NLA_BINARY },
+  [TORPROXY_OP_A_RELAYS6] = { .type = NLA_BINARY },
+  [TORPROXY_OP_A_PREFIXES6] = { .type = NLA_BINARY },
+  [TORPROXY_OP_A_ENDPOINTS6] = { .type = NLA_BINARY },
+  [TORPROXY_OP_A_GATEWAYS] = { .type = NLA_BINARY },
+  [TORPROXY_OP_A_POLICY] = { .type = NLA_BINARY },
+  [TORPROXY_OP_A_GATEWAY_ENDPOINTS] = { .type = NLA_BINARY },
+};
+
+/* the working copy of the table an operation attribute edits */
+static int config_edit_table(struct config_edit *edit, int type, struct config_table *t){
+  switch(type){
+    case TORPROXY_OP_A_RELAYS:
+      *t = (struct config_table) { edit->relays, &edit->n_relays, RELAY_MAX_ADDRS,
+                                   sizeof(__be32), relay_same, relay_valid };
+      edit->relays_changed = 1;
+      return 0;
+    case TORPROXY_OP_A_PREFIXES:
+      *t = (struct config_table) { edit->prefixes, &edit->n_prefixes, BYPASS_MAX_PREFIXES,
+                                   sizeof(struct bypass_prefix), prefix_same, prefix_valid };
+      edit->bypass_changed = 1;
+      return 0;
+    case TORPROXY_OP_A_ENDPOINTS:
+      *t = (struct config_table) { edit->endpoints, &edit->n_endpoints, TOR_MAX_ENDPOINTS,
+                                   sizeof(struct torproxy_endpoint), endpoint_same, endpoint_valid };
+      edit->endpoints_changed = 1;
+      return 0;
+    case TORPROXY_OP_A_RELAYS6:
+      *t = (struct config_table) { edit->relays6, &edit->n_relays6, RELAY6_MAX_ADDRS,
+                                   sizeof(struct in6_addr), relay6_same, relay6_valid };
+      edit->relays6_changed = 1;
+      return 0;
+    case TORPROXY_OP_A_PREFIXES6:
+      *t = (struct config_table) { edit->prefixes6, &edit->n_prefixes6, BYPASS6_MAX_PREFIXES,
+                                   sizeof(struct bypass_prefix6), prefix6_same, prefix6_valid };
+      edit->bypass6_changed = 1;
+      return 0;
+    case TORPROXY_OP_A_ENDPOINTS6:
+      *t = (struct config_table) { edit->endpoints6, &edit->n_endpoints6, TOR_MAX_ENDPOINTS,
+                                   sizeof(struct torproxy_endpoint6), endpoint6_same, endpoint6_valid };
+      edit->endpoints6_changed = 1;
+      return 0;
+    case TORPROXY_OP_A_GATEWAYS:
+      *t = (struct config_table) { edit->gateways, &edit->n_gateways, GATEWAY_MAX_IFACES,
+                                   sizeof(u32), gateway_same, gateway_valid };
+      edit->gateways_changed = 1;
+      return 0;
+    case TORPROXY_OP_A_POLICY:
+      *t = (struct config_table) { edit->policy, &edit->n_policy, POLICY_MAX_RULES,
+                                   sizeof(struct torproxy_policy), policy_rule_same, policy_rule_valid };
+      edit->policy_changed = 1;
+      return 0;
+    case TORPROXY_OP_A_GATEWAY_ENDPOINTS:
+      *t = (struct config_table) { edit->gateway_endpoints, &edit->n_gateway_endpoints, TOR_MAX_ENDPOINTS,
+                                   sizeof(struct torproxy_endpoint), endpoint_same, gateway_endpoint_valid };
+      edit->gateway_endpoints_changed = 1;
+      return 0;
+    default:
+      return -EINVAL;
+  }
+}
+
+/* parse one TORPROXY_A_OP and apply it to the working copy */
+static int config_edit_op(struct config_edit *edit, const struct nlattr *op){
+  struct nlattr *tb[TORPROXY_OP_A_MAX+1];
+  struct config_table t;
+  int err, type;
+
+  err = nla_parse_nested(tb, TORPROXY_OP_A_MAX, op, torproxy_op_policy);
+  if(err < 0) return err;
+  if(!tb[TORPROXY_OP_A_CODE]) return -EINVAL;
+
+  /* the first table attribute is the one edited */
+  for(type = TORPROXY_OP_A_CODE + 1; type <= TORPROXY_OP_A_MAX && !tb[type]; type++);
+
+  err = config_edit_table(edit, type, &t);
+  if(err < 0) return err;
+
+  if(nla_len(tb[type]) % t.size) return -EINVAL;
+
+  return config_apply(&t, nla_get_u8(tb[TORPROXY_OP_A_CODE]), nla_data(tb[type]), nla_len(tb[type]) / t.size);
+}
+
+static void config_edit_free(struct config_edit *edit){
+  vfree(edit->relays);
+  vfree(edit->prefixes);
+  vfree(edit->relays6);
+  vfree(edit->prefixes6);
+  vfree(edit->policy);
+}
+
+/* working copy of the published tables, caller holds tn->config_lock */
+static int config_edit_init(struct torproxy_net *tn, struct config_edit *edit){
+  struct relay_set *rs = rcu_dereference_protected(tn->relays, lockdep_is_held(&tn->config_lock));
+  struct bypass_table *bt = rcu_dereference_protected(tn->bypass, lockdep_is_held(&tn->config_lock));
+  struct endpoint_set *es = rcu_dereference_protected(tn->endpoints, lockdep_is_held(&tn->config_lock));
+  struct relay6_set *rs6 = rcu_dereference_protected(tn->relays6, lockdep_is_held(&tn->config_lock));
+  struct bypass6_table *bt6 = rcu_dereference_protected(tn->bypass6, lockdep_is_held(&tn->config_lock));
+  struct endpoint6_set *es6 = rcu_dereference_protected(tn->endpoints6, lockdep_is_held(&tn->config_lock));
+  struct gateway_set *gs = rcu_dereference_protected(tn->gateways, lockdep_is_held(&tn->config_lock));
+  struct endpoint_set *ges = rcu_dereference_protected(tn->gateway_endpoints, lockdep_is_held(&tn->config_lock));
+  struct policy_set *ps = rcu_dereference_protected(tn->policy, lockdep_is_held(&tn->config_lock));
+
+  memset(edit, 0, sizeof(*edit));
+
+  edit->relays = vmalloc(RELAY_MAX_ADDRS * sizeof(__be32));
+  edit->prefixes = vmalloc(BYPASS_MAX_PREFIXES * sizeof(struct bypass_prefix));
+  edit->relays6 = vmalloc(RELAY6_MAX_ADDRS * sizeof(struct in6_addr));
+  edit->prefixes6 = vmalloc(BYPASS6_MAX_PREFIXES * sizeof(struct bypass_prefix6));
+  edit->policy = vmalloc(POLICY_MAX_RULES * sizeof(struct torproxy_policy));
+  if(!edit->relays || !edit->prefixes || !edit->relays6 || !edit->prefixes6 || !edit->policy){
+    config_edit_free(edit);
+    return -ENOMEM;
+  }
+
+  if(rs){
+    edit->n_relays = rs->count;
+    memcpy(edit->relays, rs->addrs, rs->count * sizeof(__be32));
+  }
+  if(bt){
+    edit->n_prefixes = bt->n_prefixes;
+    memcpy(edit->prefixes, bt->prefixes, bt->n_prefixes * sizeof(struct bypass_prefix));
+  }
+  edit->n_endpoints = es->count;
+  memcpy(edit->endpoints, es->ep, es->count * sizeof(struct torproxy_endpoint));
+
+  if(rs6){
+    edit->n_relays6 = rs6->count;
+    memcpy(edit->relays6, rs6->addrs, rs6->count * sizeof(struct in6_addr));
+  }
+  if(bt6){
+    edit->n_prefixes6 = bt6->n_prefixes;
+    memcpy(edit->prefixes6, bt6->prefixes, bt6->n_prefixes * sizeof(struct bypass_prefix6));
+  }
+  if(es6){
+    edit->n_endpoints6 = es6->count;
+    memcpy(edit->endpoints6, es6->ep, es6->count * sizeof(struct torproxy_endpoint6));
+  }
+  if(gs){
+    edit->n_gateways = gs->count;
+    memcpy(edit->gateways, gs->ifindex, gs->count * sizeof(u32));
+  }
+  if(ges){
+    edit->n_gateway_endpoints = ges->count;
+    memcpy(edit->gateway_endpoints, ges->ep, ges->count * sizeof(struct torproxy_endpoint));
+  }
+  if(ps){
+    edit->n_policy = ps->count;
+    memcpy(edit->policy, ps->rules, ps->count * sizeof(struct torproxy_policy));
+  }
+
+  return 0;
+}
+
+/* build every changed table and publish them all, caller holds tn->config_lock */
+static int config_edit_commit(struct torproxy_net *tn, struct config_edit *edit, unsigned int generation){
+  struct relay_set *rs = NULL;
+  struct bypass_table *bt = NULL;
+  struct endpoint_set *es = NULL;
+  struct relay6_set *rs6 = NULL;
+  struct bypass6_table *bt6 = NULL;
+  struct endpoint6_set *es6 = NULL;
+  struct gateway_set *gs = NULL;
+  struct endpoint_set *ges = NULL;
+  struct policy_set *ps = NULL;
+
+  /* there has to be somewhere to send new traffic, ipv6 may have nowhere */
+  if(edit->endpoints_changed && !endpoints_active(edit->endpoints, edit->n_endpoints)) return -EINVAL;
+  if(edit->endpoints6_changed && edit->n_endpoints6 &&
+     !endpoints6_active(edit->endpoints6, edit->n_endpoints6)) return -EINVAL;
+
+  /* and for the LAN clients while there are gateway interfaces */
+  if(edit->n_gateways && !endpoints_active(edit->gateway_endpoints, edit->n_gateway_endpoints)) return -EINVAL;
+  if(edit->gateway_endpoints_changed && edit->n_gateway_endpoints &&
+     !endpoints_active(edit->gateway_endpoints, edit->n_gateway_endpoints)) return -EINVAL;
+
+  /* DNS replies are recognised by the endpoint they come from */
+  if(edit->policy_changed && policy_endpoint_count(edit->policy, edit->n_policy) > TOR_MAX_ENDPOINTS) return -ENOSPC;
+
+  if(edit->relays_changed){
+    rs = relay_set_build(edit->relays, edit->n_relays, generation);
+    if(!rs) goto err;
+  }
+  if(edit->bypass_changed){
+    bt = bypass_table_build(edit->prefixes, edit->n_prefixes, generation);
+    if(!bt) goto err;
+  }
+  if(edit->endpoints_changed){
+    es = endpoint_set_build(edit->endpoints, edit->n_endpoints, generation, GFP_KERNEL);
+    if(!es) goto err;
+  }
+  if(edit->relays6_changed){
+    rs6 = relay6_set_build(edit->relays6, edit->n_relays6, generation);
+    if(!rs6) goto err;
+  }
+  if(edit->bypass6_changed){
+    bt6 = bypass6_table_build(edit->prefixes6, edit->n_prefixes6, generation);
+    if(!bt6) goto err;
+  }
+  if(edit->endpoints6_changed && edit->n_endpoints6){
+    es6 = endpoint6_set_build(edit->endpoints6, edit->n_endpoints6, generation, GFP_KERNEL);
+    if(!es6) goto err;
+  }
+  if(edit->gateways_changed && edit->n_gateways){
+    gs = gateway_set_build(edit->gateways, edit->n_gateways, generation, GFP_KERNEL);
+    if(!gs) goto err;
+  }
+  if(edit->gateway_endpoints_changed && edit->n_gateway_endpoints){
+    ges = endpoint_set_build(edit->gateway_endpoints, edit->n_gateway_endpoints, generation, GFP_KERNEL);
+    if(!ges) goto err;
+  }
+  if(edit->policy_changed && edit->n_policy){
+    ps = policy_set_build(edit->policy, edit->n_policy, generation, GFP_KERNEL);
+    if(!ps) goto err;
+  }
+
+  if(rs){
+    relay_set_replace(&tn->relays, rs);
+    /* cached flows were checked against the old set, their conntrack
+     * references are dropped now rather than when they go idle */
+    flow_table_flush(&tn->flows);
+  }
+  if(bt) bypass_table_replace(&tn->bypass, bt);
+  if(es) endpoint_set_replace(&tn->endpoints, es);
+  if(rs6) relay6_set_replace(&tn->relays6, rs6);
+  if(bt6) bypass6_table_replace(&tn->bypass6, bt6);
+  if(edit->endpoints6_changed) endpoint6_set_replace(&tn->endpoints6, es6);
+  if(edit->gateways_changed) gateway_set_replace(&tn->gateways, gs);
+  if(edit->gateway_endpoints_changed) endpoint_set_replace(&tn->gateway_endpoints, ges);
+  if(edit->policy_changed) policy_set_replace(&tn->policy, ps);
+
+  return 0;
+
+err:
+  if(rs) relay_set_free(rs);
+  bypass_table_free(bt);
+  kfree(es);
+  if(rs6) relay6_set_free(rs6);
+  kfree(bt6);
+  kfree(es6);
+  kfree(gs);
+  kfree(ges);
+  kfree(ps);
+  return -ENOMEM;
+}
+
+
+/* replace the relay and bypass tables with a snapshot snapshot_check()
+ * accepted, like an update would. the other tables are left alone */
+static int config_load_snapshot(struct torproxy_net *tn, const void *buf){
+  static const int types[] = { TORPROXY_OP_A_RELAYS, TORPROXY_OP_A_PREFIXES,
+                               TORPROXY_OP_A_RELAYS6, TORPROXY_OP_A_PREFIXES6 };
+  const struct torproxy_snapshot_header *hdr = buf;
+  const unsigned int n[] = { hdr->n_relays, hdr->n_prefixes, hdr->n_relays6, hdr->n_prefixes6 };
+  const char *items = (const char *) buf + hdr->header_size;
+  struct config_edit edit;
+  struct config_table t;
+  int err, i;
+
+  mutex_lock(&tn->config_lock);
+
+  err = config_edit_init(tn, &edit);
+  if(err < 0){
+    mutex_unlock(&tn->config_lock);
+    return err;
+  }
+
+  for(i=0; i<ARRAY_SIZE(types); i++){
+    config_edit_table(&edit, types[i], &t);
+    err = config_apply(&t, TORPROXY_OP_REPLACE, items, n[i]);
+    if(err < 0) break;
+    items += n[i] * t.size;
+  }
+
+  if(err == 0) err = config_edit_commit(tn, &edit, tn->config_generation + 1);
+  if(err == 0) tn->config_generation++;
+
+  mutex_unlock(&tn->config_lock);
+  config_edit_free(&edit);
+
+  return err;
+}
+
+
+static struct genl_family torproxy_genl_family = {
+  .id = GENL_ID_GENERATE,
+  .hdrsize = 0,
+  .name = TORPROXY_GENL_NAME,
+  .version = TORPROXY_GENL_VERSION,
+  .maxattr = TORPROXY_A_MAX,
+  .netnsok = true,
+};
+
+static const struct nla_policy torproxy_genl_policy[TORPROXY_A_MAX+1] = {
+  [TORPROXY_A_GENERATION] = { .type = NLA_U32 },
+  [TORPROXY_A_OPS] = { .type = NLA_NESTED },
+};
+
+/* CAP_NET_ADMIN over the namespace being configured, so a
+ * container's root can configure its own namespace only */
+static int torproxy_genl_capable(struct sk_buff *skb, struct genl_info *info){
+  return netlink_ns_capable(skb, genl_info_net(info)->user_ns, CAP_NET_ADMIN);
+}
+
+/* reply carrying the generation, and every table for TORPROXY_CMD_GET */
+static int torproxy_genl_reply(struct torproxy_net *tn, struct genl_info *info, u8 cmd){
+  struct relay_set *rs;
+  struct bypass_table *bt;
+  struct endpoint_set *es;
+  struct relay6_set *rs6;
+  struct bypass6_table *bt6;
+  struct endpoint6_set *es6;
+  struct gateway_set *gs;
+  struct endpoint_set *ges;
+  struct policy_set *ps;
+  struct sk_buff *msg;
+  void *hdr;
+  size_t size = nla_total_size(sizeof(u32));
+
+  rs = rcu_dereference_protected(tn->relays, lockdep_is_held(&tn->config_lock));
+  bt = rcu_dereference_protected(tn->bypass, lockdep_is_held(&tn->config_lock));
+  es = rcu_dereference_protected(tn->endpoints, lockdep_is_held(&tn->config_lock));
+  rs6 = rcu_dereference_protected(tn->relays6, lockdep_is_held(&tn->config_lock));
+  bt6 = rcu_dereference_protected(tn->bypass6, lockdep_is_held(&tn->config_lock));
+  es6 = rcu_dereference_protected(tn->endpoints6, lockdep_is_held(&tn->config_lock));
+  gs = rcu_dereference_protected(tn->gateways, lockdep_is_held(&tn->config_lock));
+  ges = rcu_dereference_protected(tn->gateway_endpoints, lockdep_is_held(&tn->config_lock));
+  ps = rcu_dereference_protected(tn->policy, lockdep_is_held(&tn->config_lock));
+
+  if(cmd == TORPROXY_CMD_GET){
+    size += nla_total_size((rs ? rs->count : 0) * sizeof(__be32)) +
+            nla_total_size((bt ? bt->n_prefixes : 0) * sizeof(struct bypass_prefix)) +
+            nla_total_size(TOR_MAX_ENDPOINTS * sizeof(struct torproxy_endpoint)) +
+            nla_total_size((rs6 ? rs6->count : 0) * sizeof(struct in6_addr)) +
+            nla_total_size((bt6 ? bt6->n_prefixes : 0) * sizeof(struct bypass_prefix6)) +
+            nla_total_size(TOR_MAX_ENDPOINTS * sizeof(struct torproxy_endpoint6)) +
+            nla_total_size(GATEWAY_MAX_IFACES * sizeof(u32)) +
+            nla_total_size((ps ? ps->count : 0) * sizeof(struct torproxy_policy)) +
+            nla_total_size(TOR_MAX_ENDPOINTS * sizeof(struct torproxy_endpoint));
+  }
+
+  msg = genlmsg_new(size, GFP_KERNEL);
+  if(!msg) return -ENOMEM;
+
+  hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq, &torproxy_genl_family, 0, cmd);
+  if(!hdr) goto err;
+
+  if(nla_put_u32(msg, TORPROXY_A_GENERATION, tn->config_generation)) goto err;
+
+  if(cmd == TORPROXY_CMD_GET){
+    if(nla_put(msg, TORPROXY_A_RELAYS, rs ? rs->count * sizeof(__be32) : 0, rs ? rs->addrs : NULL) ||
+       nla_put(msg, TORPROXY_A_PREFIXES, bt ? bt->n_prefixes * sizeof(struct bypass_prefix) : 0,
+               bt ? bt->prefixes : NULL) ||
+       nla_put(msg, TORPROXY_A_ENDPOINTS, es->count * sizeof(struct torproxy_endpoint), es->ep) ||
+       nla_put(msg, TORPROXY_A_RELAYS6, rs6 ? rs6->count * sizeof(struct in6_addr) : 0,
+               rs6 ? rs6->addrs : NULL) ||
+       nla_put(msg, TORPROXY_A_PREFIXES6, bt6 ? bt6->n_prefixes * sizeof(struct bypass_prefix6) : 0,
+               bt6 ? bt6->prefixes : NULL) ||
+       nla_put(msg, TORPROXY_A_ENDPOINTS6, es6 ? es6->count * sizeof(struct torproxy_endpoint6) : 0,
+               es6 ? es6->ep : NULL) ||
+       nla_put(msg, TORPROXY_A_GATEWAYS, gs ? gs->count * sizeof(u32) : 0, gs ? gs->ifindex : NULL) ||
+       nla_put(msg, TORPROXY_A_POLICY, ps ? ps->count * sizeof(struct torproxy_policy) : 0,
+               ps ? ps->rules : NULL) ||
+       nla_put(msg, TORPROXY_A_GATEWAY_ENDPOINTS, ges ? ges->count * sizeof(struct torproxy_endpoint) : 0,
+               ges ? ges->ep : NULL)){
+      goto err;
+    }
+  }
+
+  genlmsg_end(msg, hdr);
+  return genlmsg_reply(msg, info);
+
+err:
+  nlmsg_free(msg);
+  return -EMSGSIZE;
+}
+
+/* TORPROXY_CMD_UPDATE, applies every operation or none */
+static int torproxy_cmd_update(struct sk_buff *skb, struct genl_info *info){
+  struct torproxy_net *tn = torproxy_pernet(genl_info_net(info));
+  struct config_edit edit;
+  struct nlattr *op;
+  int err, rem;
+
+  if(!torproxy_genl_capable(skb, info)) return -EPERM;
+
+  mutex_lock(&tn->config_lock);
+
+  /* the sender built its update against another generation */
+  if(info->attrs[TORPROXY_A_GENERATION] &&
+     nla_get_u32(info->attrs[TORPROXY_A_GENERATION]) != tn->config_generation){
+    mutex_unlock(&tn->config_lock);
+    return -ESTALE;
+  }
+
+  err = config_edit_init(tn, &edit);
+  if(err < 0){
+    mutex_unlock(&tn->config_lock);
+    return err;
+  }
+
+  if(info->attrs[TORPROXY_A_OPS]){
+    nla_for_each_nested(op, info->attrs[TORPROXY_A_OPS], rem){
+      if(nla_type(op) != TORPROXY_A_OP){
+        err = -EINVAL;
+        break;
+      }
+      err = config_edit_op(&edit, op);
+      if(err < 0) break;
+    }
+  }
+
+  if(err == 0) err = config_edit_commit(tn, &edit, tn->config_generation + 1);
+  if(err == 0){
+    tn->config_generation++;
+    err = torproxy_genl_reply(tn, info, TORPROXY_CMD_UPDATE);
+  }
+
+  mutex_unlock(&tn->config_lock);
+  config_edit_free(&edit);
+
+  return err;
+}
+
+/* TORPROXY_CMD_GET */
+static int torproxy_cmd_get(struct sk_buff *skb, struct genl_info *info){
+  struct torproxy_net *tn = torproxy_pernet(genl_info_net(info));
+  int err;
+
+  if(!torproxy_genl_capable(skb, info)) return -EPERM;
+
+  mutex_lock(&tn->config_lock);
+  err = torproxy_genl_reply(tn, info, TORPROXY_CMD_GET);
+  mutex_unlock(&tn->config_lock);
+
+  return err;
+}
+
+/* TORPROXY_CMD_STATS, counters summed over every cpu and namespace */
+static int torproxy_cmd_stats(struct sk_buff *skb, struct genl_info *info){
+  u64 verdicts[TORPROXY_STAT_MAX];
+  u64 latency[TORPROXY_HOOK_MAX][TORPROXY_LATENCY_BUCKETS];
+  struct sk_buff *msg;
+  void *hdr;
+
+  if(!torproxy_genl_capable(skb, info)) return -EPERM;
+
+  stats_read(verdicts, latency);
+
+  msg = genlmsg_new(nla_total_size(sizeof(verdicts)) + nla_total_size(sizeof(latency)), GFP_KERNEL);
+  if(!msg) return -ENOMEM;
+
+  hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq, &torproxy_genl_family, 0, TORPROXY_CMD_STATS);
+  if(!hdr ||
+     nla_put(msg, TORPROXY_A_STATS, sizeof(verdicts), verdicts) ||
+     nla_put(msg, TORPROXY_A_LATENCY, sizeof(latency), latency)){
+    nlmsg_free(msg);
+    return -EMSGSIZE;
+  }
+
+  genlmsg_end(msg, hdr);
+  return genlmsg_reply(msg, info);
+}
+
+static const struct genl_ops torproxy_genl_ops[] = {
+  {
+    .cmd = TORPROXY_CMD_UPDATE,
+    .policy = torproxy_genl_policy,
+    .doit = torproxy_cmd_update,
+  },
+  {
+    .cmd = TORPROXY_CMD_GET,
+    .policy = torproxy_genl_policy,
+    .doit = torproxy_cmd_get,
+  },
+  {
+    .cmd = TORPROXY_CMD_STATS,
+    .policy = torproxy_genl_policy,
+    .doit = torproxy_cmd_stats,
+  },
+};
+
+
+/* publish the default tables as generation 1, ipv6 has no
+ * endpoint, gateway mode is off without endpoints of its
+ * own and there is no policy */
+static int config_init(struct torproxy_net *tn){
+  struct bypass_table *bt;
+  struct endpoint_set *es;
+  struct bypass6_table *bt6;
+
+  mutex_init(&tn->config_lock);
+  tn->config_generation = 1;
+
+  bt = bypass_table_default(tn->config_generation);
+  es = endpoint_set_default(tn->config_generation);
+  bt6 = bypass6_table_default(tn->config_generation);
+  if(!bt || !es || !bt6){
+    bypass_table_free(bt);
+    kfree(es);
+    kfree(bt6);
+    return -ENOMEM;
+  }
+
+  RCU_INIT_POINTER(tn->relays, NULL);
+  RCU_INIT_POINTER(tn->bypass, bt);
+  RCU_INIT_POINTER(tn->endpoints, es);
+  RCU_INIT_POINTER(tn->relays6, NULL);
+  RCU_INIT_POINTER(tn->bypass6, bt6);
+  RCU_INIT_POINTER(tn->endpoints6, NULL);
+  RCU_INIT_POINTER(tn->gateways, NULL);
+  RCU_INIT_POINTER(tn->gateway_endpoints, NULL);
+  RCU_INIT_POINTER(tn->policy, NULL);
+
+  return 0;
+}
+
+/* the namespace is going away or the hooks are unregistered,
+ * no reader can still see the tables */
+static void config_destroy(struct torproxy_net *tn){
+  struct relay_set *rs = rcu_dereference_protected(tn->relays, 1);
+  struct endpoint_set *es = rcu_dereference_protected(tn->endpoints, 1);
+  struct relay6_set *rs6 = rcu_dereference_protected(tn->relays6, 1);
+  struct endpoint_set *ges = rcu_dereference_protected(tn->gateway_endpoints, 1);
+
+  if(rs) relay_set_free(rs);
+  bypass_table_free(rcu_dereference_protected(tn->bypass, 1));
+  if(es) endpoint_set_free_rcu(&es->rcu);
+  if(rs6) relay6_set_free(rs6);
+  kfree(rcu_dereference_protected(tn->bypass6, 1));
+  kfree(rcu_dereference_protected(tn->endpoints6, 1));
+  kfree(rcu_dereference_protected(tn->gateways, 1));
+  if(ges) endpoint_set_free_rcu(&ges->rcu);
+  kfree(rcu_dereference_protected(tn->policy, 1));
+}
+
+#endif /* TORPROXY_CONTROL_H */
@@ -0,0 +1,156 @@
+/*
+ ***************************************************
+ *
+ * per-cpu rings of dropped packets
+ *
+ * instead of logging, the ipv4 and ipv6 hooks
+ * store a fixed size event for each packet they
+ * drop in the current cpu's ring, which userspace
+ * maps from DROP_RING_DEVICE and drains at its own
+ * pace. a full ring costs the packet path one counter
+ * increment, nothing is formatted and nothing waits.
+ *
+ * a cpu's ring is only written with interrupts off
+ * so hook calls on that cpu never interleave
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_DROPS_H
+#define TORPROXY_DROPS_H
+
+#ifdef __KERNEL__
+
+#include <linux/fs.h>
+#include <linux/cred.h>
+#include <linux/miscdevice.h>
+#include <net/sock.h>
+
+#include "torproxy_trace.h"
+
+#else
+
+#include "bench/kshim.h"
+
+static inline void trace_torproxy_drop(const struct drop_event *ev){
+}
+
+#endif
+
+#include "torproxy_stats.h"
+#include "torproxy_reject.h"
+
+/* one ring per possible cpu in a single mapping */
+static struct drop_ring *drop_rings;
+static unsigned int drop_nrings;
+
+
+static inline int drop_rings_init(void){
+  unsigned int i;
+
+  drop_nrings = nr_cpu_ids;
+  drop_rings = vmalloc_user(drop_nrings * sizeof(*drop_rings));
+  if(!drop_rings) return -ENOMEM;
+
+  for(i=0; i<drop_nrings; i++){
+    drop_rings[i].rings = drop_nrings;
+    drop_rings[i].events = DROP_RING_EVENTS;
+  }
+
+  return 0;
+}
+
+/* hooks must be unregistered and the device gone */
+static inline void drop_rings_destroy(void){
+  vfree(drop_rings);
+  drop_rings = NULL;
+}
+
+
+/* uid owning the socket a packet was sent from, like xt_owner,
+ * as seen from the given user namespace */
+static inline u32 skb_owner_uid(const struct sk_buff *skb, struct user_namespace *ns){
+  struct sock *sk = skb->sk;
+
+  if(!sk || !sk->sk_socket || !sk->sk_socket->file) return (u32) -1;
+  return from_kuid_munged(ns, sk->sk_socket->file->f_cred->fsuid);
+}
+
+/* fire the tracepoint and store the event in this cpu's ring */
+static void drop_event_push(const struct drop_event *ev){
+  struct drop_ring *ring;
+  unsigned long flags;
+  u32 head;
+
+  trace_torproxy_drop(ev);
+
+  local_irq_save(flags);
+  ring = &drop_rings[smp_processor_id()];
+  head = ring->head;
+
+  /* the reader moves tail only after it copied the event out */
+  if(head - smp_load_acquire(&ring->tail) >= DROP_RING_EVENTS){
+    ring->lost++;
+  } else{
+    ring->ev[head & (DROP_RING_EVENTS - 1)] = *ev;
+    smp_store_release(&ring->head, head + 1);
+  }
+  local_irq_restore(flags);
+}
+
+static void drop_event_record(struct sk_buff *skb, enum torproxy_stat reason){
+  struct iphdr *ip_header = (struct iphdr *) skb_network_header(skb);
+  struct drop_event ev;
+  __be16 _ports[2], *ports = NULL;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.timestamp = local_clock();
+  ev.saddr[0] = ip_header->saddr;
+  ev.daddr[0] = ip_header->daddr;
+  ev.protocol = ip_header->protocol;
+  ev.reason = reason;
+  ev.family = AF_INET;
+  ev.uid = skb_owner_uid(skb, &init_user_ns);
+
+  if(ev.protocol == IPPROTO_TCP || ev.protocol == IPPROTO_UDP){
+    ports = skb_header_pointer(skb, skb_transport_offset(skb), sizeof(_ports), _ports);
+  }
+  if(ports){
+    ev.sport = ports[0];
+    ev.dport = ports[1];
+  }
+
+  drop_event_push(&ev);
+}
+
+/* count, report and maybe reject a dropped packet, returns NF_DROP */
+static inline unsigned int drop_packet(struct sk_buff *skb, enum torproxy_stat reason){
+  drop_event_record(skb, reason);
+  if(ACCESS_ONCE(reject_packets)) reject_ipv4(skb);
+  return stats_verdict(NF_DROP, reason);
+}
+
+
+#ifdef __KERNEL__
+
+/* the reader maps the whole area and writes the tails */
+static int drop_dev_mmap(struct file *file, struct vm_area_struct *vma){
+  return remap_vmalloc_range(vma, drop_rings, vma->vm_pgoff);
+}
+
+static const struct file_operations drop_dev_fops = {
+  .owner = THIS_MODULE,
+  .mmap = drop_dev_mmap,
+  .llseek = noop_llseek,
+};
+
+static struct miscdevice drop_dev = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name = "torproxy_drops",
+  .fops = &drop_dev_fops,
+  .mode = 0600,
+};
+
+#endif
+
+#endif /* TORPROXY_DROPS_H */
@@ -0,0 +1,208 @@
+/*
+ ***************************************************
+ *
+ * RCU published set of tor endpoints
+ *
+ * new TCP flows and DNS queries are spread over the
+ * endpoints by hashing their addresses and ports
+ * into a maglev lookup table, in which every
+ * endpoint owns slots in proportion to its weight.
+ * each endpoint fills slots in its own pseudo-random
+ * order, so adding, removing or reweighting one only
+ * moves the slots it gains or gives up and the rest
+ * of the flows keep their endpoint.
+ *
+ * an endpoint of weight 0 owns no slot, existing
+ * flows stay NAT'd to it by conntrack and its DNS
+ * replies are still recognised, so it drains
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_ENDPOINT_H
+#define TORPROXY_ENDPOINT_H
+
+#ifdef __KERNEL__
+
+#include <net/dst.h>
+
+#else
+
+#include "bench/kshim.h"
+
+#endif
+
+#include "torproxy_compat.h"
+#include "torproxy_genl.h"
+
+/* default tor endpoint in network byte order */
+#define TOR_PROXY_IP 0x0100007f /* 127.0.0.1 */
+#define TOR_TRANSPROXY_PORT 0x5023 /* 9040 */
+#define TOR_DNS_PORT 0x5d23 /* 9053 */
+
+/* lookup table slots, a prime so every endpoint's fill order visits
+ * each slot once, and large enough that weights come out within a
+ * percent at TOR_MAX_ENDPOINTS */
+#define ENDPOINT_TABLE_SIZE 1021
+
+struct endpoint_set {
+  struct rcu_head rcu;
+  unsigned int generation;
+  unsigned int count;
+  struct torproxy_endpoint ep[TOR_MAX_ENDPOINTS];
+
+  /* route to each endpoint for redirected DNS queries, looked up on first
+   * use and released with the set so an endpoint change never reuses it */
+  struct dst_entry __rcu *dst[TOR_MAX_ENDPOINTS];
+
+  /* endpoint index of every slot */
+  u8 table[ENDPOINT_TABLE_SIZE];
+};
+
+/* hashes flows onto slots, picked once so rebuilt sets agree */
+static u32 endpoint_flow_seed;
+
+
+/* at least one endpoint takes new flows */
+static inline int endpoints_active(const struct torproxy_endpoint *ep, unsigned int n){
+  unsigned int i;
+
+  for(i=0; i<n; i++){
+    if(ep[i].weight) return 1;
+  }
+
+  return 0;
+}
+
+/* an endpoint as the maglev population sees it, ipv6
+ * addresses are folded into one word */
+struct endpoint_key {
+  u32 addr;
+  u32 ports;
+  u16 weight;
+};
+
+/* maglev population, each round an endpoint earns its weight in credit
+ * and takes its next preferred free slot for every max_weight of it */
+static inline void endpoint_table_populate(u8 *table, const struct endpoint_key *key, unsigned int n){
+  u32 offset[TOR_MAX_ENDPOINTS], skip[TOR_MAX_ENDPOINTS];
+  u32 next[TOR_MAX_ENDPOINTS], credit[TOR_MAX_ENDPOINTS];
+  unsigned int i, filled = 0;
+  u32 slot, max_weight = 0;
+
+  for(i=0; i<n; i++){
+    offset[i] = jhash_3words(key[i].addr, key[i].ports, 0, 0) % ENDPOINT_TABLE_SIZE;
+    skip[i] = jhash_3words(key[i].addr, key[i].ports, 1, 0) % (ENDPOINT_TABLE_SIZE - 1) + 1;
+    next[i] = 0;
+    credit[i] = 0;
+    if(key[i].weight > max_weight) max_weight = key[i].weight;
+  }
+
+  memset(table, 0xff, ENDPOINT_TABLE_SIZE);
+
+  while(filled < ENDPOINT_TABLE_SIZE){
+    for(i=0; i<n && filled < ENDPOINT_TABLE_SIZE; i++){
+      credit[i] += key[i].weight;
+
+      while(credit[i] >= max_weight && filled < ENDPOINT_TABLE_SIZE){
+        credit[i] -= max_weight;
+
+        do{
+          slot = (offset[i] + next[i]++ * skip[i]) % ENDPOINT_TABLE_SIZE;
+        } while(table[slot] != 0xff);
+
+        table[slot] = i;
+        filled++;
+      }
+    }
+  }
+}
+
+static inline void endpoint_set_populate(struct endpoint_set *set){
+  struct endpoint_key key[TOR_MAX_ENDPOINTS];
+  unsigned int i;
+
+  for(i=0; i<set->count; i++){
+    key[i].addr = set->ep[i].addr;
+    key[i].ports = (u32) set->ep[i].trans_port << 16 | set->ep[i].dns_port;
+    key[i].weight = set->ep[i].weight;
+  }
+
+  endpoint_table_populate(set->table, key, set->count);
+}
+
+/* build a new generation of tor endpoints */
+static inline struct endpoint_set *endpoint_set_build(const struct torproxy_endpoint *ep,
+    unsigned int n, unsigned int generation, gfp_t gfp)
+{
+  struct endpoint_set *set;
+
+  if(n == 0 || n > TOR_MAX_ENDPOINTS || !endpoints_active(ep, n)) return NULL;
+
+  set = kzalloc(sizeof(*set), gfp);
+  if(!set) return NULL;
+
+  set->generation = generation;
+  set->count = n;
+  memcpy(set->ep, ep, n * sizeof(*ep));
+  endpoint_set_populate(set);
+
+  return set;
+}
+
+/* the tor instance on localhost with the default ports */
+static struct endpoint_set *endpoint_set_default(unsigned int generation){
+  struct torproxy_endpoint ep = {
+    .addr = (__be32) TOR_PROXY_IP,
+    .trans_port = (__be16) TOR_TRANSPROXY_PORT,
+    .dns_port = (__be16) TOR_DNS_PORT,
+    .weight = 1,
+  };
+
+  if(!endpoint_flow_seed) get_random_bytes(&endpoint_flow_seed, sizeof(endpoint_flow_seed));
+
+  return endpoint_set_build(&ep, 1, generation, GFP_KERNEL);
+}
+
+static void endpoint_set_free_rcu(struct rcu_head *head){
+  struct endpoint_set *set = container_of(head, struct endpoint_set, rcu);
+  unsigned int i;
+
+  for(i=0; i<set->count; i++){
+    dst_release(rcu_dereference_protected(set->dst[i], 1));
+  }
+  kfree(set);
+}
+
+/* publish a new generation, the old one and its routes are
+ * released once no reader can see them. caller serializes writers */
+static inline void endpoint_set_replace(struct endpoint_set __rcu **head, struct endpoint_set *set){
+  struct endpoint_set *old;
+
+  old = rcu_dereference_protected(*head, 1);
+  rcu_assign_pointer(*head, set);
+  if(old) call_rcu(&old->rcu, endpoint_set_free_rcu);
+}
+
+
+/* endpoint a new flow goes to, caller holds rcu_read_lock() */
+static inline unsigned int endpoint_pick(const struct endpoint_set *set,
+    __be32 saddr, __be32 daddr, __be16 sport, __be16 dport)
+{
+  u32 h = jhash_3words(saddr, daddr, (u32) sport << 16 | dport, endpoint_flow_seed);
+
+  return set->table[((u64) h * ENDPOINT_TABLE_SIZE) >> 32];
+}
+
+/* check if a packet comes from one of tor's DNS ports, caller holds rcu_read_lock() */
+static inline int endpoint_is_dns(const struct endpoint_set *set, __be32 addr, __be16 port){
+  unsigned int i;
+
+  for(i=0; i<set->count; i++){
+    if(set->ep[i].addr == addr && set->ep[i].dns_port == port) return 1;
+  }
+
+  return 0;
+}
+
+#endif /* TORPROXY_ENDPOINT_H */
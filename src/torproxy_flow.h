@@ -0,0 +1,354 @@
+/*
+ ***************************************************
+ *
+ * flow cache of tor's own relay connections
+ *
+ * tor's OR connections to its guard carry all of
+ * the proxied bandwidth. once such a flow is
+ * established and its destination checked against
+ * the relay set, it is remembered here and a hook
+ * ahead of conntrack attaches its conntrack entry to
+ * later packets, so conntrack skips its lookup and
+ * TCP tracking for them. the rest of the local out
+ * chain, iptables and LSM hooks included, still
+ * sees every packet.
+ *
+ * an entry is only good for the relay set it was
+ * checked against, a packet seeing another set or a
+ * closing flag takes the full path again. buckets
+ * hold a few flows each, a new flow takes a free
+ * way or replaces the one idle the longest
+ *
+ * the netfilter flowtable would do this since 4.16,
+ * on older kernels this is its software equivalent
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_FLOW_H
+#define TORPROXY_FLOW_H
+
+#ifdef __KERNEL__
+
+#include <linux/jhash.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <net/sock.h>
+#include <net/netfilter/nf_conntrack.h>
+
+#else
+
+#include "bench/kshim.h"
+
+#endif
+
+#include "torproxy_compat.h"
+
+/* default sizing, a host has a handful of guard connections
+ * but a relay running a client may hold thousands */
+#define FLOW_HASH_BITS 8
+#define FLOW_WAYS 4
+#define FLOW_IDLE_MS 30000
+
+/* set through the module's flow_offload parameter */
+static bool flow_offload;
+
+struct flow_entry {
+  struct rcu_head rcu;
+  __be32 saddr, daddr;
+  __be16 sport, dport;
+
+  /* only compared, the socket is never dereferenced */
+  const struct sock *sk;
+
+  /* held until the entry is freed */
+  struct nf_conn *ct;
+
+  /* of the relay set the destination was found in */
+  unsigned int generation;
+  unsigned long last_used;
+
+  /* window tracking flags the cache set, taken back on eviction */
+  u8 liberal;
+};
+
+struct flow_table {
+  /* FLOW_WAYS slots per bucket */
+  struct flow_entry __rcu **slots;
+  u32 mask;
+  u32 seed;
+  unsigned long timeout;
+  atomic_t count;
+
+  /* serializes writers, readers only take rcu */
+  spinlock_t lock;
+};
+
+
+#ifdef __KERNEL__
+
+/* only flows in the middle of their life, a closing one
+ * would be cached again by its last segments */
+static inline int flow_ct_established(const struct nf_conn *ct){
+  return ACCESS_ONCE(ct->proto.tcp.state) == TCP_CONNTRACK_ESTABLISHED;
+}
+
+static inline void flow_ct_hold(struct nf_conn *ct){
+  nf_conntrack_get(&ct->ct_general);
+}
+
+/* as if conntrack had found the entry itself */
+static inline void flow_ct_attach(struct sk_buff *skb, struct nf_conn *ct){
+  nf_conntrack_get(&ct->ct_general);
+  skb->nfct = &ct->ct_general;
+  skb->nfctinfo = IP_CT_ESTABLISHED;
+}
+
+/* conntrack stops seeing the flow's outgoing segments, its window
+ * tracking must not take the replies to them for out of window.
+ * returns the directions that weren't liberal already */
+static inline u8 flow_ct_liberal(struct nf_conn *ct){
+  u8 set = 0;
+  int dir;
+
+  spin_lock_bh(&ct->lock);
+  for(dir=0; dir<2; dir++){
+    if(!(ct->proto.tcp.seen[dir].flags & IP_CT_TCP_FLAG_BE_LIBERAL)){
+      ct->proto.tcp.seen[dir].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+      set |= 1 << dir;
+    }
+  }
+  spin_unlock_bh(&ct->lock);
+
+  return set;
+}
+
+/* the flow is back on the full path, the next segment it sends
+ * brings conntrack's view of its window up to date */
+static inline void flow_ct_strict(struct nf_conn *ct, u8 set){
+  int dir;
+
+  if(!set) return;
+
+  spin_lock_bh(&ct->lock);
+  for(dir=0; dir<2; dir++){
+    if(set & (1 << dir)) ct->proto.tcp.seen[dir].flags &= ~IP_CT_TCP_FLAG_BE_LIBERAL;
+  }
+  spin_unlock_bh(&ct->lock);
+}
+
+#else
+
+/* the shim tracks no TCP state */
+static inline int flow_ct_established(const struct nf_conn *ct){
+  return 1;
+}
+
+static inline void flow_ct_hold(struct nf_conn *ct){
+  atomic_inc(&ct->use);
+}
+
+static inline void flow_ct_attach(struct sk_buff *skb, struct nf_conn *ct){
+  skb->nfct = ct;
+  skb->nfctinfo = IP_CT_ESTABLISHED;
+}
+
+static inline u8 flow_ct_liberal(struct nf_conn *ct){
+  return 0;
+}
+
+static inline void flow_ct_strict(struct nf_conn *ct, u8 set){
+}
+
+#endif
+
+
+/* first slot of the flow's bucket */
+static inline unsigned int flow_hash(const struct flow_table *t, __be32 saddr, __be32 daddr,
+    __be16 sport, __be16 dport)
+{
+  return (jhash_3words((u32) saddr, (u32) daddr, ((u32) sport << 16) | dport, t->seed) & t->mask) * FLOW_WAYS;
+}
+
+static inline int flow_entry_match(const struct flow_entry *e, __be32 saddr, __be32 daddr,
+    __be16 sport, __be16 dport)
+{
+  return e->saddr == saddr && e->daddr == daddr && e->sport == sport && e->dport == dport;
+}
+
+static void flow_entry_free_rcu(struct rcu_head *head){
+  struct flow_entry *e = container_of(head, struct flow_entry, rcu);
+
+  nf_ct_put(e->ct);
+  kfree(e);
+}
+
+/* under the table lock, the slot is cleared before the grace period.
+ * a packet still holding the entry only gets the conntrack entry
+ * attached, which conntrack would have found anyway */
+static inline void flow_slot_clear(struct flow_table *t, unsigned int i){
+  struct flow_entry *e = rcu_dereference_protected(t->slots[i], lockdep_is_held(&t->lock));
+
+  if(!e) return;
+
+  flow_ct_strict(e->ct, e->liberal);
+  RCU_INIT_POINTER(t->slots[i], NULL);
+  atomic_dec(&t->count);
+  call_rcu(&e->rcu, flow_entry_free_rcu);
+}
+
+
+/* entry of the flow if it is still good for the relay set of the
+ * given generation, called under rcu_read_lock() */
+static inline struct flow_entry *flow_table_lookup(struct flow_table *t, __be32 saddr, __be32 daddr,
+    __be16 sport, __be16 dport, const struct sock *sk, unsigned int generation)
+{
+  unsigned int i = flow_hash(t, saddr, daddr, sport, dport), way;
+  struct flow_entry *e;
+
+  for(way=0; way<FLOW_WAYS; way++){
+    e = rcu_dereference(t->slots[i + way]);
+    if(!e || !flow_entry_match(e, saddr, daddr, sport, dport)) continue;
+    if(e->sk != sk || e->generation != generation || nf_ct_is_dying(e->ct)) return NULL;
+    return e;
+  }
+
+  return NULL;
+}
+
+/* slot a flow is stored in under the table lock: its own if it has
+ * one, else a free way of the bucket, else the way idle the longest */
+static inline unsigned int flow_bucket_victim(struct flow_table *t, unsigned int i, __be32 saddr,
+    __be32 daddr, __be16 sport, __be16 dport)
+{
+  struct flow_entry *e, *oldest = NULL;
+  unsigned int way, free = FLOW_WAYS, victim = i;
+
+  for(way=0; way<FLOW_WAYS; way++){
+    e = rcu_dereference_protected(t->slots[i + way], lockdep_is_held(&t->lock));
+    if(!e){
+      if(free == FLOW_WAYS) free = way;
+      continue;
+    }
+    if(flow_entry_match(e, saddr, daddr, sport, dport)) return i + way;
+    if(!oldest || time_before(ACCESS_ONCE(e->last_used), ACCESS_ONCE(oldest->last_used))){
+      oldest = e;
+      victim = i + way;
+    }
+  }
+
+  return free < FLOW_WAYS ? i + free : victim;
+}
+
+/* remember an established flow, a reference on its conntrack entry is
+ * taken for the cache. returns 1 if the flow was added */
+static inline int flow_table_insert(struct flow_table *t, __be32 saddr, __be32 daddr,
+    __be16 sport, __be16 dport, const struct sock *sk, struct nf_conn *ct, unsigned int generation)
+{
+  unsigned int i = flow_hash(t, saddr, daddr, sport, dport), victim;
+  struct flow_entry *e, *old;
+
+  e = kzalloc(sizeof(*e), GFP_ATOMIC);
+  if(!e) return 0;
+
+  e->saddr = saddr;
+  e->daddr = daddr;
+  e->sport = sport;
+  e->dport = dport;
+  e->sk = sk;
+  e->ct = ct;
+  e->generation = generation;
+  e->last_used = jiffies;
+
+  spin_lock_bh(&t->lock);
+  victim = flow_bucket_victim(t, i, saddr, daddr, sport, dport);
+
+  /* another CPU got there first */
+  old = rcu_dereference_protected(t->slots[victim], lockdep_is_held(&t->lock));
+  if(old && flow_entry_match(old, saddr, daddr, sport, dport) && old->sk == sk &&
+     old->generation == generation){
+    spin_unlock_bh(&t->lock);
+    kfree(e);
+    return 0;
+  }
+
+  /* cleared first, the flow's own stale entry takes its flags back */
+  flow_slot_clear(t, victim);
+
+  flow_ct_hold(ct);
+  e->liberal = flow_ct_liberal(ct);
+  rcu_assign_pointer(t->slots[victim], e);
+  atomic_inc(&t->count);
+  spin_unlock_bh(&t->lock);
+
+  return 1;
+}
+
+/* send the flow back to the full path, as when it closes */
+static inline void flow_table_remove(struct flow_table *t, __be32 saddr, __be32 daddr,
+    __be16 sport, __be16 dport)
+{
+  unsigned int i = flow_hash(t, saddr, daddr, sport, dport), way;
+  struct flow_entry *e;
+
+  spin_lock_bh(&t->lock);
+  for(way=0; way<FLOW_WAYS; way++){
+    e = rcu_dereference_protected(t->slots[i + way], lockdep_is_held(&t->lock));
+    if(e && flow_entry_match(e, saddr, daddr, sport, dport)) flow_slot_clear(t, i + way);
+  }
+  spin_unlock_bh(&t->lock);
+}
+
+/* forget every flow, after the relay set changed */
+static inline void flow_table_flush(struct flow_table *t){
+  unsigned int i;
+
+  if(atomic_read(&t->count) == 0) return;
+
+  spin_lock_bh(&t->lock);
+  for(i=0; i<(t->mask+1) * FLOW_WAYS; i++){
+    flow_slot_clear(t, i);
+  }
+  spin_unlock_bh(&t->lock);
+}
+
+/* forget flows idle for the timeout and those conntrack let go of,
+ * a flow that silently died would otherwise pin its entry */
+static inline void flow_table_expire(struct flow_table *t){
+  unsigned long now = jiffies;
+  struct flow_entry *e;
+  unsigned int i;
+
+  spin_lock_bh(&t->lock);
+  for(i=0; i<(t->mask+1) * FLOW_WAYS && atomic_read(&t->count) > 0; i++){
+    e = rcu_dereference_protected(t->slots[i], lockdep_is_held(&t->lock));
+    if(e && (time_after(now, ACCESS_ONCE(e->last_used) + t->timeout) || nf_ct_is_dying(e->ct))){
+      flow_slot_clear(t, i);
+    }
+  }
+  spin_unlock_bh(&t->lock);
+}
+
+static inline int flow_table_init(struct flow_table *t, unsigned int bits, unsigned int idle_ms){
+  t->mask = (1U << bits) - 1;
+  t->timeout = msecs_to_jiffies(idle_ms);
+  atomic_set(&t->count, 0);
+  get_random_bytes(&t->seed, sizeof(t->seed));
+  spin_lock_init(&t->lock);
+
+  t->slots = vzalloc((sizeof(*t->slots) * FLOW_WAYS) << bits);
+  if(!t->slots) return -ENOMEM;
+
+  return 0;
+}
+
+/* no reader is left, entries still go through a grace period
+ * since their conntrack references are dropped from there */
+static inline void flow_table_destroy(struct flow_table *t){
+  flow_table_flush(t);
+  vfree(t->slots);
+}
+
+#endif /* TORPROXY_FLOW_H */
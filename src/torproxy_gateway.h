@@ -0,0 +1,236 @@
+/*
+ ***************************************************
+ *
+ * packet path of the gateway hook
+ *
+ * in gateway mode the host proxies a LAN as well as
+ * itself. traffic coming in through one of the
+ * gateway interfaces is classified at pre routing,
+ * before it is routed: TCP is NAT'd to the
+ * TransPort, DNS is rewritten to the DNSPort and
+ * everything else is dropped. both are then
+ * delivered locally, so nothing from the clients
+ * is ever forwarded and the forward hook keeps
+ * dropping what is.
+ *
+ * the clients have endpoints of their own, off
+ * loopback since a packet that didn't come in on
+ * it can't be routed there, and the host keeps
+ * its own endpoints for its own traffic.
+ *
+ * per client state is what the host keeps for its
+ * own traffic: a TCP flow is classified once and
+ * NAT'd by conntrack, its verdict cached in the
+ * conntrack mark, and DNS queries share the DNS NAT
+ * table. tor's replies leave through the local out
+ * hook like they would to a local client
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_GATEWAY_H
+#define TORPROXY_GATEWAY_H
+
+#include <linux/netdevice.h>
+
+#include "torproxy_hook.h"
+
+/* interfaces whose clients are proxied, a handful so they are scanned */
+struct gateway_set {
+  struct rcu_head rcu;
+  unsigned int generation;
+  unsigned int count;
+  u32 ifindex[GATEWAY_MAX_IFACES];
+};
+
+
+/* build a new generation, no interface turns gateway mode off */
+static inline struct gateway_set *gateway_set_build(const u32 *ifindex, unsigned int n,
+    unsigned int generation, gfp_t gfp)
+{
+  struct gateway_set *set;
+
+  if(n == 0 || n > GATEWAY_MAX_IFACES) return NULL;
+
+  set = kzalloc(sizeof(*set), gfp);
+  if(!set) return NULL;
+
+  set->generation = generation;
+  set->count = n;
+  memcpy(set->ifindex, ifindex, n * sizeof(*ifindex));
+
+  return set;
+}
+
+/* publish a new generation, NULL turns gateway mode
+ * off. caller serializes writers */
+static inline void gateway_set_replace(struct gateway_set __rcu **head, struct gateway_set *set){
+  struct gateway_set *old;
+
+  old = rcu_dereference_protected(*head, 1);
+  rcu_assign_pointer(*head, set);
+  if(old) kfree_rcu(old, rcu);
+}
+
+/* check if a packet came in from a LAN client, safe from any context */
+static inline int is_gateway_ingress(struct torproxy_net *tn, const struct net_device *in){
+  struct gateway_set *set;
+  unsigned int i;
+  int ret = 0;
+
+  rcu_read_lock();
+  set = rcu_dereference(tn->gateways);
+  for(i=0; set && i<set->count; i++){
+    if(set->ifindex[i] == in->ifindex){
+      ret = 1;
+      break;
+    }
+  }
+  rcu_read_unlock();
+
+  return ret;
+}
+
+
+/* the packet hasn't been routed, a rejection would have
+ * no route back to the client so drops are only reported */
+static inline unsigned int gateway_drop(struct sk_buff *skb, enum torproxy_stat reason){
+  drop_event_record(skb, reason);
+  return stats_verdict(NF_DROP, reason);
+}
+
+/* point a new flow at a tor endpoint, the NAT hooks after ours
+ * rewrite it and every later packet. a flow is still new while
+ * its first packets are retransmitted */
+static inline void nat_to_tor(struct nf_conn *ct, __be32 addr, __be16 port){
+  struct nf_nat_range newrange;
+
+  if(nf_nat_initialized(ct, NF_NAT_MANIP_DST)) return;
+
+  memset(&newrange, 0, sizeof(newrange));
+  newrange.flags = (IP_NAT_RANGE_MAP_IPS | IP_NAT_RANGE_PROTO_SPECIFIED);
+  newrange.min_addr.ip = addr;
+  newrange.max_addr.ip = addr;
+  newrange.min_proto.tcp.port = port;
+  newrange.max_proto.tcp.port = port;
+
+  nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_DST);
+}
+
+/* endpoint a client's new flow or DNS query goes to, spread by flow
+ * like the host's own. the control plane keeps one while there are
+ * gateway interfaces, a packet racing the update setting both may
+ * find none */
+static inline int gateway_endpoint(struct torproxy_net *tn, const struct iphdr *ip_header,
+    const __be16 *ports, struct torproxy_endpoint *tor)
+{
+  struct endpoint_set *ep;
+  int err = -ENOENT;
+
+  rcu_read_lock();
+  ep = rcu_dereference(tn->gateway_endpoints);
+  if(ep){
+    *tor = ep->ep[endpoint_pick(ep, ip_header->saddr, ip_header->daddr, ports[0], ports[1])];
+    err = 0;
+  }
+  rcu_read_unlock();
+
+  return err;
+}
+
+/* verdict of the gateway hook for a packet from a LAN client, every return is counted */
+static inline unsigned int gateway_verdict(struct torproxy_net *tn, struct sk_buff *skb){
+  struct iphdr *ip_header = ip_hdr(skb);
+  struct torproxy_endpoint tor;
+  enum ip_conntrack_info ctinfo;
+  struct nf_conn *ct;
+  enum ct_verdict cached;
+  __be16 ports[2], *pp, dns_id;
+  int err;
+
+  if(ip_header->protocol != IPPROTO_TCP && ip_header->protocol != IPPROTO_UDP){
+    return gateway_drop(skb, TORPROXY_STAT_DROP_GATEWAY);
+  }
+
+  /* received headers need not be linear, conntrack reassembled fragments */
+  pp = skb_header_pointer(skb, skb_transport_offset(skb), sizeof(ports), ports);
+  if(!pp) return gateway_drop(skb, TORPROXY_STAT_DROP_GATEWAY);
+
+  if(ip_header->protocol == IPPROTO_UDP){
+    if(pp[1] != htons(53)) return gateway_drop(skb, TORPROXY_STAT_DROP_GATEWAY);
+
+    if(dns_transaction_id(skb, &dns_id) < 0){
+      return gateway_drop(skb, TORPROXY_STAT_DROP_DNS_INVALID);
+    }
+
+    if(gateway_endpoint(tn, ip_header, pp, &tor) < 0){
+      return gateway_drop(skb, TORPROXY_STAT_DROP_GATEWAY);
+    }
+
+    /* the reply is rewritten back by the local out hook */
+    err = nat_table_insert(&tn->dns_nat, ip_header->saddr, pp[0], dns_id, ip_header->daddr, pp[1]);
+    if(err < 0){
+      return gateway_drop(skb, TORPROXY_STAT_DROP_NAT_FULL);
+    }
+    if(!delayed_work_pending(&tn->nat_expire_work)){
+      schedule_delayed_work(&tn->nat_expire_work, nat_table_tick(&tn->dns_nat));
+    }
+
+    if(udp_nat_rewrite(skb, NF_NAT_MANIP_DST, tor.addr, tor.dns_port) < 0){
+      return gateway_drop(skb, TORPROXY_STAT_DROP_REWRITE);
+    }
+
+    /* routed to the DNSPort once the hooks are done */
+    skb_dst_drop(skb);
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_DNS_QUERY);
+  }
+
+  /* conntrack ran at its own priority before us */
+  ct = nf_ct_get(skb, &ctinfo);
+  if(!ct){
+    return gateway_drop(skb, TORPROXY_STAT_DROP_CONNTRACK);
+  }
+
+  /* a flow past its first packet follows the NAT that one got */
+  if(ctinfo != IP_CT_NEW && ctinfo != IP_CT_RELATED){
+    cached = ct_verdict_get(ct);
+    return stats_verdict(NF_ACCEPT, cached != CT_VERDICT_NONE ? ct_verdict_stat[cached] : TORPROXY_STAT_TRANS);
+  }
+
+  /* the host's own services, anything routed on is dropped by the forward hook */
+  if(is_bypassed(tn, ip_header->daddr)){
+    ct_verdict_set(ct, CT_VERDICT_BYPASS);
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_BYPASS);
+  }
+
+  if(gateway_endpoint(tn, ip_header, pp, &tor) < 0){
+    return gateway_drop(skb, TORPROXY_STAT_DROP_GATEWAY);
+  }
+
+  nat_to_tor(ct, tor.addr, tor.trans_port);
+  ct_verdict_set(ct, CT_VERDICT_TOR);
+  return stats_verdict(NF_ACCEPT, TORPROXY_STAT_TRANS_NAT);
+}
+
+/* netfilter pre routing hook function, traffic from
+ * other interfaces passes untouched */
+static unsigned int gateway_hook_func(unsigned int hooknum,
+    struct sk_buff *skb,
+    const struct net_device *in,
+    const struct net_device *out,
+    int (*okfn)(struct sk_buff *))
+{
+  struct torproxy_net *tn = torproxy_pernet(dev_net(in));
+  u64 start;
+  unsigned int verdict;
+
+  if(!is_gateway_ingress(tn, in)) return NF_ACCEPT;
+
+  start = stats_timer_start();
+  verdict = gateway_verdict(tn, skb);
+  stats_timer_end(TORPROXY_HOOK_GATEWAY, start);
+
+  return verdict;
+}
+
+#endif /* TORPROXY_GATEWAY_H */
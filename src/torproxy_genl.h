@@ -0,0 +1,248 @@
+/*
+ ***************************************************
+ *
+ * generic netlink control interface
+ *
+ * shared by the kernel module and relay_pop. one
+ * TORPROXY_CMD_UPDATE message carries a list of
+ * add/remove/replace operations on the relay,
+ * bypass and tor endpoint tables, on their
+ * ipv6 counterparts, on the gateway interfaces
+ * and their endpoints and on the steering policy,
+ * which are applied all together or not at all.
+ * every applied update bumps the configuration
+ * generation, which the reply carries back.
+ * TORPROXY_CMD_STATS reads the packet counters and
+ * hook latencies.
+ *
+ * dropped packets are also reported one by one
+ * through per-cpu rings mapped from DROP_RING_DEVICE
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_GENL_H
+#define TORPROXY_GENL_H
+
+#include <linux/types.h>
+
+#define TORPROXY_GENL_NAME "torproxy"
+#define TORPROXY_GENL_VERSION 1
+
+/* most relays in the relay set, enough for the whole consensus
+ * while the address list still fits one netlink attribute */
+#define RELAY_MAX_ADDRS 16000
+
+/* most prefixes in the bypass table */
+#define BYPASS_MAX_PREFIXES 4096
+
+/* most ipv6 relays, tor publishes far fewer than that and
+ * the 16 byte addresses still fit one netlink attribute */
+#define RELAY6_MAX_ADDRS 4000
+
+/* most prefixes in the ipv6 bypass table, which is scanned */
+#define BYPASS6_MAX_PREFIXES 256
+
+/* most interfaces LAN clients are proxied from */
+#define GATEWAY_MAX_IFACES 32
+
+/* most steering policy rules */
+#define POLICY_MAX_RULES 256
+
+/* what a policy rule matches */
+#define POLICY_MATCH_UID 1      /* fsuid of the sending socket's file, like xt_owner */
+#define POLICY_MATCH_CLASSID 2  /* net_cls cgroup classid of the sending socket */
+#define POLICY_MATCH_IFACE 3    /* egress interface index */
+
+/* what the packets of a matching flow get */
+#define POLICY_TOR 1       /* tor's own traffic, passes wherever it goes, uid rules only */
+#define POLICY_EXEMPT 2    /* sent directly */
+#define POLICY_ENDPOINT 3  /* TCP and DNS go to the rule's own tor endpoint, owner rules only */
+
+/* bypass prefix actions, the longest matching prefix decides */
+#define BYPASS_ACCEPT 1 /* send directly */
+#define BYPASS_PROXY 2  /* send a range inside a shorter bypass prefix through tor */
+
+/* most tor endpoints traffic can be sent to */
+#define TOR_MAX_ENDPOINTS 8
+
+/* new flows are spread over the endpoints in proportion to their
+ * weight, an endpoint of weight 0 only keeps the flows it has */
+#define TOR_MAX_WEIGHT 100
+
+/* one bypass prefix */
+struct bypass_prefix {
+  __be32 addr;
+  __u8 len;
+  __u8 action;
+  __u16 reserved;
+};
+
+/* a tor instance's TransPort and DNSPort, the address and ports
+ * are its key in add and remove operations */
+struct torproxy_endpoint {
+  __be32 addr;
+  __be16 trans_port;
+  __be16 dns_port;
+  __u16 weight;
+  __u16 reserved;
+};
+
+/* one ipv6 bypass prefix, addr is a struct in6_addr */
+struct bypass_prefix6 {
+  __be32 addr[4];
+  __u8 len;
+  __u8 action;
+  __u16 reserved;
+};
+
+/* a tor instance listening on an ipv6 address, addr is a struct in6_addr */
+struct torproxy_endpoint6 {
+  __be32 addr[4];
+  __be16 trans_port;
+  __be16 dns_port;
+  __u16 weight;
+  __u16 reserved;
+};
+
+/* one steering policy rule, match and value are its key */
+struct torproxy_policy {
+  __u32 value;
+  __u8 match;
+  __u8 action;
+  __u16 reserved;
+  struct torproxy_endpoint endpoint;  /* POLICY_ENDPOINT only, its weight is ignored */
+};
+
+enum torproxy_cmd {
+  TORPROXY_CMD_UNSPEC,
+  TORPROXY_CMD_UPDATE,  /* apply TORPROXY_A_OPS, replies with the new generation */
+  TORPROXY_CMD_GET,     /* replies with the generation and every table */
+  TORPROXY_CMD_STATS,   /* replies with TORPROXY_A_STATS and TORPROXY_A_LATENCY */
+  __TORPROXY_CMD_MAX
+};
+#define TORPROXY_CMD_MAX (__TORPROXY_CMD_MAX - 1)
+
+enum torproxy_attr {
+  TORPROXY_A_UNSPEC,
+  TORPROXY_A_GENERATION,  /* u32, in an update the generation it expects to replace */
+  TORPROXY_A_OPS,         /* nested TORPROXY_A_OP, applied in order */
+  TORPROXY_A_OP,          /* nested torproxy_op_attr */
+  TORPROXY_A_RELAYS,      /* __be32 array */
+  TORPROXY_A_PREFIXES,    /* struct bypass_prefix array */
+  TORPROXY_A_ENDPOINTS,   /* struct torproxy_endpoint array */
+  TORPROXY_A_STATS,       /* u64 array indexed by enum torproxy_stat */
+  TORPROXY_A_LATENCY,     /* u64 array, TORPROXY_LATENCY_BUCKETS per enum torproxy_hook */
+  TORPROXY_A_RELAYS6,     /* struct in6_addr array */
+  TORPROXY_A_PREFIXES6,   /* struct bypass_prefix6 array */
+  TORPROXY_A_ENDPOINTS6,  /* struct torproxy_endpoint6 array */
+  TORPROXY_A_GATEWAYS,    /* __u32 array of interface indexes */
+  TORPROXY_A_POLICY,      /* struct torproxy_policy array */
+  TORPROXY_A_GATEWAY_ENDPOINTS, /* struct torproxy_endpoint array */
+  __TORPROXY_A_MAX
+};
+#define TORPROXY_A_MAX (__TORPROXY_A_MAX - 1)
+
+/* an operation holds its code and exactly one of the table attributes */
+enum torproxy_op_attr {
+  TORPROXY_OP_A_UNSPEC,
+  TORPROXY_OP_A_CODE,       /* u8, enum torproxy_op */
+  TORPROXY_OP_A_RELAYS,     /* __be32 array */
+  TORPROXY_OP_A_PREFIXES,   /* struct bypass_prefix array */
+  TORPROXY_OP_A_ENDPOINTS,  /* struct torproxy_endpoint array */
+  TORPROXY_OP_A_RELAYS6,    /* struct in6_addr array */
+  TORPROXY_OP_A_PREFIXES6,  /* struct bypass_prefix6 array */
+  TORPROXY_OP_A_ENDPOINTS6, /* struct torproxy_endpoint6 array, none leaves ipv6 dropped */
+  TORPROXY_OP_A_GATEWAYS,   /* __u32 array of interface indexes, none turns gateway mode off */
+  TORPROXY_OP_A_POLICY,     /* struct torproxy_policy array */
+  TORPROXY_OP_A_GATEWAY_ENDPOINTS, /* struct torproxy_endpoint array, gateway mode needs one off loopback */
+  __TORPROXY_OP_A_MAX
+};
+#define TORPROXY_OP_A_MAX (__TORPROXY_OP_A_MAX - 1)
+
+enum torproxy_op {
+  TORPROXY_OP_ADD,      /* insert, or overwrite an entry with the same key */
+  TORPROXY_OP_REMOVE,   /* delete entries with the same key, missing ones are ignored */
+  TORPROXY_OP_REPLACE   /* the table becomes exactly the given entries */
+};
+
+/* packets counted by the verdict the hooks gave them and why */
+enum torproxy_stat {
+  TORPROXY_STAT_RELAY,            /* accepted, headed for a tor relay */
+  TORPROXY_STAT_BYPASS,           /* accepted, headed for a bypass prefix */
+  TORPROXY_STAT_TRANS_NAT,        /* new TCP connection NAT'd to the TransPort */
+  TORPROXY_STAT_TRANS,            /* later packet of a NAT'd TCP connection */
+  TORPROXY_STAT_DNS_QUERY,        /* DNS query redirected to the DNSPort */
+  TORPROXY_STAT_DNS_REPLY,        /* DNSPort reply rewritten back */
+  TORPROXY_STAT_DNS_UNMATCHED,    /* accepted from the DNSPort without a NAT entry */
+  TORPROXY_STAT_LOOPBACK,         /* through the loopback device, never leaves the host */
+  TORPROXY_STAT_DROP_NON_TCP,     /* neither TCP nor DNS */
+  TORPROXY_STAT_DROP_DNS_INVALID, /* to port 53 without a DNS transaction id */
+  TORPROXY_STAT_DROP_NAT_FULL,    /* DNS NAT table full */
+  TORPROXY_STAT_DROP_REWRITE,     /* DNS packet could not be made writable */
+  TORPROXY_STAT_DROP_ROUTE,       /* no route to the DNSPort */
+  TORPROXY_STAT_DROP_CONNTRACK,   /* no conntrack entry for a TCP packet */
+  TORPROXY_STAT_DROP_FORWARD,     /* forwarded packet */
+  TORPROXY_STAT_DROP_IPV6,        /* incoming ipv6, or outgoing without an ipv6 tor endpoint */
+  TORPROXY_STAT_DROP_GATEWAY,     /* neither TCP nor DNS from a gateway interface */
+  TORPROXY_STAT_TOR_OWNED,        /* accepted, sent by tor's own user */
+  TORPROXY_STAT_EXEMPT,           /* accepted, from an exempt owner or out a skipped interface */
+  TORPROXY_STAT_STEERED,          /* new TCP connection or DNS query sent to its owner's endpoint */
+  TORPROXY_STAT_DROP_NO_NAT,      /* TCP for tor the eBPF dataplane can't NAT to a TransPort */
+  TORPROXY_STAT_OFFLOADED,        /* conntrack entry attached from the flow cache, conntrack's lookup skipped */
+  __TORPROXY_STAT_MAX
+};
+#define TORPROXY_STAT_MAX __TORPROXY_STAT_MAX
+
+/* hooks whose latency is sampled */
+enum torproxy_hook {
+  TORPROXY_HOOK_LOCAL_OUT,
+  TORPROXY_HOOK_FORWARD,
+  TORPROXY_HOOK_IPV6,
+  TORPROXY_HOOK_GATEWAY,
+  TORPROXY_HOOK_FLOW_OUT,
+  __TORPROXY_HOOK_MAX
+};
+#define TORPROXY_HOOK_MAX __TORPROXY_HOOK_MAX
+
+/* bucket i counts hook calls which took [2^(i-1), 2^i) ns, the
+ * last one everything slower. one call in TORPROXY_LATENCY_SAMPLE
+ * per cpu is timed */
+#define TORPROXY_LATENCY_BUCKETS 32
+#define TORPROXY_LATENCY_SAMPLE 64
+
+/* the mapping holds one struct drop_ring per possible cpu, the
+ * header of ring 0 tells how many */
+#define DROP_RING_DEVICE "/dev/torproxy_drops"
+#define DROP_RING_EVENTS 1024 /* per cpu, a power of two */
+
+/* one dropped packet */
+struct drop_event {
+  __u64 timestamp;  /* ns, per cpu clock */
+  __be32 saddr[4];  /* an ipv4 address in the first word */
+  __be32 daddr[4];
+  __be16 sport;     /* 0 unless TCP or UDP */
+  __be16 dport;
+  __u32 uid;        /* owner of the sending socket, (__u32) -1 without one */
+  __u8 protocol;    /* for ipv6 the header after the extension headers */
+  __u8 reason;      /* enum torproxy_stat */
+  __u8 family;      /* AF_INET or AF_INET6 */
+  __u8 reserved[13];
+};
+
+/* single producer ring, the module only writes head and events and
+ * the reader only tail. head and tail count events and wrap, the
+ * module counts events it could not store in lost instead of waiting */
+struct drop_ring {
+  __u32 head;
+  __u32 rings;
+  __u32 events;
+  __u32 reserved;
+  __u64 lost;
+  __u8 pad0[40];
+  __u32 tail;
+  __u8 pad1[60];
+  struct drop_event ev[DROP_RING_EVENTS];
+};
+
+#endif /* TORPROXY_GENL_H */
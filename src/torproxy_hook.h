@@ -0,0 +1,627 @@
+/*
+ ***************************************************
+ *
+ * packet path of the local out hook
+ *
+ * classifies every locally generated ipv4 packet:
+ * tor relay traffic and bypass prefixes pass, DNS
+ * is rewritten to TorDNS, remaining TCP is NAT'd to
+ * the transparent proxy and everything else dropped.
+ *
+ * TCP of tor's own user, exempt owners and
+ * skipped interfaces pass before any of it, and
+ * owners steered to a tor endpoint of their own are
+ * NAT'd there instead, see torproxy_policy.h.
+ *
+ * a flow is classified once, later packets find
+ * the verdict cached in their conntrack mark. with
+ * flow_offload set, tor's established connections
+ * to its relays go to the flow cache and their
+ * packets skip conntrack's lookup, see
+ * torproxy_flow.h.
+ *
+ * the tables are those of the network namespace
+ * the packet leaves through, see torproxy_net.h
+ *
+ * kept apart from the module glue so the userspace
+ * benchmarks can build it against bench/kshim.h
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_HOOK_H
+#define TORPROXY_HOOK_H
+
+#ifdef __KERNEL__
+
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/workqueue.h>
+#include <net/ip.h>
+#include <net/route.h>
+#include <net/dst.h>
+#include <net/checksum.h>
+#include <net/udp.h>
+#include <net/netfilter/nf_conntrack_core.h>
+#include <uapi/linux/netfilter/nf_nat.h>
+#include <net/netfilter/nf_nat.h>
+
+#else
+
+#include "bench/kshim.h"
+
+#endif
+
+#include "torproxy_relay.h"
+#include "torproxy_bypass.h"
+#include "torproxy_nat.h"
+#include "torproxy_drops.h"
+#include "torproxy_endpoint.h"
+#include "torproxy_policy.h"
+#include "torproxy_flow.h"
+#include "torproxy_net.h"
+
+#define IP_NAT_RANGE_MAP_IPS (1 << 0)
+#define IP_NAT_RANGE_PROTO_SPECIFIED (1 << 1)
+
+/* verdict of a flow kept in the top bits of its conntrack mark,
+ * the other bits stay free for CONNMARK */
+#define CT_VERDICT_SHIFT 29
+#define CT_VERDICT_MASK (7U << CT_VERDICT_SHIFT)
+
+enum ct_verdict {
+  CT_VERDICT_NONE,
+  CT_VERDICT_RELAY,     /* sent directly to a tor relay */
+  CT_VERDICT_BYPASS,    /* sent directly to a bypass prefix */
+  CT_VERDICT_TOR,       /* redirected to, or left alone by, the TransPort */
+  CT_VERDICT_TOR_OWNED, /* sent by tor's own user */
+  CT_VERDICT_EXEMPT     /* sent directly by the policy */
+};
+
+static const enum torproxy_stat ct_verdict_stat[] = {
+  [CT_VERDICT_RELAY] = TORPROXY_STAT_RELAY,
+  [CT_VERDICT_BYPASS] = TORPROXY_STAT_BYPASS,
+  [CT_VERDICT_TOR] = TORPROXY_STAT_TRANS,
+  [CT_VERDICT_TOR_OWNED] = TORPROXY_STAT_TOR_OWNED,
+  [CT_VERDICT_EXEMPT] = TORPROXY_STAT_EXEMPT,
+};
+
+/* bypassed until userspace loads its own prefixes,
+ * the private and loopback blocks in host byte order */
+static const struct {
+  u32 addr;
+  u8 len;
+} bypass_default[] = {
+  { 0x0a000000, 8 },    // 10.0.0.0/8
+  { 0x7f000000, 8 },    // 127.0.0.0/8
+  { 0xac100000, 12 },   // 172.16.0.0/12
+  { 0xc0a80000, 16 }    // 192.168.0.0/16
+};
+
+
+/* check if address is a tor relay, safe from any context */
+static inline int is_tor_relay(struct torproxy_net *tn, __be32 addr){
+  int ret;
+
+  rcu_read_lock();
+  ret = relay_set_contains(rcu_dereference(tn->relays), addr);
+  rcu_read_unlock();
+
+  return ret;
+}
+
+
+/* check if address is to be sent directly, safe from any context */
+static inline int is_bypassed(struct torproxy_net *tn, __be32 addr){
+  int ret;
+
+  rcu_read_lock();
+  ret = bypass_lookup(rcu_dereference(tn->bypass), addr) == BYPASS_ACCEPT;
+  rcu_read_unlock();
+
+  return ret;
+}
+
+/* table holding only the default prefixes */
+static struct bypass_table *bypass_table_default(unsigned int generation){
+  struct bypass_prefix prefixes[ARRAY_SIZE(bypass_default)];
+  unsigned int i;
+
+  memset(prefixes, 0, sizeof(prefixes));
+  for(i=0; i<ARRAY_SIZE(bypass_default); i++){
+    prefixes[i].addr = htonl(bypass_default[i].addr);
+    prefixes[i].len = bypass_default[i].len;
+    prefixes[i].action = BYPASS_ACCEPT;
+  }
+
+  return bypass_table_build(prefixes, ARRAY_SIZE(bypass_default), generation);
+}
+
+
+/* conntrack without marks can't cache, every packet is classified */
+#if defined(CONFIG_NF_CONNTRACK_MARK) || !defined(__KERNEL__)
+
+static inline enum ct_verdict ct_verdict_get(const struct nf_conn *ct){
+  return (ACCESS_ONCE(ct->mark) & CT_VERDICT_MASK) >> CT_VERDICT_SHIFT;
+}
+
+/* only written when it changes so established flows
+ * don't keep dirtying the conntrack entry */
+static inline void ct_verdict_set(struct nf_conn *ct, enum ct_verdict verdict){
+  u32 mark = ACCESS_ONCE(ct->mark);
+
+  if((mark & CT_VERDICT_MASK) >> CT_VERDICT_SHIFT != verdict){
+    ct->mark = (mark & ~CT_VERDICT_MASK) | ((u32) verdict << CT_VERDICT_SHIFT);
+  }
+}
+
+#else
+
+static inline enum ct_verdict ct_verdict_get(const struct nf_conn *ct){
+  return CT_VERDICT_NONE;
+}
+
+static inline void ct_verdict_set(struct nf_conn *ct, enum ct_verdict verdict){
+}
+
+#endif
+
+
+/* reads the DNS transaction id following the udp header */
+static inline int dns_transaction_id(struct sk_buff *skb, __be16 *id){
+  __be16 _id, *p;
+
+  p = skb_header_pointer(skb, skb_transport_offset(skb) + sizeof(struct udphdr), sizeof(_id), &_id);
+  if(!p) return -EINVAL;
+
+  *id = *p;
+  return 0;
+}
+
+
+/* rewrite the destination (or source) address and port of a udp packet,
+ * checksums are updated incrementally and left to the offload when
+ * the stack only filled in the pseudo header */
+static int udp_nat_rewrite(struct sk_buff *skb, enum nf_nat_manip_type manip, __be32 addr, __be16 port){
+  struct iphdr *ip_header;
+  struct udphdr *udp_header;
+  __be32 *old_addr;
+  __be16 *old_port;
+
+  /* cloned or nonlinear skbs get a private copy of the headers */
+  if(!skb_make_writable(skb, skb_transport_offset(skb) + sizeof(struct udphdr))){
+    return -ENOMEM;
+  }
+
+  ip_header = (struct iphdr *) skb_network_header(skb);
+  udp_header = (struct udphdr *) skb_transport_header(skb);
+
+  if(manip == NF_NAT_MANIP_DST){
+    old_addr = &ip_header->daddr;
+    old_port = &udp_header->dest;
+  } else{
+    old_addr = &ip_header->saddr;
+    old_port = &udp_header->source;
+  }
+
+  /* a zero udp checksum means none was computed */
+  if(udp_header->check || skb->ip_summed == CHECKSUM_PARTIAL){
+    inet_proto_csum_replace4(&udp_header->check, skb, *old_addr, addr, 1);
+    inet_proto_csum_replace2(&udp_header->check, skb, *old_port, port, 0);
+    if(!udp_header->check) udp_header->check = CSUM_MANGLED_0;
+  }
+  csum_replace4(&ip_header->check, *old_addr, addr);
+
+  *old_addr = addr;
+  *old_port = port;
+
+  return 0;
+}
+
+
+/* route packets redirected to tor endpoint i, the route is looked
+ * up once and reused until the routing tables change.
+ * caller holds rcu_read_lock() */
+static int route_to_proxy(struct sk_buff *skb, struct net *net, struct endpoint_set *set, unsigned int i){
+  struct dst_entry *dst;
+  struct rtable *rt;
+
+  /* marked packets may be subject to policy routing */
+  if(skb->mark) return ip_route_me_harder(skb, RTN_UNSPEC);
+
+  dst = rcu_dereference(set->dst[i]);
+  if(dst && dst_check(dst, 0)){
+    skb_dst_drop(skb);
+    skb_dst_set(skb, dst_clone(dst));
+    return 0;
+  }
+
+  rt = ip_route_output(net, set->ep[i].addr, 0, 0, 0);
+  if(IS_ERR(rt)) return PTR_ERR(rt);
+
+  skb_dst_drop(skb);
+  skb_dst_set(skb, dst_clone(&rt->dst));
+
+  /* cache keeps the reference taken by the lookup */
+  dst = xchg((__force struct dst_entry **) &set->dst[i], &rt->dst);
+  dst_release(dst);
+
+  return 0;
+}
+
+
+/* expires NAT entries whose deadline passed, keeps
+ * running once per wheel tick until the table is empty */
+static void nat_expire_work_func(struct work_struct *work){
+  struct torproxy_net *tn = container_of(to_delayed_work(work), struct torproxy_net, nat_expire_work);
+
+  nat_table_run_timers(&tn->dns_nat);
+
+  if(atomic_read(&tn->dns_nat.count) > 0){
+    schedule_delayed_work(&tn->nat_expire_work, nat_table_tick(&tn->dns_nat));
+  }
+}
+
+
+/* forgets idle cached flows, all of them once offloading is turned
+ * off, requeued while any are left */
+static void flow_expire_work_func(struct work_struct *work){
+  struct torproxy_net *tn = container_of(to_delayed_work(work), struct torproxy_net, flow_expire_work);
+
+  if(ACCESS_ONCE(flow_offload)) flow_table_expire(&tn->flows);
+  else flow_table_flush(&tn->flows);
+
+  if(atomic_read(&tn->flows.count) > 0){
+    schedule_delayed_work(&tn->flow_expire_work, tn->flows.timeout);
+  }
+}
+
+/* an established TCP flow of tor's to a relay is handed to the flow
+ * cache, checked against the relay set its entry will be good for.
+ * packets the cache already handled only look it up again */
+static inline void flow_offer(struct torproxy_net *tn, struct sk_buff *skb, struct nf_conn *ct){
+  struct iphdr *ip_header = (struct iphdr *) skb_network_header(skb);
+  struct tcphdr *tcp_header;
+  struct relay_set *rs;
+  unsigned int generation;
+  int relay, cached;
+
+  if(ip_header->protocol != IPPROTO_TCP) return;
+
+  tcp_header = (struct tcphdr *) skb_transport_header(skb);
+  if(tcp_header->syn || tcp_header->fin || tcp_header->rst || !flow_ct_established(ct)) return;
+
+  rcu_read_lock();
+  rs = rcu_dereference(tn->relays);
+  relay = relay_set_contains(rs, ip_header->daddr);
+  generation = rs ? rs->generation : 0;
+  cached = relay && flow_table_lookup(&tn->flows, ip_header->saddr, ip_header->daddr, tcp_header->source,
+                                      tcp_header->dest, skb->sk, generation) != NULL;
+  rcu_read_unlock();
+
+  if(!relay || cached) return;
+
+  if(flow_table_insert(&tn->flows, ip_header->saddr, ip_header->daddr, tcp_header->source,
+                       tcp_header->dest, skb->sk, ct, generation) &&
+     !delayed_work_pending(&tn->flow_expire_work)){
+    schedule_delayed_work(&tn->flow_expire_work, tn->flows.timeout);
+  }
+}
+
+
+/* what the policy says about the first packet of a flow, 0 leaves it
+ * to the tables. skipped interfaces come first and tor's own user
+ * next, POLICY_ENDPOINT copies the owner's endpoint to steer */
+static inline u8 policy_decide(struct torproxy_net *tn, struct sk_buff *skb,
+    const struct net_device *out, struct torproxy_endpoint *steer)
+{
+  const struct torproxy_policy *rule = NULL;
+  struct policy_set *set;
+  u32 classid;
+  u8 action = 0;
+
+  rcu_read_lock();
+  set = rcu_dereference(tn->policy);
+  if(set){
+    if(out) rule = policy_lookup(set, POLICY_MATCH_IFACE, out->ifindex);
+    /* rules were given from inside the namespace, by a user of the
+     * user namespace owning it */
+    if(!rule && skb->sk) rule = policy_lookup(set, POLICY_MATCH_UID, skb_owner_uid(skb, tn->net->user_ns));
+    if(!rule && (classid = skb_owner_classid(skb)) != 0) rule = policy_lookup(set, POLICY_MATCH_CLASSID, classid);
+  }
+  if(rule){
+    action = rule->action;
+    if(action == POLICY_ENDPOINT) *steer = rule->endpoint;
+  }
+  rcu_read_unlock();
+
+  return action;
+}
+
+
+/* verdict of the local out hook, every return is counted */
+static inline unsigned int local_out_verdict(unsigned int hooknum,
+    struct sk_buff *skb,
+    const struct net_device *in,
+    const struct net_device *out,
+    int (*okfn)(struct sk_buff *))
+{
+  int err;
+  unsigned int ret;
+  struct torproxy_net *tn = torproxy_pernet(dev_net(out));
+  struct iphdr *ip_header;
+  struct tcphdr *tcp_header;
+  struct udphdr *udp_header;
+  struct nf_nat_range newrange;
+  enum ip_conntrack_info ctinfo;
+  struct nf_conn *ct;
+  enum ct_verdict cached;
+  struct endpoint_set *ep;
+  struct torproxy_endpoint tor;
+  unsigned int i;
+  __be32 nat_ip;
+  __be16 nat_port, dns_id;
+  int from_tor;
+  u8 action;
+
+  ip_header = (struct iphdr *) skb_network_header(skb);
+
+  /* conntrack ran at its own priority before us, a flow past its
+   * first packet keeps the verdict that packet got. only new flows
+   * are ever NAT'd so an established one is accepted whatever the
+   * relay, bypass and policy tables say now */
+  ct = nf_ct_get(skb, &ctinfo);
+  if(ct && ctinfo != IP_CT_NEW && ctinfo != IP_CT_RELATED){
+    cached = ct_verdict_get(ct);
+    if(cached != CT_VERDICT_NONE){
+      if(ACCESS_ONCE(flow_offload) && ctinfo == IP_CT_ESTABLISHED &&
+         (cached == CT_VERDICT_RELAY || cached == CT_VERDICT_TOR_OWNED)){
+        flow_offer(tn, skb, ct);
+      }
+      return stats_verdict(NF_ACCEPT, ct_verdict_stat[cached]);
+    }
+  }
+
+  /* replies from TorDNS, tor's own user sends them too */
+  if(ip_header->protocol == IPPROTO_UDP){
+
+    udp_header = (struct udphdr *) skb_transport_header(skb);
+
+    if((short) udp_header->dest != (short) 0x3500){ // not to UDP port 53
+
+      rcu_read_lock();
+      ep = rcu_dereference(tn->gateway_endpoints);
+      from_tor = endpoint_is_dns(rcu_dereference(tn->endpoints), ip_header->saddr, udp_header->source) ||
+                 (ep && endpoint_is_dns(ep, ip_header->saddr, udp_header->source)) ||
+                 policy_is_dns(rcu_dereference(tn->policy), ip_header->saddr, udp_header->source);
+      rcu_read_unlock();
+
+      /* If packet is from TorDNS */
+      if(from_tor){
+
+        /* look for entry in NAT table, erasing it */
+        if(dns_transaction_id(skb, &dns_id) < 0 ||
+           !nat_table_take(&tn->dns_nat, ip_header->daddr, udp_header->dest, dns_id, &nat_ip, &nat_port)){
+          /* query not in NAT table */
+          return stats_verdict(NF_ACCEPT, TORPROXY_STAT_DNS_UNMATCHED);
+        }
+
+        if(udp_nat_rewrite(skb, NF_NAT_MANIP_SRC, nat_ip, nat_port) < 0){
+          return drop_packet(skb, TORPROXY_STAT_DROP_REWRITE);
+        }
+
+        /* only the source changed, the packet keeps its route */
+        return stats_verdict(NF_ACCEPT, TORPROXY_STAT_DNS_REPLY);
+
+      }
+    }
+  }
+
+
+  /* never leaves the host, lets a DNS stub endpoint talk to the
+   * DNSPort and rejections reach their local sender */
+  if(out && (out->flags & IFF_LOOPBACK)){
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_LOOPBACK);
+  }
+
+  /* skipped interfaces, tor's TCP and exempt owners pass. tor's
+   * DNS replies were taken above, anything else it sends is dropped */
+  action = policy_decide(tn, skb, out, &tor);
+  if(action == POLICY_TOR){
+    if(ip_header->protocol != IPPROTO_TCP){
+      return drop_packet(skb, TORPROXY_STAT_DROP_NON_TCP);
+    }
+    if(ct) ct_verdict_set(ct, CT_VERDICT_TOR_OWNED);
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_TOR_OWNED);
+  }
+  if(action == POLICY_EXEMPT){
+    if(ct) ct_verdict_set(ct, CT_VERDICT_EXEMPT);
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_EXEMPT);
+  }
+
+  /* If regular DNS request forward to TorDNS */
+  if(ip_header->protocol == IPPROTO_UDP && (short) udp_header->dest == (short) 0x3500){ // UDP port 53
+
+    /* not a DNS query if there is no transaction id */
+    if(dns_transaction_id(skb, &dns_id) < 0){
+      return drop_packet(skb, TORPROXY_STAT_DROP_DNS_INVALID);
+    }
+
+    /* store nat entry */
+    err = nat_table_insert(&tn->dns_nat, ip_header->saddr, udp_header->source, dns_id,
+                           ip_header->daddr, udp_header->dest);
+    if(err < 0){
+      return drop_packet(skb, TORPROXY_STAT_DROP_NAT_FULL);
+    }
+    if(!delayed_work_pending(&tn->nat_expire_work)){
+      schedule_delayed_work(&tn->nat_expire_work, nat_table_tick(&tn->dns_nat));
+    }
+
+    /* the owner's own DNSPort, its route isn't cached */
+    if(action == POLICY_ENDPOINT){
+      if(udp_nat_rewrite(skb, NF_NAT_MANIP_DST, tor.addr, tor.dns_port) < 0){
+        return drop_packet(skb, TORPROXY_STAT_DROP_REWRITE);
+      }
+      if(ip_route_me_harder(skb, RTN_UNSPEC) < 0){
+        return drop_packet(skb, TORPROXY_STAT_DROP_ROUTE);
+      }
+      return stats_verdict(NF_ACCEPT, TORPROXY_STAT_STEERED);
+    }
+
+    rcu_read_lock();
+    ep = rcu_dereference(tn->endpoints);
+    i = endpoint_pick(ep, ip_header->saddr, ip_header->daddr, udp_header->source, udp_header->dest);
+
+    /* modify dest to go to DNS proxy */
+    if(udp_nat_rewrite(skb, NF_NAT_MANIP_DST, ep->ep[i].addr, ep->ep[i].dns_port) < 0){
+      rcu_read_unlock();
+      return drop_packet(skb, TORPROXY_STAT_DROP_REWRITE);
+    }
+
+    /* re-route mangled packets */
+    err = route_to_proxy(skb, dev_net(out), ep, i);
+    rcu_read_unlock();
+    if(err < 0){
+     return drop_packet(skb, TORPROXY_STAT_DROP_ROUTE);
+    }
+
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_DNS_QUERY);
+
+  }
+
+  /* Drop all non TCP packets */
+  if(ip_header->protocol != IPPROTO_TCP){
+    return drop_packet(skb, TORPROXY_STAT_DROP_NON_TCP);
+  }
+
+  /* ensure all outbound packets are tor relays */
+  if(is_tor_relay(tn, ip_header->daddr)){
+    if(ct) ct_verdict_set(ct, CT_VERDICT_RELAY);
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_RELAY);
+  }
+
+
+  /* allow connections to bypassed prefixes */
+  if(is_bypassed(tn, ip_header->daddr)){
+    if(ct) ct_verdict_set(ct, CT_VERDICT_BYPASS);
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_BYPASS);
+  }
+
+
+  /* retrieve conntrack entry */
+  if(!ct){
+    /* initialize conntrack */
+    ret = nf_conntrack_in(dev_net(out), PF_INET, hooknum, skb);
+    ct = nf_ct_get(skb, &ctinfo);
+    if(!ct){
+      return drop_packet(skb, TORPROXY_STAT_DROP_CONNTRACK);
+    }
+  }
+
+
+  /* setup natting to transparent TOR proxy */
+  if(ct && (ctinfo == IP_CT_NEW || ctinfo == IP_CT_RELATED)){
+
+    /* spread over the endpoints by flow, unless the owner has its own */
+    if(action != POLICY_ENDPOINT){
+      rcu_read_lock();
+      tcp_header = (struct tcphdr *) skb_transport_header(skb);
+      ep = rcu_dereference(tn->endpoints);
+      tor = ep->ep[endpoint_pick(ep, ip_header->saddr, ip_header->daddr, tcp_header->source, tcp_header->dest)];
+      rcu_read_unlock();
+    }
+
+    newrange.flags = (IP_NAT_RANGE_MAP_IPS | IP_NAT_RANGE_PROTO_SPECIFIED);
+    newrange.min_addr.ip = tor.addr;
+    newrange.max_addr.ip = tor.addr;
+    newrange.min_proto.tcp.port = tor.trans_port;
+    newrange.max_proto.tcp.port = tor.trans_port;
+
+    ret = nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_DST);
+    ct_verdict_set(ct, CT_VERDICT_TOR);
+    return stats_verdict(NF_ACCEPT, action == POLICY_ENDPOINT ? TORPROXY_STAT_STEERED : TORPROXY_STAT_TRANS_NAT);
+  }
+
+  ct_verdict_set(ct, CT_VERDICT_TOR);
+  return stats_verdict(NF_ACCEPT, TORPROXY_STAT_TRANS);
+
+
+}
+
+/* netfilter local out hook function */
+static unsigned int local_out_hook_func(unsigned int hooknum,
+    struct sk_buff *skb,
+    const struct net_device *in,
+    const struct net_device *out,
+    int (*okfn)(struct sk_buff *))
+{
+  u64 start = stats_timer_start();
+  unsigned int verdict;
+
+  verdict = local_out_verdict(hooknum, skb, in, out, okfn);
+  stats_timer_end(TORPROXY_HOOK_LOCAL_OUT, start);
+
+  return verdict;
+}
+
+/* verdict of the flow cache hook, a packet of a cached flow gets its
+ * conntrack entry so conntrack leaves it alone. every packet goes on
+ * down the chain, the local out hook and iptables still see it */
+static inline unsigned int flow_out_verdict(struct sk_buff *skb, const struct net_device *out){
+  struct torproxy_net *tn = torproxy_pernet(dev_net(out));
+  struct iphdr *ip_header = (struct iphdr *) skb_network_header(skb);
+  struct tcphdr *tcp_header;
+  struct relay_set *rs;
+  struct flow_entry *e;
+  unsigned long now;
+
+  if(ip_header->protocol != IPPROTO_TCP || atomic_read(&tn->flows.count) == 0) return NF_ACCEPT;
+
+  tcp_header = (struct tcphdr *) skb_transport_header(skb);
+
+  rcu_read_lock();
+  rs = rcu_dereference(tn->relays);
+  e = flow_table_lookup(&tn->flows, ip_header->saddr, ip_header->daddr, tcp_header->source,
+                        tcp_header->dest, skb->sk, rs ? rs->generation : 0);
+  if(e && !(tcp_header->syn || tcp_header->fin || tcp_header->rst)){
+    now = jiffies;
+    if(ACCESS_ONCE(e->last_used) != now) e->last_used = now;
+    flow_ct_attach(skb, e->ct);
+    rcu_read_unlock();
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_OFFLOADED);
+  }
+  rcu_read_unlock();
+
+  /* conntrack sees the flow close, its later packets take the full path */
+  if(e){
+    flow_table_remove(&tn->flows, ip_header->saddr, ip_header->daddr, tcp_header->source, tcp_header->dest);
+  }
+
+  return NF_ACCEPT;
+}
+
+/* netfilter local out hook function ahead of conntrack, only timed
+ * while offloading so it costs nothing when the option is off */
+static unsigned int flow_out_hook_func(unsigned int hooknum,
+    struct sk_buff *skb,
+    const struct net_device *in,
+    const struct net_device *out,
+    int (*okfn)(struct sk_buff *))
+{
+  u64 start;
+  unsigned int verdict;
+
+  /* untracked by a raw table rule, or already seen */
+  if(!ACCESS_ONCE(flow_offload) || skb->nfct) return NF_ACCEPT;
+
+  start = stats_timer_start();
+  verdict = flow_out_verdict(skb, out);
+  stats_timer_end(TORPROXY_HOOK_FLOW_OUT, start);
+
+  return verdict;
+}
+
+#endif /* TORPROXY_HOOK_H */
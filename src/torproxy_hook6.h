@@ -0,0 +1,251 @@
+/*
+ ***************************************************
+ *
+ * packet path of the ipv6 hooks
+ *
+ * locally generated ipv6 is classified like ipv4:
+ * tor relays and bypass prefixes pass, TCP is NAT'd
+ * to an ipv6 TransPort and DNS to an ipv6 DNSPort,
+ * both through conntrack, and everything else is
+ * dropped. without an ipv6 tor endpoint all of it is
+ * dropped, or rejected so dual stack clients fall
+ * back to ipv4 at once.
+ *
+ * packets through the loopback device never leave
+ * the host and always pass, that is how the
+ * redirected connections reach tor and their
+ * replies come back. other incoming ipv6 is dropped
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_HOOK6_H
+#define TORPROXY_HOOK6_H
+
+#include <linux/ipv6.h>
+#include <linux/netfilter_ipv6.h>
+#include <net/ipv6.h>
+#include <net/netfilter/nf_conntrack_core.h>
+#include <net/netfilter/nf_nat.h>
+
+#include "torproxy_hook.h"
+#include "torproxy_ipv6.h"
+
+/* bypassed until userspace loads its own prefixes, unique local addresses */
+static const struct {
+  __be32 addr[4];
+  u8 len;
+} bypass6_default[] = {
+  { { __constant_htonl(0xfc000000), 0, 0, 0 }, 7 }   // fc00::/7
+};
+
+
+/* table holding only the default prefixes */
+static struct bypass6_table *bypass6_table_default(unsigned int generation){
+  struct bypass_prefix6 prefixes[ARRAY_SIZE(bypass6_default)];
+  unsigned int i;
+
+  memset(prefixes, 0, sizeof(prefixes));
+  for(i=0; i<ARRAY_SIZE(bypass6_default); i++){
+    memcpy(prefixes[i].addr, bypass6_default[i].addr, sizeof(prefixes[i].addr));
+    prefixes[i].len = bypass6_default[i].len;
+    prefixes[i].action = BYPASS_ACCEPT;
+  }
+
+  return bypass6_table_build(prefixes, ARRAY_SIZE(bypass6_default), generation);
+}
+
+
+/* point a new flow at an ipv6 tor endpoint, the NAT hooks after
+ * ours rewrite and reroute it and every later packet. a flow is
+ * still new while its first packets are retransmitted */
+static inline void nat6_to_tor(struct nf_conn *ct, const struct in6_addr *addr, __be16 port){
+  struct nf_nat_range newrange;
+
+  if(nf_nat_initialized(ct, NF_NAT_MANIP_DST)) return;
+
+  memset(&newrange, 0, sizeof(newrange));
+  newrange.flags = (IP_NAT_RANGE_MAP_IPS | IP_NAT_RANGE_PROTO_SPECIFIED);
+  newrange.min_addr.in6 = *addr;
+  newrange.max_addr.in6 = *addr;
+  newrange.min_proto.all = port;
+  newrange.max_proto.all = port;
+
+  nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_DST);
+}
+
+/* the ipv6 twin of drop_event_record(), the ports are those of the
+ * header after the extension headers unless it is a later fragment */
+static void drop_event_record6(struct sk_buff *skb, enum torproxy_stat reason){
+  struct ipv6hdr *ip6_header = ipv6_hdr(skb);
+  struct drop_event ev;
+  __be16 _ports[2], *ports = NULL, frag_off;
+  u8 proto = ip6_header->nexthdr;
+  int thoff;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.timestamp = local_clock();
+  memcpy(ev.saddr, &ip6_header->saddr, sizeof(ev.saddr));
+  memcpy(ev.daddr, &ip6_header->daddr, sizeof(ev.daddr));
+  ev.reason = reason;
+  ev.family = AF_INET6;
+  ev.uid = skb_owner_uid(skb, &init_user_ns);
+
+  thoff = ipv6_skip_exthdr(skb, sizeof(struct ipv6hdr), &proto, &frag_off);
+  ev.protocol = proto;
+  if(thoff >= 0 && !(frag_off & htons(~0x7)) && (proto == IPPROTO_TCP || proto == IPPROTO_UDP)){
+    ports = skb_header_pointer(skb, thoff, sizeof(_ports), _ports);
+  }
+  if(ports){
+    ev.sport = ports[0];
+    ev.dport = ports[1];
+  }
+
+  drop_event_push(&ev);
+}
+
+/* count, report and maybe reject a dropped ipv6 packet, returns NF_DROP */
+static inline unsigned int drop_ipv6(struct sk_buff *skb, const struct net_device *out,
+    unsigned int hooknum, enum torproxy_stat reason)
+{
+  drop_event_record6(skb, reason);
+  if(ACCESS_ONCE(reject_packets)) reject_ipv6(dev_net(out), skb, hooknum);
+
+  return stats_verdict(NF_DROP, reason);
+}
+
+
+/* verdict of the ipv6 local out hook, every return is counted */
+static inline unsigned int local_out6_verdict(unsigned int hooknum,
+    struct sk_buff *skb,
+    const struct net_device *in,
+    const struct net_device *out,
+    int (*okfn)(struct sk_buff *))
+{
+  struct torproxy_net *tn = torproxy_pernet(dev_net(out));
+  struct ipv6hdr *ip6_header;
+  struct endpoint6_set *ep;
+  struct torproxy_endpoint6 tor;
+  enum ip_conntrack_info ctinfo;
+  struct nf_conn *ct;
+  enum ct_verdict cached;
+  __be16 ports[2], *pp, frag_off;
+  u8 proto;
+  int thoff, is_dns;
+
+  /* never leaves the host */
+  if(out && (out->flags & IFF_LOOPBACK)){
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_LOOPBACK);
+  }
+
+  ip6_header = ipv6_hdr(skb);
+  proto = ip6_header->nexthdr;
+  thoff = ipv6_skip_exthdr(skb, sizeof(struct ipv6hdr), &proto, &frag_off);
+  if(thoff < 0 || (proto != IPPROTO_TCP && proto != IPPROTO_UDP)){
+    return drop_ipv6(skb, out, hooknum, TORPROXY_STAT_DROP_IPV6);
+  }
+
+  /* a non-first fragment carries no ports */
+  pp = (frag_off & htons(~0x7)) ? NULL : skb_header_pointer(skb, thoff, sizeof(ports), ports);
+  if(!pp) return drop_ipv6(skb, out, hooknum, TORPROXY_STAT_DROP_IPV6);
+
+  is_dns = proto == IPPROTO_UDP && pp[1] == htons(53);
+  if(proto == IPPROTO_UDP && !is_dns) return drop_ipv6(skb, out, hooknum, TORPROXY_STAT_DROP_IPV6);
+
+  /* conntrack ran at its own priority before us, see local_out_verdict() */
+  ct = nf_ct_get(skb, &ctinfo);
+  if(ct && proto == IPPROTO_TCP && ctinfo != IP_CT_NEW && ctinfo != IP_CT_RELATED){
+    cached = ct_verdict_get(ct);
+    if(cached != CT_VERDICT_NONE){
+      return stats_verdict(NF_ACCEPT, ct_verdict_stat[cached]);
+    }
+  }
+
+  if(proto == IPPROTO_TCP){
+    rcu_read_lock();
+    if(relay6_set_contains(rcu_dereference(tn->relays6), &ip6_header->daddr)){
+      rcu_read_unlock();
+      if(ct) ct_verdict_set(ct, CT_VERDICT_RELAY);
+      return stats_verdict(NF_ACCEPT, TORPROXY_STAT_RELAY);
+    }
+    if(bypass6_lookup(rcu_dereference(tn->bypass6), &ip6_header->daddr) == BYPASS_ACCEPT){
+      rcu_read_unlock();
+      if(ct) ct_verdict_set(ct, CT_VERDICT_BYPASS);
+      return stats_verdict(NF_ACCEPT, TORPROXY_STAT_BYPASS);
+    }
+    rcu_read_unlock();
+  }
+
+  if(!ct){
+    nf_conntrack_in(dev_net(out), PF_INET6, hooknum, skb);
+    ct = nf_ct_get(skb, &ctinfo);
+    if(!ct){
+      return drop_ipv6(skb, out, hooknum, TORPROXY_STAT_DROP_CONNTRACK);
+    }
+  }
+
+  /* later packets follow the NAT their flow's first one got */
+  if(ctinfo != IP_CT_NEW && ctinfo != IP_CT_RELATED){
+    if(is_dns) return stats_verdict(NF_ACCEPT, TORPROXY_STAT_DNS_QUERY);
+    ct_verdict_set(ct, CT_VERDICT_TOR);
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_TRANS);
+  }
+
+  rcu_read_lock();
+  ep = rcu_dereference(tn->endpoints6);
+  if(!ep){
+    rcu_read_unlock();
+    return drop_ipv6(skb, out, hooknum, TORPROXY_STAT_DROP_IPV6);
+  }
+  tor = ep->ep[endpoint6_pick(ep, &ip6_header->saddr, &ip6_header->daddr, pp[0], pp[1])];
+  rcu_read_unlock();
+
+  if(is_dns){
+    nat6_to_tor(ct, in6(tor.addr), tor.dns_port);
+    return stats_verdict(NF_ACCEPT, TORPROXY_STAT_DNS_QUERY);
+  }
+
+  nat6_to_tor(ct, in6(tor.addr), tor.trans_port);
+  ct_verdict_set(ct, CT_VERDICT_TOR);
+  return stats_verdict(NF_ACCEPT, TORPROXY_STAT_TRANS_NAT);
+}
+
+/* netfilter ipv6 local out hook function */
+static unsigned int local_out6_hook_func(unsigned int hooknum,
+    struct sk_buff *skb,
+    const struct net_device *in,
+    const struct net_device *out,
+    int (*okfn)(struct sk_buff *))
+{
+  u64 start = stats_timer_start();
+  unsigned int verdict;
+
+  verdict = local_out6_verdict(hooknum, skb, in, out, okfn);
+  stats_timer_end(TORPROXY_HOOK_IPV6, start);
+
+  return verdict;
+}
+
+/* Drop all incoming ipv6 traffic except what
+ * comes back from tor over the loopback device */
+static unsigned int pre_routing6_hook_func(unsigned int hooknum,
+    struct sk_buff *skb,
+    const struct net_device *in,
+    const struct net_device *out,
+    int (*okfn)(struct sk_buff *))
+{
+  u64 start = stats_timer_start();
+  unsigned int verdict;
+
+  if(in && (in->flags & IFF_LOOPBACK)){
+    verdict = stats_verdict(NF_ACCEPT, TORPROXY_STAT_LOOPBACK);
+  } else{
+    drop_event_record6(skb, TORPROXY_STAT_DROP_IPV6);
+    verdict = stats_verdict(NF_DROP, TORPROXY_STAT_DROP_IPV6);
+  }
+  stats_timer_end(TORPROXY_HOOK_IPV6, start);
+
+  return verdict;
+}
+
+#endif /* TORPROXY_HOOK6_H */
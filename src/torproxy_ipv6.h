@@ -0,0 +1,264 @@
+/*
+ ***************************************************
+ *
+ * RCU published ipv6 tables
+ *
+ * the ipv6 relay set, bypass prefixes and tor
+ * endpoints. tor publishes a few thousand ipv6
+ * relays at most, they go in the same kind of open
+ * addressing table as the ipv4 ones. bypass lists
+ * hold a handful of ipv6 prefixes, those are kept
+ * longest first and scanned. the endpoints share
+ * the maglev population of the ipv4 ones.
+ *
+ * every update builds complete new tables and swaps
+ * them in with one pointer store, like the ipv4 ones
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_IPV6_H
+#define TORPROXY_IPV6_H
+
+#include <linux/in6.h>
+#include <net/ipv6.h>
+
+#include "torproxy_compat.h"
+#include "torproxy_genl.h"
+#include "torproxy_relay.h"
+#include "torproxy_bypass.h"
+#include "torproxy_endpoint.h"
+
+struct relay6_set {
+  struct rcu_head rcu;
+  unsigned int generation;
+  unsigned int count;
+  u32 mask;
+  u32 seed;
+
+  /* the relays in the order they were given, for readers of the table */
+  struct in6_addr *addrs;
+
+  /* hash table, the unspecified address marks a free slot */
+  struct in6_addr slots[];
+};
+
+struct bypass6_table {
+  struct rcu_head rcu;
+  unsigned int generation;
+
+  /* longest first, so the first match is the longest */
+  unsigned int n_prefixes;
+  struct bypass_prefix6 prefixes[];
+};
+
+struct endpoint6_set {
+  struct rcu_head rcu;
+  unsigned int generation;
+  unsigned int count;
+  struct torproxy_endpoint6 ep[TOR_MAX_ENDPOINTS];
+
+  /* endpoint index of every slot */
+  u8 table[ENDPOINT_TABLE_SIZE];
+};
+
+
+static inline const struct in6_addr *in6(const __be32 *addr){
+  return (const struct in6_addr *) addr;
+}
+
+static inline u32 relay6_hash(const struct relay6_set *set, const struct in6_addr *addr){
+  return jhash2((const u32 *) addr->s6_addr32, 4, set->seed);
+}
+
+/* check if address is a relay, caller holds rcu_read_lock() */
+static inline int relay6_set_contains(const struct relay6_set *set, const struct in6_addr *addr){
+  u32 i;
+
+  if(!set) return 0;
+
+  for(i = relay6_hash(set, addr) & set->mask; !ipv6_addr_any(&set->slots[i]); i = (i+1) & set->mask){
+    if(ipv6_addr_equal(&set->slots[i], addr)) return 1;
+  }
+
+  return 0;
+}
+
+static inline void relay6_set_free(struct relay6_set *set){
+  if(is_vmalloc_addr(set)){
+    vfree(set);
+  } else{
+    kfree(set);
+  }
+}
+
+static void relay6_set_free_rcu(struct rcu_head *head){
+  relay6_set_free(container_of(head, struct relay6_set, rcu));
+}
+
+/* build a new generation from a list of relays, duplicates
+ * and the unspecified address are skipped. a large set is
+ * vmalloc'd, so this may sleep */
+static inline struct relay6_set *relay6_set_build(const struct in6_addr *addrs, unsigned int n,
+    unsigned int generation)
+{
+  struct relay6_set *set;
+  unsigned int n_slots = RELAY_MIN_SLOTS, i;
+  size_t size;
+  u32 h;
+
+  if(n > RELAY6_MAX_ADDRS) return NULL;
+
+  while(n_slots < n + n/2) n_slots *= 2;
+  size = sizeof(*set) + (n_slots + n) * sizeof(struct in6_addr);
+
+  set = (size <= PAGE_SIZE) ? kzalloc(size, GFP_KERNEL) : vzalloc(size);
+  if(!set) return NULL;
+
+  set->generation = generation;
+  set->mask = n_slots - 1;
+  set->addrs = &set->slots[n_slots];
+  get_random_bytes(&set->seed, sizeof(set->seed));
+
+  for(i=0; i<n; i++){
+    if(ipv6_addr_any(&addrs[i])) continue;
+
+    for(h = relay6_hash(set, &addrs[i]) & set->mask; !ipv6_addr_any(&set->slots[h]); h = (h+1) & set->mask){
+      if(ipv6_addr_equal(&set->slots[h], &addrs[i])) break;
+    }
+    if(ipv6_addr_equal(&set->slots[h], &addrs[i])) continue;
+
+    set->slots[h] = addrs[i];
+    set->addrs[set->count++] = addrs[i];
+  }
+
+  return set;
+}
+
+/* publish a new generation, caller serializes writers */
+static inline void relay6_set_replace(struct relay6_set __rcu **head, struct relay6_set *set){
+  struct relay6_set *old;
+
+  old = rcu_dereference_protected(*head, 1);
+  rcu_assign_pointer(*head, set);
+  if(old) call_rcu(&old->rcu, relay6_set_free_rcu);
+}
+
+
+/* action of the longest prefix holding addr, caller holds rcu_read_lock() */
+static inline u32 bypass6_lookup(const struct bypass6_table *t, const struct in6_addr *addr){
+  unsigned int i;
+
+  if(!t) return BYPASS_NONE;
+
+  for(i=0; i<t->n_prefixes; i++){
+    if(ipv6_prefix_equal(addr, in6(t->prefixes[i].addr), t->prefixes[i].len)){
+      return t->prefixes[i].action;
+    }
+  }
+
+  return BYPASS_NONE;
+}
+
+static inline int bypass_prefix6_valid(const struct bypass_prefix6 *p){
+  return p->len <= 128 && (p->action == BYPASS_ACCEPT || p->action == BYPASS_PROXY);
+}
+
+/* prefixes are keyed on their masked address and length */
+static inline int bypass_prefix6_same(const struct bypass_prefix6 *a, const struct bypass_prefix6 *b){
+  return a->len == b->len && ipv6_prefix_equal(in6(a->addr), in6(b->addr), a->len);
+}
+
+static int bypass_prefix6_cmp(const void *a, const void *b){
+  return (int) ((const struct bypass_prefix6 *) b)->len - (int) ((const struct bypass_prefix6 *) a)->len;
+}
+
+/* build a new generation from a list of prefixes */
+static inline struct bypass6_table *bypass6_table_build(const struct bypass_prefix6 *prefixes,
+    unsigned int n, unsigned int generation)
+{
+  struct bypass6_table *t;
+
+  if(n > BYPASS6_MAX_PREFIXES) return NULL;
+
+  t = kmalloc(sizeof(*t) + n * sizeof(*prefixes), GFP_KERNEL);
+  if(!t) return NULL;
+
+  t->generation = generation;
+  t->n_prefixes = n;
+  memcpy(t->prefixes, prefixes, n * sizeof(*prefixes));
+  sort(t->prefixes, n, sizeof(*prefixes), bypass_prefix6_cmp, NULL);
+
+  return t;
+}
+
+/* publish a new generation, caller serializes writers */
+static inline void bypass6_table_replace(struct bypass6_table __rcu **head, struct bypass6_table *t){
+  struct bypass6_table *old;
+
+  old = rcu_dereference_protected(*head, 1);
+  rcu_assign_pointer(*head, t);
+  if(old) kfree_rcu(old, rcu);
+}
+
+
+/* at least one endpoint takes new flows */
+static inline int endpoints6_active(const struct torproxy_endpoint6 *ep, unsigned int n){
+  unsigned int i;
+
+  for(i=0; i<n; i++){
+    if(ep[i].weight) return 1;
+  }
+
+  return 0;
+}
+
+/* build a new generation of ipv6 tor endpoints */
+static inline struct endpoint6_set *endpoint6_set_build(const struct torproxy_endpoint6 *ep,
+    unsigned int n, unsigned int generation, gfp_t gfp)
+{
+  struct endpoint_key key[TOR_MAX_ENDPOINTS];
+  struct endpoint6_set *set;
+  unsigned int i;
+
+  if(n == 0 || n > TOR_MAX_ENDPOINTS || !endpoints6_active(ep, n)) return NULL;
+
+  set = kzalloc(sizeof(*set), gfp);
+  if(!set) return NULL;
+
+  set->generation = generation;
+  set->count = n;
+  memcpy(set->ep, ep, n * sizeof(*ep));
+
+  for(i=0; i<n; i++){
+    key[i].addr = jhash2((const u32 *) ep[i].addr, 4, 0);
+    key[i].ports = (u32) ep[i].trans_port << 16 | ep[i].dns_port;
+    key[i].weight = ep[i].weight;
+  }
+  endpoint_table_populate(set->table, key, n);
+
+  return set;
+}
+
+/* publish a new generation, NULL leaves ipv6 without
+ * endpoints. caller serializes writers */
+static inline void endpoint6_set_replace(struct endpoint6_set __rcu **head, struct endpoint6_set *set){
+  struct endpoint6_set *old;
+
+  old = rcu_dereference_protected(*head, 1);
+  rcu_assign_pointer(*head, set);
+  if(old) kfree_rcu(old, rcu);
+}
+
+/* endpoint a new flow goes to, caller holds rcu_read_lock() */
+static inline unsigned int endpoint6_pick(const struct endpoint6_set *set,
+    const struct in6_addr *saddr, const struct in6_addr *daddr, __be16 sport, __be16 dport)
+{
+  u32 h = jhash_3words(jhash2((const u32 *) saddr->s6_addr32, 4, 0),
+                       jhash2((const u32 *) daddr->s6_addr32, 4, 0),
+                       (u32) sport << 16 | dport, endpoint_flow_seed);
+
+  return set->table[((u64) h * ENDPOINT_TABLE_SIZE) >> 32];
+}
+
+#endif /* TORPROXY_IPV6_H */
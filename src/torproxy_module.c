@@ -10,318 +10,43 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
-#include <linux/proc_fs.h>
-#include <linux/ip.h>
-#include <linux/tcp.h>
-#include <linux/netfilter.h>
-#include <linux/netfilter_ipv4.h>
 #include <linux/types.h>
-#include <linux/kthread.h>
-#include <linux/time.h>
-#include <net/ip.h>
-#include <net/netfilter/nf_conntrack_core.h>
-#include <uapi/linux/netfilter/nf_nat.h>
-#include <net/netfilter/nf_nat.h>
+#include <linux/fs.h>
+#include <linux/vmalloc.h>
 
-MODULE_LICENSE("GPL");
-
-/* tor proxy in network byte order */
-#define TOR_PROXY_IP 0x0100007f /* 127.0.0.1 */
-#define TOR_TRANSPROXY_PORT 0x5023 /* 9040 */
-#define TOR_DNS_PORT 0x5d23 /* 9053 */
-#define RELAY_FILE_NAME "tor_relays"
+#include "torproxy_hook.h"
+#include "torproxy_hook6.h"
+#include "torproxy_gateway.h"
+#include "torproxy_control.h"
 
-#define MAX_RELAY 8
-#define MAX_NAT_ENTRY 500
+#define CREATE_TRACE_POINTS
+#include "torproxy_trace.h"
 
-#define IP_NAT_RANGE_MAP_IPS (1 << 0)
-#define IP_NAT_RANGE_PROTO_SPECIFIED (1 << 1)
+MODULE_LICENSE("GPL");
 
 /* netfilter hook registration */
-static struct nf_hook_ops nfho_local_out, nfho_pre_routing, nfho_forward, nfho_ipv6;
-
-/* for kernel thread */
-struct task_struct *task;
-int data=0;
-
-/* IANA Reserved IP blocks */
-int n_reserved_blocks = 4;
-unsigned int reserved_blocks[] = {
-  0x0000000a,   // 10.0.0.0/8
-  0x0000007f,   // 127.0.0.0/8
-  0x000010ac,   // 172.16.0.0/12
-  0x006358c0    // 192.168.0.0/16
-};
-unsigned int cidr_mask[] = {8, 8, 12, 16};
-
-/* for NAT'ing requests */
-typedef struct{
-  unsigned int ip_src;
-  unsigned int ip_dst;
-  short port_src;
-  short port_dst;
-} nat_entry;
-nat_entry *nat_table;
-
-/* func. defs */
-ssize_t relay_file_read(struct file *file, char *buf, size_t count, loff_t *offset);
-ssize_t relay_file_write(struct file *file, const char *buf, size_t count, loff_t *offset);
-
-/* for creation of proc entry for kernel-userspace communication */
-struct proc_dir_entry *proc_entry;
-static const struct file_operations proc_file_ops= {
-  .read = relay_file_read,
-  .write = relay_file_write,
-};
-
-/* for storing currently used tor relays */
-int *relays;
-
-/* mutex for reading from relays */
-static DEFINE_MUTEX(cache_lock);
-
-
-/* for reading from created tor relays proc entry */
-ssize_t relay_file_read(struct file *file, char *buf, size_t count, loff_t *offset){
-  int ret;
-
-  if(*offset > sizeof(int)*MAX_RELAY) return 0;
-
-  if(count > (sizeof(int)*MAX_RELAY)+*offset){
-    ret = sizeof(int)*MAX_RELAY-*offset;
-  } else{
-    ret = count;
-  }
-
-  memcpy(buf, relays+*offset, ret);
-  *offset += ret;
-
-  return ret;
-
-}
-
-/* for writing to created tor relays proc entry */
-ssize_t relay_file_write(struct file *file, const char *buf, size_t count, loff_t *offset){
-  int ret;
-
-  if(count > (sizeof(int)*MAX_RELAY)-*offset){
-    ret = sizeof(int)*MAX_RELAY-*offset;
-  } else{
-    ret = count;
-  }
-
-  mutex_lock(&cache_lock);
-  if(copy_from_user(relays+*offset, buf, ret)){
-    mutex_unlock(&cache_lock);
-    return -EFAULT;
-  }
-  mutex_unlock(&cache_lock);
-  *offset += ret;
-
-  return ret;
-
-}
-
-
-
-/* netfilter local out hook function */
-unsigned int local_out_hook_func(unsigned int hooknum,
-    struct sk_buff *skb,
-    const struct net_device *in,
-    const struct net_device *out,
-    int (*okfn)(struct sk_buff *))
-{
-  int i, err, len, offset;
-  unsigned int ret;
-  struct iphdr *ip_header;
-  struct tcphdr *tcp_header;
-  struct udphdr *udp_header;
-  struct nf_nat_range newrange;
-  enum ip_conntrack_info ctinfo;
-  struct nf_conn *ct;
-  nat_entry *nat;
-
-  ip_header = (struct iphdr *) skb_network_header(skb);
-
-  /* Handle UDP packets */
-  if(ip_header->protocol == IPPROTO_UDP){
-
-    udp_header = (struct udphdr *) skb_transport_header(skb);
-
-    /* If regular DNS request forward to TorDNS */
-    if((short) udp_header->dest == (short) 0x3500){ // UDP port 53
-
-      /* store nat entry */
-      mutex_lock(&cache_lock);
-      for(i=0; i<MAX_NAT_ENTRY; i++){
-        nat = &nat_table[i];
-        if(nat->ip_dst == 0){
-          nat->ip_dst = ip_header->daddr;
-          nat->port_dst = udp_header->dest;
-          nat->ip_src = ip_header->saddr;
-          nat->port_src = udp_header->source;
-          break;
-        }
-      }
-      mutex_unlock(&cache_lock);
-
-      if(i == MAX_NAT_ENTRY){
-        printk(KERN_INFO "Torproxy NAT table full, dropping packet %pI4:%d\n", &ip_header->daddr, ntohs(udp_header->dest));
-        return NF_DROP;
-      }
-
-      /* modify dest to go to DNS proxy */
-      ip_header->daddr = (unsigned int) TOR_PROXY_IP; 
-      udp_header->dest = (short) TOR_DNS_PORT;
-
-      /* correct the IP checksum */
-      ip_send_check(ip_header);
-
-      /* correct UDP checksum */
-      offset = skb_transport_offset(skb);
-      len = skb->len - offset;
-      udp_header->check = 0;
-      if(skb->len > 60){
-        udp_header->check  = csum_tcpudp_magic(ip_header->saddr,
-                                                 ip_header->daddr,
-                                                 len,
-                                                 IPPROTO_UDP,
-                                                 csum_partial((unsigned char *)udp_header,len,0));
-      }
-      else{
-        udp_header->check  = ~csum_tcpudp_magic(ip_header->saddr,
-                                                  ip_header->daddr,
-                                                  len,
-                                                  IPPROTO_UDP,
-                                                  0);
-      }
-
-      /* re-route mangled packets */
-      err = ip_route_me_harder(skb, RTN_UNSPEC);
-      if(err < 0){
-       return NF_DROP;
-      }
-
-      return NF_ACCEPT;
-
-    }
-
-
-    /* If packet is from TorDNS */
-    if((ip_header->saddr == (unsigned int) TOR_PROXY_IP) && (udp_header->source == (short) TOR_DNS_PORT)){ // UDP port 53
-
-      /* look for entry in NAT table */
-      mutex_lock(&cache_lock);
-      for(i=0; i<MAX_NAT_ENTRY; i++){
-        nat = &nat_table[i];
-        if(nat->port_src == (short) udp_header->dest){
-          ip_header->saddr = nat->ip_dst;
-          udp_header->source = nat->port_dst;
-          /* erase NAT entry */
-          memset(nat, 0, sizeof(nat_entry));
-          break;
-        }
-      }
-      mutex_unlock(&cache_lock);
-
-      /* port not in NAT table */
-      if(i == MAX_NAT_ENTRY){
-        return NF_ACCEPT;
-      }
-
-
-      /* correct the IP checksum */
-      ip_send_check(ip_header);
-
-      /* correct UDP checksum */
-      offset = skb_transport_offset(skb);
-      len = skb->len - offset;
-      udp_header->check = 0;
-      if(skb->len > 60){
-        udp_header->check  = csum_tcpudp_magic(ip_header->saddr,
-                                                ip_header->daddr,
-                                                len,
-                                                IPPROTO_UDP,
-                                                csum_partial((unsigned char *)udp_header,len,0));
-      }
-      else{
-        udp_header->check  = ~csum_tcpudp_magic(ip_header->saddr,
-                                                  ip_header->daddr,
-                                                  len,
-                                                  IPPROTO_UDP,
-                                                  0);
-      }
-
-
-      /* re-route mangled packets */
-      err = ip_route_me_harder(skb, RTN_UNSPEC);
-      if(err < 0){
-        printk("Error rerouting packet\n");
-        return NF_DROP;
-      }
-
-      return NF_ACCEPT;
-
-    }
-  }
-
-
-
-  /* Drop all non TCP packets */
-  if(ip_header->protocol != IPPROTO_TCP){
-    return NF_DROP;
-  }
-
-  tcp_header = (struct tcphdr *) skb_transport_header(skb);
-
-  /* ensure all outbound packets are tor relays */
-  mutex_lock(&cache_lock);
-  for(i=0; i<MAX_RELAY;i++){
-    if(ip_header->daddr == relays[i]){
-      mutex_unlock(&cache_lock);
-      return NF_ACCEPT;
-    }
-  }
-  mutex_unlock(&cache_lock);
-
+static struct nf_hook_ops nfho_local_out, nfho_pre_routing, nfho_forward, nfho_ipv6, nfho_ipv6_local_out, nfho_gateway, nfho_flow_out;
 
-  /* allow connections to reserved blocks */
-  for(i=0; i< n_reserved_blocks; i++){
-    if((ip_header->daddr & (0xffffffff >> cidr_mask[i])) ==  reserved_blocks[i]){
-      return NF_ACCEPT;
-    }
-  }
+static unsigned int nat_max_entries = NAT_MAX_ENTRIES;
+module_param(nat_max_entries, uint, 0444);
+MODULE_PARM_DESC(nat_max_entries, "maximum number of DNS queries in flight");
 
+static unsigned int nat_timeout_ms = NAT_TIMEOUT_MS;
+module_param(nat_timeout_ms, uint, 0444);
+MODULE_PARM_DESC(nat_timeout_ms, "milliseconds before an unanswered DNS query is forgotten");
 
-  /* retrieve conntrack entry */
-  ct = nf_ct_get(skb, &ctinfo);
-  if(!ct){
-    /* initialize conntrack */
-    ret = nf_conntrack_in(dev_net(out), PF_INET, hooknum, skb);
-    ct = nf_ct_get(skb, &ctinfo);
-    if(!ct){
-      printk(KERN_INFO "Could not insert conntrack %pI4:%d, packet dropped\n", &ip_header->daddr,ntohs(tcp_header->dest));
-      return NF_DROP;
-    }
-  }
+/* NAT entries of every namespace */
+static struct kmem_cache *nat_cache;
 
+module_param_named(reject, reject_packets, bool, 0644);
+MODULE_PARM_DESC(reject, "answer dropped local packets with a reset or ICMP error so senders fail at once");
 
-  /* setup natting to transparent TOR proxy */
-  if(ct && (ctinfo == IP_CT_NEW || ctinfo == IP_CT_RELATED)){
-    newrange.flags = (IP_NAT_RANGE_MAP_IPS | IP_NAT_RANGE_PROTO_SPECIFIED);
-    newrange.min_addr.ip = (__be32) TOR_PROXY_IP;
-    newrange.max_addr.ip =  (__be32) TOR_PROXY_IP;
-    newrange.min_proto.tcp.port = (__be16) TOR_TRANSPROXY_PORT;
-    newrange.max_proto.tcp.port = (__be16) TOR_TRANSPROXY_PORT;
+module_param(flow_offload, bool, 0644);
+MODULE_PARM_DESC(flow_offload, "let tor's established relay connections skip conntrack's lookup");
 
-    ret = nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_DST);
-  }
-
-  //printk("packet %pI4:%d\n", &ip_header->daddr,ntohs(tcp_header->dest));
-  return NF_ACCEPT;
-
-
-}
+static char *snapshot = TORPROXY_SNAPSHOT_PATH;
+module_param(snapshot, charp, 0444);
+MODULE_PARM_DESC(snapshot, "relay and bypass snapshot loaded at insert, empty for none");
 
 /* netfilter pre-routing hook function double check to
  * ensure ALL outgoing packets are for Tor relay
@@ -332,7 +57,6 @@ unsigned int post_routing_hook_func(unsigned int hooknum,
     const struct net_device *out,
     int (*okfn)(struct sk_buff *))
 {
-  int i;
   struct iphdr *ip_header;
 
   return NF_ACCEPT;
@@ -340,20 +64,13 @@ unsigned int post_routing_hook_func(unsigned int hooknum,
   ip_header = (struct iphdr *) skb_network_header(skb);
 
   // ensure all outbound packets are tor relays 
-  mutex_lock(&cache_lock);
-  for(i=0; i<MAX_RELAY;i++){
-    if(ip_header->daddr == relays[i]){
-      mutex_unlock(&cache_lock);
-      return NF_ACCEPT;
-    }
+  if(is_tor_relay(torproxy_pernet(dev_net(out)), ip_header->daddr)){
+    return NF_ACCEPT;
   }
-  mutex_unlock(&cache_lock);
 
-  /* allow connections to reserved blocks */
-  for(i=0; i< n_reserved_blocks; i++){
-    if((ip_header->daddr & (0xffffffff >> cidr_mask[i])) ==  reserved_blocks[i]){
-      return NF_ACCEPT;
-    }
+  /* allow connections to bypassed prefixes */
+  if(is_bypassed(torproxy_pernet(dev_net(out)), ip_header->daddr)){
+    return NF_ACCEPT;
   }
 
   /* drop if not headed for relay */
@@ -361,80 +78,185 @@ unsigned int post_routing_hook_func(unsigned int hooknum,
 
 }
 
-/* Drop all forwarded traffic */
+/* Drop all forwarded traffic, a rejection would go back
+ * onto the wire and the local out hook drops it anyway.
+ * gateway clients are NAT'd to tor before routing and
+ * delivered locally, they are never forwarded either */
 unsigned int forward_hook_func(unsigned int hooknum,
       struct sk_buff *skb,
       const struct net_device *in,
       const struct net_device *out,
       int (*okfn)(struct sk_buff *))
 {
-  return NF_DROP;
+  u64 start = stats_timer_start();
+  unsigned int verdict;
+
+  verdict = stats_verdict(NF_DROP, TORPROXY_STAT_DROP_FORWARD);
+  stats_timer_end(TORPROXY_HOOK_FORWARD, start);
+
+  return verdict;
 }
 
-/* Drop all ipv6 traffic */
-unsigned int ipv6_hook_func(unsigned int hooknum,
-    struct sk_buff *skb,
-    const struct net_device *in,
-    const struct net_device *out,
-    int (*okfn)(struct sk_buff *))
-{
-  return NF_DROP;
+/* every namespace, the existing ones when the module is inserted,
+ * starts with no relays, the private blocks bypassed and the local
+ * tor instance used. ipv6 is dropped until it gets a tor endpoint
+ * and no LAN is proxied until it gets gateway interfaces */
+static int __net_init torproxy_net_init(struct net *net){
+  struct torproxy_net *tn = torproxy_pernet(net);
+  int err;
+
+  tn->net = net;
+  INIT_DELAYED_WORK(&tn->nat_expire_work, nat_expire_work_func);
+  INIT_DELAYED_WORK(&tn->flow_expire_work, flow_expire_work_func);
+
+  err = nat_table_init(&tn->dns_nat, nat_cache, NAT_HASH_BITS, nat_max_entries, nat_timeout_ms);
+  if(err < 0) return err;
+
+  err = flow_table_init(&tn->flows, FLOW_HASH_BITS, FLOW_IDLE_MS);
+  if(err < 0){
+    nat_table_destroy(&tn->dns_nat);
+    return err;
+  }
+
+  err = config_init(tn);
+  if(err < 0){
+    flow_table_destroy(&tn->flows);
+    nat_table_destroy(&tn->dns_nat);
+    return err;
+  }
+
+  return 0;
 }
 
+/* the namespace has no device left to send a packet through */
+static void __net_exit torproxy_net_exit(struct net *net){
+  struct torproxy_net *tn = torproxy_pernet(net);
 
-/* Thread for clearing NAT table every 30 seconds */
-int purge_relays_th(void *data){
-  struct timespec ts;
-  time_t time_b, time_c;
-  int i;
-
-  while(!kthread_should_stop()){
-    getnstimeofday(&ts);
-    time_b = time_c = ts.tv_sec;
-    while((time_c-time_b) < (time_t) 30){
-      schedule();
-      if(kthread_should_stop()) return 0;
-      getnstimeofday(&ts);
-      time_c = ts.tv_sec;
-    }
-    /* clear NAT table */
-    mutex_lock(&cache_lock);
-    for(i=0; i<MAX_NAT_ENTRY; i++){
-      memset(nat_table, 0, sizeof(nat_entry)*MAX_NAT_ENTRY);
+  cancel_delayed_work_sync(&tn->nat_expire_work);
+  cancel_delayed_work_sync(&tn->flow_expire_work);
+  config_destroy(tn);
+  flow_table_destroy(&tn->flows);
+  nat_table_destroy(&tn->dns_nat);
+}
+
+static struct pernet_operations torproxy_net_ops = {
+  .init = torproxy_net_init,
+  .exit = torproxy_net_exit,
+  .id = &torproxy_net_id,
+  .size = sizeof(struct torproxy_net),
+};
+
+
+/* load the relays and bypass prefixes relay_pop last saved into the
+ * initial namespace, a missing or bad snapshot leaves the defaults */
+static void load_snapshot(const char *path){
+  struct file *file;
+  loff_t size;
+  void *buf;
+  int err;
+
+  if(!path || !*path) return;
+
+  file = filp_open(path, O_RDONLY, 0);
+  if(IS_ERR(file)){
+    if(PTR_ERR(file) != -ENOENT){
+      printk(KERN_WARNING "Tor Proxy: could not open snapshot %s (%ld)\n", path, PTR_ERR(file));
     }
-    mutex_unlock(&cache_lock);
+    return;
   }
 
-  return 0;
+  size = i_size_read(file_inode(file));
+  if(size <= 0 || size > TORPROXY_SNAPSHOT_MAX){
+    printk(KERN_WARNING "Tor Proxy: ignoring snapshot %s of %lld bytes\n", path, size);
+    filp_close(file, NULL);
+    return;
+  }
+
+  buf = vmalloc(size);
+  if(!buf){
+    filp_close(file, NULL);
+    return;
+  }
+
+  err = kernel_read(file, 0, buf, size);
+  filp_close(file, NULL);
+
+  if(err == size) err = snapshot_check(buf, size);
+  else if(err >= 0) err = -EIO;
+
+  if(err == 0) err = config_load_snapshot(torproxy_pernet(&init_net), buf);
+
+  if(err < 0) printk(KERN_WARNING "Tor Proxy: ignoring snapshot %s (%d)\n", path, err);
+  else printk(KERN_INFO "Tor Proxy: loaded snapshot %s\n", path);
+
+  vfree(buf);
 }
 
 /* initialization routine */
 int init_module(){
 
-  int i;
+  int err;
 
-  /* For storing currently used tor relays */
-  relays = kmalloc(sizeof(int)*MAX_RELAY, GFP_KERNEL);
+  /* per-cpu counters the hooks update */
+  err = stats_init();
+  if(err < 0){
+    printk(KERN_ALERT "Error: could not allocate statistics\n");
+    return err;
+  }
+
+  /* rings the hooks report dropped packets to */
+  err = drop_rings_init();
+  if(err < 0){
+    printk(KERN_ALERT "Error: could not allocate drop rings\n");
+    stats_destroy();
+    return err;
+  }
 
   /* For storing NAT entries */
-  nat_table = kmalloc(sizeof(nat_entry)*MAX_NAT_ENTRY, GFP_KERNEL);
-  memset(nat_table, 0, sizeof(nat_entry)*MAX_NAT_ENTRY);
+  nat_cache = nat_entry_cache_create();
+  if(!nat_cache){
+    printk(KERN_ALERT "Error: could not allocate NAT table\n");
+    drop_rings_destroy();
+    stats_destroy();
+    return -ENOMEM;
+  }
 
-  /* initialize ips */
-  for(i=0; i<MAX_RELAY; i++){
-    relays[i] = -1;
+  /* tables and NAT state of every namespace */
+  err = register_pernet_subsys(&torproxy_net_ops);
+  if(err < 0){
+    printk(KERN_ALERT "Error: could not allocate relay tables\n");
+    kmem_cache_destroy(nat_cache);
+    drop_rings_destroy();
+    stats_destroy();
+    return err;
   }
 
-  /* start kernel thread removing tor relays periodically */
-  task = kthread_run(&purge_relays_th, (void *) &data, "purge_relays");
+  /* tables the hooks start with, before they see a packet */
+  load_snapshot(snapshot);
+
+  /* generic netlink family for kernel-userspace communication */
+  err = genl_register_family_with_ops(&torproxy_genl_family, torproxy_genl_ops);
+  if(err < 0){
+    printk(KERN_ALERT "Error: could not register %s netlink family\n", TORPROXY_GENL_NAME);
+    unregister_pernet_subsys(&torproxy_net_ops);
+    rcu_barrier();
+    kmem_cache_destroy(nat_cache);
+    drop_rings_destroy();
+    stats_destroy();
+    return err;
+  }
 
-  /* creates entry in proc for reading and writing
-   * needed for communication between kernel and userspace */
-  proc_entry= proc_create(RELAY_FILE_NAME, 0644, NULL, &proc_file_ops);
-  if(proc_entry == NULL){
-    proc_remove(proc_entry);
-    printk(KERN_ALERT "Error: could not create /proc/%s entry\n", RELAY_FILE_NAME);
-    return -ENOMEM;
+  /* userspace maps the drop rings from here */
+  err = misc_register(&drop_dev);
+  if(err < 0){
+    printk(KERN_ALERT "Error: could not register %s\n", DROP_RING_DEVICE);
+    genl_unregister_family(&torproxy_genl_family);
+    unregister_pernet_subsys(&torproxy_net_ops);
+    rcu_barrier();
+    kmem_cache_destroy(nat_cache);
+    drop_rings_destroy();
+    stats_destroy();
+    return err;
   }
 
   /*  Fill in our hooking structures */
@@ -456,12 +278,31 @@ int init_module(){
   nfho_forward.priority = NF_IP_PRI_FIRST;
   nf_register_hook(&nfho_forward);
 
-  nfho_ipv6.hook = (nf_hookfn *) ipv6_hook_func;
+  nfho_ipv6.hook = (nf_hookfn *) pre_routing6_hook_func;
   nfho_ipv6.hooknum = NF_INET_PRE_ROUTING;
   nfho_ipv6.pf = PF_INET6;
   nfho_ipv6.priority = NF_IP_PRI_FIRST;
   nf_register_hook(&nfho_ipv6);
 
+  nfho_ipv6_local_out.hook = (nf_hookfn *) local_out6_hook_func;
+  nfho_ipv6_local_out.hooknum = NF_INET_LOCAL_OUT;
+  nfho_ipv6_local_out.pf = PF_INET6;
+  nfho_ipv6_local_out.priority = NF_IP6_PRI_MANGLE;
+  nf_register_hook(&nfho_ipv6_local_out);
+
+  /* after conntrack and before its NAT, like the local out hook */
+  nfho_gateway.hook = (nf_hookfn *) gateway_hook_func;
+  nfho_gateway.hooknum = NF_INET_PRE_ROUTING;
+  nfho_gateway.pf = PF_INET;
+  nfho_gateway.priority = NF_IP_PRI_MANGLE;
+  nf_register_hook(&nfho_gateway);
+
+  /* after raw so its NOTRACK rules still apply, before conntrack */
+  nfho_flow_out.hook = (nf_hookfn *) flow_out_hook_func;
+  nfho_flow_out.hooknum = NF_INET_LOCAL_OUT;
+  nfho_flow_out.pf = PF_INET;
+  nfho_flow_out.priority = NF_IP_PRI_CONNTRACK - 1;
+  nf_register_hook(&nfho_flow_out);
 
   printk(KERN_INFO "Tor Proxy module inserted\n");
   return 0;
@@ -470,19 +311,28 @@ int init_module(){
 /* cleanup routine */
 void cleanup_module(){
 
-  kthread_stop(task);
+  /* no more updates from userspace, a mapped device holds a module reference */
+  genl_unregister_family(&torproxy_genl_family);
+  misc_deregister(&drop_dev);
 
   /*unregister netfilter hook */
   nf_unregister_hook(&nfho_local_out);
   nf_unregister_hook(&nfho_pre_routing);
   nf_unregister_hook(&nfho_forward);
   nf_unregister_hook(&nfho_ipv6);
-
-  /* remove /proc/tor_relays */
-  proc_remove(proc_entry);
-
-  kfree(relays);
-  kfree(nat_table);
+  nf_unregister_hook(&nfho_ipv6_local_out);
+  nf_unregister_hook(&nfho_gateway);
+  nf_unregister_hook(&nfho_flow_out);
+
+  /* hooks are unregistered so no reader can still see the tables
+   * and none can queue the expiry work anymore */
+  unregister_pernet_subsys(&torproxy_net_ops);
+
+  /* sets replaced by earlier updates may still be waiting for their grace period */
+  rcu_barrier();
+  kmem_cache_destroy(nat_cache);
+  drop_rings_destroy();
+  stats_destroy();
 
   printk(KERN_INFO "Tor Proxy module removed\n");
 }
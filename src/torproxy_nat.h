@@ -0,0 +1,366 @@
+/*
+ ***************************************************
+ *
+ * DNS NAT table
+ *
+ * remembers where redirected DNS queries were headed
+ * so TorDNS replies can be rewritten back. entries
+ * are hashed on (source address, source port, DNS
+ * transaction id) into buckets with their own lock.
+ *
+ * every entry also sits in a timer wheel slot picked
+ * from its deadline, expiry only ever visits the
+ * slots whose time has passed so its cost follows the
+ * number of expired entries rather than table size
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_NAT_H
+#define TORPROXY_NAT_H
+
+#include "torproxy_compat.h"
+
+/* default sizing, 16k buckets keep chains short at 64k queries in flight */
+#define NAT_HASH_BITS 14
+#define NAT_MAX_ENTRIES 65536
+#define NAT_TIMEOUT_MS 30000
+
+/* the wheel spans at least twice the timeout so a new
+ * entry never lands in a slot that is about to be reaped */
+#define NAT_WHEEL_BITS 6
+#define NAT_WHEEL_SLOTS (1U << NAT_WHEEL_BITS)
+
+/* each slot is split in lanes by bucket so CPUs inserting
+ * during the same tick don't all take one lock */
+#define NAT_WHEEL_LANES 16
+
+/* entries collected per pass over a wheel slot */
+#define NAT_REAP_BATCH 32
+
+struct nat_entry {
+  struct nat_entry *next;
+  struct nat_entry *tw_next, **tw_pprev;
+  unsigned long expires;
+  unsigned int bucket;
+  unsigned int slot;
+  __be32 ip_src;
+  __be32 ip_dst;
+  __be16 port_src;
+  __be16 port_dst;
+  __be16 dns_id;
+};
+
+struct nat_bucket {
+  spinlock_t lock;
+  struct nat_entry *head;
+};
+
+struct nat_wheel_slot {
+  spinlock_t lock;
+  struct nat_entry *head;
+};
+
+struct nat_table {
+  struct nat_bucket *buckets;
+  struct kmem_cache *cache;
+  unsigned int mask;
+  unsigned int max_entries;
+  unsigned long timeout;
+  u32 seed;
+  atomic_t count;
+
+  /* timer wheel, a slot covers 1 << tick_shift jiffies.
+   * wheel_time is only touched by the expiry worker */
+  struct nat_wheel_slot wheel[NAT_WHEEL_SLOTS][NAT_WHEEL_LANES];
+  unsigned int tick_shift;
+  unsigned long wheel_time;
+};
+
+
+static inline unsigned int nat_hash(const struct nat_table *t, __be32 ip_src,
+    __be16 port_src, __be16 dns_id)
+{
+  return jhash_3words((u32) ip_src, ((u32) port_src << 16) | dns_id, 0, t->seed) & t->mask;
+}
+
+static inline int nat_entry_match(const struct nat_entry *e, __be32 ip_src,
+    __be16 port_src, __be16 dns_id)
+{
+  return e->ip_src == ip_src && e->port_src == port_src && e->dns_id == dns_id;
+}
+
+static inline unsigned int nat_wheel_index(const struct nat_table *t, unsigned long time){
+  return (time >> t->tick_shift) & (NAT_WHEEL_SLOTS-1);
+}
+
+/* jiffies until the wheel next needs to advance */
+static inline unsigned long nat_table_tick(const struct nat_table *t){
+  return 1UL << t->tick_shift;
+}
+
+
+/* wheel links, caller holds the entry's bucket lock */
+static inline void nat_wheel_link(struct nat_table *t, struct nat_entry *e){
+  struct nat_wheel_slot *ws;
+
+  e->slot = nat_wheel_index(t, e->expires);
+  ws = &t->wheel[e->slot][e->bucket % NAT_WHEEL_LANES];
+
+  spin_lock_bh(&ws->lock);
+  e->tw_next = ws->head;
+  if(ws->head) ws->head->tw_pprev = &e->tw_next;
+  e->tw_pprev = &ws->head;
+  ws->head = e;
+  spin_unlock_bh(&ws->lock);
+}
+
+static inline void nat_wheel_unlink(struct nat_table *t, struct nat_entry *e){
+  struct nat_wheel_slot *ws = &t->wheel[e->slot][e->bucket % NAT_WHEEL_LANES];
+
+  spin_lock_bh(&ws->lock);
+  *e->tw_pprev = e->tw_next;
+  if(e->tw_next) e->tw_next->tw_pprev = e->tw_pprev;
+  spin_unlock_bh(&ws->lock);
+}
+
+/* remove entry *pp from its bucket and the wheel, caller holds the bucket lock */
+static inline void nat_entry_unlink(struct nat_table *t, struct nat_entry **pp){
+  struct nat_entry *e = *pp;
+
+  *pp = e->next;
+  nat_wheel_unlink(t, e);
+}
+
+static inline void nat_entry_free(struct nat_table *t, struct nat_entry *e){
+  kmem_cache_free(t->cache, e);
+  atomic_dec(&t->count);
+}
+
+
+/* store where a query was headed, a retransmitted query refreshes
+ * its entry. returns -ENOSPC if max_entries queries are in flight */
+static inline int nat_table_insert(struct nat_table *t, __be32 ip_src, __be16 port_src,
+    __be16 dns_id, __be32 ip_dst, __be16 port_dst)
+{
+  unsigned int h = nat_hash(t, ip_src, port_src, dns_id);
+  struct nat_bucket *b = &t->buckets[h];
+  struct nat_entry *e;
+  unsigned long expires = jiffies + t->timeout;
+  int ret = 0;
+
+  spin_lock_bh(&b->lock);
+
+  for(e = b->head; e; e = e->next){
+    if(nat_entry_match(e, ip_src, port_src, dns_id)){
+      e->ip_dst = ip_dst;
+      e->port_dst = port_dst;
+      if(nat_wheel_index(t, expires) != e->slot){
+        nat_wheel_unlink(t, e);
+        e->expires = expires;
+        nat_wheel_link(t, e);
+      } else{
+        e->expires = expires;
+      }
+      goto out;
+    }
+  }
+
+  if((unsigned int) atomic_inc_return(&t->count) > t->max_entries){
+    atomic_dec(&t->count);
+    ret = -ENOSPC;
+    goto out;
+  }
+
+  e = kmem_cache_alloc(t->cache, GFP_ATOMIC);
+  if(!e){
+    atomic_dec(&t->count);
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  e->ip_src = ip_src;
+  e->port_src = port_src;
+  e->dns_id = dns_id;
+  e->ip_dst = ip_dst;
+  e->port_dst = port_dst;
+  e->expires = expires;
+  e->bucket = h;
+  e->next = b->head;
+  b->head = e;
+  nat_wheel_link(t, e);
+
+out:
+  spin_unlock_bh(&b->lock);
+  return ret;
+}
+
+/* look up the original destination of a query and erase its entry,
+ * returns 1 if found */
+static inline int nat_table_take(struct nat_table *t, __be32 ip_src, __be16 port_src,
+    __be16 dns_id, __be32 *ip_dst, __be16 *port_dst)
+{
+  struct nat_bucket *b = &t->buckets[nat_hash(t, ip_src, port_src, dns_id)];
+  struct nat_entry **pp, *e = NULL;
+  int found = 0;
+
+  spin_lock_bh(&b->lock);
+
+  for(pp = &b->head; *pp; pp = &(*pp)->next){
+    if(nat_entry_match(*pp, ip_src, port_src, dns_id)){
+      e = *pp;
+      /* expired but not reaped yet, the query is gone all the same */
+      found = !time_after_eq(jiffies, e->expires);
+      if(found){
+        *ip_dst = e->ip_dst;
+        *port_dst = e->port_dst;
+      }
+      nat_entry_unlink(t, pp);
+      break;
+    }
+  }
+
+  spin_unlock_bh(&b->lock);
+
+  if(e) nat_entry_free(t, e);
+  return found;
+}
+
+
+/* reap an entry seen expired in a wheel slot. it may have been taken
+ * or refreshed since, so it is only trusted once found in its bucket */
+static inline int nat_reap_one(struct nat_table *t, struct nat_entry *e,
+    unsigned int bucket, unsigned long now)
+{
+  struct nat_bucket *b = &t->buckets[bucket];
+  struct nat_entry **pp;
+  int reaped = 0;
+
+  spin_lock_bh(&b->lock);
+  for(pp = &b->head; *pp; pp = &(*pp)->next){
+    if(*pp != e) continue;
+    if(time_after_eq(now, e->expires)){
+      nat_entry_unlink(t, pp);
+      reaped = 1;
+    }
+    break;
+  }
+  spin_unlock_bh(&b->lock);
+
+  if(reaped) nat_entry_free(t, e);
+  return reaped;
+}
+
+static inline unsigned int nat_reap_lane(struct nat_table *t, struct nat_wheel_slot *ws, unsigned long now){
+  struct nat_entry *batch[NAT_REAP_BATCH], *e;
+  unsigned int bucket[NAT_REAP_BATCH];
+  unsigned int i, n, reaped = 0;
+
+  do{
+    n = 0;
+    spin_lock_bh(&ws->lock);
+    for(e = ws->head; e && n < NAT_REAP_BATCH; e = e->tw_next){
+      if(!time_after_eq(now, e->expires)) continue;
+      batch[n] = e;
+      bucket[n] = e->bucket;
+      n++;
+    }
+    spin_unlock_bh(&ws->lock);
+
+    for(i=0; i<n; i++){
+      reaped += nat_reap_one(t, batch[i], bucket[i], now);
+    }
+  } while(n == NAT_REAP_BATCH);
+
+  return reaped;
+}
+
+static inline unsigned int nat_reap_slot(struct nat_table *t, unsigned int slot, unsigned long now){
+  unsigned int lane, reaped = 0;
+
+  for(lane=0; lane<NAT_WHEEL_LANES; lane++){
+    if(!t->wheel[slot][lane].head) continue;
+    reaped += nat_reap_lane(t, &t->wheel[slot][lane], now);
+  }
+
+  return reaped;
+}
+
+/* advance the wheel over every slot whose interval has fully passed,
+ * returns number of entries expired. callers must not run concurrently */
+static inline unsigned int nat_table_run_timers(struct nat_table *t){
+  unsigned long now = jiffies, tick = nat_table_tick(t);
+  unsigned int steps, reaped = 0;
+
+  for(steps=0; steps<NAT_WHEEL_SLOTS && time_after_eq(now, t->wheel_time + tick); steps++){
+    reaped += nat_reap_slot(t, nat_wheel_index(t, t->wheel_time), now);
+    t->wheel_time += tick;
+  }
+
+  /* slept through a whole revolution, every slot was just visited */
+  if(time_after_eq(now, t->wheel_time + tick)){
+    t->wheel_time = now & ~(tick-1);
+  }
+
+  return reaped;
+}
+
+
+/* entries come from cache, which tables of several namespaces may share */
+static inline int nat_table_init(struct nat_table *t, struct kmem_cache *cache, unsigned int bits,
+    unsigned int max_entries, unsigned int timeout_ms)
+{
+  unsigned int i, lane;
+
+  t->mask = (1U << bits) - 1;
+  t->max_entries = max_entries;
+  t->timeout = msecs_to_jiffies(timeout_ms);
+  if(t->timeout == 0) t->timeout = 1;
+  atomic_set(&t->count, 0);
+  get_random_bytes(&t->seed, sizeof(t->seed));
+
+  /* power of two ticks keep slots continuous when jiffies wrap */
+  t->tick_shift = 0;
+  while((1UL << t->tick_shift) * (NAT_WHEEL_SLOTS/2) < t->timeout){
+    t->tick_shift++;
+  }
+  t->wheel_time = jiffies & ~(nat_table_tick(t)-1);
+  for(i=0; i<NAT_WHEEL_SLOTS; i++){
+    for(lane=0; lane<NAT_WHEEL_LANES; lane++){
+      spin_lock_init(&t->wheel[i][lane].lock);
+      t->wheel[i][lane].head = NULL;
+    }
+  }
+
+  t->buckets = vzalloc(sizeof(struct nat_bucket) << bits);
+  if(!t->buckets) return -ENOMEM;
+  for(i=0; i<=t->mask; i++){
+    spin_lock_init(&t->buckets[i].lock);
+  }
+
+  t->cache = cache;
+
+  return 0;
+}
+
+/* cache for nat_table_init(), destroyed once no table uses it */
+static inline struct kmem_cache *nat_entry_cache_create(void){
+  return kmem_cache_create("torproxy_nat", sizeof(struct nat_entry), 0, 0, NULL);
+}
+
+/* caller ensures no hook or timer can still use the table */
+static inline void nat_table_destroy(struct nat_table *t){
+  struct nat_entry *e, *next;
+  unsigned int i;
+
+  for(i=0; i<=t->mask; i++){
+    for(e = t->buckets[i].head; e; e = next){
+      next = e->next;
+      kmem_cache_free(t->cache, e);
+    }
+  }
+
+  vfree(t->buckets);
+}
+
+#endif /* TORPROXY_NAT_H */
@@ -0,0 +1,96 @@
+/*
+ ***************************************************
+ *
+ * per network namespace proxy state
+ *
+ * every namespace proxies through its own tor
+ * endpoints with its own relay, bypass and DNS NAT
+ * tables, configured from inside the namespace. the
+ * hooks are registered once for all namespaces and
+ * find the state of the one a packet travels in
+ * through its device, so containers share no table
+ * and no lock on the packet path
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_NET_H
+#define TORPROXY_NET_H
+
+#ifdef __KERNEL__
+
+#include <linux/workqueue.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+
+#else
+
+#include "bench/kshim.h"
+
+#endif
+
+#include "torproxy_compat.h"
+#include "torproxy_relay.h"
+#include "torproxy_bypass.h"
+#include "torproxy_endpoint.h"
+#include "torproxy_nat.h"
+#include "torproxy_policy.h"
+#include "torproxy_flow.h"
+
+struct relay6_set;
+struct bypass6_table;
+struct endpoint6_set;
+struct gateway_set;
+
+struct torproxy_net {
+  struct net *net;
+
+  /* currently used tor relays, read locklessly by the hooks */
+  struct relay_set __rcu *relays;
+
+  /* prefixes sent directly instead of through tor, read locklessly by the hooks */
+  struct bypass_table __rcu *bypass;
+
+  /* tor instances redirected traffic is spread over, read locklessly by the hooks */
+  struct endpoint_set __rcu *endpoints;
+
+  /* owners and interfaces handled before the tables, none without rules */
+  struct policy_set __rcu *policy;
+
+  /* ipv6 counterparts, without endpoints until userspace sets one */
+  struct relay6_set __rcu *relays6;
+  struct bypass6_table __rcu *bypass6;
+  struct endpoint6_set __rcu *endpoints6;
+
+  /* interfaces whose LAN clients are proxied too, none outside gateway mode */
+  struct gateway_set __rcu *gateways;
+
+  /* tor instances the LAN clients are sent to, apart from the host's
+   * own since loopback is martian before routing. none until set */
+  struct endpoint_set __rcu *gateway_endpoints;
+
+  /* for NAT'ing DNS requests */
+  struct nat_table dns_nat;
+
+  /* advances the NAT timer wheel, only queued while entries exist */
+  struct delayed_work nat_expire_work;
+
+  /* tor's established relay connections, empty without flow_offload */
+  struct flow_table flows;
+
+  /* forgets idle flows, only queued while entries exist */
+  struct delayed_work flow_expire_work;
+
+  /* serializes updates, generation counts applied ones */
+  struct mutex config_lock;
+  unsigned int config_generation;
+};
+
+/* slot of the state in every namespace, see register_pernet_subsys() */
+static int torproxy_net_id;
+
+static inline struct torproxy_net *torproxy_pernet(const struct net *net){
+  return net_generic(net, torproxy_net_id);
+}
+
+#endif /* TORPROXY_NET_H */
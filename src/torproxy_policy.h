@@ -0,0 +1,181 @@
+/*
+ ***************************************************
+ *
+ * RCU published steering policy
+ *
+ * rules match the owner of the sending socket, by
+ * uid or net_cls classid, or the egress interface.
+ * tor's own user passes its TCP, exempt
+ * owners and skipped interfaces are sent directly
+ * and steered owners have their TCP and DNS sent to
+ * a tor endpoint of their own.
+ *
+ * every rule is hashed on what it matches, so a
+ * lookup costs the same whatever the number of
+ * rules. the local out hook only looks a flow up on
+ * its first packet and keeps the decision in the
+ * conntrack mark, a TCP flow being one socket's
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_POLICY_H
+#define TORPROXY_POLICY_H
+
+#ifdef __KERNEL__
+
+#include <net/sock.h>
+
+#else
+
+#include "bench/kshim.h"
+
+#endif
+
+#include "torproxy_compat.h"
+#include "torproxy_genl.h"
+
+/* hash slots, a power of two at least twice POLICY_MAX_RULES */
+#define POLICY_SLOTS 512
+
+struct policy_set {
+  struct rcu_head rcu;
+  unsigned int generation;
+  unsigned int count;
+
+  /* rules per match, a lookup is skipped for matches without any */
+  unsigned int n_match[POLICY_MATCH_IFACE + 1];
+
+  /* index + 1 of the rule, 0 marks a free slot */
+  u16 slots[POLICY_SLOTS];
+
+  /* distinct endpoints of the steering rules, for recognising their DNS replies */
+  unsigned int n_ep;
+  struct torproxy_endpoint ep[TOR_MAX_ENDPOINTS];
+
+  /* the rules in the order they were given, for readers of the table */
+  struct torproxy_policy rules[];
+};
+
+
+static inline u32 policy_hash(u8 match, u32 value){
+  return jhash_3words(value, match, 0, 0) & (POLICY_SLOTS - 1);
+}
+
+/* rule matching value, caller holds rcu_read_lock() */
+static inline const struct torproxy_policy *policy_lookup(const struct policy_set *set, u8 match, u32 value){
+  const struct torproxy_policy *rule;
+  u32 i;
+
+  if(!set || !set->n_match[match]) return NULL;
+
+  for(i = policy_hash(match, value); set->slots[i]; i = (i+1) & (POLICY_SLOTS - 1)){
+    rule = &set->rules[set->slots[i] - 1];
+    if(rule->match == match && rule->value == value) return rule;
+  }
+
+  return NULL;
+}
+
+static inline int policy_valid(const struct torproxy_policy *rule){
+  switch(rule->action){
+    case POLICY_TOR:
+      return rule->match == POLICY_MATCH_UID;
+    case POLICY_EXEMPT:
+      return rule->match >= POLICY_MATCH_UID && rule->match <= POLICY_MATCH_IFACE;
+    case POLICY_ENDPOINT:
+      return (rule->match == POLICY_MATCH_UID || rule->match == POLICY_MATCH_CLASSID) &&
+             rule->endpoint.addr && rule->endpoint.trans_port && rule->endpoint.dns_port;
+    default:
+      return 0;
+  }
+}
+
+static inline int policy_same(const struct torproxy_policy *a, const struct torproxy_policy *b){
+  return a->match == b->match && a->value == b->value;
+}
+
+static inline int policy_endpoint_same(const struct torproxy_endpoint *a, const struct torproxy_endpoint *b){
+  return a->addr == b->addr && a->trans_port == b->trans_port && a->dns_port == b->dns_port;
+}
+
+/* distinct endpoints the rules steer to */
+static inline unsigned int policy_endpoint_count(const struct torproxy_policy *rules, unsigned int n){
+  unsigned int i, j, count = 0;
+
+  for(i=0; i<n; i++){
+    if(rules[i].action != POLICY_ENDPOINT) continue;
+
+    for(j=0; j<i; j++){
+      if(rules[j].action == POLICY_ENDPOINT && policy_endpoint_same(&rules[j].endpoint, &rules[i].endpoint)) break;
+    }
+    if(j == i) count++;
+  }
+
+  return count;
+}
+
+/* build a new generation, no rule leaves every flow to the tables.
+ * later duplicates are skipped */
+static inline struct policy_set *policy_set_build(const struct torproxy_policy *rules,
+    unsigned int n, unsigned int generation, gfp_t gfp)
+{
+  struct policy_set *set;
+  unsigned int i;
+  u32 h;
+
+  if(n == 0 || n > POLICY_MAX_RULES || policy_endpoint_count(rules, n) > TOR_MAX_ENDPOINTS) return NULL;
+
+  set = kzalloc(sizeof(*set) + n * sizeof(*rules), gfp);
+  if(!set) return NULL;
+
+  set->generation = generation;
+
+  for(i=0; i<n; i++){
+    if(!policy_valid(&rules[i]) || policy_lookup(set, rules[i].match, rules[i].value)) continue;
+
+    for(h = policy_hash(rules[i].match, rules[i].value); set->slots[h]; h = (h+1) & (POLICY_SLOTS - 1));
+
+    set->rules[set->count] = rules[i];
+    set->slots[h] = ++set->count;
+    set->n_match[rules[i].match]++;
+
+    if(rules[i].action != POLICY_ENDPOINT) continue;
+    for(h=0; h<set->n_ep && !policy_endpoint_same(&set->ep[h], &rules[i].endpoint); h++);
+    if(h == set->n_ep) set->ep[set->n_ep++] = rules[i].endpoint;
+  }
+
+  return set;
+}
+
+/* publish a new generation, NULL drops every rule. caller serializes writers */
+static inline void policy_set_replace(struct policy_set __rcu **head, struct policy_set *set){
+  struct policy_set *old;
+
+  old = rcu_dereference_protected(*head, 1);
+  rcu_assign_pointer(*head, set);
+  if(old) kfree_rcu(old, rcu);
+}
+
+/* check if a packet comes from a steering endpoint's DNS port, caller holds rcu_read_lock() */
+static inline int policy_is_dns(const struct policy_set *set, __be32 addr, __be16 port){
+  unsigned int i;
+
+  for(i=0; set && i<set->n_ep; i++){
+    if(set->ep[i].addr == addr && set->ep[i].dns_port == port) return 1;
+  }
+
+  return 0;
+}
+
+
+/* net_cls classid of the sending socket, 0 without one */
+static inline u32 skb_owner_classid(const struct sk_buff *skb){
+#if defined(CONFIG_CGROUP_NET_CLASSID) || !defined(__KERNEL__)
+  return skb->sk ? skb->sk->sk_classid : 0;
+#else
+  return 0;
+#endif
+}
+
+#endif /* TORPROXY_POLICY_H */
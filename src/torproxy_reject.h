@@ -0,0 +1,72 @@
+/*
+ ***************************************************
+ *
+ * fast-fail rejection of dropped packets
+ *
+ * with reject_packets set, a locally generated packet
+ * that is dropped is also answered, so the sender
+ * fails at once instead of retransmitting into a
+ * timeout. UDP gets port unreachable, other non-TCP
+ * protocols administratively prohibited and ipv6 TCP
+ * a reset. the answers are addressed to the local
+ * sender and leave through the loopback device,
+ * which the local out hooks let pass
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_REJECT_H
+#define TORPROXY_REJECT_H
+
+#ifdef __KERNEL__
+
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
+#include <net/icmp.h>
+#include <net/ipv6.h>
+#include <net/netfilter/ipv6/nf_reject.h>
+
+#else
+
+#include "bench/kshim.h"
+
+#endif
+
+#include "torproxy_compat.h"
+
+/* set through the module's reject parameter */
+static bool reject_packets;
+
+
+/* a locally generated ipv4 packet about to be dropped. TCP is never
+ * rejected, only packets conntrack lost track of are dropped and a
+ * reset would itself be taken for a new connection */
+static inline void reject_ipv4(struct sk_buff *skb){
+  struct iphdr *ip_header = (struct iphdr *) skb_network_header(skb);
+
+  if(ip_header->protocol == IPPROTO_TCP) return;
+
+  icmp_send(skb, ICMP_DEST_UNREACH,
+            ip_header->protocol == IPPROTO_UDP ? ICMP_PORT_UNREACH : ICMP_PKT_FILTERED, 0);
+}
+
+#ifdef __KERNEL__
+
+/* a locally generated ipv6 packet about to be dropped */
+static inline void reject_ipv6(struct net *net, struct sk_buff *skb, unsigned int hooknum){
+  u8 proto = ipv6_hdr(skb)->nexthdr;
+  __be16 frag_off;
+
+  if(ipv6_skip_exthdr(skb, sizeof(struct ipv6hdr), &proto, &frag_off) < 0) return;
+
+  if(proto == IPPROTO_TCP){
+    nf_send_reset6(net, skb, hooknum);
+  } else{
+    icmpv6_send(skb, ICMPV6_DEST_UNREACH,
+                proto == IPPROTO_UDP ? ICMPV6_PORT_UNREACH : ICMPV6_ADM_PROHIBITED, 0);
+  }
+}
+
+#endif
+
+#endif /* TORPROXY_REJECT_H */
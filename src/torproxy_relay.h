@@ -0,0 +1,126 @@
+/*
+ ***************************************************
+ *
+ * RCU published set of tor relay addresses
+ *
+ * the netfilter hooks look addresses up without
+ * taking any lock, writers build a complete new
+ * generation and swap it in with one pointer store.
+ *
+ * addresses are kept in an open addressing hash
+ * table at most two thirds full, so a lookup is a
+ * multiply and a probe of one or two cache lines
+ * whether the set holds a handful of guards or the
+ * whole consensus
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_RELAY_H
+#define TORPROXY_RELAY_H
+
+#include "torproxy_compat.h"
+#include "torproxy_genl.h"
+
+/* addresses meaning "no relay", never accepted into a set */
+#define RELAY_SLOT_EMPTY 0x00000000
+#define RELAY_SLOT_UNSET 0xffffffff
+
+/* smallest table, one cache line */
+#define RELAY_MIN_SLOTS 16
+
+struct relay_set {
+  struct rcu_head rcu;
+  unsigned int generation;
+  unsigned int count;
+  u32 mask;
+  u32 seed;
+
+  /* the relays in the order they were given, for readers of the table */
+  __be32 *addrs;
+
+  /* hash table, RELAY_SLOT_EMPTY marks a free slot */
+  __be32 slots[];
+};
+
+
+static inline u32 relay_hash(const struct relay_set *set, __be32 addr){
+  return (((u32) addr ^ set->seed) * 0x9e3779b1) >> 16;
+}
+
+/* check if address is a relay, caller holds rcu_read_lock() */
+static inline int relay_set_contains(const struct relay_set *set, __be32 addr){
+  u32 i;
+
+  if(!set) return 0;
+
+  for(i = relay_hash(set, addr) & set->mask; set->slots[i] != RELAY_SLOT_EMPTY; i = (i+1) & set->mask){
+    if(set->slots[i] == addr) return 1;
+  }
+
+  return 0;
+}
+
+static inline void relay_set_free(struct relay_set *set){
+  if(is_vmalloc_addr(set)){
+    vfree(set);
+  } else{
+    kfree(set);
+  }
+}
+
+static void relay_set_free_rcu(struct rcu_head *head){
+  relay_set_free(container_of(head, struct relay_set, rcu));
+}
+
+/* build a new generation from a list of relays, duplicates
+ * and the empty slot values are skipped. a large set is
+ * vmalloc'd, so this may sleep */
+static inline struct relay_set *relay_set_build(const __be32 *addrs, unsigned int n,
+    unsigned int generation)
+{
+  struct relay_set *set;
+  unsigned int n_slots = RELAY_MIN_SLOTS, i;
+  size_t size;
+  u32 h;
+
+  if(n > RELAY_MAX_ADDRS) return NULL;
+
+  while(n_slots < n + n/2) n_slots *= 2;
+  size = sizeof(*set) + (n_slots + n) * sizeof(__be32);
+
+  set = (size <= PAGE_SIZE) ? kzalloc(size, GFP_KERNEL) : vzalloc(size);
+  if(!set) return NULL;
+
+  set->generation = generation;
+  set->mask = n_slots - 1;
+  set->addrs = &set->slots[n_slots];
+  get_random_bytes(&set->seed, sizeof(set->seed));
+
+  for(i=0; i<n; i++){
+    if(addrs[i] == RELAY_SLOT_EMPTY || addrs[i] == RELAY_SLOT_UNSET) continue;
+
+    for(h = relay_hash(set, addrs[i]) & set->mask; set->slots[h] != RELAY_SLOT_EMPTY; h = (h+1) & set->mask){
+      if(set->slots[h] == addrs[i]) break;
+    }
+    if(set->slots[h] == addrs[i]) continue;
+
+    set->slots[h] = addrs[i];
+    set->addrs[set->count++] = addrs[i];
+  }
+
+  return set;
+}
+
+/* publish a new generation, old one is freed once all
+ * readers that could still see it have finished.
+ * caller serializes writers */
+static inline void relay_set_replace(struct relay_set __rcu **head, struct relay_set *set){
+  struct relay_set *old;
+
+  old = rcu_dereference_protected(*head, 1);
+  rcu_assign_pointer(*head, set);
+  if(old) call_rcu(&old->rcu, relay_set_free_rcu);
+}
+
+#endif /* TORPROXY_RELAY_H */
@@ -0,0 +1,111 @@
+/*
+ ***************************************************
+ *
+ * relay and bypass snapshot
+ *
+ * shared by the kernel module and relay_pop, which
+ * rewrites the snapshot after every update it
+ * applies. the module reads it at insert, so tor's
+ * relays and the bypass prefixes are in place
+ * before the hooks see a packet instead of once
+ * relay_pop has found tor and its consensus.
+ *
+ * a header, then the relays, bypass prefixes, ipv6
+ * relays and ipv6 bypass prefixes in their netlink
+ * formats, all in the byte order of the host that
+ * wrote it. anything that doesn't check out is
+ * ignored and the module starts with its defaults
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_SNAPSHOT_H
+#define TORPROXY_SNAPSHOT_H
+
+#ifdef __KERNEL__
+
+#include <linux/crc32.h>
+
+#else
+
+#include <stddef.h>
+#include <errno.h>
+
+#endif
+
+#include <linux/types.h>
+
+#include "torproxy_genl.h"
+
+/* where relay_pop keeps it and the module looks for it by default */
+#define TORPROXY_SNAPSHOT_PATH "/var/lib/torproxy/snapshot"
+
+#define TORPROXY_SNAPSHOT_MAGIC 0x4e535054 /* "TPSN" */
+#define TORPROXY_SNAPSHOT_VERSION 1
+
+struct torproxy_snapshot_header {
+  __u32 magic;
+  __u16 version;
+  __u16 header_size;  /* the tables start here, later versions may add fields */
+  __u32 crc;          /* crc32 of everything after the header */
+  __u32 n_relays;
+  __u32 n_prefixes;
+  __u32 n_relays6;
+  __u32 n_prefixes6;
+  __u32 reserved;
+};
+
+/* size of the largest valid snapshot */
+#define TORPROXY_SNAPSHOT_MAX (sizeof(struct torproxy_snapshot_header) + \
+                               RELAY_MAX_ADDRS * sizeof(__be32) + \
+                               BYPASS_MAX_PREFIXES * sizeof(struct bypass_prefix) + \
+                               RELAY6_MAX_ADDRS * 16 + \
+                               BYPASS6_MAX_PREFIXES * sizeof(struct bypass_prefix6))
+
+
+/* the zlib crc32 */
+static inline __u32 snapshot_crc(const void *data, size_t len){
+#ifdef __KERNEL__
+  return ~crc32_le(~0, data, len);
+#else
+  const unsigned char *p = data;
+  __u32 crc = ~0U;
+  int i;
+
+  while(len--){
+    crc ^= *p++;
+    for(i=0; i<8; i++) crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+
+  return ~crc;
+#endif
+}
+
+/* size of the tables the header announces */
+static inline size_t snapshot_tables_size(const struct torproxy_snapshot_header *hdr){
+  return (size_t) hdr->n_relays * sizeof(__be32) +
+         (size_t) hdr->n_prefixes * sizeof(struct bypass_prefix) +
+         (size_t) hdr->n_relays6 * 16 +
+         (size_t) hdr->n_prefixes6 * sizeof(struct bypass_prefix6);
+}
+
+/* 0 when buf holds a complete snapshot this version can read. the
+ * entries themselves are checked as they are loaded into the tables */
+static inline int snapshot_check(const void *buf, size_t size){
+  const struct torproxy_snapshot_header *hdr = buf;
+
+  if(size < sizeof(*hdr) || hdr->magic != TORPROXY_SNAPSHOT_MAGIC) return -EINVAL;
+  if(hdr->version != TORPROXY_SNAPSHOT_VERSION || hdr->header_size < sizeof(*hdr)) return -EPROTO;
+
+  if(hdr->n_relays > RELAY_MAX_ADDRS || hdr->n_prefixes > BYPASS_MAX_PREFIXES ||
+     hdr->n_relays6 > RELAY6_MAX_ADDRS || hdr->n_prefixes6 > BYPASS6_MAX_PREFIXES ||
+     size != hdr->header_size + snapshot_tables_size(hdr)){
+    return -EINVAL;
+  }
+
+  if(snapshot_crc((const char *) buf + hdr->header_size, size - hdr->header_size) != hdr->crc) return -EBADMSG;
+
+  return 0;
+}
+
+#endif /* TORPROXY_SNAPSHOT_H */
@@ -0,0 +1,94 @@
+/*
+ ***************************************************
+ *
+ * per-cpu packet counters and hook latencies
+ *
+ * every verdict the hooks give bumps a counter in
+ * the current cpu's own copy of the statistics, and
+ * one hook call in TORPROXY_LATENCY_SAMPLE per cpu
+ * is timed into a log2 histogram. the packet path
+ * never writes memory another cpu writes, the copies
+ * are only summed up when userspace reads them
+ *
+ ***************************************************
+*/
+
+#ifndef TORPROXY_STATS_H
+#define TORPROXY_STATS_H
+
+#include "torproxy_compat.h"
+#include "torproxy_genl.h"
+
+struct torproxy_cpu_stats {
+  u64 verdicts[TORPROXY_STAT_MAX];
+  u64 latency[TORPROXY_HOOK_MAX][TORPROXY_LATENCY_BUCKETS];
+  unsigned int calls;
+};
+
+static struct torproxy_cpu_stats __percpu *stats;
+
+
+static inline int stats_init(void){
+  stats = alloc_percpu(struct torproxy_cpu_stats);
+  return stats ? 0 : -ENOMEM;
+}
+
+/* hooks must be unregistered */
+static inline void stats_destroy(void){
+  free_percpu(stats);
+  stats = NULL;
+}
+
+
+/* count a verdict, returns it so hooks can end with
+ * return stats_verdict(NF_DROP, TORPROXY_STAT_...) */
+static inline unsigned int stats_verdict(unsigned int verdict, enum torproxy_stat stat){
+  this_cpu_inc(stats->verdicts[stat]);
+  return verdict;
+}
+
+/* start time of a sampled hook call, 0 when this one isn't timed */
+static inline u64 stats_timer_start(void){
+  if(this_cpu_inc_return(stats->calls) & (TORPROXY_LATENCY_SAMPLE - 1)) return 0;
+  return local_clock();
+}
+
+static inline void stats_timer_end(enum torproxy_hook hook, u64 start){
+  s64 ns;
+  int bucket;
+
+  if(!start) return;
+
+  /* the clock is per cpu and the call may have migrated */
+  ns = local_clock() - start;
+  bucket = ns > 0 ? fls64(ns) : 0;
+  if(bucket >= TORPROXY_LATENCY_BUCKETS) bucket = TORPROXY_LATENCY_BUCKETS - 1;
+
+  this_cpu_inc(stats->latency[hook][bucket]);
+}
+
+
+/* sum of every cpu's copy, concurrent updates may or may not be seen */
+static void stats_read(u64 *verdicts, u64 (*latency)[TORPROXY_LATENCY_BUCKETS]){
+  struct torproxy_cpu_stats *s;
+  unsigned int i, j;
+  int cpu;
+
+  memset(verdicts, 0, TORPROXY_STAT_MAX * sizeof(*verdicts));
+  memset(latency, 0, TORPROXY_HOOK_MAX * sizeof(*latency));
+
+  for_each_possible_cpu(cpu){
+    s = per_cpu_ptr(stats, cpu);
+
+    for(i=0; i<TORPROXY_STAT_MAX; i++){
+      verdicts[i] += s->verdicts[i];
+    }
+    for(i=0; i<TORPROXY_HOOK_MAX; i++){
+      for(j=0; j<TORPROXY_LATENCY_BUCKETS; j++){
+        latency[i][j] += s->latency[i][j];
+      }
+    }
+  }
+}
+
+#endif /* TORPROXY_STATS_H */
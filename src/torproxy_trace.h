@@ -0,0 +1,73 @@
+/*
+ ***************************************************
+ *
+ * tracepoints
+ *
+ * torproxy:torproxy_drop fires for every packet the
+ * local out hook drops, with the same fields as the
+ * drop ring event, so perf and ftrace can follow
+ * drops without the ring reader running. ipv4
+ * addresses are printed ipv4 mapped:
+ *
+ *   perf record -e torproxy:torproxy_drop -a
+ *
+ * torproxy_module.c defines CREATE_TRACE_POINTS
+ *
+ ***************************************************
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM torproxy
+
+#if !defined(TORPROXY_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define TORPROXY_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <net/ipv6.h>
+
+#include "torproxy_genl.h"
+
+TRACE_EVENT(torproxy_drop,
+
+  TP_PROTO(const struct drop_event *ev),
+
+  TP_ARGS(ev),
+
+  TP_STRUCT__entry(
+    __field(__u8, reason)
+    __field(__u8, protocol)
+    __array(__u8, saddr, 16)
+    __array(__u8, daddr, 16)
+    __field(__u16, sport)
+    __field(__u16, dport)
+    __field(__u32, uid)
+  ),
+
+  TP_fast_assign(
+    __entry->reason = ev->reason;
+    __entry->protocol = ev->protocol;
+    if(ev->family == AF_INET6){
+      memcpy(__entry->saddr, ev->saddr, 16);
+      memcpy(__entry->daddr, ev->daddr, 16);
+    } else{
+      ipv6_addr_set_v4mapped(ev->saddr[0], (struct in6_addr *) __entry->saddr);
+      ipv6_addr_set_v4mapped(ev->daddr[0], (struct in6_addr *) __entry->daddr);
+    }
+    __entry->sport = ntohs(ev->sport);
+    __entry->dport = ntohs(ev->dport);
+    __entry->uid = ev->uid;
+  ),
+
+  TP_printk("reason=%u proto=%u [%pI6c]:%u -> [%pI6c]:%u uid=%d",
+            __entry->reason, __entry->protocol, __entry->saddr, __entry->sport,
+            __entry->daddr, __entry->dport, (int) __entry->uid)
+);
+
+#endif /* TORPROXY_TRACE_H */
+
+/* found through ccflags-y := -I$(src) in the Kbuild file */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE torproxy_trace
+#include <trace/define_trace.h>